@@ -8,13 +8,25 @@ dd if=/bin/ls of=/tmp/img bs=1k seek=10000
 dd if=/bin/ln of=/tmp/img bs=1k seek=100000
 dd if=/bin/grep of=/tmp/img bs=1k seek=1000000
 
+# a zeroed run inside the data, which import skips and export leaves
+# as a hole, straddling the 4M object boundary
+dd if=/bin/bash of=/tmp/img bs=1k seek=4000 conv=notrunc
+dd if=/dev/zero of=/tmp/img bs=1k count=200 seek=4050 conv=notrunc
+
 rbd rm testimg || true
+rbd rm testimg2 || true
 
 rbd import /tmp/img testimg
 rbd export testimg /tmp/img2
-
 cmp /tmp/img /tmp/img2
 
-rm /tmp/img /tmp/img2
+# copy it, and the copy exports the same
+rbd cp testimg testimg2
+rbd export testimg2 /tmp/img3
+cmp /tmp/img /tmp/img3
+
+rbd rm testimg
+rbd rm testimg2
+rm /tmp/img /tmp/img2 /tmp/img3
 
-echo OK
\ No newline at end of file
+echo OK
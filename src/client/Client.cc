@@ -51,6 +51,7 @@ using namespace std;
 #include "osdc/Filer.h"
 #include "osdc/Objecter.h"
 #include "osdc/ObjectCacher.h"
+#include "osdc/ObjecterWriteback.h"
 
 #include "common/Cond.h"
 #include "common/Mutex.h"
@@ -181,10 +182,16 @@ Client::Client(Messenger *m, MonClient *mc)
   mdsmap = new MDSMap(m->cct);
   objecter = new Objecter(cct, messenger, monclient, osdmap, client_lock, timer);
   objecter->set_client_incarnation(0);  // client always 0, for now.
-  objectcacher = new ObjectCacher(cct, objecter, client_lock, 
+  writeback_handler = new ObjecterWriteback(objecter);
+  objectcacher = new ObjectCacher(cct, cct->_conf->name.to_str(),
+				  *writeback_handler, client_lock,
 				  0,                            // all ack callback
 				  client_flush_set_callback,    // all commit callback
-				  (void*)this);
+				  (void*)this,
+				  cct->_conf->client_oc_size,
+				  cct->_conf->client_oc_max_dirty,
+				  cct->_conf->client_oc_target_dirty,
+				  cct->_conf->client_oc_max_dirty_age);
   filer = new Filer(objecter);
 }
 
@@ -199,6 +206,10 @@ Client::~Client()
     delete objectcacher; 
     objectcacher = 0; 
   }
+  if (writeback_handler) {
+    delete writeback_handler;
+    writeback_handler = 0;
+  }
 
   if (filer) { delete filer; filer = 0; }
   if (objecter) { delete objecter; objecter = 0; }
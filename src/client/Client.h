@@ -76,6 +76,7 @@ class MClientCapRelease;
 class Filer;
 class Objecter;
 class ObjectCacher;
+class WritebackHandler;
 
 extern class PerfCounters  *client_counters;
 
@@ -882,6 +883,7 @@ public:
 protected:
   Filer                 *filer;     
   ObjectCacher          *objectcacher;
+  WritebackHandler      *writeback_handler;
   Objecter              *objecter;     // (non-blocking) osd interface
   
   // cache
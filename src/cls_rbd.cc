@@ -2,6 +2,8 @@
 
 
 #include <iostream>
+#include <map>
+#include <set>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -11,7 +13,7 @@
 
 #include "include/rbd_types.h"
 
-CLS_VER(1,3)
+CLS_VER(1,5)
 CLS_NAME(rbd)
 
 cls_handle_t h_class;
@@ -20,6 +22,9 @@ cls_method_handle_t h_snapshot_add;
 cls_method_handle_t h_snapshot_remove;
 cls_method_handle_t h_snapshot_revert;
 cls_method_handle_t h_assign_bid;
+cls_method_handle_t h_object_map_update;
+cls_method_handle_t h_add_child;
+cls_method_handle_t h_remove_child;
 
 static int snap_read_header(cls_method_context_t hctx, bufferlist& bl)
 {
@@ -54,6 +59,45 @@ static int snap_read_header(cls_method_context_t hctx, bufferlist& bl)
   return 0;
 }
 
+/*
+ * The clones of each snapshot, by child key, kept in an xattr on the
+ * image header so that registering a clone and removing its snapshot
+ * are ordered by the osd.
+ */
+typedef map<uint64_t, set<string> > children_t;
+
+static int read_children(cls_method_context_t hctx, children_t *children)
+{
+  char *data;
+  int len;
+  int rc = cls_getxattr(hctx, RBD_CHILDREN_ATTR, &data, &len);
+  if (rc == -ENODATA || (rc >= 0 && !len)) {
+    free(data);
+    return 0;
+  }
+  if (rc < 0) {
+    free(data);
+    return rc;
+  }
+  bufferlist bl;
+  bl.append(data, len);
+  free(data);
+  try {
+    bufferlist::iterator iter = bl.begin();
+    ::decode(*children, iter);
+  } catch (const buffer::error &err) {
+    return -EIO;
+  }
+  return 0;
+}
+
+static int write_children(cls_method_context_t hctx, const children_t& children)
+{
+  bufferlist bl;
+  ::encode(children, bl);
+  return cls_setxattr(hctx, RBD_CHILDREN_ATTR, bl.c_str(), bl.length());
+}
+
 int snapshots_list(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
 {
   bufferlist bl;
@@ -285,6 +329,15 @@ int snapshot_remove(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
     return -ENOENT;
   }
 
+  children_t children;
+  rc = read_children(hctx, &children);
+  if (rc < 0)
+    return rc;
+  if (children.count(snap.id)) {
+    CLS_LOG("snap %s has clones\n", snap_name);
+    return -EBUSY;
+  }
+
   header->snap_names_len  = header->snap_names_len - (s.length() + 1);
   header->snap_count = header->snap_count - 1;
 
@@ -366,6 +419,128 @@ int rbd_assign_bid(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
   return out->length();
 }
 
+/*
+ * Set or clear the bits for objects [start, end) in an image's object
+ * map (see rbd_types.h).  Called on the map object itself; only the
+ * bytes covering the range are read and rewritten, and not at all if
+ * nothing changes.
+ */
+int object_map_update(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
+{
+  uint64_t start, end;
+  __u8 val;
+  try {
+    bufferlist::iterator iter = in->begin();
+    ::decode(start, iter);
+    ::decode(end, iter);
+    ::decode(val, iter);
+  } catch (const buffer::error &err) {
+    return -EINVAL;
+  }
+  if (start >= end)
+    return 0;
+
+  uint64_t first = start >> 3;
+  uint64_t len = ((end - 1) >> 3) - first + 1;
+  bufferlist bl;
+  int rc = cls_cxx_read(hctx, first, len, &bl);
+  if (rc < 0 && rc != -ENOENT)
+    return rc;
+
+  bufferptr bp(len);
+  memset(bp.c_str(), 0, len);
+  if (rc > 0)
+    memcpy(bp.c_str(), bl.c_str(), rc);
+
+  bool changed = false;
+  for (uint64_t i = start; i < end; i++) {
+    char *byte = bp.c_str() + ((i >> 3) - first);
+    char bit = 1 << (i & 7);
+    if (!(*byte & bit) == !val)
+      continue;
+    if (val)
+      *byte |= bit;
+    else
+      *byte &= ~bit;
+    changed = true;
+  }
+  if (!changed)
+    return 0;
+
+  bufferlist newbl;
+  newbl.push_back(bp);
+  rc = cls_cxx_write(hctx, first, len, &newbl);
+  if (rc < 0) {
+    CLS_LOG("error writing object map, got rc=%d", rc);
+    return rc;
+  }
+  return 0;
+}
+
+/*
+ * Register a clone of one of this image's snapshots.  Fails with ENOENT
+ * if the snapshot is gone; once this succeeds, snap_remove refuses to
+ * remove it until remove_child.
+ */
+int add_child(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
+{
+  uint64_t snap_id;
+  string key;
+  try {
+    bufferlist::iterator iter = in->begin();
+    ::decode(snap_id, iter);
+    ::decode(key, iter);
+  } catch (const buffer::error &err) {
+    return -EINVAL;
+  }
+
+  bufferlist bl;
+  int rc = snap_read_header(hctx, bl);
+  if (rc < 0)
+    return rc;
+  struct rbd_obj_header_ondisk *header = (struct rbd_obj_header_ondisk *)bl.c_str();
+  unsigned i;
+  for (i = 0; i < header->snap_count; i++)
+    if (header->snaps[i].id == snap_id)
+      break;
+  if (i == header->snap_count) {
+    CLS_LOG("add_child: no snap %llu\n", (unsigned long long)snap_id);
+    return -ENOENT;
+  }
+
+  children_t children;
+  rc = read_children(hctx, &children);
+  if (rc < 0)
+    return rc;
+  if (!children[snap_id].insert(key).second)
+    return 0;
+  return write_children(hctx, children);
+}
+
+int remove_child(cls_method_context_t hctx, bufferlist *in, bufferlist *out)
+{
+  uint64_t snap_id;
+  string key;
+  try {
+    bufferlist::iterator iter = in->begin();
+    ::decode(snap_id, iter);
+    ::decode(key, iter);
+  } catch (const buffer::error &err) {
+    return -EINVAL;
+  }
+
+  children_t children;
+  int rc = read_children(hctx, &children);
+  if (rc < 0)
+    return rc;
+  children_t::iterator p = children.find(snap_id);
+  if (p == children.end() || !p->second.erase(key))
+    return 0;
+  if (p->second.empty())
+    children.erase(p);
+  return write_children(hctx, children);
+}
+
 void __cls_init()
 {
   CLS_LOG("Loaded rbd class!");
@@ -379,6 +554,13 @@ void __cls_init()
   /* assign a unique block id for rbd blocks */
   cls_register_cxx_method(h_class, "assign_bid", CLS_METHOD_RD | CLS_METHOD_WR | CLS_METHOD_PUBLIC, rbd_assign_bid, &h_assign_bid);
 
+  /* maintain the object map of an image */
+  cls_register_cxx_method(h_class, "map_update", CLS_METHOD_RD | CLS_METHOD_WR | CLS_METHOD_PUBLIC, object_map_update, &h_object_map_update);
+
+  /* track the clones of an image's snapshots */
+  cls_register_cxx_method(h_class, "add_child", CLS_METHOD_RD | CLS_METHOD_WR | CLS_METHOD_PUBLIC, add_child, &h_add_child);
+  cls_register_cxx_method(h_class, "remove_child", CLS_METHOD_RD | CLS_METHOD_WR | CLS_METHOD_PUBLIC, remove_child, &h_remove_child);
+
   return;
 }
 
@@ -23,6 +23,7 @@
 
 #include <errno.h>
 #include <fstream>
+#include <map>
 #include <sstream>
 #include <sys/uio.h>
 #include <limits.h>
@@ -40,6 +41,8 @@ static uint32_t simple_spinlock_t buffer_debug_lock = SIMPLE_SPINLOCK_INITIALIZE
 
 atomic_t buffer_total_alloc;
 bool buffer_track_alloc = get_env_bool("CEPH_BUFFER_TRACK");
+atomic_t buffer_cached_crc;
+atomic_t buffer_cached_crc_adjusted;
 
   void buffer::inc_total_alloc(unsigned len) {
     if (buffer_track_alloc)
@@ -52,6 +55,12 @@ bool buffer_track_alloc = get_env_bool("CEPH_BUFFER_TRACK");
   int buffer::get_total_alloc() {
     return buffer_total_alloc.read();
   }
+  int buffer::get_cached_crc() {
+    return buffer_cached_crc.read();
+  }
+  int buffer::get_cached_crc_adjusted() {
+    return buffer_cached_crc_adjusted.read();
+  }
 
   class buffer::raw {
   public:
@@ -59,9 +68,25 @@ bool buffer_track_alloc = get_env_bool("CEPH_BUFFER_TRACK");
     unsigned len;
     atomic_t nref;
 
-    raw(unsigned l) : len(l), nref(0)
+    /*
+     * crc32c of ranges of this buffer we have already computed:
+     * (from, to) -> (seed, crc).  Handing out a writable pointer
+     * (non-const ptr::c_str(), and so copy_in, zero, append and the
+     * messenger reading into a posted rx buffer) drops them.  Code
+     * that keeps such a pointer and writes through it after the data
+     * may have been checksummed must call ptr::invalidate_crc().
+     * crc_cached is set while crc_map is non-empty so that handing out
+     * a pointer to an unchecksummed buffer doesn't take the lock.
+     */
+    simple_spinlock_t crc_lock;
+    atomic_t crc_cached;
+    std::map<std::pair<unsigned, unsigned>, std::pair<uint32_t, uint32_t> > crc_map;
+
+    raw(unsigned l) : len(l), nref(0), crc_lock(SIMPLE_SPINLOCK_INITIALIZER),
+		      crc_cached(0)
     { }
-    raw(char *c, unsigned l) : data(c), len(l), nref(0)
+    raw(char *c, unsigned l) : data(c), len(l), nref(0),
+			       crc_lock(SIMPLE_SPINLOCK_INITIALIZER), crc_cached(0)
     { }
     virtual ~raw() {};
 
@@ -82,6 +107,41 @@ bool buffer_track_alloc = get_env_bool("CEPH_BUFFER_TRACK");
     bool is_n_page_sized() {
       return (len & ~PAGE_MASK) == 0;
     }
+
+    // memory we don't own may change under us without telling
+    virtual bool can_cache_crc() {
+      return true;
+    }
+    bool get_crc(const std::pair<unsigned, unsigned> &fromto,
+		 std::pair<uint32_t, uint32_t> *crc) {
+      simple_spin_lock(&crc_lock);
+      std::map<std::pair<unsigned, unsigned>, std::pair<uint32_t, uint32_t> >::iterator i =
+	crc_map.find(fromto);
+      bool found = i != crc_map.end();
+      if (found)
+	*crc = i->second;
+      simple_spin_unlock(&crc_lock);
+      return found;
+    }
+    void set_crc(const std::pair<unsigned, unsigned> &fromto,
+		 const std::pair<uint32_t, uint32_t> &crc) {
+      simple_spin_lock(&crc_lock);
+      if (crc_map.size() >= MAX_CACHED_CRCS)
+	crc_map.clear();
+      crc_map[fromto] = crc;
+      crc_cached.set(1);
+      simple_spin_unlock(&crc_lock);
+    }
+    void invalidate_crc() {
+      if (!crc_cached.read())
+	return;
+      simple_spin_lock(&crc_lock);
+      crc_map.clear();
+      crc_cached.set(0);
+      simple_spin_unlock(&crc_lock);
+    }
+
+    static const unsigned MAX_CACHED_CRCS = 8;
   };
 
   class buffer::raw_malloc : public buffer::raw {
@@ -213,6 +273,9 @@ bool buffer_track_alloc = get_env_bool("CEPH_BUFFER_TRACK");
   public:
     raw_static(const char *d, unsigned l) : raw((char*)d, l) { }
     ~raw_static() {}
+    bool can_cache_crc() {
+      return false;
+    }
     raw* clone_empty() {
       return new buffer::raw_char(len);
     }
@@ -308,7 +371,11 @@ bool buffer_track_alloc = get_env_bool("CEPH_BUFFER_TRACK");
   bool buffer::ptr::at_buffer_tail() const { return _off + _len == _raw->len; }
 
   const char *buffer::ptr::c_str() const { assert(_raw); return _raw->data + _off; }
-  char *buffer::ptr::c_str() { assert(_raw); return _raw->data + _off; }
+  char *buffer::ptr::c_str() {
+    assert(_raw);
+    _raw->invalidate_crc();  // the caller may write
+    return _raw->data + _off;
+  }
   unsigned buffer::ptr::unused_tail_length() const {
     if (_raw)
       return _raw->len - (_off+_len);
@@ -323,6 +390,7 @@ bool buffer_track_alloc = get_env_bool("CEPH_BUFFER_TRACK");
   char& buffer::ptr::operator[](unsigned n) {
     assert(_raw);
     assert(n < _len);
+    _raw->invalidate_crc();  // the caller may write
     return _raw->data[_off + n];
   }
 
@@ -335,6 +403,11 @@ bool buffer_track_alloc = get_env_bool("CEPH_BUFFER_TRACK");
     return _raw->len - _len;
   }
 
+  void buffer::ptr::invalidate_crc() {
+    if (_raw)
+      _raw->invalidate_crc();
+  }
+
 void buffer::list::encode_base64(buffer::list& o)
 {
   bufferptr bp(length() * 4 / 3 + 3);
@@ -360,7 +433,35 @@ void buffer::list::decode_base64(buffer::list& e)
 
 void buffer::list::rebuild_page_aligned()
 {
+  // A segment that sits at the same offset within a page in memory as
+  // it does in the list (the journal lays out write payloads that way)
+  // has a page aligned middle that can be written as is.  Split off its
+  // unaligned head and tail so that only those get copied below.
+  unsigned off = 0;
   std::list<ptr>::iterator p = _buffers.begin();
+  while (p != _buffers.end()) {
+    unsigned len = p->length();
+    unsigned phase = (unsigned long)p->c_str() & ~PAGE_MASK;
+    if (len && phase == (off & ~PAGE_MASK) &&
+	!(p->is_page_aligned() && p->is_n_page_sized())) {
+      unsigned head = (PAGE_SIZE - phase) & ~PAGE_MASK;
+      unsigned body = len > head ? ((len - head) & PAGE_MASK) : 0;
+      if (body) {
+	if (head)
+	  _buffers.insert(p, ptr(*p, 0, head));
+	_buffers.insert(p, ptr(*p, head, body));
+	if (head + body < len)
+	  _buffers.insert(p, ptr(*p, head + body, len - head - body));
+	_buffers.erase(p++);
+	off += len;
+	continue;
+      }
+    }
+    off += len;
+    p++;
+  }
+
+  p = _buffers.begin();
   while (p != _buffers.end()) {
     // keep anything that's already page sized+aligned
     if (p->is_page_aligned() && p->is_n_page_sized()) {
@@ -522,6 +623,46 @@ int buffer::list::write_fd(int fd) const
 }
 
 
+__u32 buffer::list::crc32c(__u32 crc)
+{
+  for (std::list<ptr>::const_iterator it = _buffers.begin();
+       it != _buffers.end();
+       it++) {
+    if (!it->length())
+      continue;
+    raw *r = it->get_raw();
+    if (!r->can_cache_crc()) {
+      crc = ceph_crc32c_le(crc, (unsigned char*)it->c_str(), it->length());
+      continue;
+    }
+    pair<unsigned, unsigned> ofs(it->start(), it->end());
+    pair<uint32_t, uint32_t> ccrc;
+    if (r->get_crc(ofs, &ccrc)) {
+      if (ccrc.first == crc) {
+	// got it already
+	crc = ccrc.second;
+	if (buffer_track_alloc)
+	  buffer_cached_crc.inc();
+      } else {
+	// got it already, but with a different seed.  crc32c is linear
+	// in the seed:
+	//
+	//   crc(seed, d) = crc(old_seed, d) ^ crc(seed ^ old_seed, zeros)
+	//
+	// so fix it up without looking at the data.
+	crc = ccrc.second ^ ceph_crc32c_zeros(ccrc.first ^ crc, it->length());
+	if (buffer_track_alloc)
+	  buffer_cached_crc_adjusted.inc();
+      }
+    } else {
+      uint32_t base = crc;
+      crc = ceph_crc32c_le(crc, (unsigned char*)it->c_str(), it->length());
+      r->set_crc(ofs, make_pair(base, crc));
+    }
+  }
+  return crc;
+}
+
 void buffer::list::hexdump(std::ostream &out) const
 {
   out.setf(std::ios::right);
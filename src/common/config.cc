@@ -184,7 +184,10 @@ struct config_option config_optionsp[] = {
   OPTION(ms_dispatch_throttle_bytes, OPT_U64, 100 << 20),
   OPTION(ms_bind_ipv6, OPT_BOOL, false),
   OPTION(ms_rwthread_stack_bytes, OPT_U64, 1024 << 10),
+  OPTION(ms_event_workers, OPT_INT, 0),  // epoll loops for open pipes (0 = thread per pipe)
+  OPTION(ms_fast_dispatch_threads, OPT_INT, 0),  // 0 = fast dispatch in the reader thread
   OPTION(ms_tcp_read_timeout, OPT_U64, 900),
+  OPTION(ms_tcp_prefetch_max_size, OPT_INT, 4096),  // read-ahead per pipe for small messages (0 = off)
   OPTION(ms_inject_socket_failures, OPT_U64, 0),
   OPTION(mon_data, OPT_STR, 0),
   OPTION(mon_tick_interval, OPT_INT, 5),
@@ -230,8 +233,15 @@ struct config_option config_optionsp[] = {
   OPTION(client_oc_size, OPT_INT, 1024*1024* 200),    // MB * n
   OPTION(client_oc_max_dirty, OPT_INT, 1024*1024* 100),    // MB * n  (dirty OR tx.. bigish)
   OPTION(client_oc_target_dirty, OPT_INT, 1024*1024* 8), // target dirty (keep this smallish)
+  OPTION(client_oc_max_dirty_age, OPT_DOUBLE, 1.0),      // max age(s) of dirty data before the flusher writes it out
   // note: the max amount of "in flight" dirty data is roughly (max - target)
   OPTION(client_oc_max_sync_write, OPT_U64, 128*1024),   // sync writes >= this use wrlock
+  OPTION(rbd_cache, OPT_BOOL, false),                    // per-image writeback/read cache in librbd
+  OPTION(rbd_cache_size, OPT_LONGLONG, 32<<20),          // cache size in bytes
+  OPTION(rbd_cache_max_dirty, OPT_LONGLONG, 24<<20),     // writes block once this much is dirty|tx
+  OPTION(rbd_cache_target_dirty, OPT_LONGLONG, 16<<20),  // flusher starts writing back above this
+  OPTION(rbd_cache_max_dirty_age, OPT_DOUBLE, 1.0),      // seconds dirty data may sit in the cache
+  OPTION(rbd_concurrent_ops, OPT_INT, 10),              // object ops in flight for copy/import/export
   OPTION(objecter_tick_interval, OPT_DOUBLE, 5.0),
   OPTION(objecter_mon_retry_interval, OPT_DOUBLE, 5.0),
   OPTION(objecter_timeout, OPT_DOUBLE, 10.0),    // before we ask for a map
@@ -340,9 +350,12 @@ struct config_option config_optionsp[] = {
   OPTION(osd_pool_default_size, OPT_INT, 2),
   OPTION(osd_pool_default_pg_num, OPT_INT, 8),
   OPTION(osd_pool_default_pgp_num, OPT_INT, 8),
-  OPTION(osd_op_threads, OPT_INT, 2),    // 0 == no threading
+  OPTION(osd_op_threads, OPT_INT, 2),    // 0 == no threading; else threads per shard
+  OPTION(osd_op_shards, OPT_INT, 1),     // op queues, each with its own lock and threads
   OPTION(osd_max_opq, OPT_INT, 10),
   OPTION(osd_disk_threads, OPT_INT, 1),
+  OPTION(osd_scrub_threads, OPT_INT, 1),
+  OPTION(osd_map_mapping_threads, OPT_INT, 2), // for precomputing pg mappings of big maps
   OPTION(osd_recovery_threads, OPT_INT, 1),
   OPTION(osd_op_thread_timeout, OPT_INT, 30),
   OPTION(osd_backlog_thread_timeout, OPT_INT, 60*60*1),
@@ -362,15 +375,24 @@ struct config_option config_optionsp[] = {
   OPTION(osd_min_down_reports, OPT_INT, 3),     // number of times a down OSD must be reported for it to count
   OPTION(osd_replay_window, OPT_INT, 45),
   OPTION(osd_preserve_trimmed_log, OPT_BOOL, true),
+  OPTION(osd_pg_log_segment_entries, OPT_INT, 1000),  // pg log entries per on-disk segment object
   OPTION(osd_auto_mark_unfound_lost, OPT_BOOL, false),
   OPTION(osd_recovery_delay_start, OPT_FLOAT, 15),
   OPTION(osd_recovery_max_active, OPT_INT, 5),
   OPTION(osd_recovery_max_chunk, OPT_U64, 1<<20),  // max size of push chunk
+  OPTION(osd_recovery_chunk_window, OPT_INT, 4),  // push/pull chunks in flight per object
   OPTION(osd_recovery_forget_lost_objects, OPT_BOOL, false),   // off for now
   OPTION(osd_max_scrubs, OPT_INT, 1),
   OPTION(osd_scrub_load_threshold, OPT_FLOAT, 0.5),
   OPTION(osd_scrub_min_interval, OPT_FLOAT, 300),
   OPTION(osd_scrub_max_interval, OPT_FLOAT, 60*60*24),   // once a day
+  OPTION(osd_scrub_chunk_max, OPT_INT, 25),    // objects per scrub chunk
+  OPTION(osd_scrub_max_bytes_per_sec, OPT_U64, 0),   // data read by deep scrub; 0 = unthrottled
+  OPTION(osd_scrub_max_objects_per_sec, OPT_INT, 0), // 0 = unthrottled
+  OPTION(osd_deep_scrub_interval, OPT_FLOAT, 60*60*24*7), // once a week
+  OPTION(osd_deep_scrub_stride, OPT_INT, 524288),  // data read size for deep scrub
+  OPTION(osd_copy_from_timeout, OPT_DOUBLE, 30.0),  // give up on fetching a copy-from source after this long
+  OPTION(osd_copy_from_max_bytes, OPT_U64, 16 << 20),  // larger sources get EOPNOTSUPP; the client copies them itself
   OPTION(osd_auto_weight, OPT_BOOL, false),
   OPTION(osd_class_error_timeout, OPT_DOUBLE, 60.0),  // seconds
   OPTION(osd_class_timeout, OPT_DOUBLE, 60*60.0), // seconds
@@ -379,6 +401,7 @@ struct config_option config_optionsp[] = {
   OPTION(osd_use_stale_snap, OPT_BOOL, false),
   OPTION(osd_rollback_to_cluster_snap, OPT_STR, 0),
   OPTION(osd_max_notify_timeout, OPT_U32, 30), // max notify timeout in seconds
+  OPTION(osd_object_context_cache_size, OPT_INT, 64),  // unreferenced object/snapset contexts kept per pg
   OPTION(filestore, OPT_BOOL, false),
   OPTION(filestore_max_sync_interval, OPT_DOUBLE, 5),    // seconds
   OPTION(filestore_min_sync_interval, OPT_DOUBLE, .01),  // seconds
@@ -404,13 +427,28 @@ struct config_option config_optionsp[] = {
   OPTION(filestore_op_thread_timeout, OPT_INT, 60),
   OPTION(filestore_commit_timeout, OPT_FLOAT, 600),
   OPTION(filestore_fiemap_threshold, OPT_INT, 4096),
+  OPTION(filestore_index_hashed, OPT_BOOL, true),   // new collections get a hashed dir tree
+  OPTION(filestore_index_split_threshold, OPT_INT, 320),  // split a dir beyond this many objects
+  OPTION(filestore_cache_size, OPT_U64, 64 << 20),   // 0 disables
+  OPTION(filestore_cache_shards, OPT_INT, 16),
+  OPTION(filestore_cache_max_extent, OPT_INT, 64 << 10),
+  OPTION(filestore_kv_attrs, OPT_BOOL, false),   // spill big/many attrs out of xattrs
+  OPTION(filestore_kv_attr_size_threshold, OPT_INT, 2048),
+  OPTION(filestore_kv_attr_count_threshold, OPT_INT, 32),
+  OPTION(filestore_kv_compact_min, OPT_U64, 1 << 20),
+  OPTION(filestore_copy_offload, OPT_BOOL, true),   // reflink/splice/sendfile for clone and copy
   OPTION(journal_dio, OPT_BOOL, true),
+  OPTION(journal_aio, OPT_BOOL, false),
+  OPTION(journal_aio_max_inflight, OPT_INT, 32),   // aio writes in flight
   OPTION(journal_block_align, OPT_BOOL, true),
   OPTION(journal_max_write_bytes, OPT_INT, 10 << 20),
   OPTION(journal_max_write_entries, OPT_INT, 100),
   OPTION(journal_queue_max_ops, OPT_INT, 500),
   OPTION(journal_queue_max_bytes, OPT_INT, 100 << 20),
   OPTION(journal_align_min_size, OPT_INT, 64 << 10),  // align data payloads >= this.
+  OPTION(journal_replay_threads, OPT_INT, 1),  // >1 replays entries for disjoint collections and objects in parallel
+  OPTION(journal_replay_queue_max_ops, OPT_INT, 500),
+  OPTION(journal_replay_queue_max_bytes, OPT_INT, 100 << 20),
   OPTION(bdev_lock, OPT_BOOL, true),
   OPTION(bdev_iothreads, OPT_INT, 1),         // number of ios to queue with kernel
   OPTION(bdev_idle_kick_after_ms, OPT_INT, 100),  // ms
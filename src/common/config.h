@@ -255,7 +255,10 @@ public:
   uint64_t ms_dispatch_throttle_bytes;
   bool ms_bind_ipv6;
   uint64_t ms_rwthread_stack_bytes;
+  int ms_event_workers;
+  int ms_fast_dispatch_threads;
   uint64_t ms_tcp_read_timeout;
+  int ms_tcp_prefetch_max_size;
   uint64_t ms_inject_socket_failures;
 
   // mon
@@ -313,8 +316,17 @@ public:
   int      client_oc_size;
   int      client_oc_max_dirty;
   int      client_oc_target_dirty;
+  double   client_oc_max_dirty_age;
   uint64_t client_oc_max_sync_write;
 
+  // librbd cache
+  bool      rbd_cache;
+  long long rbd_cache_size;
+  long long rbd_cache_max_dirty;
+  long long rbd_cache_target_dirty;
+  double    rbd_cache_max_dirty_age;
+  int       rbd_concurrent_ops;
+
   int      client_notify_timeout;
 
   // objecter
@@ -456,8 +468,11 @@ public:
   int osd_pool_default_pgp_num;
 
   int   osd_op_threads;
+  int   osd_op_shards;
   int   osd_max_opq;
   int   osd_disk_threads;
+  int   osd_scrub_threads;
+  int   osd_map_mapping_threads;
   int   osd_recovery_threads;
 
   int   osd_op_thread_timeout;
@@ -479,14 +494,19 @@ public:
   int   osd_min_down_reports;
   int   osd_replay_window;
   bool  osd_preserve_trimmed_log;
+  int   osd_pg_log_segment_entries;
   bool  osd_auto_mark_unfound_lost;
 
   float osd_recovery_delay_start;
   int osd_recovery_max_active;
   uint64_t osd_recovery_max_chunk;
+  int osd_recovery_chunk_window;
 
   bool osd_recovery_forget_lost_objects;
 
+  double osd_copy_from_timeout;
+  uint64_t osd_copy_from_max_bytes;
+
   bool osd_auto_weight;
 
   double osd_class_error_timeout;
@@ -497,6 +517,11 @@ public:
   float osd_scrub_load_threshold;
   float osd_scrub_min_interval;
   float osd_scrub_max_interval;
+  int osd_scrub_chunk_max;
+  uint64_t osd_scrub_max_bytes_per_sec;
+  int osd_scrub_max_objects_per_sec;
+  float osd_deep_scrub_interval;
+  int osd_deep_scrub_stride;
 
   bool osd_check_for_log_corruption;  // bleh
 
@@ -505,6 +530,8 @@ public:
 
   uint32_t osd_max_notify_timeout;
 
+  int osd_object_context_cache_size;
+
   // filestore
   bool filestore;
   double   filestore_max_sync_interval;
@@ -531,15 +558,30 @@ public:
   int filestore_op_thread_timeout;
   float filestore_commit_timeout;
   int filestore_fiemap_threshold;
+  bool filestore_index_hashed;
+  int filestore_index_split_threshold;
+  uint64_t filestore_cache_size;
+  int filestore_cache_shards;
+  int filestore_cache_max_extent;
+  bool filestore_kv_attrs;
+  int filestore_kv_attr_size_threshold;
+  int filestore_kv_attr_count_threshold;
+  uint64_t filestore_kv_compact_min;
+  bool filestore_copy_offload;
 
   // journal
   bool journal_dio;
+  bool journal_aio;
+  int journal_aio_max_inflight;
   bool journal_block_align;
   int journal_max_write_bytes;
   int journal_max_write_entries;
   int journal_queue_max_ops;
   int journal_queue_max_bytes;
   int journal_align_min_size;
+  int journal_replay_threads;
+  int journal_replay_queue_max_ops;
+  int journal_replay_queue_max_bytes;
 
   // block device
   bool  bdev_lock;
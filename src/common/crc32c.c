@@ -0,0 +1,117 @@
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2011 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "include/crc32c.h"
+
+/*
+ * Pick the crc32c implementation once, the first time anybody asks
+ * for a checksum.  Until then ceph_crc32c_func points at a stub that
+ * does the choosing.  Two threads may both get there first; they
+ * will choose the same thing, so that is harmless.
+ */
+static uint32_t crc32c_choose_and_run(uint32_t crc, unsigned char const *data, unsigned length);
+
+static ceph_crc32c_func_t ceph_crc32c_func = crc32c_choose_and_run;
+
+ceph_crc32c_func_t ceph_choose_crc32c(void)
+{
+	if (ceph_crc32c_intel_fast_exists())
+		return ceph_crc32c_intel_fast;
+	return ceph_crc32c_sctp;
+}
+
+const char *ceph_crc32c_name(ceph_crc32c_func_t f)
+{
+	if (f == ceph_crc32c_intel_fast)
+		return "intel_fast";
+	if (f == ceph_crc32c_sctp)
+		return "sctp";
+	return "unknown";
+}
+
+static uint32_t crc32c_choose_and_run(uint32_t crc, unsigned char const *data, unsigned length)
+{
+	ceph_crc32c_func = ceph_choose_crc32c();
+	return ceph_crc32c_func(crc, data, length);
+}
+
+uint32_t ceph_crc32c_le(uint32_t crc, unsigned char const *data, unsigned length)
+{
+	return ceph_crc32c_func(crc, data, length);
+}
+
+/*
+ * Appending zeros to a crc is linear over GF(2), so it can be done
+ * with a 32x32 bit matrix per power of two length instead of by
+ * reading any memory.  Together with
+ *
+ *   crc(a ^ b, x) = crc(a, zeros) ^ crc(b, x)
+ *
+ * this lets us reuse a checksum that was computed with a different
+ * seed, or glue checksums of adjacent pieces together.
+ */
+#define CRC32C_POLY 0x82f63b78  /* reflected */
+
+static uint32_t zeros_op[32][32];   /* zeros_op[i] appends 2^i zero bytes */
+static pthread_once_t zeros_op_once = PTHREAD_ONCE_INIT;
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+	int n;
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+static void init_zeros_op(void)
+{
+	uint32_t a[32], b[32];
+	uint32_t row = 1;
+	int n;
+
+	/* one zero bit */
+	a[0] = CRC32C_POLY;
+	for (n = 1; n < 32; n++) {
+		a[n] = row;
+		row <<= 1;
+	}
+	gf2_matrix_square(b, a);   /* two bits */
+	gf2_matrix_square(a, b);   /* four bits */
+	gf2_matrix_square(zeros_op[0], a);   /* one byte */
+	for (n = 1; n < 32; n++)
+		gf2_matrix_square(zeros_op[n], zeros_op[n - 1]);
+}
+
+uint32_t ceph_crc32c_zeros(uint32_t crc, unsigned length)
+{
+	int n;
+
+	pthread_once(&zeros_op_once, init_zeros_op);
+	for (n = 0; length && crc; n++, length >>= 1)
+		if (length & 1)
+			crc = gf2_matrix_times(zeros_op[n], crc);
+	return crc;
+}
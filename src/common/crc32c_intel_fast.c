@@ -0,0 +1,156 @@
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2011 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * crc32c with the SSE 4.2 crc32 instruction.
+ *
+ * The instruction has a latency of three cycles but can start one
+ * every cycle, so a single dependent chain runs at a third of the
+ * speed the cpu is capable of.  For large buffers we therefore run
+ * three chains over three adjacent blocks at once and stitch the
+ * results together: since crc32c (without the pre and post
+ * inversion, which ceph does not use) is linear,
+ *
+ *   crc(c, A . B) = crc(c, A) shifted over |B| zero bytes ^ crc(0, B)
+ *
+ * and shifting over a fixed number of zero bytes (see
+ * ceph_crc32c_zeros) is linear too, so we precompute it into four
+ * byte-indexed tables per block size.
+ *
+ * The instruction is used via inline assembly so that the file
+ * builds without -msse4.2; it is only ever called after cpuid said
+ * it is there.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "include/crc32c.h"
+
+#if defined(__x86_64__)
+
+#define LONG_BLOCK 8192
+#define SHORT_BLOCK 256
+
+static uint32_t long_shift[4][256];
+static uint32_t short_shift[4][256];
+static pthread_once_t shift_tables_once = PTHREAD_ONCE_INIT;
+
+static void build_shift_table(uint32_t table[4][256], unsigned len)
+{
+	unsigned n;
+
+	for (n = 0; n < 256; n++) {
+		table[0][n] = ceph_crc32c_zeros(n, len);
+		table[1][n] = ceph_crc32c_zeros(n << 8, len);
+		table[2][n] = ceph_crc32c_zeros(n << 16, len);
+		table[3][n] = ceph_crc32c_zeros(n << 24, len);
+	}
+}
+
+static void build_shift_tables(void)
+{
+	build_shift_table(long_shift, LONG_BLOCK);
+	build_shift_table(short_shift, SHORT_BLOCK);
+}
+
+static inline uint32_t shift_crc(uint32_t table[4][256], uint32_t crc)
+{
+	return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^
+		table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+static inline uint64_t crc32q(uint64_t crc, uint64_t v)
+{
+	__asm__("crc32q %1, %0" : "+r" (crc) : "rm" (v));
+	return crc;
+}
+
+static inline uint32_t crc32b(uint32_t crc, uint8_t v)
+{
+	__asm__("crc32b %1, %0" : "+r" (crc) : "rm" (v));
+	return crc;
+}
+
+static inline uint64_t load64(unsigned char const *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+int ceph_crc32c_intel_fast_exists(void)
+{
+	uint32_t eax = 1, ebx, ecx, edx;
+	__asm__("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+	if (!(ecx & (1 << 20)))  /* SSE 4.2 */
+		return 0;
+	pthread_once(&shift_tables_once, build_shift_tables);
+	return 1;
+}
+
+/* three interleaved chains over the next 3 * block bytes */
+#define CRC_TRIPLE(block, table)					\
+	do {								\
+		uint64_t c0 = crc, c1 = 0, c2 = 0;			\
+		unsigned char const *end = data + (block);		\
+		do {							\
+			c0 = crc32q(c0, load64(data));			\
+			c1 = crc32q(c1, load64(data + (block)));	\
+			c2 = crc32q(c2, load64(data + 2 * (block)));	\
+			data += 8;					\
+		} while (data < end);					\
+		crc = shift_crc(table, (uint32_t)c0) ^ (uint32_t)c1;	\
+		crc = shift_crc(table, crc) ^ (uint32_t)c2;		\
+		data += 2 * (block);					\
+		length -= 3 * (block);					\
+	} while (0)
+
+uint32_t ceph_crc32c_intel_fast(uint32_t crc, unsigned char const *data, unsigned length)
+{
+	/* align to 8 bytes */
+	while (length && ((uintptr_t)data & 7)) {
+		crc = crc32b(crc, *data++);
+		length--;
+	}
+
+	while (length >= 3 * LONG_BLOCK)
+		CRC_TRIPLE(LONG_BLOCK, long_shift);
+	while (length >= 3 * SHORT_BLOCK)
+		CRC_TRIPLE(SHORT_BLOCK, short_shift);
+
+	while (length >= 8) {
+		crc = (uint32_t)crc32q(crc, load64(data));
+		data += 8;
+		length -= 8;
+	}
+	while (length) {
+		crc = crc32b(crc, *data++);
+		length--;
+	}
+	return crc;
+}
+
+#else
+
+int ceph_crc32c_intel_fast_exists(void)
+{
+	return 0;
+}
+
+uint32_t ceph_crc32c_intel_fast(uint32_t crc, unsigned char const *data, unsigned length)
+{
+	return ceph_crc32c_sctp(crc, data, length);
+}
+
+#endif
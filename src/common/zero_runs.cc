@@ -0,0 +1,49 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2011 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "common/zero_runs.h"
+
+#include <string.h>
+
+bool buf_is_zero(const char *buf, size_t len)
+{
+  // the first byte is zero, and every other one matches its predecessor
+  if (!len)
+    return true;
+  if (buf[0])
+    return false;
+  return memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+void get_data_runs(const char *buf, uint64_t len, uint64_t granularity,
+		   std::map<uint64_t, uint64_t> *runs)
+{
+  uint64_t pos = 0;
+  while (pos < len) {
+    uint64_t step = len - pos < granularity ? len - pos : granularity;
+    if (buf_is_zero(buf + pos, step)) {
+      pos += step;
+      continue;
+    }
+    uint64_t run = step;
+    while (pos + run < len) {
+      step = len - pos - run < granularity ? len - pos - run : granularity;
+      if (buf_is_zero(buf + pos + run, step))
+	break;
+      run += step;
+    }
+    (*runs)[pos] = run;
+    pos += run;
+  }
+}
@@ -0,0 +1,38 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2011 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_COMMON_ZERO_RUNS_H
+#define CEPH_COMMON_ZERO_RUNS_H
+
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+
+/// granularity at which copies leave zeroed data as holes
+#define ZERO_RUN_GRANULARITY 4096
+
+extern bool buf_is_zero(const char *buf, size_t len);
+
+/**
+ * Find the parts of buf that hold data, so that a copy can write just
+ * those and leave the rest as holes.  buf is looked at in blocks of
+ * granularity bytes from its start; a block that is all zeros is
+ * skipped, and adjacent nonzero blocks are merged.
+ *
+ * @param runs [out] offset -> length of each nonzero run
+ */
+extern void get_data_runs(const char *buf, uint64_t len, uint64_t granularity,
+			  std::map<uint64_t, uint64_t> *runs);
+
+#endif
@@ -20,6 +20,7 @@ void CrushWrapper::find_roots(set<int>& roots) const
 int CrushWrapper::remove_item(int item)
 {
   cout << "remove_item " << item << std::endl;
+  generation++;
 
   crush_bucket *was_bucket = 0;
   int ret = -ENOENT;
@@ -65,6 +66,7 @@ int CrushWrapper::insert_item(int item, int weight, string name,
 {
   cout << "insert_item item " << item << " weight " << weight
 	  << " name " << name << " loc " << loc << std::endl;
+  generation++;
 
   if (name_exists(name.c_str())) {
     cerr << "error: device name '" << name << "' already exists as id "
@@ -129,6 +131,7 @@ int CrushWrapper::insert_item(int item, int weight, string name,
 int CrushWrapper::adjust_item_weight(int id, int weight)
 {
   cout << "adjust_item_weight " << id << " weight " << weight << std::endl;
+  generation++;
   for (int bidx = 0; bidx < crush->max_buckets; bidx++) {
     crush_bucket *b = crush->buckets[bidx];
     if (b == 0)
@@ -146,6 +149,7 @@ int CrushWrapper::adjust_item_weight(int id, int weight)
 
 void CrushWrapper::reweight()
 {
+  generation++;
   set<int> roots;
   find_roots(roots);
   for (set<int>::iterator p = roots.begin(); p != roots.end(); p++) {
@@ -54,6 +54,14 @@ public:
   mutable std::map<string, int> type_rmap, name_rmap, rule_name_rmap;
 
 private:
+  /*
+   * bumped by every modifier below that can change placement, so that
+   * anything derived from the map (e.g. OSDMap's precomputed pg
+   * mappings) can tell it is stale.  code that changes *crush directly
+   * must finalize() afterwards.
+   */
+  unsigned generation;
+
   void build_rmaps() {
     if (have_rmaps) return;
     build_rmap(type_map, type_rmap);
@@ -71,7 +79,7 @@ public:
   CrushWrapper(const CrushWrapper& other);
   const CrushWrapper& operator=(const CrushWrapper& other);
 
-  CrushWrapper() : crush(0), have_rmaps(false) {}
+  CrushWrapper() : crush(0), have_rmaps(false), generation(0) {}
   ~CrushWrapper() {
     if (crush) crush_destroy(crush);
   }
@@ -80,8 +88,11 @@ public:
   void create() {
     if (crush) crush_destroy(crush);
     crush = crush_create();
+    generation++;
   }
 
+  unsigned get_generation() const { return generation; }
+
   // bucket types
   int get_num_type_names() {
     return type_map.size();
@@ -247,6 +258,7 @@ public:
     if (!crush) return -ENOENT;
     crush_rule *n = crush_make_rule(len, pool, type, minsize, maxsize);
     ruleno = crush_add_rule(crush, n, ruleno);
+    generation++;
     return ruleno;
   }
   int set_rule_step(unsigned ruleno, unsigned step, int op, int arg1, int arg2) {
@@ -254,6 +266,7 @@ public:
     crush_rule *n = get_rule(ruleno);
     if (!n) return -1;
     crush_rule_set_step(n, step, op, arg1, arg2);
+    generation++;
     return 0;
   }
   int set_rule_step_take(unsigned ruleno, unsigned step, int val) {
@@ -366,16 +379,19 @@ public:
   int add_bucket(int bucketno, int alg, int hash, int type, int size,
 		 int *items, int *weights) {
     crush_bucket *b = crush_make_bucket(alg, hash, type, size, items, weights);
+    generation++;
     return crush_add_bucket(crush, bucketno, b);
   }
   
   void finalize() {
     assert(crush);
     crush_finalize(crush);
+    generation++;
   }
 
   void set_max_devices(int m) {
     crush->max_devices = m;
+    generation++;
   }
 
   int find_rule(int pool, int type, int size) {
@@ -98,6 +98,10 @@ public:
 
   static int get_total_alloc();
 
+  /* how often bufferlist::crc32c found an answer it had already computed */
+  static int get_cached_crc();
+  static int get_cached_crc_adjusted();
+
 private:
  
   /* hack for memory utilization debugging. */
@@ -237,17 +241,25 @@ public:
       assert(_raw);
       assert(o <= _len);
       assert(o+l <= _len);
+      invalidate_crc();
       memcpy(c_str()+o, src, l);
     }
 
     void zero() {
+      invalidate_crc();
       memset(c_str(), 0, _len);
     }
     void zero(unsigned o, unsigned l) {
       assert(o+l <= _len);
+      invalidate_crc();
       memset(c_str()+o, 0, l);
     }
 
+    // forget checksums cached on the raw buffer.  non-const c_str()
+    // does this; call it when writing through a pointer obtained
+    // before the data was last checksummed.
+    void invalidate_crc();
+
     void clean() {
       //raw *newraw = _raw->makesib(_len);
     }
@@ -889,14 +901,7 @@ public:
     ssize_t read_fd(int fd, size_t len);
     int write_file(const char *fn, int mode=0644);
     int write_fd(int fd) const;
-    __u32 crc32c(__u32 crc) {
-      for (std::list<ptr>::const_iterator it = _buffers.begin(); 
-	   it != _buffers.end(); 
-	   it++)
-	if (it->length())
-	  crc = ceph_crc32c_le(crc, (unsigned char*)it->c_str(), it->length());
-      return crc;
-    }
+    __u32 crc32c(__u32 crc);
 
   };
 };
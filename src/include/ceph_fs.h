@@ -48,6 +48,9 @@
 #define CEPH_FEATURE_RECONNECT_SEQ  (1<<6)
 #define CEPH_FEATURE_DIRLAYOUTHASH  (1<<7)
 #define CEPH_FEATURE_OBJECTLOCATOR  (1<<8)
+#define CEPH_FEATURE_CHUNKY_SCRUB   (1<<9)
+#define CEPH_FEATURE_DEEP_SCRUB     (1<<10)
+#define CEPH_FEATURE_OSD_COPY_FROM  (1<<11)
 
 
 /*
@@ -1,12 +1,34 @@
 #ifndef CEPH_CRC32C_H
 #define CEPH_CRC32C_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef uint32_t (*ceph_crc32c_func_t)(uint32_t crc, unsigned char const *data, unsigned length);
+
+/*
+ * ceph_crc32c_le() goes to the fastest implementation this cpu has,
+ * picked on first use; the others are here to test and benchmark
+ * against each other.
+ */
 uint32_t ceph_crc32c_le(uint32_t crc, unsigned char const *data, unsigned length);
 
+ceph_crc32c_func_t ceph_choose_crc32c(void);
+const char *ceph_crc32c_name(ceph_crc32c_func_t f);
+
+/* crc after length zero bytes, without reading any memory */
+uint32_t ceph_crc32c_zeros(uint32_t crc, unsigned length);
+
+/* table driven (slicing by 8); works everywhere */
+uint32_t ceph_crc32c_sctp(uint32_t crc, unsigned char const *data, unsigned length);
+
+/* the SSE 4.2 crc32 instruction; only if ceph_crc32c_intel_fast_exists() */
+int ceph_crc32c_intel_fast_exists(void);
+uint32_t ceph_crc32c_intel_fast(uint32_t crc, unsigned char const *data, unsigned length);
+
 #ifdef __cplusplus
 }
 #endif
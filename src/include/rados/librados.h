@@ -195,6 +195,8 @@ int rados_aio_read(rados_ioctx_t io, const char *oid,
 		   char *buf, size_t len, uint64_t off);
 
 int rados_aio_flush(rados_ioctx_t io);
+/* completes once all aio writes issued so far are safe */
+int rados_aio_flush_async(rados_ioctx_t io, rados_completion_t completion);
 
 /* watch/notify */
 typedef void (*rados_watchcb_t)(uint8_t opcode, uint64_t ver, void *arg);
@@ -128,6 +128,13 @@ namespace librados
                      size_t len);
     void src_cmpxattr(const std::string& src_oid,
 		      const char *name, const bufferlist& val, int op, int mode);
+    /**
+     * Replace this object's data and user xattrs with those of src_oid,
+     * read through src_ioctx (its pool, locator key and read snap).  The
+     * copy happens on the osds; the data never comes back to the client.
+     * Osds that predate this op fail it with -EOPNOTSUPP.
+     */
+    void copy_from(const std::string& src_oid, const IoCtx& src_ioctx);
 
     void exec(const char *cls, const char *method, bufferlist& bl);
 
@@ -242,6 +249,7 @@ namespace librados
     int aio_write_full(const std::string& oid, AioCompletion *c, const bufferlist& bl);
     
     int aio_flush();
+    int aio_flush_async(AioCompletion *c);
 
     // compound object operations
     int operate(const std::string& oid, ObjectOperation *op, bufferlist *pbl);
@@ -264,6 +272,9 @@ namespace librados
 
     int get_id();
 
+    // a context for another pool, by id, in the same cluster
+    int ioctx_create(int pool_id, IoCtx &ioctx);
+
     CephContext *cct();
 
   private:
@@ -271,6 +282,7 @@ namespace librados
     IoCtx(IoCtxImpl *io_ctx_impl_);
 
     friend class Rados; // Only Rados can use our private constructor to create IoCtxes.
+    friend class ObjectOperation;
 
     IoCtxImpl *io_ctx_impl;
   };
@@ -26,7 +26,7 @@ extern "C" {
 
 #define LIBRBD_VER_MAJOR 0
 #define LIBRBD_VER_MINOR 1
-#define LIBRBD_VER_EXTRA 0
+#define LIBRBD_VER_EXTRA 4
 
 #define LIBRBD_VERSION(maj, min, extra) ((maj << 16) + (min << 8) + extra)
 
@@ -37,6 +37,8 @@ extern "C" {
 typedef void *rbd_snap_t;
 typedef void *rbd_image_t;
 
+typedef int (*librbd_progress_fn_t)(uint64_t offset, uint64_t total, void *ptr);
+
 typedef struct {
   uint64_t id;
   uint64_t size;
@@ -46,6 +48,10 @@ typedef struct {
 #define RBD_MAX_IMAGE_NAME_SIZE 96
 #define RBD_MAX_BLOCK_NAME_SIZE 24
 
+/* image features, chosen at creation */
+#define RBD_FEATURE_OBJECT_MAP	(1<<0)  /* track which block objects exist */
+#define RBD_FEATURE_LAYERING	(1<<1)  /* a clone; set by rbd_clone only */
+
 typedef struct {
   uint64_t size;
   uint64_t obj_size;
@@ -61,14 +67,25 @@ void rbd_version(int *major, int *minor, int *extra);
 /* images */
 int rbd_list(rados_ioctx_t io, char *names, size_t *size);
 int rbd_create(rados_ioctx_t io, const char *name, uint64_t size, int *order);
+int rbd_create2(rados_ioctx_t io, const char *name, uint64_t size,
+		uint64_t features, int *order);
+/* a copy-on-write clone of p_name@p_snapname; *c_order 0 means the parent's */
+int rbd_clone(rados_ioctx_t p_io, const char *p_name, const char *p_snapname,
+	      rados_ioctx_t c_io, const char *c_name, uint64_t features, int *c_order);
 int rbd_remove(rados_ioctx_t io, const char *name);
 int rbd_copy(rados_ioctx_t src_io_ctx, const char *srcname, rados_ioctx_t dest_io_ctx, const char *destname);
+int rbd_copy_with_progress(rados_ioctx_t src_io_ctx, const char *srcname,
+			   rados_ioctx_t dest_io_ctx, const char *destname,
+			   librbd_progress_fn_t cb, void *cbdata);
 int rbd_rename(rados_ioctx_t src_io_ctx, const char *srcname, const char *destname);
 
 int rbd_open(rados_ioctx_t io, const char *name, rbd_image_t *image, const char *snap_name);
 int rbd_close(rbd_image_t image);
 int rbd_resize(rbd_image_t image, uint64_t size);
 int rbd_stat(rbd_image_t image, rbd_image_info_t *info, size_t infosize);
+int rbd_get_features(rbd_image_t image, uint64_t *features);
+/* bytes allocated to the image; -EOPNOTSUPP without RBD_FEATURE_OBJECT_MAP */
+int rbd_get_used_size(rbd_image_t image, uint64_t *used);
 
 /* snapshots */
 int rbd_snap_list(rbd_image_t image, rbd_snap_info_t *snaps, int *max_snaps);
@@ -87,6 +104,9 @@ int64_t rbd_read_iterate(rbd_image_t image, uint64_t ofs, size_t len,
 ssize_t rbd_write(rbd_image_t image, uint64_t ofs, size_t len, const char *buf);
 int rbd_aio_write(rbd_image_t image, uint64_t off, size_t len, const char *buf, rbd_completion_t c);
 int rbd_aio_read(rbd_image_t image, uint64_t off, size_t len, char *buf, rbd_completion_t c);
+/* write back anything buffered by the cache (rbd_cache) and wait for it to be safe */
+int rbd_flush(rbd_image_t image);
+int rbd_aio_flush(rbd_image_t image, rbd_completion_t c);
 int rbd_aio_create_completion(void *cb_arg, rbd_callback_t complete_cb, rbd_completion_t *c);
 int rbd_aio_wait_for_complete(rbd_completion_t c);
 ssize_t rbd_aio_get_return_value(rbd_completion_t c);
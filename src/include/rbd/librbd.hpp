@@ -41,6 +41,13 @@ namespace librbd {
 
   typedef rbd_image_info_t image_info_t;
 
+  class ProgressContext
+  {
+  public:
+    virtual ~ProgressContext();
+    virtual int update_progress(uint64_t offset, uint64_t total) = 0;
+  };
+
 class RBD
 {
 public:
@@ -61,8 +68,14 @@ public:
   int open(IoCtx& io_ctx, Image& image, const char *name, const char *snapname);
   int list(IoCtx& io_ctx, std::vector<std::string>& names);
   int create(IoCtx& io_ctx, const char *name, uint64_t size, int *order);
+  int create2(IoCtx& io_ctx, const char *name, uint64_t size,
+	      uint64_t features, int *order);
+  int clone(IoCtx& p_ioctx, const char *p_name, const char *p_snapname,
+	    IoCtx& c_ioctx, const char *c_name, uint64_t features, int *c_order);
   int remove(IoCtx& io_ctx, const char *name);
   int copy(IoCtx& src_io_ctx, const char *srcname, IoCtx& dest_io_ctx, const char *destname);
+  int copy_with_progress(IoCtx& src_io_ctx, const char *srcname, IoCtx& dest_io_ctx,
+			 const char *destname, ProgressContext& prog);
   int rename(IoCtx& src_io_ctx, const char *srcname, const char *destname);
 
 private:
@@ -79,6 +92,8 @@ public:
 
   int resize(uint64_t size);
   int stat(image_info_t &info, size_t infosize);
+  int get_features(uint64_t *features);
+  int get_used_size(uint64_t *used);
 
   /* snapshots */
   int snap_list(std::vector<snap_info_t>& snaps);
@@ -96,6 +111,9 @@ public:
   int aio_write(uint64_t off, size_t len, ceph::bufferlist& bl, RBD::AioCompletion *c);
   int aio_read(uint64_t off, size_t len, ceph::bufferlist& bl, RBD::AioCompletion *c);
 
+  int flush();
+  int aio_flush(RBD::AioCompletion *c);
+
 private:
   friend class RBD;
 
@@ -21,11 +21,39 @@
  *   foo.00000000
  *   foo.00000001
  *   ...          - data
+ *
+ * If the image has RBD_FEATURE_OBJECT_MAP, the data objects are
+ * accompanied by
+ *   <block_name>.map - one bit per data object, least significant bit
+ *                      first, set before the object is first written
+ * A clear bit means the object doesn't exist.  The map is written with
+ * the image's snap context, so each snapshot has its own copy.  Clients
+ * that don't know about the map must not write to such an image, so
+ * images with any features get RBD_HEADER_FEATURES_TEXT and
+ * RBD_HEADER_FEATURES_VERSION in their header instead; older clients,
+ * the kernel's included, don't recognize those and refuse the image.
+ * Setting a bit notifies the header's watchers with the block number,
+ * so other openers of the image stop treating the block as a hole.
+ *
+ * A layered image (RBD_FEATURE_LAYERING) is a clone of a snapshot of
+ * another image.  Its header has an RBD_PARENT_ATTR xattr naming the
+ * parent, and block objects the clone doesn't have yet are read from
+ * the parent; the first write to one copies the parent's data up.
+ * Clones are registered in the parent pool's RBD_CHILDREN tmap, which
+ * keeps the parent from being renamed or removed, and in the
+ * RBD_CHILDREN_ATTR xattr of the parent's header, where the rbd class
+ * keeps their snapshot from being removed while they exist.  Only the head
+ * records how much of the parent shows through, so a clone with
+ * snapshots can't be shrunk below that.
  */
 
 #define RBD_SUFFIX	 	".rbd"
 #define RBD_DIRECTORY           "rbd_directory"
 #define RBD_INFO                "rbd_info"
+#define RBD_CHILDREN            "rbd_children"
+
+#define RBD_PARENT_ATTR         "rbd.parent"
+#define RBD_CHILDREN_ATTR       "rbd.children"
 
 #define RBD_DEFAULT_OBJ_ORDER	22   /* 4MB */
 
@@ -39,6 +67,15 @@
 #define RBD_HEADER_SIGNATURE	"RBD"
 #define RBD_HEADER_VERSION	"001.005"
 
+#define RBD_HEADER_FEATURES_TEXT	"<<< Rados Block Device Image v2 >>>\n"
+#define RBD_HEADER_FEATURES_VERSION	"001.006"
+
+#define RBD_MAP_SUFFIX		".map"
+
+#define RBD_FEATURE_OBJECT_MAP	(1<<0)
+#define RBD_FEATURE_LAYERING	(1<<1)
+#define RBD_FEATURES_ALL	(RBD_FEATURE_OBJECT_MAP | RBD_FEATURE_LAYERING)
+
 struct rbd_info {
 	__le64 max_id;
 } __attribute__ ((packed));
@@ -57,7 +94,7 @@ struct rbd_obj_header_ondisk {
 		__u8 order;
 		__u8 crypt_type;
 		__u8 comp_type;
-		__u8 unused;
+		__u8 features;
 	} __attribute__((packed)) options;
 	__le64 image_size;
 	__le64 snap_seq;
@@ -93,6 +93,7 @@ struct librados::IoCtxImpl {
   tid_t aio_write_seq;
   Cond aio_write_cond;
   xlist<AioCompletionImpl*> aio_write_list;
+  map<tid_t, std::list<AioCompletionImpl*> > aio_write_waiters;
 
   IoCtxImpl();
   IoCtxImpl(RadosClient *c, int pid, const char *pool_name_, snapid_t s);
@@ -125,6 +126,7 @@ struct librados::IoCtxImpl {
 
   void queue_aio_write(struct AioCompletionImpl *c);
   void complete_aio_write(struct AioCompletionImpl *c);
+  void flush_aio_writes_async(AioCompletionImpl *c);
   void flush_aio_writes();
 
   int get_id() {
@@ -219,6 +221,13 @@ void librados::ObjectOperation::src_cmpxattr(const std::string& src_oid,
   o->src_cmpxattr(oid, CEPH_NOSNAP, name, v, op, mode);
 }
 
+void librados::ObjectOperation::copy_from(const std::string& src_oid, const IoCtx& src_ioctx)
+{
+  ::ObjectOperation *o = (::ObjectOperation *)impl;
+  object_t oid(src_oid);
+  o->copy_from(oid, src_ioctx.io_ctx_impl->oloc, src_ioctx.io_ctx_impl->snap_seq);
+}
+
 
 librados::WatchCtx::
 ~WatchCtx()
@@ -340,6 +349,24 @@ void librados::IoCtxImpl::queue_aio_write(AioCompletionImpl *c)
   aio_write_list_lock.Unlock();
 }
 
+static void complete_aio_flush(librados::AioCompletionImpl *c)
+{
+  c->lock.Lock();
+  c->rval = 0;
+  c->ack = true;
+  c->safe = true;
+  c->cond.Signal();
+  rados_callback_t cb_complete = c->callback_complete;
+  rados_callback_t cb_safe = c->callback_safe;
+  void *cb_arg = c->callback_arg;
+  c->lock.Unlock();
+  if (cb_complete)
+    cb_complete(c, cb_arg);
+  if (cb_safe)
+    cb_safe(c, cb_arg);
+  c->put();
+}
+
 void librados::IoCtxImpl::complete_aio_write(AioCompletionImpl *c)
 {
   aio_write_list_lock.Lock();
@@ -347,10 +374,42 @@ void librados::IoCtxImpl::complete_aio_write(AioCompletionImpl *c)
   c->io = NULL;
   c->aio_write_list_item.remove_myself();
   aio_write_cond.Signal();
+
+  // flushes waiting only on writes older than the oldest one left
+  std::list<AioCompletionImpl*> ready;
+  map<tid_t, std::list<AioCompletionImpl*> >::iterator p = aio_write_waiters.begin();
+  while (p != aio_write_waiters.end() &&
+	 (aio_write_list.empty() ||
+	  aio_write_list.front()->aio_write_seq > p->first)) {
+    ready.splice(ready.end(), p->second);
+    aio_write_waiters.erase(p++);
+  }
   aio_write_list_lock.Unlock();
+
+  for (std::list<AioCompletionImpl*>::iterator q = ready.begin(); q != ready.end(); ++q)
+    complete_aio_flush(*q);
   put();
 }
 
+/*
+ * complete c once every aio write queued so far is safe.  it may
+ * complete (and call back) before we return.
+ */
+void librados::IoCtxImpl::flush_aio_writes_async(AioCompletionImpl *c)
+{
+  c->get();
+  aio_write_list_lock.Lock();
+  tid_t seq = aio_write_seq;
+  if (aio_write_list.empty() ||
+      aio_write_list.front()->aio_write_seq > seq) {
+    aio_write_list_lock.Unlock();
+    complete_aio_flush(c);
+    return;
+  }
+  aio_write_waiters[seq].push_back(c);
+  aio_write_list_lock.Unlock();
+}
+
 void librados::IoCtxImpl::flush_aio_writes()
 {
   aio_write_list_lock.Lock();
@@ -638,9 +697,11 @@ public:
 	c->lock.Lock();
       }
 
+      // this may complete flushes waiting on us; not under our lock
+      c->lock.Unlock();
       c->io->complete_aio_write(c);
 
-      c->put_unlock();
+      c->put();
     }
     C_aio_Safe(AioCompletionImpl *_c) : c(_c) {
       c->get();
@@ -1647,14 +1708,17 @@ aio_operate(IoCtxImpl& io, const object_t& oid, ::ObjectOperation *o, AioComplet
 	    bufferlist *pbl)
 {
   utime_t ut = ceph_clock_now(cct);
-  Context *onack = new C_aio_Ack(c);
-  Context *oncommit = new C_aio_Safe(c);
 
   /* can't write to a snapshot */
   if (io.snap_seq != CEPH_NOSNAP)
     return -EINVAL;
 
   io.queue_aio_write(c);
+
+  Context *onack = new C_aio_Ack(c);
+  Context *oncommit = new C_aio_Safe(c);
+
+  Mutex::Locker l(lock);
   objecter->mutate(oid, io.oloc, *o, io.snapc, ut, 0, onack, oncommit, &c->objver);
 
   return 0;
@@ -2900,6 +2964,13 @@ aio_flush()
   return 0;
 }
 
+int librados::IoCtx::
+aio_flush_async(librados::AioCompletion *c)
+{
+  io_ctx_impl->flush_aio_writes_async(c->pc);
+  return 0;
+}
+
 int librados::IoCtx::
 watch(const string& oid, uint64_t ver, uint64_t *cookie, librados::WatchCtx *ctx)
 {
@@ -2959,6 +3030,20 @@ get_id()
   return io_ctx_impl->get_id();
 }
 
+int librados::IoCtx::
+ioctx_create(int pool_id, IoCtx &io)
+{
+  RadosClient *client = io_ctx_impl->client;
+  const char *name = client->get_pool_name(pool_id);
+  if (!name)
+    return -ENOENT;
+
+  IoCtxImpl *ctx = new IoCtxImpl(client, pool_id, name, CEPH_NOSNAP);
+  ctx->get();
+  io.io_ctx_impl = ctx;
+  return 0;
+}
+
 CephContext *librados::IoCtx::
 cct()
 {
@@ -3914,6 +3999,14 @@ extern "C" int rados_aio_flush(rados_ioctx_t io)
   return 0;
 }
 
+extern "C" int rados_aio_flush_async(rados_ioctx_t io,
+				     rados_completion_t completion)
+{
+  librados::IoCtxImpl *ctx = (librados::IoCtxImpl *)io;
+  ctx->flush_aio_writes_async((librados::AioCompletionImpl*)completion);
+  return 0;
+}
+
 struct C_WatchCB : public librados::WatchCtx {
   rados_watchcb_t wcb;
   void *arg;
@@ -13,9 +13,13 @@
  */
 
 #include "common/Cond.h"
+#include "common/Finisher.h"
 #include "common/dout.h"
 #include "common/errno.h"
+#include "common/zero_runs.h"
 #include "include/rbd/librbd.hpp"
+#include "osdc/ObjectCacher.h"
+#include "osdc/WritebackHandler.h"
 
 #include <errno.h>
 #include <inttypes.h>
@@ -39,12 +43,124 @@ namespace librbd {
     SnapInfo(snap_t _id, uint64_t _size) : id(_id), size(_size) {};
   };
 
+  /*
+   * Where a layered image reads the data it hasn't written itself: a
+   * snapshot of another image, for the first overlap bytes of the clone.
+   */
+  struct ParentSpec {
+    int64_t pool_id;
+    string image_name;
+    string snap_name;
+    snap_t snap_id;
+    uint64_t overlap;
+
+    ParentSpec() : pool_id(-1), snap_id(CEPH_NOSNAP), overlap(0) {}
+
+    void encode(bufferlist& bl) const {
+      __u8 struct_v = 1;
+      ::encode(struct_v, bl);
+      ::encode(pool_id, bl);
+      ::encode(image_name, bl);
+      ::encode(snap_name, bl);
+      ::encode(snap_id, bl);
+      ::encode(overlap, bl);
+    }
+    void decode(bufferlist::iterator& bl) {
+      __u8 struct_v;
+      ::decode(struct_v, bl);
+      ::decode(pool_id, bl);
+      ::decode(image_name, bl);
+      ::decode(snap_name, bl);
+      ::decode(snap_id, bl);
+      ::decode(overlap, bl);
+    }
+  };
+}
+WRITE_CLASS_ENCODER(librbd::ParentSpec)
+
+namespace librbd {
+
+  /*
+   * Writeback for the image cache, on top of the public librados api.
+   * librados runs completion callbacks with its own lock held, so they
+   * can't take the cache lock directly (a thread holding the cache lock
+   * may be blocked submitting io to librados); they're handed to a
+   * Finisher thread instead, which completes them under the cache lock.
+   *
+   * Reads use the IoCtx's read snapshot and writes its snap context,
+   * which librbd keeps current (and flushes the cache around changing).
+   */
+  class LibrbdWriteback : public WritebackHandler {
+  public:
+    LibrbdWriteback(IoCtx& io, Mutex& lock)
+      : io_ctx(io), cache_lock(lock), finisher(io.cct()), last_tid(0) {}
+    virtual ~LibrbdWriteback() {}
+
+    void start() {
+      finisher.start();
+    }
+    void stop() {
+      finisher.stop();
+    }
+    // for completions that mustn't run under the cache lock
+    Finisher& get_finisher() {
+      return finisher;
+    }
+
+    virtual tid_t read(const object_t& oid, const object_locator_t& oloc,
+		       uint64_t off, uint64_t len, snapid_t snapid,
+		       bufferlist *pbl, uint64_t trunc_size, __u32 trunc_seq,
+		       Context *onfinish);
+    virtual tid_t write(const object_t& oid, const object_locator_t& oloc,
+			uint64_t off, uint64_t len, const SnapContext& snapc,
+			const bufferlist &bl, utime_t mtime,
+			uint64_t trunc_size, __u32 trunc_seq,
+			Context *onack, Context *oncommit);
+    virtual tid_t lock(const object_t& oid, const object_locator_t& oloc,
+		       int op, int flags, Context *onack, Context *oncommit);
+
+  private:
+    struct C_Request : public Context {
+      LibrbdWriteback *wb;
+      Context *first, *second;
+      C_Request(LibrbdWriteback *w, Context *f, Context *s)
+	: wb(w), first(f), second(s) {}
+      void finish(int r) {
+	wb->cache_lock.Lock();
+	if (first)
+	  first->complete(r);
+	if (second)
+	  second->complete(r);
+	wb->cache_lock.Unlock();
+      }
+    };
+    static void rados_req_cb(rados_completion_t c, void *arg);
+
+    IoCtx& io_ctx;
+    Mutex& cache_lock;
+    Finisher finisher;
+    tid_t last_tid;
+  };
+
   struct ImageCtx {
     CephContext *cct;
     struct rbd_obj_header_ondisk header;
     ::SnapContext snapc;
     vector<snap_t> snaps;
     std::map<std::string, struct SnapInfo> snaps_by_name;
+    vector<bool> object_map; // RBD_FEATURE_OBJECT_MAP, as of snapid
+    vector<uint64_t> map_adds; // bits other openers have set; under refresh_lock
+    // bits we set that other openers haven't been told about yet (under
+    // lock); object_map_add() hands them to map_notifier in batches
+    vector<uint64_t> map_notify_pending;
+    bool map_notify_queued;
+    Finisher map_notifier;
+    bool map_notifier_started;
+    // RBD_FEATURE_LAYERING; the parent is opened once and never changes
+    ImageCtx *parent;
+    ParentSpec parent_spec;
+    std::map<uint64_t, bool> child_objects; // block objects known to exist (or not)
+    uint64_t map_adds_seen; // batches of map_adds applied, to spot a racing copy-up
     uint64_t snapid;
     std::string name;
     std::string snapname;
@@ -54,16 +170,74 @@ namespace librbd {
     Mutex refresh_lock;
     Mutex lock; // protects access to snapshot and header information
 
-    ImageCtx(std::string imgname, IoCtx& p) : cct(p.cct()), snapid(CEPH_NOSNAP),
+    // optional data cache (rbd_cache)
+    Mutex cache_lock; // protects the ObjectCacher and object_set
+    LibrbdWriteback *writeback_handler;
+    ObjectCacher *object_cacher;
+    ObjectCacher::ObjectSet *object_set;
+
+    ImageCtx(std::string imgname, IoCtx& p) : cct(p.cct()),
+					      map_notify_queued(false),
+					      map_notifier(p.cct()),
+					      map_notifier_started(false),
+					      parent(NULL),
+					      map_adds_seen(0),
+					      snapid(CEPH_NOSNAP),
 					      name(imgname),
+					      wctx(NULL),
 					      needs_refresh(true),
 					      refresh_lock("librbd::ImageCtx::refresh_lock"),
-					      lock("librbd::ImageCtx::lock") {
+					      lock("librbd::ImageCtx::lock"),
+					      cache_lock("librbd::ImageCtx::cache_lock"),
+					      writeback_handler(NULL),
+					      object_cacher(NULL),
+					      object_set(NULL) {
       md_ctx.dup(p);
       data_ctx.dup(p);
+
+      if (cct->_conf->rbd_cache) {
+	writeback_handler = new LibrbdWriteback(data_ctx, cache_lock);
+	object_cacher = new ObjectCacher(cct, "librbd-" + name,
+					 *writeback_handler, cache_lock,
+					 NULL, NULL, NULL,
+					 cct->_conf->rbd_cache_size,
+					 cct->_conf->rbd_cache_max_dirty,
+					 cct->_conf->rbd_cache_target_dirty,
+					 cct->_conf->rbd_cache_max_dirty_age);
+	object_set = new ObjectCacher::ObjectSet(NULL, data_ctx.get_id(), 0);
+	writeback_handler->start();
+	object_cacher->start();
+      }
     }
 
     ~ImageCtx() {
+      if (map_notifier_started) {
+	map_notifier.wait_for_empty();
+	map_notifier.stop();
+      }
+      if (object_cacher) {
+	// close_image has flushed it; drop what's left and shut down
+	cache_lock.Lock();
+	loff_t unclean = object_cacher->release_set(object_set);
+	cache_lock.Unlock();
+	if (unclean) {
+	  // the flush failed or raced with a write; let writes in flight
+	  // finish before tearing down what their callbacks touch
+	  data_ctx.aio_flush();
+	  writeback_handler->get_finisher().wait_for_empty();
+	  cache_lock.Lock();
+	  unclean = object_cacher->release_set(object_set);
+	  cache_lock.Unlock();
+	  if (unclean)
+	    lderr(cct) << "~ImageCtx: dropping " << unclean << " unflushed bytes of "
+		       << name << dendl;
+	}
+	object_cacher->stop();
+	writeback_handler->stop();
+	delete object_cacher;
+	delete object_set;
+	delete writeback_handler;
+      }
     }
 
     int snap_set(std::string snap_name)
@@ -104,6 +278,14 @@ namespace librbd {
     {
       return name + RBD_SUFFIX;
     }
+
+    // without an object map, any object may exist
+    bool object_may_exist(uint64_t num) const
+    {
+      if (!(header.options.features & RBD_FEATURE_OBJECT_MAP))
+	return true;
+      return num < object_map.size() && object_map[num];
+    }
   };
 
   class WatchCtx : public librados::WatchCtx {
@@ -234,8 +416,14 @@ namespace librbd {
   int snap_set(ImageCtx *ictx, const char *snap_name);
   int list(IoCtx& io_ctx, std::vector<string>& names);
   int create(IoCtx& io_ctx, const char *imgname, uint64_t size, int *order);
+  int create(IoCtx& io_ctx, const char *imgname, uint64_t size, uint64_t features,
+	     int *order);
+  int create_image(IoCtx& io_ctx, const char *imgname, uint64_t size, uint64_t features,
+		   int *order, const ParentSpec *parent);
   int rename(IoCtx& io_ctx, const char *srcname, const char *dstname);
   int info(ImageCtx *ictx, image_info_t& info, size_t image_size);
+  int get_features(ImageCtx *ictx, uint64_t *features);
+  int get_used_size(ImageCtx *ictx, uint64_t *used);
   int remove(IoCtx& io_ctx, const char *imgname);
   int resize(ImageCtx *ictx, uint64_t size);
   int snap_create(ImageCtx *ictx, const char *snap_name);
@@ -247,11 +435,16 @@ namespace librbd {
   int ictx_check(ImageCtx *ictx);
   int ictx_refresh(ImageCtx *ictx, const char *snap_name);
   int copy(IoCtx& src_md_ctx, const char *srcname, IoCtx& dest_md_ctx, const char *destname);
+  int copy(IoCtx& src_md_ctx, const char *srcname, IoCtx& dest_md_ctx, const char *destname,
+	   ProgressContext& prog);
+  int clone(IoCtx& p_ioctx, const char *p_name, const char *p_snap_name,
+	    IoCtx& c_ioctx, const char *c_name, uint64_t features, int *c_order);
 
   int open_image(IoCtx& io_ctx, ImageCtx *ictx, const char *name, const char *snap_name);
   void close_image(ImageCtx *ictx);
 
-  void trim_image(IoCtx& io_ctx, const rbd_obj_header_ondisk &header, uint64_t newsize);
+  int trim_image(IoCtx& io_ctx, const rbd_obj_header_ondisk &header,
+		 const vector<bool> *object_map, uint64_t newsize);
   int read_rbd_info(IoCtx& io_ctx, const string& info_oid, struct rbd_info *info);
 
   int touch_rbd_info(IoCtx& io_ctx, const string& info_oid);
@@ -259,6 +452,8 @@ namespace librbd {
   int read_header_bl(IoCtx& io_ctx, const string& md_oid, bufferlist& header, uint64_t *ver);
   int notify_change(IoCtx& io_ctx, const string& oid, uint64_t *pver, ImageCtx *ictx);
   int read_header(IoCtx& io_ctx, const string& md_oid, struct rbd_obj_header_ondisk *header, uint64_t *ver);
+  int check_header(CephContext *cct, const string& md_oid,
+		   const rbd_obj_header_ondisk& header);
   int write_header(IoCtx& io_ctx, const string& md_oid, bufferlist& header);
   int tmap_set(IoCtx& io_ctx, const string& imgname);
   int tmap_rm(IoCtx& io_ctx, const string& imgname);
@@ -269,10 +464,34 @@ namespace librbd {
   uint64_t get_block_size(const rbd_obj_header_ondisk &header);
   uint64_t get_block_num(const rbd_obj_header_ondisk &header, uint64_t ofs);
   uint64_t get_block_ofs(const rbd_obj_header_ondisk &header, uint64_t ofs);
+  string get_map_oid(const rbd_obj_header_ondisk &header);
+  int read_object_map(IoCtx& io_ctx, const rbd_obj_header_ondisk &header, vector<bool>& map);
+  int update_object_map(IoCtx& io_ctx, const string& map_oid,
+			uint64_t start, uint64_t end, bool exists);
+  int refresh_object_map(ImageCtx *ictx);
+  int object_map_add(ImageCtx *ictx, uint64_t num);
+  void flush_map_notifies(ImageCtx *ictx, Context *onfinish);
+  void wait_for_map_notifies(ImageCtx *ictx);
+
+  int read_parent_spec(IoCtx& io_ctx, const string& md_oid, ParentSpec *spec);
+  int write_parent_spec(IoCtx& io_ctx, const string& md_oid, const ParentSpec& spec);
+  string get_children_prefix(const string& parent_name, snap_t snap_id);
+  string get_child_key(const string& parent_name, snap_t snap_id,
+		       int64_t child_pool, const string& child_name);
+  int add_child(IoCtx& p_ioctx, const string& parent_name, snap_t snap_id,
+		const string& key);
+  int remove_child(IoCtx& p_ioctx, const string& parent_name, snap_t snap_id,
+		   const string& key);
+  int has_children(IoCtx& p_ioctx, const string& prefix, bool *found);
+  int open_parent(ImageCtx *ictx);
+  uint64_t parent_overlap(ImageCtx *ictx, uint64_t off, uint64_t len);
+  int child_has_object(ImageCtx *ictx, uint64_t num, bool *exists);
+  int read_from_parent(ImageCtx *ictx, uint64_t off, size_t len, char *buf);
+  int copy_up(ImageCtx *ictx, uint64_t num);
   int check_io(ImageCtx *ictx, uint64_t off, uint64_t len);
   int init_rbd_info(struct rbd_info *info);
   void init_rbd_header(struct rbd_obj_header_ondisk& ondisk,
-			      uint64_t size, int *order, uint64_t bid);
+		       uint64_t size, uint64_t features, int *order, uint64_t bid);
 
   int64_t read_iterate(ImageCtx *ictx, uint64_t off, size_t len,
 		       int (*cb)(uint64_t, size_t, const char *, void *),
@@ -283,6 +502,17 @@ namespace librbd {
                 AioCompletion *c);
   int aio_read(ImageCtx *ictx, uint64_t off, size_t len,
                char *buf, AioCompletion *c);
+  int flush(ImageCtx *ictx);
+  int aio_flush(ImageCtx *ictx, AioCompletion *c);
+
+  void aio_read_from_cache(ImageCtx *ictx, const string& oid, bufferlist *bl,
+			   size_t len, uint64_t off, Context *onfinish);
+  int read_from_cache(ImageCtx *ictx, const string& oid, bufferlist *bl,
+		      size_t len, uint64_t off);
+  void write_to_cache(ImageCtx *ictx, const string& oid, bufferlist& bl,
+		      size_t len, uint64_t off);
+  int flush_cache(ImageCtx *ictx);
+  int invalidate_cache(ImageCtx *ictx);
   ssize_t handle_sparse_read(CephContext *cct,
 			     bufferlist data_bl,
 			     uint64_t block_ofs,
@@ -314,20 +544,85 @@ void WatchCtx::notify(uint8_t opcode, uint64_t ver, bufferlist& bl)
   ldout(ictx->cct, 1) <<  " got notification opcode=" << (int)opcode << " ver=" << ver << " cookie=" << cookie << dendl;
   if (valid) {
     Mutex::Locker lictx(ictx->refresh_lock);
+    if (bl.length()) {
+      // object map bits were set; no need to re-read everything
+      try {
+	bufferlist::iterator p = bl.begin();
+	vector<uint64_t> nums;
+	::decode(nums, p);
+	ictx->map_adds.insert(ictx->map_adds.end(), nums.begin(), nums.end());
+	return;
+      }
+      catch (buffer::error& e) {
+      }
+    }
     ictx->needs_refresh = true;
   }
 }
 
+void LibrbdWriteback::rados_req_cb(rados_completion_t c, void *arg)
+{
+  C_Request *req = (C_Request *)arg;
+  req->wb->finisher.queue(req, rados_aio_get_return_value(c));
+}
+
+tid_t LibrbdWriteback::read(const object_t& oid, const object_locator_t& oloc,
+			    uint64_t off, uint64_t len, snapid_t snapid,
+			    bufferlist *pbl, uint64_t trunc_size,
+			    __u32 trunc_seq, Context *onfinish)
+{
+  C_Request *req = new C_Request(this, onfinish, NULL);
+  librados::AioCompletion *rados_completion =
+    Rados::aio_create_completion(req, rados_req_cb, NULL);
+  int r = io_ctx.aio_read(oid.name, rados_completion, pbl, len, off);
+  rados_completion->release();
+  if (r < 0)
+    finisher.queue(req, r);
+  return ++last_tid;
+}
+
+tid_t LibrbdWriteback::write(const object_t& oid, const object_locator_t& oloc,
+			     uint64_t off, uint64_t len,
+			     const SnapContext& snapc, const bufferlist &bl,
+			     utime_t mtime, uint64_t trunc_size,
+			     __u32 trunc_seq, Context *onack,
+			     Context *oncommit)
+{
+  // rbd writes complete when they're safe; ack and commit together
+  C_Request *req = new C_Request(this, onack, oncommit);
+  librados::AioCompletion *rados_completion =
+    Rados::aio_create_completion(req, NULL, rados_req_cb);
+  int r = io_ctx.aio_write(oid.name, rados_completion, bl, len, off);
+  rados_completion->release();
+  if (r < 0)
+    finisher.queue(req, r);
+  return ++last_tid;
+}
+
+tid_t LibrbdWriteback::lock(const object_t& oid, const object_locator_t& oloc,
+			    int op, int flags, Context *onack,
+			    Context *oncommit)
+{
+  assert(0 == "librbd doesn't use object locks");
+  return 0;
+}
+
 void init_rbd_header(struct rbd_obj_header_ondisk& ondisk,
-					uint64_t size, int *order, uint64_t bid)
+		     uint64_t size, uint64_t features, int *order, uint64_t bid)
 {
   uint32_t hi = bid >> 32;
   uint32_t lo = bid & 0xFFFFFFFF;
   memset(&ondisk, 0, sizeof(ondisk));
 
-  memcpy(&ondisk.text, RBD_HEADER_TEXT, sizeof(RBD_HEADER_TEXT));
+  if (features) {
+    // keep clients that don't know about features away
+    memcpy(&ondisk.text, RBD_HEADER_FEATURES_TEXT, sizeof(RBD_HEADER_FEATURES_TEXT));
+    memcpy(&ondisk.version, RBD_HEADER_FEATURES_VERSION, sizeof(RBD_HEADER_FEATURES_VERSION));
+  } else {
+    memcpy(&ondisk.text, RBD_HEADER_TEXT, sizeof(RBD_HEADER_TEXT));
+    memcpy(&ondisk.version, RBD_HEADER_VERSION, sizeof(RBD_HEADER_VERSION));
+  }
   memcpy(&ondisk.signature, RBD_HEADER_SIGNATURE, sizeof(RBD_HEADER_SIGNATURE));
-  memcpy(&ondisk.version, RBD_HEADER_VERSION, sizeof(RBD_HEADER_VERSION));
 
   snprintf(ondisk.block_name, sizeof(ondisk.block_name), "rb.%x.%x", hi, lo);
 
@@ -338,6 +633,7 @@ void init_rbd_header(struct rbd_obj_header_ondisk& ondisk,
   ondisk.options.order = *order;
   ondisk.options.crypt_type = RBD_CRYPT_NONE;
   ondisk.options.comp_type = RBD_COMP_NONE;
+  ondisk.options.features = features;
   ondisk.snap_seq = 0;
   ondisk.snap_count = 0;
   ondisk.reserved = 0;
@@ -400,19 +696,446 @@ int init_rbd_info(struct rbd_info *info)
   return 0;
 }
 
-void trim_image(IoCtx& io_ctx, const rbd_obj_header_ondisk &header, uint64_t newsize)
+string get_map_oid(const rbd_obj_header_ondisk &header)
+{
+  return string(header.block_name) + RBD_MAP_SUFFIX;
+}
+
+/*
+ * Read the object map as of io_ctx's read snapshot.  A missing map
+ * object just means nothing has been written yet.
+ */
+int read_object_map(IoCtx& io_ctx, const rbd_obj_header_ondisk &header, vector<bool>& map)
+{
+  bufferlist bl;
+  map.clear();
+  int r = io_ctx.read(get_map_oid(header), bl, 0, 0);
+  if (r == -ENOENT)
+    return 0;
+  if (r < 0)
+    return r;
+
+  const char *p = bl.c_str();
+  map.resize((uint64_t)bl.length() << 3);
+  for (uint64_t i = 0; i < map.size(); i++)
+    map[i] = p[i >> 3] & (1 << (i & 7));
+  return 0;
+}
+
+// set or clear the bits for objects [start, end), under the write snap context
+int update_object_map(IoCtx& io_ctx, const string& map_oid,
+		      uint64_t start, uint64_t end, bool exists)
+{
+  bufferlist bl;
+  __u8 val = exists;
+  ::encode(start, bl);
+  ::encode(end, bl);
+  ::encode(val, bl);
+  librados::ObjectOperation op;
+  op.exec("rbd", "map_update", bl);
+  return io_ctx.operate(map_oid, &op, NULL);
+}
+
+int refresh_object_map(ImageCtx *ictx)
+{
+  assert(ictx->lock.is_locked());
+  ictx->object_map.clear();
+  if (!(ictx->header.options.features & RBD_FEATURE_OBJECT_MAP))
+    return 0;
+
+  int r = read_object_map(ictx->data_ctx, ictx->header, ictx->object_map);
+  if (r < 0)
+    lderr(ictx->cct) << "error reading object map: " << cpp_strerror(-r) << dendl;
+  return r;
+}
+
+/*
+ * Tell other openers about the object map bits set since the last
+ * batch went out.  Runs in map_notifier, so a slow or failed notify
+ * only delays whoever waits for it with flush_map_notifies().
+ */
+struct C_NotifyMapAdds : public Context {
+  ImageCtx *ictx;
+  C_NotifyMapAdds(ImageCtx *i) : ictx(i) {}
+  void finish(int r) {
+    vector<uint64_t> nums;
+    ictx->lock.Lock();
+    nums.swap(ictx->map_notify_pending);
+    ictx->map_notify_queued = false;
+    string md_oid = ictx->md_oid();
+    ictx->lock.Unlock();
+
+    bufferlist bl;
+    ::encode(nums, bl);
+    r = ictx->md_ctx.notify(md_oid, 0, bl);
+    if (r < 0)
+      lderr(ictx->cct) << "error notifying other openers of " << nums.size()
+		       << " new objects: " << cpp_strerror(-r) << dendl;
+  }
+};
+
+/*
+ * Mark a block object as existing before it is first written, so the
+ * map never misses an object.  Only the first write to each object pays
+ * for the extra round trip.  Other openers are told asynchronously;
+ * callers that set a bit (return value 1) should flush_map_notifies()
+ * before reporting the write done, so that none of them reads the
+ * object as a hole afterwards.
+ */
+int object_map_add(ImageCtx *ictx, uint64_t num)
+{
+  ictx->lock.Lock();
+  if (ictx->object_may_exist(num)) {
+    ictx->lock.Unlock();
+    return 0;
+  }
+  string map_oid = get_map_oid(ictx->header);
+  ictx->lock.Unlock();
+
+  ldout(ictx->cct, 20) << "object_map_add " << map_oid << " " << num << dendl;
+  int r = update_object_map(ictx->data_ctx, map_oid, num, num + 1, true);
+  if (r < 0) {
+    lderr(ictx->cct) << "error updating object map: " << cpp_strerror(-r) << dendl;
+    return r;
+  }
+
+  Mutex::Locker l(ictx->lock);
+  if (ictx->object_map.size() <= num)
+    ictx->object_map.resize(num + 1);
+  ictx->object_map[num] = true;
+  ictx->map_notify_pending.push_back(num);
+  if (!ictx->map_notify_queued) {
+    if (!ictx->map_notifier_started) {
+      ictx->map_notifier.start();
+      ictx->map_notifier_started = true;
+    }
+    ictx->map_notifier.queue(new C_NotifyMapAdds(ictx));
+    ictx->map_notify_queued = true;
+  }
+  return 1;
+}
+
+/*
+ * Complete onfinish once every object_map_add() so far has been sent
+ * to the other openers.
+ */
+void flush_map_notifies(ImageCtx *ictx, Context *onfinish)
+{
+  Mutex::Locker l(ictx->lock);
+  if (!ictx->map_notifier_started) {
+    ictx->map_notifier.start();
+    ictx->map_notifier_started = true;
+  }
+  ictx->map_notifier.queue(onfinish);
+}
+
+void wait_for_map_notifies(ImageCtx *ictx)
+{
+  Mutex mylock("librbd::wait_for_map_notifies");
+  Cond cond;
+  bool done;
+  flush_map_notifies(ictx, new C_SafeCond(&mylock, &cond, &done));
+  mylock.Lock();
+  while (!done)
+    cond.Wait(mylock);
+  mylock.Unlock();
+}
+
+/*
+ * Remove the block objects past newsize.  With an object map only the
+ * objects it has are removed, and their bits are cleared afterwards.
+ */
+int trim_image(IoCtx& io_ctx, const rbd_obj_header_ondisk &header,
+	       const vector<bool> *object_map, uint64_t newsize)
 {
   CephContext *cct = io_ctx.cct();
   uint64_t numseg = get_max_block(header);
   uint64_t start = get_block_num(header, newsize);
   ldout(cct, 2) << "trimming image data from " << numseg << " to " << start << " objects..." << dendl;
   for (uint64_t i=start; i<numseg; i++) {
+    if (object_map && (i >= object_map->size() || !(*object_map)[i]))
+      continue;
     string oid = get_block_oid(header, i);
     io_ctx.remove(oid);
     if ((i & 127) == 0) {
       ldout(cct, 2) << "\t" << i << "/" << numseg << dendl;
     }
   }
+
+  if (object_map && start < numseg) {
+    int r = update_object_map(io_ctx, get_map_oid(header), start, numseg, false);
+    if (r < 0) {
+      lderr(cct) << "error updating object map: " << cpp_strerror(-r) << dendl;
+      return r;
+    }
+  }
+  return 0;
+}
+
+int open_parent(ImageCtx *ictx)
+{
+  CephContext *cct = ictx->cct;
+  ictx->lock.Lock();
+  bool layered = ictx->header.options.features & RBD_FEATURE_LAYERING;
+  ParentSpec spec = ictx->parent_spec;
+  ictx->lock.Unlock();
+  if (!layered)
+    return 0;
+
+  IoCtx p_ioctx;
+  int r = ictx->md_ctx.ioctx_create(spec.pool_id, p_ioctx);
+  if (r < 0) {
+    lderr(cct) << "error opening parent pool " << spec.pool_id << ": " << cpp_strerror(-r) << dendl;
+    return r;
+  }
+  ImageCtx *parent = new ImageCtx(spec.image_name, p_ioctx);
+  r = open_image(p_ioctx, parent, spec.image_name.c_str(), spec.snap_name.c_str());
+  if (r < 0) {
+    lderr(cct) << "error opening parent image " << spec.image_name << "@" << spec.snap_name
+	       << ": " << cpp_strerror(-r) << dendl;
+    close_image(parent);
+    return r;
+  }
+  if (parent->snapid != spec.snap_id) {
+    lderr(cct) << "parent snapshot " << spec.image_name << "@" << spec.snap_name
+	       << " was replaced" << dendl;
+    close_image(parent);
+    return -ENOENT;
+  }
+
+  Mutex::Locker l(ictx->lock);
+  ictx->parent = parent;
+  return 0;
+}
+
+// how much of image extent off~len is read from the parent
+uint64_t parent_overlap(ImageCtx *ictx, uint64_t off, uint64_t len)
+{
+  Mutex::Locker l(ictx->lock);
+  if (!ictx->parent || off >= ictx->parent_spec.overlap)
+    return 0;
+  return MIN(len, ictx->parent_spec.overlap - off);
+}
+
+/*
+ * Whether the clone has block object num itself (at the snapshot being
+ * read).  A yes is remembered.  Another opener may copy the object up at
+ * any time, so a no is only remembered when the object map is there to
+ * tell us (through map_adds) when that happens.
+ */
+int child_has_object(ImageCtx *ictx, uint64_t num, bool *exists)
+{
+  ictx->lock.Lock();
+  if (!ictx->object_may_exist(num)) {
+    ictx->lock.Unlock();
+    *exists = false;
+    return 0;
+  }
+  std::map<uint64_t, bool>::iterator p = ictx->child_objects.find(num);
+  if (p != ictx->child_objects.end()) {
+    *exists = p->second;
+    ictx->lock.Unlock();
+    return 0;
+  }
+  string oid = get_block_oid(ictx->header, num);
+  bool has_map = ictx->header.options.features & RBD_FEATURE_OBJECT_MAP;
+  uint64_t seen = ictx->map_adds_seen;
+  ictx->lock.Unlock();
+
+  int r = ictx->data_ctx.stat(oid, NULL, NULL);
+  if (r < 0 && r != -ENOENT)
+    return r;
+  *exists = (r == 0);
+
+  Mutex::Locker l(ictx->lock);
+  if (*exists || ictx->snapid != CEPH_NOSNAP ||
+      (has_map && ictx->map_adds_seen == seen))
+    ictx->child_objects[num] = *exists;
+  return 0;
+}
+
+// read image extent off~len of the clone from its parent; past the overlap is zeros
+int read_from_parent(ImageCtx *ictx, uint64_t off, size_t len, char *buf)
+{
+  uint64_t plen = parent_overlap(ictx, off, len);
+  if (plen) {
+    ssize_t r = read(ictx->parent, off, plen, buf);
+    if (r < 0)
+      return r;
+  }
+  memset(buf + plen, 0, len - plen);
+  return len;
+}
+
+/*
+ * Before the first write to a block object of a clone, give it the
+ * parent's data for that block.  The object is created exclusively, so
+ * if someone beat us to it their copy (and anything since) stands.
+ * Returns 1 if it set the block's object map bit (see object_map_add()).
+ */
+int copy_up(ImageCtx *ictx, uint64_t num)
+{
+  CephContext *cct = ictx->cct;
+  ictx->lock.Lock();
+  uint64_t block_size = get_block_size(ictx->header);
+  string oid = get_block_oid(ictx->header, num);
+  ictx->lock.Unlock();
+
+  uint64_t off = num * block_size;
+  uint64_t len = parent_overlap(ictx, off, block_size);
+  if (!len)
+    return 0;
+
+  bool exists;
+  int r = child_has_object(ictx, num, &exists);
+  if (r < 0)
+    return r;
+  if (exists)
+    return 0;
+
+  ldout(cct, 20) << "copy_up " << oid << " from parent " << off << "~" << len << dendl;
+  bufferptr bp(len);
+  r = read_from_parent(ictx, off, len, bp.c_str());
+  if (r < 0) {
+    lderr(cct) << "error reading parent data for " << oid << ": " << cpp_strerror(-r) << dendl;
+    return r;
+  }
+
+  int added = object_map_add(ictx, num);
+  if (added < 0)
+    return added;
+
+  // leave zeroed runs as holes
+  bufferlist data;
+  data.push_back(bp);
+  librados::ObjectOperation op;
+  op.create(true);
+  map<uint64_t, uint64_t> runs;
+  get_data_runs(bp.c_str(), len, ZERO_RUN_GRANULARITY, &runs);
+  for (map<uint64_t, uint64_t>::iterator p = runs.begin(); p != runs.end(); ++p) {
+    bufferlist bl;
+    bl.substr_of(data, p->first, p->second);
+    op.write(p->first, bl);
+  }
+  r = ictx->data_ctx.operate(oid, &op, NULL);
+  if (r < 0 && r != -EEXIST) {
+    lderr(cct) << "error copying up " << oid << ": " << cpp_strerror(-r) << dendl;
+    return r;
+  }
+
+  Mutex::Locker l(ictx->lock);
+  ictx->child_objects[num] = true;
+  return added;
+}
+
+int read_parent_spec(IoCtx& io_ctx, const string& md_oid, ParentSpec *spec)
+{
+  bufferlist bl;
+  int r = io_ctx.getxattr(md_oid, RBD_PARENT_ATTR, bl);
+  if (r < 0)
+    return r;
+  try {
+    bufferlist::iterator p = bl.begin();
+    ::decode(*spec, p);
+  } catch (const buffer::error &err) {
+    return -EIO;
+  }
+  return 0;
+}
+
+int write_parent_spec(IoCtx& io_ctx, const string& md_oid, const ParentSpec& spec)
+{
+  bufferlist bl;
+  ::encode(spec, bl);
+  return io_ctx.setxattr(md_oid, RBD_PARENT_ATTR, bl);
+}
+
+/*
+ * Clones are registered in the parent's pool under
+ * <parent>@<snapid>/<child pool>/<child>, so a prefix finds the
+ * children of an image or of one of its snapshots.
+ */
+string get_children_prefix(const string& parent_name, snap_t snap_id)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "@%" PRIu64 "/", (uint64_t)snap_id);
+  return parent_name + buf;
+}
+
+string get_child_key(const string& parent_name, snap_t snap_id,
+		     int64_t child_pool, const string& child_name)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%" PRId64 "/", child_pool);
+  return get_children_prefix(parent_name, snap_id) + buf + child_name;
+}
+
+static int tmap_update_child(IoCtx& p_ioctx, __u8 c, const string& key)
+{
+  bufferlist cmdbl, emptybl;
+  ::encode(c, cmdbl);
+  ::encode(key, cmdbl);
+  if (c == CEPH_OSD_TMAP_SET)
+    ::encode(emptybl, cmdbl);
+  return p_ioctx.tmap_update(RBD_CHILDREN, cmdbl);
+}
+
+/*
+ * The parent's header is updated first, by the rbd class, which fails
+ * if the snapshot is already gone; snap_remove checks it in the same
+ * op that removes the snapshot.
+ */
+int add_child(IoCtx& p_ioctx, const string& parent_name, snap_t snap_id,
+	      const string& key)
+{
+  bufferlist inbl, outbl;
+  ::encode((uint64_t)snap_id, inbl);
+  ::encode(key, inbl);
+  int r = p_ioctx.exec(parent_name + RBD_SUFFIX, "rbd", "add_child", inbl, outbl);
+  if (r < 0)
+    return r;
+  r = tmap_update_child(p_ioctx, CEPH_OSD_TMAP_SET, key);
+  if (r < 0) {
+    outbl.clear();
+    p_ioctx.exec(parent_name + RBD_SUFFIX, "rbd", "remove_child", inbl, outbl);
+  }
+  return r;
+}
+
+int remove_child(IoCtx& p_ioctx, const string& parent_name, snap_t snap_id,
+		 const string& key)
+{
+  int r = tmap_update_child(p_ioctx, CEPH_OSD_TMAP_RM, key);
+  if (r < 0)
+    return r;
+  bufferlist inbl, outbl;
+  ::encode((uint64_t)snap_id, inbl);
+  ::encode(key, inbl);
+  return p_ioctx.exec(parent_name + RBD_SUFFIX, "rbd", "remove_child", inbl, outbl);
+}
+
+int has_children(IoCtx& p_ioctx, const string& prefix, bool *found)
+{
+  *found = false;
+  bufferlist bl;
+  int r = p_ioctx.read(RBD_CHILDREN, bl, 0, 0);
+  if (r == -ENOENT || (r >= 0 && bl.length() == 0))
+    return 0;
+  if (r < 0)
+    return r;
+
+  bufferlist header;
+  map<string,bufferlist> m;
+  try {
+    bufferlist::iterator p = bl.begin();
+    ::decode(header, p);
+    ::decode(m, p);
+  } catch (const buffer::error &err) {
+    return -EIO;
+  }
+  map<string,bufferlist>::iterator q = m.lower_bound(prefix);
+  *found = (q != m.end() && q->first.compare(0, prefix.length(), prefix) == 0);
+  return 0;
 }
 
 int read_rbd_info(IoCtx& io_ctx, const string& info_oid, struct rbd_info *info)
@@ -510,7 +1233,34 @@ int read_header(IoCtx& io_ctx, const string& md_oid, struct rbd_obj_header_ondis
     return -EIO;
   memcpy(header, header_bl.c_str(), sizeof(*header));
 
-  return 0;
+  return check_header(io_ctx.cct(), md_oid, *header);
+}
+
+/*
+ * Only images with features use the v2 header text, and we must know
+ * all of their features.
+ */
+int check_header(CephContext *cct, const string& md_oid,
+		 const rbd_obj_header_ondisk& header)
+{
+  if (memcmp(header.text, RBD_HEADER_TEXT, sizeof(RBD_HEADER_TEXT)) == 0) {
+    if (header.options.features) {
+      lderr(cct) << md_oid << " has features " << (int)header.options.features
+		 << " but an old header" << dendl;
+      return -EIO;
+    }
+    return 0;
+  }
+  if (memcmp(header.text, RBD_HEADER_FEATURES_TEXT, sizeof(RBD_HEADER_FEATURES_TEXT)) == 0) {
+    if (header.options.features & ~RBD_FEATURES_ALL) {
+      lderr(cct) << md_oid << " has unsupported features "
+		 << (int)(header.options.features & ~RBD_FEATURES_ALL) << dendl;
+      return -ENXIO;
+    }
+    return 0;
+  }
+  lderr(cct) << md_oid << " is not an rbd header" << dendl;
+  return -ENXIO;
 }
 
 int write_header(IoCtx& io_ctx, const string& md_oid, bufferlist& header)
@@ -546,15 +1296,57 @@ int rollback_image(ImageCtx *ictx, uint64_t snapid)
 {
   assert(ictx->lock.is_locked());
   uint64_t numseg = get_max_block(ictx->header);
+  bool has_map = ictx->header.options.features & RBD_FEATURE_OBJECT_MAP;
+  string map_oid = get_map_oid(ictx->header);
+
+  if (has_map) {
+    // until the map itself is rolled back, it has to cover the objects
+    // of both the head and the snapshot
+    IoCtx snap_ctx;
+    snap_ctx.dup(ictx->data_ctx);
+    snap_ctx.snap_set_read(snapid);
+    vector<bool> snap_map;
+    int r = read_object_map(snap_ctx, ictx->header, snap_map);
+    if (r < 0) {
+      lderr(ictx->cct) << "error reading snapshot object map: " << cpp_strerror(-r) << dendl;
+      return r;
+    }
+    uint64_t i = 0;
+    while (i < snap_map.size() && i < numseg) {
+      if (!snap_map[i]) {
+	i++;
+	continue;
+      }
+      uint64_t end = i + 1;
+      while (end < snap_map.size() && end < numseg && snap_map[end])
+	end++;
+      r = update_object_map(ictx->data_ctx, map_oid, i, end, true);
+      if (r < 0)
+	return r;
+      if (ictx->object_map.size() < end)
+	ictx->object_map.resize(end);
+      for (; i < end; i++)
+	ictx->object_map[i] = true;
+    }
+  }
 
   for (uint64_t i = 0; i < numseg; i++) {
     int r;
+    if (!ictx->object_may_exist(i))
+      continue;
     string oid = get_block_oid(ictx->header, i);
     r = ictx->data_ctx.selfmanaged_snap_rollback(oid, snapid);
     ldout(ictx->cct, 10) << "selfmanaged_snap_rollback on " << oid << " to " << snapid << " returned " << r << dendl;
     if (r < 0 && r != -ENOENT)
       return r;
   }
+
+  if (has_map) {
+    int r = ictx->data_ctx.selfmanaged_snap_rollback(map_oid, snapid);
+    if (r < 0 && r != -ENOENT)
+      return r;
+    return refresh_object_map(ictx);
+  }
   return 0;
 }
 
@@ -586,6 +1378,11 @@ int snap_create(ImageCtx *ictx, const char *snap_name)
   if (r < 0)
     return r;
 
+  // anything still in the cache was written before the snapshot
+  r = flush_cache(ictx);
+  if (r < 0)
+    return r;
+
   Mutex::Locker l(ictx->lock);
   r = add_snap(ictx, snap_name);
 
@@ -610,6 +1407,7 @@ int snap_remove(ImageCtx *ictx, const char *snap_name)
   if (snapid == CEPH_NOSNAP)
     return -ENOENT;
 
+  // the rbd class refuses (EBUSY) if the snapshot has clones
   r = rm_snap(ictx, snap_name);
   if (r < 0)
     return r;
@@ -625,9 +1423,33 @@ int snap_remove(ImageCtx *ictx, const char *snap_name)
 }
 
 int create(IoCtx& io_ctx, const char *imgname, uint64_t size, int *order)
+{
+  return create(io_ctx, imgname, size, 0, order);
+}
+
+int create(IoCtx& io_ctx, const char *imgname, uint64_t size, uint64_t features,
+	   int *order)
+{
+  CephContext *cct = io_ctx.cct();
+  if (features & RBD_FEATURE_LAYERING) {
+    lderr(cct) << "only clones can be layered" << dendl;
+    return -EINVAL;
+  }
+  return create_image(io_ctx, imgname, size, features, order, NULL);
+}
+
+// parent is set for clones only
+int create_image(IoCtx& io_ctx, const char *imgname, uint64_t size, uint64_t features,
+		 int *order, const ParentSpec *parent)
 {
   CephContext *cct = io_ctx.cct();
-  ldout(cct, 20) << "create " << &io_ctx << " name = " << imgname << " size = " << size << dendl;
+  ldout(cct, 20) << "create " << &io_ctx << " name = " << imgname << " size = " << size
+		 << " features = " << features << dendl;
+
+  if (features & ~RBD_FEATURES_ALL) {
+    lderr(cct) << "unsupported features " << (features & ~RBD_FEATURES_ALL) << dendl;
+    return -ENOSYS;
+  }
 
   string md_oid = imgname;
   md_oid += RBD_SUFFIX;
@@ -648,7 +1470,7 @@ int create(IoCtx& io_ctx, const char *imgname, uint64_t size, int *order)
   }
 
   struct rbd_obj_header_ondisk header;
-  init_rbd_header(header, size, order, bid);
+  init_rbd_header(header, size, features, order, bid);
 
   bufferlist bl;
   bl.append((const char *)&header, sizeof(header));
@@ -666,7 +1488,17 @@ int create(IoCtx& io_ctx, const char *imgname, uint64_t size, int *order)
   }
 
   ldout(cct, 2) << "creating rbd image..." << dendl;
-  r = io_ctx.write(md_oid, bl, bl.length(), 0);
+  if (parent) {
+    // a clone's header never exists without its parent
+    bufferlist parentbl;
+    ::encode(*parent, parentbl);
+    librados::ObjectOperation op;
+    op.write_full(bl);
+    op.setxattr(RBD_PARENT_ATTR, parentbl);
+    r = io_ctx.operate(md_oid, &op, NULL);
+  } else {
+    r = io_ctx.write(md_oid, bl, bl.length(), 0);
+  }
   if (r < 0) {
     lderr(cct) << "error writing header: " << strerror(-r) << dendl;
     return r;
@@ -676,6 +1508,60 @@ int create(IoCtx& io_ctx, const char *imgname, uint64_t size, int *order)
   return 0;
 }
 
+/*
+ * Create c_name as a clone of p_name@p_snap_name.  No data is copied:
+ * the clone reads through to the parent snapshot until it writes.
+ */
+int clone(IoCtx& p_ioctx, const char *p_name, const char *p_snap_name,
+	  IoCtx& c_ioctx, const char *c_name, uint64_t features, int *c_order)
+{
+  CephContext *cct = p_ioctx.cct();
+  ldout(cct, 20) << "clone " << &p_ioctx << " parent = " << p_name << "@"
+		 << (p_snap_name ? p_snap_name : "NULL") << " child = " << c_name
+		 << " features = " << features << dendl;
+
+  if (!p_snap_name) {
+    lderr(cct) << "a clone's parent must be a snapshot" << dendl;
+    return -EINVAL;
+  }
+
+  ImageCtx *p_imctx = new ImageCtx(p_name, p_ioctx);
+  int r = open_image(p_ioctx, p_imctx, p_name, p_snap_name);
+  if (r < 0) {
+    lderr(cct) << "error opening parent image: " << cpp_strerror(-r) << dendl;
+    close_image(p_imctx);
+    return r;
+  }
+  ParentSpec spec;
+  spec.pool_id = p_ioctx.get_id();
+  spec.image_name = p_name;
+  spec.snap_name = p_snap_name;
+  p_imctx->lock.Lock();
+  spec.snap_id = p_imctx->snapid;
+  spec.overlap = p_imctx->snaps_by_name.find(p_snap_name)->second.size;
+  int order = p_imctx->header.options.order;
+  p_imctx->lock.Unlock();
+  close_image(p_imctx);
+
+  if (!*c_order)
+    *c_order = order;
+
+  // register first, so the snapshot can't be removed out from under the clone
+  string key = get_child_key(p_name, spec.snap_id, c_ioctx.get_id(), c_name);
+  r = add_child(p_ioctx, p_name, spec.snap_id, key);
+  if (r < 0) {
+    lderr(cct) << "error registering clone with parent: " << cpp_strerror(-r) << dendl;
+    return r;
+  }
+  r = create_image(c_ioctx, c_name, spec.overlap, features | RBD_FEATURE_LAYERING,
+		   c_order, &spec);
+  if (r < 0) {
+    remove_child(p_ioctx, p_name, spec.snap_id, key);
+    return r;
+  }
+  return 0;
+}
+
 int rename(IoCtx& io_ctx, const char *srcname, const char *dstname)
 {
   CephContext *cct = io_ctx.cct();
@@ -694,16 +1580,59 @@ int rename(IoCtx& io_ctx, const char *srcname, const char *dstname)
     lderr(cct) << "error reading header: " << md_oid << ": " << strerror(-r) << dendl;
     return r;
   }
+  if (header.length() < sizeof(rbd_obj_header_ondisk))
+    return -EIO;
+  r = check_header(cct, md_oid, *(const rbd_obj_header_ondisk *)header.c_str());
+  if (r < 0)
+    return r;
   r = io_ctx.stat(dst_md_oid, NULL, NULL);
   if (r == 0) {
     lderr(cct) << "rbd image header " << dst_md_oid << " already exists" << dendl;
     return -EEXIST;
   }
+  // clones find their parent by name
+  bool has_clones;
+  r = has_children(io_ctx, imgname_str + "@", &has_clones);
+  if (r < 0)
+    return r;
+  if (has_clones) {
+    lderr(cct) << "image has clones; can't rename it" << dendl;
+    return -EBUSY;
+  }
+  const rbd_obj_header_ondisk *ondisk = (const rbd_obj_header_ondisk *)header.c_str();
+  bool layered = ondisk->options.features & RBD_FEATURE_LAYERING;
+  ParentSpec spec;
+  if (layered) {
+    r = read_parent_spec(io_ctx, md_oid, &spec);
+    if (r < 0)
+      return r;
+  }
   r = write_header(io_ctx, dst_md_oid, header);
+  if (r >= 0 && layered)
+    r = write_parent_spec(io_ctx, dst_md_oid, spec);
   if (r < 0) {
+    io_ctx.remove(dst_md_oid);
     lderr(cct) << "error writing header: " << dst_md_oid << ": " << strerror(-r) << dendl;
     return r;
   }
+  if (layered) {
+    IoCtx p_ioctx;
+    r = io_ctx.ioctx_create(spec.pool_id, p_ioctx);
+    if (r >= 0)
+      r = add_child(p_ioctx, spec.image_name, spec.snap_id,
+		    get_child_key(spec.image_name, spec.snap_id,
+				  io_ctx.get_id(), dstname_str));
+    if (r < 0) {
+      io_ctx.remove(dst_md_oid);
+      lderr(cct) << "can't register " << dstname_str << " with its parent" << dendl;
+      return r;
+    }
+    r = remove_child(p_ioctx, spec.image_name, spec.snap_id,
+		     get_child_key(spec.image_name, spec.snap_id,
+				   io_ctx.get_id(), imgname_str));
+    if (r < 0)
+      lderr(cct) << "warning: couldn't remove old entry from parent's children" << dendl;
+  }
   r = tmap_set(io_ctx, dstname_str);
   if (r < 0) {
     io_ctx.remove(dst_md_oid);
@@ -733,6 +1662,54 @@ int info(ImageCtx *ictx, image_info_t& info, size_t infosize)
 
   Mutex::Locker l(ictx->lock);
   image_info(ictx->header, info, infosize);
+  if (ictx->parent) {
+    info.parent_pool = ictx->parent_spec.pool_id;
+    snprintf(info.parent_name, RBD_MAX_IMAGE_NAME_SIZE, "%s@%s",
+	     ictx->parent_spec.image_name.c_str(), ictx->parent_spec.snap_name.c_str());
+  }
+  return 0;
+}
+
+int get_features(ImageCtx *ictx, uint64_t *features)
+{
+  int r = ictx_check(ictx);
+  if (r < 0)
+    return r;
+
+  Mutex::Locker l(ictx->lock);
+  *features = ictx->header.options.features;
+  return 0;
+}
+
+/*
+ * Space allocated to the image (or the snapshot being read), counting
+ * every block object the object map has in full.  This is what a
+ * scan of the pool would find, short of holes within objects.
+ */
+int get_used_size(ImageCtx *ictx, uint64_t *used)
+{
+  ldout(ictx->cct, 20) << "get_used_size " << ictx << dendl;
+
+  int r = ictx_check(ictx);
+  if (r < 0)
+    return r;
+
+  Mutex::Locker l(ictx->lock);
+  if (!(ictx->header.options.features & RBD_FEATURE_OBJECT_MAP))
+    return -EOPNOTSUPP;
+
+  uint64_t size = ictx->header.image_size;
+  if (ictx->snapid != CEPH_NOSNAP) {
+    std::map<std::string, struct SnapInfo>::iterator p = ictx->snaps_by_name.find(ictx->snapname);
+    if (p != ictx->snaps_by_name.end())
+      size = p->second.size;
+  }
+  uint64_t block_size = get_block_size(ictx->header);
+  *used = 0;
+  for (uint64_t i = 0; i < ictx->object_map.size() && i * block_size < size; i++) {
+    if (ictx->object_map[i])
+      *used += MIN(block_size, size - i * block_size);
+  }
   return 0;
 }
 
@@ -747,7 +1724,42 @@ int remove(IoCtx& io_ctx, const char *imgname)
   struct rbd_obj_header_ondisk header;
   int r = read_header(io_ctx, md_oid, &header, NULL);
   if (r >= 0) {
-    trim_image(io_ctx, header, 0);
+    bool has_clones;
+    r = has_children(io_ctx, string(imgname) + "@", &has_clones);
+    if (r < 0)
+      return r;
+    if (has_clones) {
+      lderr(cct) << "image has clones; remove them first" << dendl;
+      return -EBUSY;
+    }
+    if (header.options.features & RBD_FEATURE_OBJECT_MAP) {
+      vector<bool> object_map;
+      r = read_object_map(io_ctx, header, object_map);
+      if (r < 0) {
+	lderr(cct) << "error reading object map, removing all objects: "
+		   << cpp_strerror(-r) << dendl;
+	trim_image(io_ctx, header, NULL, 0);
+      } else {
+	trim_image(io_ctx, header, &object_map, 0);
+      }
+      io_ctx.remove(get_map_oid(header));
+    } else {
+      trim_image(io_ctx, header, NULL, 0);
+    }
+    if (header.options.features & RBD_FEATURE_LAYERING) {
+      ParentSpec spec;
+      IoCtx p_ioctx;
+      r = read_parent_spec(io_ctx, md_oid, &spec);
+      if (r >= 0)
+	r = io_ctx.ioctx_create(spec.pool_id, p_ioctx);
+      if (r >= 0)
+	r = remove_child(p_ioctx, spec.image_name, spec.snap_id,
+			 get_child_key(spec.image_name, spec.snap_id,
+				       io_ctx.get_id(), imgname));
+      if (r < 0)
+	lderr(cct) << "warning: couldn't unregister clone from its parent: "
+		   << cpp_strerror(-r) << dendl;
+    }
     ldout(cct, 2) << "removing header..." << dendl;
     io_ctx.remove(md_oid);
   }
@@ -788,7 +1800,35 @@ int resize(ImageCtx *ictx, uint64_t size)
     ictx->header.image_size = size;
   } else {
     ldout(cct, 2) << "shrinking image " << size << " -> " << ictx->header.image_size << " objects" << dendl;
-    trim_image(ictx->data_ctx, ictx->header, size);
+    // the overlap is kept at the head only, and the snapshots still
+    // read through the part we would cut off
+    if (ictx->parent && ictx->parent_spec.overlap > size && !ictx->snaps.empty()) {
+      lderr(cct) << "can't shrink a clone below its parent overlap while it has snapshots"
+		 << dendl;
+      return -EBUSY;
+    }
+    // don't let cached writes recreate the objects we remove
+    r = invalidate_cache(ictx);
+    if (r < 0)
+      return r;
+    // nothing past the new end may show through from the parent again
+    if (ictx->parent && ictx->parent_spec.overlap > size) {
+      ParentSpec spec = ictx->parent_spec;
+      spec.overlap = size;
+      r = write_parent_spec(ictx->md_ctx, ictx->md_oid(), spec);
+      if (r < 0)
+	return r;
+      ictx->parent_spec.overlap = size;
+    }
+    bool has_map = ictx->header.options.features & RBD_FEATURE_OBJECT_MAP;
+    r = trim_image(ictx->data_ctx, ictx->header, has_map ? &ictx->object_map : NULL, size);
+    if (r < 0)
+      return r;
+    uint64_t start = get_block_num(ictx->header, size);
+    for (uint64_t i = start; i < ictx->object_map.size(); i++)
+      ictx->object_map[i] = false;
+    ictx->child_objects.erase(ictx->child_objects.lower_bound(start),
+			      ictx->child_objects.end());
     ictx->header.image_size = size;
   }
 
@@ -901,6 +1941,24 @@ int ictx_check(ImageCtx *ictx)
       return -ENOENT;
     }
   }
+
+  vector<uint64_t> map_adds;
+  ictx->refresh_lock.Lock();
+  map_adds.swap(ictx->map_adds);
+  ictx->refresh_lock.Unlock();
+  if (!map_adds.empty()) {
+    Mutex::Locker l(ictx->lock);
+    if (ictx->snapid == CEPH_NOSNAP) {  // snapshots' maps don't change
+      for (vector<uint64_t>::iterator p = map_adds.begin(); p != map_adds.end(); ++p) {
+	ldout(cct, 20) << "ictx_check " << ictx << " object " << *p << " was added" << dendl;
+	if (ictx->object_map.size() <= *p)
+	  ictx->object_map.resize(*p + 1);
+	ictx->object_map[*p] = true;
+	ictx->child_objects.erase(*p);  // maybe copied up by its opener
+      }
+      ictx->map_adds_seen++;
+    }
+  }
   return 0;
 }
 
@@ -960,8 +2018,22 @@ int ictx_refresh(ImageCtx *ictx, const char *snap_name)
 
   ictx->data_ctx.selfmanaged_snap_set_write_ctx(ictx->snapc.seq, ictx->snaps);
 
+  r = refresh_object_map(ictx);
+  if (r < 0)
+    return r;
+
+  ictx->child_objects.clear();
+  if (ictx->header.options.features & RBD_FEATURE_LAYERING) {
+    r = read_parent_spec(ictx->md_ctx, ictx->md_oid(), &ictx->parent_spec);
+    if (r < 0) {
+      lderr(cct) << "Error reading parent: " << cpp_strerror(-r) << dendl;
+      return r;
+    }
+  }
+
   ictx->refresh_lock.Lock();
   ictx->needs_refresh = false;
+  ictx->map_adds.clear();
   ictx->refresh_lock.Unlock();
 
   return 0;
@@ -975,31 +2047,169 @@ int snap_rollback(ImageCtx *ictx, const char *snap_name)
   int r = ictx_check(ictx);
   if (r < 0)
     return r;
-
-  Mutex::Locker l(ictx->lock);
-  snap_t snapid = ictx->get_snapid(snap_name);
-  if (snapid == CEPH_NOSNAP) {
-    lderr(cct) << "No such snapshot found." << dendl;
-    return -ENOENT;
+
+  Mutex::Locker l(ictx->lock);
+  snap_t snapid = ictx->get_snapid(snap_name);
+  if (snapid == CEPH_NOSNAP) {
+    lderr(cct) << "No such snapshot found." << dendl;
+    return -ENOENT;
+  }
+
+  r = invalidate_cache(ictx);
+  if (r < 0)
+    return r;
+
+  r = rollback_image(ictx, snapid);
+  if (r < 0) {
+    lderr(cct) << "Error rolling back image: " << cpp_strerror(-r) << dendl;
+    return r;
+  }
+
+  // refresh without setting the snapid we read from
+  ictx_refresh(ictx, NULL);
+  snap_t new_snapid = ictx->get_snapid(snap_name);
+  ldout(ictx->cct, 20) << "snapid is " << ictx->snapid << " new snapid is " << new_snapid << dendl;
+
+  notify_change(ictx->md_ctx, ictx->md_oid(), NULL, ictx);
+
+  return 0;
+}
+
+class NoOpProgressContext : public librbd::ProgressContext
+{
+public:
+  NoOpProgressContext() {}
+  int update_progress(uint64_t offset, uint64_t src_size) {
+    return 0;
+  }
+};
+
+class CProgressContext : public librbd::ProgressContext
+{
+public:
+  CProgressContext(librbd_progress_fn_t fn, void *data)
+    : m_fn(fn), m_data(data) {}
+  int update_progress(uint64_t offset, uint64_t src_size) {
+    return m_fn(offset, src_size, m_data);
+  }
+private:
+  librbd_progress_fn_t m_fn;
+  void *m_data;
+};
+
+/*
+ * One block object being copied.  Normally the destination osd copies
+ * it from the source itself; against osds that don't support that we
+ * do a sparse read of the source and then (unless the object doesn't
+ * exist or is all holes) a single compound write of its extents.
+ */
+struct CopyBlock {
+  enum { COPYING, READING, WRITING };
+  uint64_t num;
+  string oid, dest_oid;
+  map<uint64_t, uint64_t> m;
+  bufferlist bl;
+  librados::AioCompletion *c;
+  int state;
+
+  CopyBlock(uint64_t n, const string& o, const string& d)
+    : num(n), oid(o), dest_oid(d), c(NULL), state(COPYING) {}
+};
+
+static int start_copy_block(IoCtx& src_data_ctx, IoCtx& dest_data_ctx,
+			    CopyBlock *b, bool server_copy, uint64_t block_size)
+{
+  b->c = Rados::aio_create_completion();
+  int ret;
+  if (server_copy) {
+    librados::ObjectOperation op;
+    op.copy_from(b->oid, src_data_ctx);
+    b->state = CopyBlock::COPYING;
+    ret = dest_data_ctx.aio_operate(b->dest_oid, b->c, &op, NULL);
+  } else {
+    b->state = CopyBlock::READING;
+    ret = src_data_ctx.aio_sparse_read(b->oid, b->c, &b->m, &b->bl, block_size, 0);
+  }
+  if (ret < 0) {
+    b->c->release();
+    b->c = NULL;
+  }
+  return ret;
+}
+
+/*
+ * Part of a clone's data is its parent's, so a clone is copied through
+ * the image a block at a time.  The copy stands on its own.
+ */
+static int copy_clone(IoCtx& src_md_ctx, const char *srcname, IoCtx& dest_md_ctx,
+		      const char *destname, const rbd_obj_header_ondisk& header,
+		      ProgressContext& prog)
+{
+  CephContext *cct = src_md_ctx.cct();
+  int order = header.options.order;
+  uint64_t features = header.options.features & ~RBD_FEATURE_LAYERING;
+  int r = create(dest_md_ctx, destname, header.image_size, features, &order);
+  if (r < 0) {
+    lderr(cct) << "header creation failed" << dendl;
+    return r;
   }
 
-  r = rollback_image(ictx, snapid);
+  ImageCtx *src = new ImageCtx(srcname, src_md_ctx);
+  r = open_image(src_md_ctx, src, srcname, NULL);
   if (r < 0) {
-    lderr(cct) << "Error rolling back image: " << cpp_strerror(-r) << dendl;
+    close_image(src);
+    return r;
+  }
+  ImageCtx *dest = new ImageCtx(destname, dest_md_ctx);
+  r = open_image(dest_md_ctx, dest, destname, NULL);
+  if (r < 0) {
+    close_image(dest);
+    close_image(src);
     return r;
   }
 
-  // refresh without setting the snapid we read from
-  ictx_refresh(ictx, NULL);
-  snap_t new_snapid = ictx->get_snapid(snap_name);
-  ldout(ictx->cct, 20) << "snapid is " << ictx->snapid << " new snapid is " << new_snapid << dendl;
-
-  notify_change(ictx->md_ctx, ictx->md_oid(), NULL, ictx);
+  uint64_t size = header.image_size;
+  uint64_t block_size = get_block_size(header);
+  bufferptr bp(block_size);
+  for (uint64_t off = 0; off < size; off += block_size) {
+    uint64_t len = MIN(block_size, size - off);
+    ssize_t ret = read(src, off, len, bp.c_str());
+    if (ret < 0) {
+      r = ret;
+      break;
+    }
+    // leave zeroed runs as holes
+    map<uint64_t, uint64_t> runs;
+    get_data_runs(bp.c_str(), len, ZERO_RUN_GRANULARITY, &runs);
+    for (map<uint64_t, uint64_t>::iterator p = runs.begin(); p != runs.end(); ++p) {
+      ret = write(dest, off + p->first, p->second, bp.c_str() + p->first);
+      if (ret < 0) {
+	r = ret;
+	break;
+      }
+    }
+    if (r < 0)
+      break;
+    prog.update_progress(off + len, size);
+  }
+  if (r >= 0)
+    r = flush(dest);
+  if (r < 0)
+    lderr(cct) << "error copying clone: " << cpp_strerror(-r) << dendl;
 
-  return 0;
+  close_image(dest);
+  close_image(src);
+  return r;
 }
 
 int copy(IoCtx& src_md_ctx, const char *srcname, IoCtx& dest_md_ctx, const char *destname)
+{
+  NoOpProgressContext prog;
+  return copy(src_md_ctx, srcname, dest_md_ctx, destname, prog);
+}
+
+int copy(IoCtx& src_md_ctx, const char *srcname, IoCtx& dest_md_ctx, const char *destname,
+	 ProgressContext& prog)
 {
   CephContext *cct = src_md_ctx.cct();
   struct rbd_obj_header_ondisk header, dest_header;
@@ -1018,11 +2228,14 @@ int copy(IoCtx& src_md_ctx, const char *srcname, IoCtx& dest_md_ctx, const char
   if (ret < 0)
     return ret;
 
+  if (header.options.features & RBD_FEATURE_LAYERING)
+    return copy_clone(src_md_ctx, srcname, dest_md_ctx, destname, header, prog);
+
   uint64_t numseg = get_max_block(header);
   uint64_t block_size = get_block_size(header);
   int order = header.options.order;
 
-  r = create(dest_md_ctx, destname, header.image_size, &order);
+  r = create(dest_md_ctx, destname, header.image_size, header.options.features, &order);
   if (r < 0) {
     lderr(cct) << "header creation failed" << dendl;
     return r;
@@ -1034,36 +2247,156 @@ int copy(IoCtx& src_md_ctx, const char *srcname, IoCtx& dest_md_ctx, const char
     return ret;
   }
 
-  for (uint64_t i = 0; i < numseg; i++) {
+  // only objects in the source's map need copying; the destination
+  // starts out with the same map
+  bool has_map = header.options.features & RBD_FEATURE_OBJECT_MAP;
+  vector<bool> object_map;
+  if (has_map) {
+    r = read_object_map(src_data_ctx, header, object_map);
+    if (r < 0) {
+      lderr(cct) << "error reading object map: " << cpp_strerror(-r) << dendl;
+      return r;
+    }
+    bufferptr bp((object_map.size() + 7) >> 3);
+    bp.zero();
+    for (uint64_t i = 0; i < object_map.size(); i++)
+      if (object_map[i])
+	bp.c_str()[i >> 3] |= 1 << (i & 7);
     bufferlist bl;
-    string oid = get_block_oid(header, i);
-    string dest_oid = get_block_oid(dest_header, i);
-    map<uint64_t, uint64_t> m;
-    map<uint64_t, uint64_t>::iterator iter;
-    r = src_data_ctx.sparse_read(oid, m, bl, block_size, 0);
-    if (r < 0 && r == -ENOENT)
-      r = 0;
-    if (r < 0)
+    bl.push_back(bp);
+    r = dest_data_ctx.write_full(get_map_oid(dest_header), bl);
+    if (r < 0) {
+      lderr(cct) << "error writing object map: " << cpp_strerror(-r) << dendl;
       return r;
+    }
+  }
 
+  /*
+   * Keep up to rbd_concurrent_ops blocks in flight.  Blocks are retired
+   * in order: a block whose read finishes goes to the back of the queue
+   * with its write outstanding, so we only ever wait on the oldest op.
+   * The first copy the osds reject as unsupported switches us (and any
+   * copies still in flight) to reading and writing the data ourselves.
+   */
+  unsigned max_ops = MAX(1, cct->_conf->rbd_concurrent_ops);
+  std::list<CopyBlock*> in_flight;
+  uint64_t next = 0, done_blocks = 0, copied = 0;
+  bool server_copy = true;
+  utime_t start = ceph_clock_now(cct);
+  r = 0;
 
-    for (iter = m.begin(); iter != m.end(); ++iter) {
-      uint64_t extent_ofs = iter->first;
-      size_t extent_len = iter->second;
-      bufferlist wrbl;
-      if (extent_ofs + extent_len > bl.length()) {
-	lderr(cct) << "data error!" << dendl;
-	return -EIO;
+  while (!in_flight.empty() || (r == 0 && next < numseg)) {
+    while (r == 0 && next < numseg && in_flight.size() < max_ops) {
+      if (has_map && (next >= object_map.size() || !object_map[next])) {
+	next++;
+	done_blocks++;
+	continue;
       }
-      bl.copy(extent_ofs, extent_len, wrbl);
-      r = dest_data_ctx.write(dest_oid, wrbl, extent_len, extent_ofs);
-      if (r < 0)
-	goto done;
+      CopyBlock *b = new CopyBlock(next, get_block_oid(header, next),
+				   get_block_oid(dest_header, next));
+      ret = start_copy_block(src_data_ctx, dest_data_ctx, b, server_copy, block_size);
+      if (ret < 0) {
+	delete b;
+	r = ret;
+	break;
+      }
+      in_flight.push_back(b);
+      next++;
     }
+    if (in_flight.empty())
+      break;
+
+    CopyBlock *b = in_flight.front();
+    in_flight.pop_front();
+
+    if (b->state == CopyBlock::COPYING) {
+      b->c->wait_for_safe();
+      ret = b->c->get_return_value();
+      b->c->release();
+      b->c = NULL;
+      if (ret == -ENOENT)
+	ret = 0;  // no source object: a hole, and the dest is left alone
+      if (ret == -EOPNOTSUPP && r == 0) {
+	if (server_copy) {
+	  ldout(cct, 1) << "osds can't copy objects, copying through the client" << dendl;
+	  server_copy = false;
+	}
+	ret = start_copy_block(src_data_ctx, dest_data_ctx, b, false, block_size);
+	if (ret == 0) {
+	  in_flight.push_back(b);
+	  continue;
+	}
+      }
+      if (ret < 0 && r == 0) {
+	lderr(cct) << "error copying " << b->oid << ": " << cpp_strerror(ret) << dendl;
+	r = ret;
+      }
+    } else if (b->state == CopyBlock::READING) {
+      b->c->wait_for_complete();
+      ret = b->c->get_return_value();
+      b->c->release();
+      b->c = NULL;
+      if (ret == -ENOENT)
+	ret = 0;
+      if (ret < 0 && r == 0) {
+	lderr(cct) << "error reading " << b->oid << ": " << cpp_strerror(ret) << dendl;
+	r = ret;
+      }
+
+      if (r == 0 && !b->m.empty()) {
+	librados::ObjectOperation op;
+	uint64_t len = 0;
+	for (map<uint64_t, uint64_t>::iterator p = b->m.begin(); p != b->m.end(); ++p) {
+	  if (len + p->second > b->bl.length()) {
+	    lderr(cct) << "data error!" << dendl;
+	    r = -EIO;
+	    break;
+	  }
+	  bufferlist wrbl;
+	  wrbl.substr_of(b->bl, len, p->second);
+	  op.write(p->first, wrbl);
+	  len += p->second;
+	}
+	if (r == 0) {
+	  b->c = Rados::aio_create_completion();
+	  ret = dest_data_ctx.aio_operate(b->dest_oid, b->c, &op, NULL);
+	  if (ret < 0) {
+	    b->c->release();
+	    r = ret;
+	  } else {
+	    b->state = CopyBlock::WRITING;
+	    copied += len;
+	    in_flight.push_back(b);
+	    continue;
+	  }
+	}
+      }
+    } else {
+      b->c->wait_for_safe();
+      ret = b->c->get_return_value();
+      b->c->release();
+      if (ret < 0 && r == 0) {
+	lderr(cct) << "error writing " << b->dest_oid << ": " << cpp_strerror(ret) << dendl;
+	r = ret;
+      }
+    }
+
+    delete b;
+    done_blocks++;
+    if (r == 0)
+      prog.update_progress(done_blocks * block_size, numseg * block_size);
   }
-  r = 0;
 
-done:
+  if (r == 0) {
+    utime_t elapsed = ceph_clock_now(cct) - start;
+    if (server_copy)
+      ldout(cct, 10) << "copied " << srcname << " to " << destname << ": "
+		     << numseg << " objects on the osds, " << elapsed << "s" << dendl;
+    else
+      ldout(cct, 10) << "copied " << srcname << " to " << destname << ": "
+		     << copied << " bytes in " << numseg << " objects, " << elapsed
+		     << "s" << dendl;
+  }
   return r;
 }
 
@@ -1082,8 +2415,9 @@ int snap_set(ImageCtx *ictx, const char *snap_name)
     ictx->snap_unset();
 
   ictx->data_ctx.snap_set_read(ictx->snapid);
+  ictx->child_objects.clear();
 
-  return 0;
+  return refresh_object_map(ictx);
 }
 
 int open_image(IoCtx& io_ctx, ImageCtx *ictx, const char *name, const char *snap_name)
@@ -1099,6 +2433,10 @@ int open_image(IoCtx& io_ctx, ImageCtx *ictx, const char *name, const char *snap
   if (r < 0)
     return r;
 
+  r = open_parent(ictx);
+  if (r < 0)
+    return r;
+
   WatchCtx *wctx = new WatchCtx(ictx);
   if (!wctx)
     return -ENOMEM;
@@ -1111,14 +2449,126 @@ int open_image(IoCtx& io_ctx, ImageCtx *ictx, const char *name, const char *snap
 void close_image(ImageCtx *ictx)
 {
   ldout(ictx->cct, 20) << "close_image " << ictx << dendl;
+  int r = flush_cache(ictx);
+  if (r < 0)
+    lderr(ictx->cct) << "close_image: error flushing cache: "
+		     << cpp_strerror(-r) << dendl;
   ictx->lock.Lock();
-  ictx->wctx->invalidate();
-  ictx->md_ctx.unwatch(ictx->md_oid(), ictx->wctx->cookie);
-  delete ictx->wctx;
+  if (ictx->wctx) {
+    ictx->wctx->invalidate();
+    ictx->md_ctx.unwatch(ictx->md_oid(), ictx->wctx->cookie);
+    delete ictx->wctx;
+  }
   ictx->lock.Unlock();
+  if (ictx->parent)
+    close_image(ictx->parent);
   delete ictx;
 }
 
+/*
+ * Cache access is per block object, like the uncached paths.  onfinish
+ * is never called with the cache lock held, so it may issue more io.
+ */
+void aio_read_from_cache(ImageCtx *ictx, const string& oid, bufferlist *bl,
+			 size_t len, uint64_t off, Context *onfinish)
+{
+  ObjectExtent extent(oid, off, len);
+  extent.oloc = object_locator_t(ictx->data_ctx.get_id());
+  extent.buffer_extents[0] = len;
+
+  Context *c = new C_OnFinisher(onfinish, &ictx->writeback_handler->get_finisher());
+  ictx->cache_lock.Lock();
+  ObjectCacher::OSDRead *rd = ictx->object_cacher->prepare_read(ictx->snapid, bl, 0);
+  rd->extents.push_back(extent);
+  int r = ictx->object_cacher->readx(rd, ictx->object_set, c);
+  ictx->cache_lock.Unlock();
+  if (r > 0) {
+    // all hits
+    delete c;
+    onfinish->complete(r);
+  }
+}
+
+int read_from_cache(ImageCtx *ictx, const string& oid, bufferlist *bl,
+		    size_t len, uint64_t off)
+{
+  Mutex mylock("librbd::read_from_cache");
+  Cond cond;
+  bool done;
+  int r;
+  aio_read_from_cache(ictx, oid, bl, len, off,
+		      new C_SafeCond(&mylock, &cond, &done, &r));
+  mylock.Lock();
+  while (!done)
+    cond.Wait(mylock);
+  mylock.Unlock();
+  return r;
+}
+
+void write_to_cache(ImageCtx *ictx, const string& oid, bufferlist& bl,
+		    size_t len, uint64_t off)
+{
+  ObjectExtent extent(oid, off, len);
+  extent.oloc = object_locator_t(ictx->data_ctx.get_id());
+  extent.buffer_extents[0] = len;
+
+  ictx->lock.Lock();
+  ::SnapContext snapc = ictx->snapc;
+  ictx->lock.Unlock();
+
+  ictx->cache_lock.Lock();
+  ObjectCacher::OSDWrite *wr = ictx->object_cacher->prepare_write(snapc, bl, utime_t(), 0);
+  wr->extents.push_back(extent);
+  ictx->object_cacher->wait_for_write(len, ictx->cache_lock);
+  ictx->object_cacher->writex(wr, ictx->object_set);
+  ictx->cache_lock.Unlock();
+}
+
+// write back everything dirty and wait for it to be safe
+int flush_cache(ImageCtx *ictx)
+{
+  if (!ictx->object_cacher)
+    return 0;
+
+  ldout(ictx->cct, 20) << "flush_cache " << ictx << dendl;
+  Mutex mylock("librbd::flush_cache");
+  Cond cond;
+  bool done;
+  int r = 0;
+  Context *onfinish = new C_SafeCond(&mylock, &cond, &done, &r);
+  ictx->cache_lock.Lock();
+  bool already_flushed = ictx->object_cacher->commit_set(ictx->object_set, onfinish);
+  ictx->cache_lock.Unlock();
+  if (already_flushed) {
+    delete onfinish;
+    return 0;
+  }
+  mylock.Lock();
+  while (!done)
+    cond.Wait(mylock);
+  mylock.Unlock();
+  return r;
+}
+
+// flush, then drop everything cached
+int invalidate_cache(ImageCtx *ictx)
+{
+  if (!ictx->object_cacher)
+    return 0;
+
+  int r = flush_cache(ictx);
+  if (r < 0)
+    return r;
+  ictx->cache_lock.Lock();
+  loff_t unclean = ictx->object_cacher->release_set(ictx->object_set);
+  ictx->cache_lock.Unlock();
+  if (unclean) {
+    lderr(ictx->cct) << "invalidate_cache: " << unclean << " bytes still busy" << dendl;
+    return -EBUSY;
+  }
+  return 0;
+}
+
 int64_t read_iterate(ImageCtx *ictx, uint64_t off, size_t len,
 		     int (*cb)(uint64_t, size_t, const char *, void *),
 		     void *arg)
@@ -1147,20 +2597,56 @@ int64_t read_iterate(ImageCtx *ictx, uint64_t off, size_t len,
     ictx->lock.Lock();
     string oid = get_block_oid(ictx->header, i);
     uint64_t block_ofs = get_block_ofs(ictx->header, off + total_read);
+    bool may_exist = ictx->object_may_exist(i);
     ictx->lock.Unlock();
     uint64_t read_len = min(block_size - block_ofs, left);
 
-    map<uint64_t, uint64_t> m;
-    r = ictx->data_ctx.sparse_read(oid, m, bl, read_len, block_ofs);
-    if (r < 0 && r == -ENOENT)
-      r = 0;
-    if (r < 0) {
-      return r;
+    // a clear map bit just means the clone hasn't got the object yet
+    bool from_parent = false;
+    if (parent_overlap(ictx, off + total_read, read_len)) {
+      bool exists;
+      r = child_has_object(ictx, i, &exists);
+      if (r < 0)
+	return r;
+      from_parent = !exists;
     }
 
-    r = handle_sparse_read(ictx->cct, bl, block_ofs, m, total_read, read_len, cb, arg);
-    if (r < 0) {
-      return r;
+    if (from_parent) {
+      bufferptr bp(read_len);
+      r = read_from_parent(ictx, off + total_read, read_len, bp.c_str());
+      if (r < 0)
+	return r;
+      r = cb(total_read, read_len, bp.c_str(), arg);
+      if (r < 0)
+	return r;
+      r = read_len;
+    } else if (!may_exist) {
+      r = cb(total_read, read_len, NULL, arg);
+      if (r < 0)
+	return r;
+      r = read_len;
+    } else if (ictx->object_cacher) {
+      // the cache zero-fills holes; no sparse map
+      r = read_from_cache(ictx, oid, &bl, read_len, block_ofs);
+      if (r < 0)
+	return r;
+      r = cb(total_read, read_len, bl.c_str(), arg);
+      if (r < 0)
+	return r;
+      r = read_len;
+    } else {
+      map<uint64_t, uint64_t> m;
+      r = ictx->data_ctx.sparse_read(oid, m, bl, read_len, block_ofs);
+      if (r < 0 && r == -ENOENT)
+	r = 0;
+      if (r < 0) {
+	return r;
+      }
+
+      r = handle_sparse_read(ictx->cct, bl, block_ofs, m, total_read, read_len, cb, arg);
+      if (r < 0) {
+	return r;
+      }
     }
 
     total_read += r;
@@ -1210,6 +2696,7 @@ ssize_t write(ImageCtx *ictx, uint64_t off, size_t len, const char *buf)
   uint64_t block_size = get_block_size(ictx->header);
   ictx->lock.Unlock();
   uint64_t left = len;
+  bool map_added = false;
 
   for (uint64_t i = start_block; i <= end_block; i++) {
     bufferlist bl;
@@ -1219,14 +2706,30 @@ ssize_t write(ImageCtx *ictx, uint64_t off, size_t len, const char *buf)
     ictx->lock.Unlock();
     uint64_t write_len = min(block_size - block_ofs, left);
     bl.append(buf + total_write, write_len);
-    r = ictx->data_ctx.write(oid, bl, write_len, block_ofs);
+    r = copy_up(ictx, i);
     if (r < 0)
       return r;
-    if ((uint64_t)r != write_len)
-      return -EIO;
+    if (r > 0)
+      map_added = true;
+    r = object_map_add(ictx, i);
+    if (r < 0)
+      return r;
+    if (r > 0)
+      map_added = true;
+    if (ictx->object_cacher) {
+      write_to_cache(ictx, oid, bl, write_len, block_ofs);
+    } else {
+      r = ictx->data_ctx.write(oid, bl, write_len, block_ofs);
+      if (r < 0)
+	return r;
+      if ((uint64_t)r != write_len)
+	return -EIO;
+    }
     total_write += write_len;
     left -= write_len;
   }
+  if (map_added)
+    wait_for_map_notifies(ictx);
   return total_write;
 }
 
@@ -1339,6 +2842,15 @@ int check_io(ImageCtx *ictx, uint64_t off, uint64_t len)
   return 0;
 }
 
+struct C_AioBlockCompletion : public Context {
+  AioBlockCompletion *block_completion;
+  C_AioBlockCompletion(AioBlockCompletion *c) : block_completion(c) {}
+  void finish(int r) {
+    block_completion->complete(r);
+    delete block_completion;
+  }
+};
+
 int aio_write(ImageCtx *ictx, uint64_t off, size_t len, const char *buf,
 			         AioCompletion *c)
 {
@@ -1364,6 +2876,7 @@ int aio_write(ImageCtx *ictx, uint64_t off, size_t len, const char *buf,
   if (r < 0)
     return r;
 
+  bool map_added = false;
   c->get();
   for (uint64_t i = start_block; i <= end_block; i++) {
     bufferlist bl;
@@ -1373,6 +2886,24 @@ int aio_write(ImageCtx *ictx, uint64_t off, size_t len, const char *buf,
     ictx->lock.Unlock();
     uint64_t write_len = min(block_size - block_ofs, left);
     bl.append(buf + total_write, write_len);
+    // synchronous, but only the first write to each block of a clone pays
+    r = copy_up(ictx, i);
+    if (r < 0)
+      goto done;
+    if (r > 0)
+      map_added = true;
+    r = object_map_add(ictx, i);
+    if (r < 0)
+      goto done;
+    if (r > 0)
+      map_added = true;
+    if (ictx->object_cacher) {
+      // buffered; it's done as far as the caller is concerned
+      write_to_cache(ictx, oid, bl, write_len, block_ofs);
+      total_write += write_len;
+      left -= write_len;
+      continue;
+    }
     AioBlockCompletion *block_completion = new AioBlockCompletion(cct, c, off, len, NULL);
     c->add_block_completion(block_completion);
     librados::AioCompletion *rados_completion =
@@ -1386,6 +2917,12 @@ int aio_write(ImageCtx *ictx, uint64_t off, size_t len, const char *buf,
   }
   r = 0;
 done:
+  if (map_added) {
+    // don't complete until other openers know about the new objects
+    AioBlockCompletion *block_completion = new AioBlockCompletion(cct, c, off, 0, NULL);
+    c->add_block_completion(block_completion);
+    flush_map_notifies(ictx, new C_AioBlockCompletion(block_completion));
+  }
   c->finish_adding_completions();
   c->put();
   /* FIXME: cleanup all the allocated stuff */
@@ -1399,6 +2936,50 @@ void rados_aio_sparse_read_cb(rados_completion_t c, void *arg)
   delete block_completion;
 }
 
+// a block of a clone read from the parent image
+struct ParentReadCompletion {
+  AioBlockCompletion *block_completion;
+  AioCompletion *parent_completion;
+};
+
+static void parent_read_cb(completion_t cb, void *arg)
+{
+  ParentReadCompletion *pr = (ParentReadCompletion *)arg;
+  ssize_t r = pr->parent_completion->get_return_value();
+  pr->block_completion->complete(r < 0 ? r : pr->block_completion->len);
+  delete pr->block_completion;
+  delete pr;
+}
+
+/*
+ * Read image extent off~len of a clone from its parent into buf,
+ * completing block_completion.  Once the parent has accepted the read
+ * its completion always fires, so only failures before that are
+ * handled here.
+ */
+static int aio_read_from_parent(ImageCtx *ictx, uint64_t off, size_t len, char *buf,
+				AioBlockCompletion *block_completion)
+{
+  uint64_t plen = parent_overlap(ictx, off, len);
+  memset(buf + plen, 0, len - plen);
+  int r = ictx_check(ictx->parent);
+  if (r >= 0)
+    r = check_io(ictx->parent, off, plen);
+  if (r < 0) {
+    block_completion->complete(r);
+    delete block_completion;
+    return r;
+  }
+
+  ParentReadCompletion *pr = new ParentReadCompletion;
+  pr->block_completion = block_completion;
+  pr->parent_completion = aio_create_completion(pr, parent_read_cb);
+  AioCompletion *parent_completion = pr->parent_completion;
+  r = aio_read(ictx->parent, off, plen, buf, parent_completion);
+  parent_completion->release();
+  return r < 0 ? r : 0;
+}
+
 int aio_read(ImageCtx *ictx, uint64_t off, size_t len,
 				char *buf,
                                 AioCompletion *c)
@@ -1428,9 +3009,46 @@ int aio_read(ImageCtx *ictx, uint64_t off, size_t len,
     ictx->lock.Lock();
     string oid = get_block_oid(ictx->header, i);
     uint64_t block_ofs = get_block_ofs(ictx->header, off + total_read);
+    bool may_exist = ictx->object_may_exist(i);
     ictx->lock.Unlock();
     uint64_t read_len = min(block_size - block_ofs, left);
 
+    if (parent_overlap(ictx, off + total_read, read_len)) {
+      bool exists;
+      r = child_has_object(ictx, i, &exists);
+      if (r < 0) {
+	ret = r;
+	goto done;
+      }
+      if (!exists) {
+	AioBlockCompletion *block_completion =
+	  new AioBlockCompletion(ictx->cct, c, block_ofs, read_len, NULL);
+	c->add_block_completion(block_completion);
+	r = aio_read_from_parent(ictx, off + total_read, read_len, buf + total_read,
+				 block_completion);
+	if (r < 0) {
+	  ret = r;
+	  goto done;
+	}
+	total_read += read_len;
+	left -= read_len;
+	continue;
+      }
+    }
+
+    if (!may_exist) {
+      // nothing to read; complete the block right away
+      memset(buf + total_read, 0, read_len);
+      AioBlockCompletion *block_completion =
+	new AioBlockCompletion(ictx->cct, c, block_ofs, read_len, NULL);
+      c->add_block_completion(block_completion);
+      block_completion->complete(read_len);
+      delete block_completion;
+      total_read += read_len;
+      left -= read_len;
+      continue;
+    }
+
     map<uint64_t,uint64_t> m;
     map<uint64_t,uint64_t>::iterator iter;
 
@@ -1438,6 +3056,15 @@ int aio_read(ImageCtx *ictx, uint64_t off, size_t len,
 	new AioBlockCompletion(ictx->cct, c, block_ofs, read_len, buf + total_read);
     c->add_block_completion(block_completion);
 
+    if (ictx->object_cacher) {
+      block_completion->m[block_ofs] = read_len;
+      aio_read_from_cache(ictx, oid, &block_completion->data_bl, read_len,
+			  block_ofs, new C_AioBlockCompletion(block_completion));
+      total_read += read_len;
+      left -= read_len;
+      continue;
+    }
+
     librados::AioCompletion *rados_completion =
       Rados::aio_create_completion(block_completion, rados_aio_sparse_read_cb, rados_cb);
     r = ictx->data_ctx.aio_sparse_read(oid, rados_completion,
@@ -1460,6 +3087,62 @@ done:
   return ret;
 }
 
+int flush(ImageCtx *ictx)
+{
+  ldout(ictx->cct, 20) << "flush " << ictx << dendl;
+
+  int r = ictx_check(ictx);
+  if (r < 0)
+    return r;
+
+  if (ictx->object_cacher)
+    return flush_cache(ictx);
+  return ictx->data_ctx.aio_flush();
+}
+
+int aio_flush(ImageCtx *ictx, AioCompletion *c)
+{
+  ldout(ictx->cct, 20) << "aio_flush " << ictx << " completion " << c << dendl;
+
+  int r = ictx_check(ictx);
+  if (r < 0)
+    return r;
+
+  c->get();
+  AioBlockCompletion *block_completion =
+    new AioBlockCompletion(ictx->cct, c, 0, 0, NULL);
+  c->add_block_completion(block_completion);
+
+  if (ictx->object_cacher) {
+    Context *onfinish = new C_AioBlockCompletion(block_completion);
+    Context *ctx = new C_OnFinisher(onfinish, &ictx->writeback_handler->get_finisher());
+    ictx->cache_lock.Lock();
+    bool already_flushed = ictx->object_cacher->commit_set(ictx->object_set, ctx);
+    ictx->cache_lock.Unlock();
+    if (already_flushed) {
+      delete ctx;
+      onfinish->complete(0);
+    }
+  } else {
+    // nothing is buffered; just wait for outstanding aio writes
+    librados::AioCompletion *rados_completion =
+      Rados::aio_create_completion(block_completion, NULL, rados_cb);
+    ictx->data_ctx.aio_flush_async(rados_completion);
+    rados_completion->release();
+  }
+
+  c->finish_adding_completions();
+  c->put();
+  return 0;
+}
+
+/*
+   ProgressContext
+*/
+ProgressContext::~ProgressContext()
+{
+}
+
 /*
    RBD
 */
@@ -1501,6 +3184,20 @@ int RBD::create(IoCtx& io_ctx, const char *name, uint64_t size, int *order)
   return r;
 }
 
+int RBD::create2(IoCtx& io_ctx, const char *name, uint64_t size,
+		 uint64_t features, int *order)
+{
+  int r = librbd::create(io_ctx, name, size, features, order);
+  return r;
+}
+
+int RBD::clone(IoCtx& p_ioctx, const char *p_name, const char *p_snapname,
+	       IoCtx& c_ioctx, const char *c_name, uint64_t features, int *c_order)
+{
+  int r = librbd::clone(p_ioctx, p_name, p_snapname, c_ioctx, c_name, features, c_order);
+  return r;
+}
+
 int RBD::remove(IoCtx& io_ctx, const char *name)
 {
   int r = librbd::remove(io_ctx, name);
@@ -1519,6 +3216,13 @@ int RBD::copy(IoCtx& src_io_ctx, const char *srcname, IoCtx& dest_io_ctx, const
   return r;
 }
 
+int RBD::copy_with_progress(IoCtx& src_io_ctx, const char *srcname, IoCtx& dest_io_ctx,
+			    const char *destname, ProgressContext& prog)
+{
+  int r = librbd::copy(src_io_ctx, srcname, dest_io_ctx, destname, prog);
+  return r;
+}
+
 int RBD::rename(IoCtx& src_io_ctx, const char *srcname, const char *destname)
 {
   int r = librbd::rename(src_io_ctx, srcname, destname);
@@ -1581,6 +3285,20 @@ int Image::stat(image_info_t& info, size_t infosize)
   return r;
 }
 
+int Image::get_features(uint64_t *features)
+{
+  ImageCtx *ictx = (ImageCtx *)ctx;
+  int r = librbd::get_features(ictx, features);
+  return r;
+}
+
+int Image::get_used_size(uint64_t *used)
+{
+  ImageCtx *ictx = (ImageCtx *)ctx;
+  int r = librbd::get_used_size(ictx, used);
+  return r;
+}
+
 
 int Image::snap_create(const char *snap_name)
 {
@@ -1655,6 +3373,18 @@ int Image::aio_read(uint64_t off, size_t len, bufferlist& bl, RBD::AioCompletion
   return librbd::aio_read(ictx, off, len, bl.c_str(), (librbd::AioCompletion *)c->pc);
 }
 
+int Image::flush()
+{
+  ImageCtx *ictx = (ImageCtx *)ctx;
+  return librbd::flush(ictx);
+}
+
+int Image::aio_flush(RBD::AioCompletion *c)
+{
+  ImageCtx *ictx = (ImageCtx *)ctx;
+  return librbd::aio_flush(ictx, (librbd::AioCompletion *)c->pc);
+}
+
 } // namespace librbd
 
 extern "C" void rbd_version(int *major, int *minor, int *extra)
@@ -1704,6 +3434,24 @@ extern "C" int rbd_create(rados_ioctx_t p, const char *name, uint64_t size, int
   return librbd::create(io_ctx, name, size, order);
 }
 
+extern "C" int rbd_create2(rados_ioctx_t p, const char *name, uint64_t size,
+			   uint64_t features, int *order)
+{
+  librados::IoCtx io_ctx;
+  librados::IoCtx::from_rados_ioctx_t(p, io_ctx);
+  return librbd::create(io_ctx, name, size, features, order);
+}
+
+extern "C" int rbd_clone(rados_ioctx_t p_ioctx, const char *p_name, const char *p_snapname,
+			 rados_ioctx_t c_ioctx, const char *c_name, uint64_t features,
+			 int *c_order)
+{
+  librados::IoCtx p_ioc, c_ioc;
+  librados::IoCtx::from_rados_ioctx_t(p_ioctx, p_ioc);
+  librados::IoCtx::from_rados_ioctx_t(c_ioctx, c_ioc);
+  return librbd::clone(p_ioc, p_name, p_snapname, c_ioc, c_name, features, c_order);
+}
+
 extern "C" int rbd_remove(rados_ioctx_t p, const char *name)
 {
   librados::IoCtx io_ctx;
@@ -1719,6 +3467,17 @@ extern "C" int rbd_copy(rados_ioctx_t src_p, const char *srcname, rados_ioctx_t
   return librbd::copy(src_io_ctx, srcname, dest_io_ctx, destname);
 }
 
+extern "C" int rbd_copy_with_progress(rados_ioctx_t src_p, const char *srcname,
+				      rados_ioctx_t dest_p, const char *destname,
+				      librbd_progress_fn_t fn, void *data)
+{
+  librados::IoCtx src_io_ctx, dest_io_ctx;
+  librados::IoCtx::from_rados_ioctx_t(src_p, src_io_ctx);
+  librados::IoCtx::from_rados_ioctx_t(dest_p, dest_io_ctx);
+  librbd::CProgressContext prog(fn, data);
+  return librbd::copy(src_io_ctx, srcname, dest_io_ctx, destname, prog);
+}
+
 extern "C" int rbd_rename(rados_ioctx_t src_p, const char *srcname, const char *destname)
 {
   librados::IoCtx src_io_ctx;
@@ -1757,6 +3516,18 @@ extern "C" int rbd_stat(rbd_image_t image, rbd_image_info_t *info, size_t infosi
   return librbd::info(ictx, *info, infosize);
 }
 
+extern "C" int rbd_get_features(rbd_image_t image, uint64_t *features)
+{
+  librbd::ImageCtx *ictx = (librbd::ImageCtx *)image;
+  return librbd::get_features(ictx, features);
+}
+
+extern "C" int rbd_get_used_size(rbd_image_t image, uint64_t *used)
+{
+  librbd::ImageCtx *ictx = (librbd::ImageCtx *)image;
+  return librbd::get_used_size(ictx, used);
+}
+
 /* snapshots */
 extern "C" int rbd_snap_create(rbd_image_t image, const char *snap_name)
 {
@@ -1866,6 +3637,19 @@ extern "C" int rbd_aio_read(rbd_image_t image, uint64_t off, size_t len, char *b
   return librbd::aio_read(ictx, off, len, buf, (librbd::AioCompletion *)comp->pc);
 }
 
+extern "C" int rbd_flush(rbd_image_t image)
+{
+  librbd::ImageCtx *ictx = (librbd::ImageCtx *)image;
+  return librbd::flush(ictx);
+}
+
+extern "C" int rbd_aio_flush(rbd_image_t image, rbd_completion_t c)
+{
+  librbd::ImageCtx *ictx = (librbd::ImageCtx *)image;
+  librbd::RBD::AioCompletion *comp = (librbd::RBD::AioCompletion *)c;
+  return librbd::aio_flush(ictx, (librbd::AioCompletion *)comp->pc);
+}
+
 extern "C" int rbd_aio_wait_for_complete(rbd_completion_t c)
 {
   librbd::RBD::AioCompletion *comp = (librbd::RBD::AioCompletion *)c;
@@ -20,19 +20,39 @@
 
 /*
  * instruct an OSD initiate a replica scrub on a specific PG
+ *
+ * A chunky request asks for the objects in [start, end) only, once the
+ * replica has applied everything up to scrub_to.  An end of sobject_t()
+ * means the end of the pg.
  */
 
 struct MOSDRepScrub : public Message {
   pg_t pgid;             // PG to scrub
   eversion_t scrub_from; // only scrub log entries after scrub_from
   epoch_t map_epoch;
+  bool chunky;           // scrub the range [start, end) only
+  sobject_t start, end;
+  eversion_t scrub_to;   // last update touching the range
+  bool deep;             // include object data digests
 
-  MOSDRepScrub() {}
+  MOSDRepScrub() : chunky(false), deep(false) {}
   MOSDRepScrub(pg_t pgid, eversion_t scrub_from, epoch_t map_epoch) :
     Message(MSG_OSD_REP_SCRUB),
     pgid(pgid),
     scrub_from(scrub_from),
-    map_epoch(map_epoch) {}
+    map_epoch(map_epoch),
+    chunky(false),
+    deep(false) {}
+  MOSDRepScrub(pg_t pgid, const sobject_t& start, const sobject_t& end,
+	       eversion_t scrub_to, epoch_t map_epoch, bool deep) :
+    Message(MSG_OSD_REP_SCRUB),
+    pgid(pgid),
+    map_epoch(map_epoch),
+    chunky(true),
+    start(start),
+    end(end),
+    scrub_to(scrub_to),
+    deep(deep) {}
   
 private:
   ~MOSDRepScrub() {}
@@ -43,6 +63,10 @@ public:
     out << "replica scrub(pg: ";
     out << pgid << ",from:" << scrub_from << "epoch:" 
         << map_epoch;
+    if (chunky)
+      out << ",chunk:[" << start << "," << end << "),to:" << scrub_to;
+    if (deep)
+      out << ",deep";
     out << ")";
   }
 
@@ -50,12 +74,30 @@ public:
     ::encode(pgid, payload);
     ::encode(scrub_from, payload);
     ::encode(map_epoch, payload);
+    ::encode(chunky, payload);
+    ::encode(start, payload);
+    ::encode(end, payload);
+    ::encode(scrub_to, payload);
+    ::encode(deep, payload);
+    header.version = 3;
   }
   void decode_payload(CephContext *cct) {
     bufferlist::iterator p = payload.begin();
     ::decode(pgid, p);
     ::decode(scrub_from, p);
     ::decode(map_epoch, p);
+    if (header.version >= 2) {
+      ::decode(chunky, p);
+      ::decode(start, p);
+      ::decode(end, p);
+      ::decode(scrub_to, p);
+    } else {
+      chunky = false;
+    }
+    if (header.version >= 3)
+      ::decode(deep, p);
+    else
+      deep = false;
   }
 };
 
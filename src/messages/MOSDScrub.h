@@ -26,14 +26,15 @@ struct MOSDScrub : public Message {
   ceph_fsid_t fsid;
   vector<pg_t> scrub_pgs;
   bool repair;
+  bool deep;    // also compare object data digests
 
-  MOSDScrub() {}
-  MOSDScrub(const ceph_fsid_t& f, bool r) :
+  MOSDScrub() : repair(false), deep(false) {}
+  MOSDScrub(const ceph_fsid_t& f, bool r, bool d=false) :
     Message(MSG_OSD_SCRUB),
-    fsid(f), repair(r) {}
-  MOSDScrub(const ceph_fsid_t& f, vector<pg_t>& pgs, bool r) :
+    fsid(f), repair(r), deep(d) {}
+  MOSDScrub(const ceph_fsid_t& f, vector<pg_t>& pgs, bool r, bool d=false) :
     Message(MSG_OSD_SCRUB),
-    fsid(f), scrub_pgs(pgs), repair(r) {}
+    fsid(f), scrub_pgs(pgs), repair(r), deep(d) {}
 private:
   ~MOSDScrub() {}
 
@@ -47,6 +48,8 @@ public:
       out << scrub_pgs;
     if (repair)
       out << " repair";
+    if (deep)
+      out << " deep";
     out << ")";
   }
 
@@ -54,12 +57,18 @@ public:
     ::encode(fsid, payload);
     ::encode(scrub_pgs, payload);
     ::encode(repair, payload);
+    ::encode(deep, payload);
+    header.version = 2;
   }
   void decode_payload(CephContext *cct) {
     bufferlist::iterator p = payload.begin();
     ::decode(fsid, p);
     ::decode(scrub_pgs, p);
     ::decode(repair, p);
+    if (header.version >= 2)
+      ::decode(deep, p);
+    else
+      deep = false;
   }
 };
 
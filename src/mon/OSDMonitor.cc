@@ -87,6 +87,12 @@ bool OSDMonitor::update_from_paxos()
     }
   } 
   
+  // only keep the old mapping table around if we are going to log the diff
+  OSDMapMapping oldmapping;
+  bool diff_mapping = g_conf->debug_mon >= 10 && osdmap.have_mapping();
+  if (diff_mapping)
+    oldmapping = osdmap.get_mapping();
+
   // walk through incrementals
   bufferlist bl;
   while (paxosv > osdmap.epoch) {
@@ -109,6 +115,15 @@ bool OSDMonitor::update_from_paxos()
   // save latest
   paxos->stash_latest(paxosv, bl);
 
+  // we look up pgs all over the cluster; precompute them
+  osdmap.update_mapping(g_conf->osd_map_mapping_threads);
+  if (diff_mapping) {
+    set<pg_t> changed;
+    OSDMapMapping::diff(oldmapping, osdmap.get_mapping(), &changed);
+    dout(10) << "update_from_paxos " << changed.size() << " pgs changed mapping since e"
+	     << oldmapping.get_epoch() << dendl;
+  }
+
   // populate down -> out map
   for (int o = 0; o < osdmap.get_max_osd(); o++)
     if (osdmap.is_down(o) && osdmap.is_in(o) &&
@@ -1267,10 +1282,11 @@ bool OSDMonitor::preprocess_command(MMonCommand *m)
 	} else ss << "specify osd number or *";
       }
     }
-    else if ((m->cmd[1] == "scrub" || m->cmd[1] == "repair")) {
+    else if ((m->cmd[1] == "scrub" || m->cmd[1] == "deep-scrub" ||
+	      m->cmd[1] == "repair")) {
       if (m->cmd.size() <= 2) {
 	r = -EINVAL;
-	ss << "usage: osd [scrub|repair] <who>";
+	ss << "usage: osd [scrub|deep-scrub|repair] <who>";
 	goto out;
       }
       if (m->cmd[2] == "*") {
@@ -1280,7 +1296,8 @@ bool OSDMonitor::preprocess_command(MMonCommand *m)
 	  if (osdmap.is_up(i)) {
 	    ss << (c++ ? ",":"") << i;
 	    mon->try_send_message(new MOSDScrub(osdmap.get_fsid(),
-						m->cmd[1] == "repair"),
+						m->cmd[1] == "repair",
+						m->cmd[1] == "deep-scrub"),
 				  osdmap.get_inst(i));
 	  }	    
 	r = 0;
@@ -1289,7 +1306,8 @@ bool OSDMonitor::preprocess_command(MMonCommand *m)
 	long osd = strtol(m->cmd[2].c_str(), 0, 10);
 	if (osdmap.is_up(osd)) {
 	  mon->try_send_message(new MOSDScrub(osdmap.get_fsid(),
-					      m->cmd[1] == "repair"),
+					      m->cmd[1] == "repair",
+					      m->cmd[1] == "deep-scrub"),
 				osdmap.get_inst(osd));
 	  r = 0;
 	  ss << "osd" << osd << " instructed to " << m->cmd[1];
@@ -33,6 +33,20 @@ public:
   // how i receive messages
   virtual bool ms_dispatch(Message *m) = 0;
 
+  /*
+   * fast dispatch.  a dispatcher may claim messages (say, by type) to
+   * be delivered through ms_fast_dispatch() as soon as they are read,
+   * from the connection's reader thread or one of ms_fast_dispatch_threads
+   * threads, instead of going through the dispatch queue.  messages
+   * from one connection are fast dispatched in order, but not in order
+   * with the ones the same connection gets through ms_dispatch().
+   *
+   * ms_can_fast_dispatch() must be cheap and must not depend on state
+   * that changes; both may be called from several threads at once.
+   */
+  virtual bool ms_can_fast_dispatch(Message *m) { return false; }
+  virtual void ms_fast_dispatch(Message *m) { assert(0); }
+
   // after a connection connects
   virtual void ms_handle_connect(Connection *con) { };
 
@@ -23,6 +23,9 @@
 #include <sys/uio.h>
 #include <limits.h>
 #include <sys/user.h>
+#ifndef DARWIN
+#include <sys/epoll.h>
+#endif
 
 #include "common/config.h"
 #include "global/global_init.h"
@@ -36,6 +39,7 @@
 
 #include "common/Timer.h"
 #include "common/errno.h"
+#include "common/perf_counters.h"
 #include "common/safe_io.h"
 #include "include/page.h"
 
@@ -341,23 +345,7 @@ void SimpleMessenger::dispatch_entry()
 	  ms_deliver_handle_reset(con);
 	  con->put();
 	} else {
-	  uint64_t msize = m->get_dispatch_throttle_size();
-	  m->set_dispatch_throttle_size(0);  // clear it out, in case we requeue this message.
-
-	  ldout(cct,1) << "<== " << m->get_source_inst()
-		  << " " << m->get_seq()
-		  << " ==== " << *m
-		  << " ==== " << m->get_payload().length() << "+" << m->get_middle().length()
-		  << "+" << m->get_data().length()
-		  << " (" << m->get_footer().front_crc << " " << m->get_footer().middle_crc
-		  << " " << m->get_footer().data_crc << ")"
-		  << " " << m << " con " << m->get_connection()
-		  << dendl;
-	  ms_deliver_dispatch(m);
-
-	  dispatch_throttle_release(msize);
-
-	  ldout(cct,20) << "done calling dispatch on " << m << dendl;
+	  deliver_message(m, false);
 	}
       }
       dispatch_queue.lock.Lock();
@@ -374,6 +362,123 @@ void SimpleMessenger::dispatch_entry()
   lock.Unlock();
 }
 
+void SimpleMessenger::deliver_message(Message *m, bool fast)
+{
+  uint64_t msize = m->get_dispatch_throttle_size();
+  m->set_dispatch_throttle_size(0);  // clear it out, in case we requeue this message.
+
+  ldout(cct,1) << "<== " << m->get_source_inst()
+	  << " " << m->get_seq()
+	  << " ==== " << *m
+	  << " ==== " << m->get_payload().length() << "+" << m->get_middle().length()
+	  << "+" << m->get_data().length()
+	  << " (" << m->get_footer().front_crc << " " << m->get_footer().middle_crc
+	  << " " << m->get_footer().data_crc << ")"
+	  << " " << m << " con " << m->get_connection()
+	  << (fast ? " fast" : "")
+	  << dendl;
+  if (fast)
+    ms_fast_dispatch(m);
+  else
+    ms_deliver_dispatch(m);
+
+  dispatch_throttle_release(msize);
+
+  ldout(cct,20) << "done calling dispatch on " << m << dendl;
+}
+
+void SimpleMessenger::drop_message(Message *m)
+{
+  ldout(cct,10) << "dropping " << m << " " << *m << ", dispatch is stopped" << dendl;
+  dispatch_throttle_release(m->get_dispatch_throttle_size());
+  m->put();
+}
+
+/*
+ * Deliver a message the dispatchers want fast dispatched.  Called by
+ * the pipe's reader (or its EventWorker) without pipe_lock.  With
+ * fast dispatch threads, a connection always goes to the same one, so
+ * its messages stay in order.
+ */
+void SimpleMessenger::fast_dispatch(Message *m)
+{
+  if (fast_dispatch_threads.empty()) {
+    if (dispatch_queue.stop)
+      drop_message(m);
+    else
+      deliver_message(m, true);
+    return;
+  }
+  unsigned long h = (unsigned long)m->get_connection();
+  h ^= h >> 12;
+  fast_dispatch_threads[(h >> 4) % fast_dispatch_threads.size()]->queue(m);
+}
+
+void SimpleMessenger::start_fast_dispatch()
+{
+  for (int i = 0; i < cct->_conf->ms_fast_dispatch_threads; i++) {
+    FastDispatchThread *t = new FastDispatchThread(this);
+    t->create();
+    fast_dispatch_threads.push_back(t);
+  }
+}
+
+void SimpleMessenger::stop_fast_dispatch()
+{
+  while (!fast_dispatch_threads.empty()) {
+    FastDispatchThread *t = fast_dispatch_threads.back();
+    fast_dispatch_threads.pop_back();
+    t->shutdown();
+    delete t;
+  }
+}
+
+void SimpleMessenger::FastDispatchThread::queue(Message *m)
+{
+  lock.Lock();
+  if (stop) {
+    lock.Unlock();
+    msgr->drop_message(m);
+    return;
+  }
+  if (q.empty())
+    cond.Signal();
+  q.push_back(m);
+  lock.Unlock();
+}
+
+void SimpleMessenger::FastDispatchThread::shutdown()
+{
+  lock.Lock();
+  stop = true;
+  cond.Signal();
+  lock.Unlock();
+  join();
+}
+
+void *SimpleMessenger::FastDispatchThread::entry()
+{
+  lock.Lock();
+  while (true) {
+    while (!q.empty()) {
+      Message *m = q.front();
+      q.pop_front();
+      lock.Unlock();
+      if (stop || msgr->dispatch_queue.stop)
+	msgr->drop_message(m);
+      else
+	msgr->deliver_message(m, true);
+      lock.Lock();
+    }
+    if (stop)
+      break;
+    cond.Wait(lock);
+  }
+  lock.Unlock();
+  return 0;
+}
+
+
 void SimpleMessenger::ready()
 {
   ldout(cct,10) << "ready " << get_myaddr() << dendl;
@@ -972,6 +1077,11 @@ int SimpleMessenger::Pipe::accept()
 
   pipe_lock.Lock();
   if (state != STATE_CLOSED) {
+    if (event_attach()) {
+      ldout(msgr->cct,10) << "accept handed sd to event worker, " << "state=" << state << dendl;
+      pipe_lock.Unlock();
+      return 1;
+    }
     ldout(msgr->cct,10) << "accept starting writer, " << "state=" << state << dendl;
     start_writer();
   }
@@ -1299,8 +1409,12 @@ int SimpleMessenger::Pipe::connect()
       }
       
       if (!reader_running) {
-	ldout(msgr->cct,20) << "connect starting reader" << dendl;
-	start_reader();
+	if (event_attach()) {
+	  ldout(msgr->cct,20) << "connect handed sd to event worker" << dendl;
+	} else {
+	  ldout(msgr->cct,20) << "connect starting reader" << dendl;
+	  start_reader();
+	}
       }
       delete authorizer;
       return 0;
@@ -1542,8 +1656,18 @@ void SimpleMessenger::Pipe::stop()
  */
 void SimpleMessenger::Pipe::reader()
 {
-  if (state == STATE_ACCEPTING) 
-    accept();
+  discard_recv_buffer();  // anything left over came from an old socket
+
+  if (state == STATE_ACCEPTING) {
+    if (accept() == 1) {
+      // an event worker reads from here on
+      pipe_lock.Lock();
+      reader_running = false;
+      unlock_maybe_reap();
+      ldout(msgr->cct,10) << "reader done (event worker took over)" << dendl;
+      return;
+    }
+  }
 
   pipe_lock.Lock();
 
@@ -1564,7 +1688,7 @@ void SimpleMessenger::Pipe::reader()
     char buf[80];
     char tag = -1;
     ldout(msgr->cct,20) << "reader reading tag..." << dendl;
-    int rc = tcp_read(msgr->cct, sd, (char*)&tag, 1, msgr->timeout);
+    int rc = buffered_read((char*)&tag, 1);
     if (rc < 0) {
       pipe_lock.Lock();
       ldout(msgr->cct,2) << "reader couldn't read tag, " << strerror_r(errno, buf, sizeof(buf)) << dendl;
@@ -1582,7 +1706,7 @@ void SimpleMessenger::Pipe::reader()
     if (tag == CEPH_MSGR_TAG_ACK) {
       ldout(msgr->cct,20) << "reader got ACK" << dendl;
       ceph_le64 seq;
-      int rc = tcp_read(msgr->cct,  sd, (char*)&seq, sizeof(seq), msgr->timeout);
+      int rc = buffered_read((char*)&seq, sizeof(seq));
       pipe_lock.Lock();
       if (rc < 0) {
 	ldout(msgr->cct,2) << "reader couldn't read ack seq, " << strerror_r(errno, buf, sizeof(buf)) << dendl;
@@ -1637,7 +1761,13 @@ void SimpleMessenger::Pipe::reader()
       ldout(msgr->cct,10) << "reader got message "
 	       << m->get_seq() << " " << m << " " << *m
 	       << dendl;
-      queue_received(m);
+      if (!halt_delivery && msgr->ms_can_fast_dispatch(m)) {
+	pipe_lock.Unlock();
+	msgr->fast_dispatch(m);
+	pipe_lock.Lock();
+      } else {
+	queue_received(m);
+      }
     } 
     
     else if (tag == CEPH_MSGR_TAG_CLOSE) {
@@ -1675,6 +1805,12 @@ void SimpleMessenger::Pipe::writer()
   while (state != STATE_CLOSED) {// && state != STATE_WAIT) {
     ldout(msgr->cct,10) << "writer: state = " << state << " policy.server=" << policy.server << dendl;
 
+    // connect() handed the open socket to an event worker?
+    if (event_running) {
+      ldout(msgr->cct,10) << "writer: event worker took over" << dendl;
+      break;
+    }
+
     // standby?
     if (is_queued() && state == STATE_STANDBY && !policy.server) {
       connect_seq++;
@@ -1792,7 +1928,7 @@ void SimpleMessenger::Pipe::writer()
 
 void SimpleMessenger::Pipe::unlock_maybe_reap()
 {
-  if (!reader_running && !writer_running) {
+  if (!reader_running && !writer_running && !event_running) {
     shutdown_socket();
     pipe_lock.Unlock();
     msgr->queue_reap(this);
@@ -1825,6 +1961,128 @@ static void alloc_aligned_buffer(bufferlist& data, unsigned len, unsigned off)
   }
 }
 
+/*
+ * A single recv(2) that does not block.  Returns the number of bytes
+ * read, 0 if there is nothing to read right now, or -1 on error or if
+ * the peer closed the connection.
+ */
+int SimpleMessenger::Pipe::do_recv(char *buf, int len)
+{
+  char err[80];
+  while (true) {
+    int got = ::recv(sd, buf, len, MSG_DONTWAIT);
+    recv_syscalls++;
+    if (got > 0) {
+      recv_bytes += got;
+      return got;
+    }
+    if (got == 0) {
+      ldout(msgr->cct,10) << "do_recv socket " << sd << " closed by peer" << dendl;
+      errno = ECONNRESET;
+      return -1;
+    }
+    if (errno == EINTR)
+      continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    ldout(msgr->cct,10) << "do_recv socket " << sd << " returned " << got
+			<< " errno " << errno << " " << strerror_r(errno, err, sizeof(err)) << dendl;
+    return -1;
+  }
+}
+
+/*
+ * Read up to len bytes without blocking, by way of recv_buf.  Bytes
+ * already buffered are handed out first.  A short read is served by
+ * reading up to ms_tcp_prefetch_max_size bytes at once, so the tag,
+ * header, front and footer of a small message (and of whatever
+ * messages follow it) come out of a single recv(2).  Anything at least
+ * that big, i.e. the bulk of a data payload, goes straight to buf,
+ * which may be a registered rx_buffer.  Returns like do_recv().
+ */
+int SimpleMessenger::Pipe::buffered_recv(char *buf, int len)
+{
+  if (recv_ofs < recv_len) {
+    int n = MIN(len, recv_len - recv_ofs);
+    memcpy(buf, recv_buf + recv_ofs, n);
+    recv_ofs += n;
+    if (recv_ofs == recv_len)
+      discard_recv_buffer();
+    return n;
+  }
+
+  if (len >= recv_max_prefetch)
+    return do_recv(buf, len);
+
+  int got = do_recv(recv_buf, recv_max_prefetch);
+  if (got <= 0)
+    return got;
+  int n = MIN(len, got);
+  memcpy(buf, recv_buf, n);
+  if (n < got) {
+    recv_ofs = n;
+    recv_len = got;
+  }
+  return n;
+}
+
+/*
+ * tcp_read_wait() for the reader thread, which does not need to wait
+ * while there is buffered input.
+ */
+int SimpleMessenger::Pipe::buffered_read_wait()
+{
+  if (recv_ofs < recv_len)
+    return 0;
+  return tcp_read_wait(sd, msgr->timeout);
+}
+
+/*
+ * tcp_read() for the reader thread: block (up to ms_tcp_read_timeout)
+ * until all len bytes are there.  Returns 0 or -1.
+ */
+int SimpleMessenger::Pipe::buffered_read(char *buf, int len)
+{
+  if (sd < 0)
+    return -1;
+
+  while (len > 0) {
+    if (msgr->cct->_conf->ms_inject_socket_failures) {
+      if (rand() % msgr->cct->_conf->ms_inject_socket_failures == 0) {
+	ldout(msgr->cct,0) << "injecting socket failure" << dendl;
+	::shutdown(sd, SHUT_RDWR);
+      }
+    }
+
+    if (buffered_read_wait() < 0)
+      return -1;
+
+    int got = buffered_recv(buf, len);
+    if (got < 0)
+      return -1;
+    len -= got;
+    buf += got;
+  }
+  return 0;
+}
+
+/*
+ * Account the system calls and bytes it took to read a message.
+ * Counted per pipe and pushed into the perf counters once per message,
+ * so the counters' lock is not taken on every recv.
+ */
+void SimpleMessenger::Pipe::note_recv_message()
+{
+  if (msgr->logger) {
+    msgr->logger->inc(l_msgr_recv_msgs);
+    msgr->logger->inc(l_msgr_recv_bytes, recv_bytes);
+    msgr->logger->inc(l_msgr_recv_syscalls, recv_syscalls);
+    msgr->logger->finc(l_msgr_recv_syscalls_per_msg, recv_syscalls);
+  }
+  recv_syscalls = 0;
+  recv_bytes = 0;
+}
+
 int SimpleMessenger::Pipe::read_message(Message **pm)
 {
   int ret = -1;
@@ -1836,12 +2094,12 @@ int SimpleMessenger::Pipe::read_message(Message **pm)
   __u32 header_crc;
   
   if (connection_state->has_feature(CEPH_FEATURE_NOSRCADDR)) {
-    if (tcp_read(msgr->cct,  sd, (char*)&header, sizeof(header), msgr->timeout ) < 0)
+    if (buffered_read((char*)&header, sizeof(header)) < 0)
       return -1;
     header_crc = ceph_crc32c_le(0, (unsigned char *)&header, sizeof(header) - sizeof(header.crc));
   } else {
     ceph_msg_header_old oldheader;
-    if (tcp_read(msgr->cct,  sd, (char*)&oldheader, sizeof(oldheader), msgr->timeout ) < 0)
+    if (buffered_read((char*)&oldheader, sizeof(oldheader)) < 0)
       return -1;
     // this is fugly
     memcpy(&header, &oldheader, sizeof(header));
@@ -1893,7 +2151,7 @@ int SimpleMessenger::Pipe::read_message(Message **pm)
   front_len = header.front_len;
   if (front_len) {
     bufferptr bp = buffer::create(front_len);
-    if (tcp_read(msgr->cct,  sd, bp.c_str(), front_len, msgr->timeout ) < 0)
+    if (buffered_read(bp.c_str(), front_len) < 0)
       goto out_dethrottle;
     front.push_back(bp);
     ldout(msgr->cct,20) << "reader got front " << front.length() << dendl;
@@ -1903,7 +2161,7 @@ int SimpleMessenger::Pipe::read_message(Message **pm)
   middle_len = header.middle_len;
   if (middle_len) {
     bufferptr bp = buffer::create(middle_len);
-    if (tcp_read(msgr->cct,  sd, bp.c_str(), middle_len, msgr->timeout ) < 0)
+    if (buffered_read(bp.c_str(), middle_len) < 0)
       goto out_dethrottle;
     middle.push_back(bp);
     ldout(msgr->cct,20) << "reader got middle " << middle.length() << dendl;
@@ -1923,7 +2181,7 @@ int SimpleMessenger::Pipe::read_message(Message **pm)
 	
     while (left > 0) {
       // wait for data
-      if (tcp_read_wait(sd, msgr->timeout) < 0)
+      if (buffered_read_wait() < 0)
 	goto out_dethrottle;
 
       // get a buffer
@@ -1953,7 +2211,7 @@ int SimpleMessenger::Pipe::read_message(Message **pm)
       bufferptr bp = blp.get_current_ptr();
       int read = MIN(bp.length(), left);
       ldout(msgr->cct,20) << "reader reading nonblocking into " << (void*)bp.c_str() << " len " << bp.length() << dendl;
-      int got = tcp_read_nonblocking(msgr->cct, sd, bp.c_str(), read);
+      int got = buffered_recv(bp.c_str(), read);
       ldout(msgr->cct,30) << "reader read " << got << " of " << read << dendl;
       connection_state->lock.Unlock();
       if (got < 0)
@@ -1968,7 +2226,7 @@ int SimpleMessenger::Pipe::read_message(Message **pm)
   }
 
   // footer
-  if (tcp_read(msgr->cct, sd, (char*)&footer, sizeof(footer), msgr->timeout) < 0)
+  if (buffered_read((char*)&footer, sizeof(footer)) < 0)
     goto out_dethrottle;
   
   aborted = (footer.flags & CEPH_MSG_FOOTER_COMPLETE) == 0;
@@ -1994,6 +2252,7 @@ int SimpleMessenger::Pipe::read_message(Message **pm)
   // by messages entering the dispatch queue through other paths.
   message->set_dispatch_throttle_size(message_size);
 
+  note_recv_message();
   *pm = message;
   return 0;
 
@@ -2025,6 +2284,11 @@ int SimpleMessenger::Pipe::do_sendmsg(int sd, struct msghdr *msg, int len, bool
     }
 
     int r = ::sendmsg(sd, msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    if (msgr->logger) {
+      msgr->logger->inc(l_msgr_send_syscalls);
+      if (r > 0)
+	msgr->logger->inc(l_msgr_send_bytes, r);
+    }
     if (r == 0) 
       ldout(msgr->cct,10) << "do_sendmsg hmm do_sendmsg got r==0!" << dendl;
     if (r < 0) { 
@@ -2250,6 +2514,8 @@ int SimpleMessenger::Pipe::write_message(Message *m)
   if (do_sendmsg(sd, &msg, msglen)) 
     goto fail;
 
+  if (msgr->logger)
+    msgr->logger->inc(l_msgr_send_msgs);
   ret = 0;
 
  out:
@@ -2262,6 +2528,546 @@ int SimpleMessenger::Pipe::write_message(Message *m)
 }
 
 
+/********************************************
+ * Pipe, event-driven
+ *
+ * When a pipe is attached to an EventWorker its socket is read and
+ * written without blocking from the worker's epoll loop.  The input
+ * side is a small state machine (ev_in_state) that remembers how far
+ * into the current tag/ack/message it got; the output side queues the
+ * encoded bytes in ev_out and pushes them out as the socket takes them.
+ * Both mirror what reader()/read_message() and writer()/write_message()
+ * do, so the two modes are interchangeable on the wire.
+ */
+
+bool SimpleMessenger::Pipe::event_attach()
+{
+  assert(pipe_lock.is_locked());
+  EventWorker *w = msgr->pick_event_worker();
+  if (!w)
+    return false;
+
+  ev_reset_in();
+  discard_recv_buffer();
+  ev_out.clear();
+  ev_events = 0;
+  ev_throttled = false;
+  ev_last_rx = ceph_clock_now(msgr->cct);
+
+  event_running = true;
+  event_worker = w;
+  if (w->add_pipe(this) < 0) {
+    event_running = false;
+    event_worker = NULL;
+    return false;
+  }
+  return true;
+}
+
+/*
+ * The worker let go of sd.  Called with pipe_lock held; drops it.
+ * Whatever is left to do (reconnect, standby, writing CLOSE, or just
+ * being reaped) is up to the writer thread, same as in threaded mode.
+ */
+void SimpleMessenger::Pipe::event_detached()
+{
+  assert(pipe_lock.is_locked());
+  event_worker = NULL;
+  event_running = false;
+  ev_reset_in();
+  ev_out.clear();
+
+  if (state == STATE_OPEN)
+    fault();
+
+  if (state != STATE_CLOSED && !writer_running) {
+    ldout(msgr->cct,10) << "event_detached starting writer, state=" << state << dendl;
+    start_writer();
+  }
+  unlock_maybe_reap();
+}
+
+/*
+ * Drop a partially read message, and give back what it holds of the
+ * throttlers.
+ */
+void SimpleMessenger::Pipe::ev_reset_in()
+{
+  if (ev_policy_throttled) {
+    ldout(msgr->cct,10) << "event reader releasing " << ev_msg_size << " to policy throttler "
+			<< policy.throttler->get_current() << "/"
+			<< policy.throttler->get_max() << dendl;
+    policy.throttler->put(ev_msg_size);
+  }
+  if (ev_dispatch_throttled)
+    msgr->dispatch_throttle_release(ev_msg_size);
+  ev_policy_throttled = ev_dispatch_throttled = false;
+  ev_msg_size = 0;
+  ev_in_state = EV_IN_TAG;
+  ev_in_have = 0;
+  ev_in_bp = bufferptr();
+  ev_front.clear();
+  ev_middle.clear();
+  ev_data.clear();
+  ev_newbuf.clear();
+  ev_rxbuf.clear();
+  ev_rxbuf_version = 0;
+}
+
+/*
+ * Read up to want bytes into buf, continuing from ev_in_have.  Returns
+ * 1 once all want bytes are there, 0 if the socket ran dry first, -1 on
+ * error or if the peer closed the connection.
+ */
+int SimpleMessenger::Pipe::ev_fill(char *buf, unsigned want)
+{
+  while (ev_in_have < want) {
+    int got = buffered_recv(buf + ev_in_have, want - ev_in_have);
+    if (got <= 0)
+      return got;
+    ev_in_have += got;
+  }
+  return 1;
+}
+
+/*
+ * Like the data loop in read_message(): land the payload directly in
+ * the rx buffer the user registered for this tid, if any.
+ */
+int SimpleMessenger::Pipe::ev_read_data()
+{
+  unsigned data_len = le32_to_cpu(ev_header.data_len);
+  unsigned data_off = le32_to_cpu(ev_header.data_off);
+
+  while (ev_data.length() < data_len) {
+    unsigned offset = ev_data.length();
+    unsigned left = data_len - offset;
+
+    connection_state->lock.Lock();
+    map<tid_t,pair<bufferlist,int> >::iterator p = connection_state->rx_buffers.find(ev_header.tid);
+    if (p != connection_state->rx_buffers.end()) {
+      if (ev_rxbuf.length() == 0 || p->second.second != ev_rxbuf_version) {
+	ldout(msgr->cct,10) << "event reader selecting rx buffer v " << p->second.second
+			    << " at offset " << offset
+			    << " len " << p->second.first.length() << dendl;
+	ev_rxbuf = p->second.first;
+	ev_rxbuf_version = p->second.second;
+	// make sure it's big enough
+	if (ev_rxbuf.length() < data_len)
+	  ev_rxbuf.push_back(buffer::create(data_len - ev_rxbuf.length()));
+	ev_blp = p->second.first.begin();
+	ev_blp.advance(offset);
+      }
+    } else {
+      if (!ev_newbuf.length()) {
+	ldout(msgr->cct,20) << "event reader allocating new rx buffer at offset " << offset << dendl;
+	alloc_aligned_buffer(ev_newbuf, data_len, data_off);
+	ev_blp = ev_newbuf.begin();
+	ev_blp.advance(offset);
+      }
+    }
+    bufferptr bp = ev_blp.get_current_ptr();
+    int want = MIN(bp.length(), left);
+    int got = buffered_recv(bp.c_str(), want);
+    connection_state->lock.Unlock();
+    if (got <= 0)
+      return got;
+    ldout(msgr->cct,30) << "event reader read " << got << " of " << want << dendl;
+    ev_blp.advance(got);
+    ev_data.append(bp, 0, got);
+  }
+  return 1;
+}
+
+/*
+ * The footer is in ev_in_buf: build the message and queue it for
+ * dispatch the way reader() does.  Returns -1 if the connection should
+ * fault.
+ */
+int SimpleMessenger::Pipe::ev_finish_message()
+{
+  ceph_msg_footer footer;
+  memcpy(&footer, ev_in_buf, sizeof(footer));
+
+  if ((footer.flags & CEPH_MSG_FOOTER_COMPLETE) == 0) {
+    ldout(msgr->cct,0) << "event reader got " << ev_front.length() << " + " << ev_middle.length()
+		       << " + " << ev_data.length() << " byte message.. ABORTED" << dendl;
+    ev_reset_in();
+    return 0;
+  }
+
+  ldout(msgr->cct,20) << "event reader got " << ev_front.length() << " + " << ev_middle.length()
+		      << " + " << ev_data.length() << " byte message" << dendl;
+  Message *m = decode_message(msgr->cct, ev_header, footer, ev_front, ev_middle, ev_data);
+  if (!m) {
+    ev_reset_in();
+    return -1;
+  }
+  m->set_throttler(policy.throttler);
+  m->set_dispatch_throttle_size(ev_msg_size);
+  note_recv_message();
+
+  // the message owns the throttle reservation now
+  ev_policy_throttled = ev_dispatch_throttled = false;
+  ev_reset_in();
+
+  pipe_lock.Lock();
+  if (state == STATE_CLOSED ||
+      state == STATE_CONNECTING) {
+    msgr->dispatch_throttle_release(m->get_dispatch_throttle_size());
+    m->put();
+  } else if (m->get_seq() <= in_seq) {
+    ldout(msgr->cct,0) << "event reader got old message "
+		       << m->get_seq() << " <= " << in_seq << " " << m << " " << *m
+		       << ", discarding" << dendl;
+    msgr->dispatch_throttle_release(m->get_dispatch_throttle_size());
+    m->put();
+  } else {
+    m->set_connection(connection_state->get());
+    in_seq = m->get_seq();
+    ldout(msgr->cct,10) << "event reader got message "
+			<< m->get_seq() << " " << m << " " << *m
+			<< dendl;
+    if (!halt_delivery && msgr->ms_can_fast_dispatch(m)) {
+      pipe_lock.Unlock();
+      msgr->fast_dispatch(m);
+      return 0;
+    }
+    queue_received(m);
+  }
+  pipe_lock.Unlock();
+  return 0;
+}
+
+/*
+ * Consume whatever the socket has for us.  Returns 0 once it is
+ * drained, 1 if we stopped because a throttler is full (the worker
+ * tries again shortly), or -1 if the pipe should leave the event loop.
+ */
+int SimpleMessenger::Pipe::event_read()
+{
+  ev_last_rx = ceph_clock_now(msgr->cct);
+
+  if (msgr->cct->_conf->ms_inject_socket_failures) {
+    if (rand() % msgr->cct->_conf->ms_inject_socket_failures == 0) {
+      ldout(msgr->cct,0) << "injecting socket failure" << dendl;
+      shutdown_socket();
+    }
+  }
+
+  while (true) {
+    int r;
+    switch (ev_in_state) {
+    case EV_IN_TAG:
+      r = ev_fill(ev_in_buf, 1);
+      if (r <= 0)
+	return r;
+      ev_in_have = 0;
+      switch (ev_in_buf[0]) {
+      case CEPH_MSGR_TAG_KEEPALIVE:
+	ldout(msgr->cct,20) << "event reader got KEEPALIVE" << dendl;
+	break;
+      case CEPH_MSGR_TAG_ACK:
+	ldout(msgr->cct,20) << "event reader got ACK" << dendl;
+	ev_in_state = EV_IN_ACK;
+	break;
+      case CEPH_MSGR_TAG_MSG:
+	ldout(msgr->cct,20) << "event reader got MSG" << dendl;
+	ev_in_state = EV_IN_HEADER;
+	break;
+      case CEPH_MSGR_TAG_CLOSE:
+	ldout(msgr->cct,20) << "event reader got CLOSE" << dendl;
+	pipe_lock.Lock();
+	if (state == STATE_CLOSING)
+	  state = STATE_CLOSED;
+	else
+	  state = STATE_CLOSING;
+	pipe_lock.Unlock();
+	return -1;  // the writer thread answers with our CLOSE
+      default:
+	ldout(msgr->cct,0) << "event reader bad tag " << (int)ev_in_buf[0] << dendl;
+	return -1;
+      }
+      break;
+
+    case EV_IN_ACK:
+      r = ev_fill(ev_in_buf, sizeof(ceph_le64));
+      if (r <= 0)
+	return r;
+      ev_in_have = 0;
+      ev_in_state = EV_IN_TAG;
+      {
+	ceph_le64 seq;
+	memcpy(&seq, ev_in_buf, sizeof(seq));
+	pipe_lock.Lock();
+	if (state != STATE_CLOSED)
+	  handle_ack(seq);
+	pipe_lock.Unlock();
+      }
+      break;
+
+    case EV_IN_HEADER:
+      {
+	__u32 header_crc;
+	if (connection_state->has_feature(CEPH_FEATURE_NOSRCADDR)) {
+	  r = ev_fill(ev_in_buf, sizeof(ceph_msg_header));
+	  if (r <= 0)
+	    return r;
+	  memcpy(&ev_header, ev_in_buf, sizeof(ev_header));
+	  header_crc = ceph_crc32c_le(0, (unsigned char *)&ev_header,
+				      sizeof(ev_header) - sizeof(ev_header.crc));
+	} else {
+	  r = ev_fill(ev_in_buf, sizeof(ceph_msg_header_old));
+	  if (r <= 0)
+	    return r;
+	  ceph_msg_header_old oldheader;
+	  memcpy(&oldheader, ev_in_buf, sizeof(oldheader));
+	  memcpy(&ev_header, &oldheader, sizeof(ev_header));
+	  ev_header.src = oldheader.src.name;
+	  ev_header.reserved = oldheader.reserved;
+	  ev_header.crc = oldheader.crc;
+	  header_crc = ceph_crc32c_le(0, (unsigned char *)&oldheader,
+				      sizeof(oldheader) - sizeof(oldheader.crc));
+	}
+	ev_in_have = 0;
+
+	ldout(msgr->cct,20) << "event reader got envelope type=" << ev_header.type
+			    << " src " << entity_name_t(ev_header.src)
+			    << " front=" << ev_header.front_len
+			    << " data=" << ev_header.data_len
+			    << " off " << ev_header.data_off
+			    << dendl;
+	if (header_crc != ev_header.crc) {
+	  ldout(msgr->cct,0) << "event reader got bad header crc " << header_crc
+			     << " != " << ev_header.crc << dendl;
+	  return -1;
+	}
+	ev_msg_size = ev_header.front_len + ev_header.middle_len + ev_header.data_len;
+	ev_in_state = EV_IN_THROTTLE;
+      }
+      // fall through
+
+    case EV_IN_THROTTLE:
+      // same order as read_message(): the policy throttle, then dispatch
+      if (ev_msg_size) {
+	if (policy.throttler && !ev_policy_throttled) {
+	  if (!policy.throttler->get_or_fail(ev_msg_size)) {
+	    ldout(msgr->cct,10) << "event reader waiting for " << ev_msg_size << " from policy throttler "
+				<< policy.throttler->get_current() << "/"
+				<< policy.throttler->get_max() << dendl;
+	    return 1;
+	  }
+	  ev_policy_throttled = true;
+	}
+	if (!ev_dispatch_throttled) {
+	  if (!msgr->dispatch_throttler.get_or_fail(ev_msg_size)) {
+	    ldout(msgr->cct,10) << "event reader waiting for " << ev_msg_size << " from dispatch throttler "
+				<< msgr->dispatch_throttler.get_current() << "/"
+				<< msgr->dispatch_throttler.get_max() << dendl;
+	    return 1;
+	  }
+	  ev_dispatch_throttled = true;
+	}
+      }
+      ev_in_state = EV_IN_FRONT;
+      // fall through
+
+    case EV_IN_FRONT:
+      if (ev_header.front_len) {
+	if (!ev_in_bp.have_raw())
+	  ev_in_bp = buffer::create(ev_header.front_len);
+	r = ev_fill(ev_in_bp.c_str(), ev_header.front_len);
+	if (r <= 0)
+	  return r;
+	ev_front.push_back(ev_in_bp);
+	ev_in_bp = bufferptr();
+	ev_in_have = 0;
+      }
+      ev_in_state = EV_IN_MIDDLE;
+      // fall through
+
+    case EV_IN_MIDDLE:
+      if (ev_header.middle_len) {
+	if (!ev_in_bp.have_raw())
+	  ev_in_bp = buffer::create(ev_header.middle_len);
+	r = ev_fill(ev_in_bp.c_str(), ev_header.middle_len);
+	if (r <= 0)
+	  return r;
+	ev_middle.push_back(ev_in_bp);
+	ev_in_bp = bufferptr();
+	ev_in_have = 0;
+      }
+      ev_in_state = EV_IN_DATA;
+      // fall through
+
+    case EV_IN_DATA:
+      r = ev_read_data();
+      if (r <= 0)
+	return r;
+      ev_in_state = EV_IN_FOOTER;
+      // fall through
+
+    case EV_IN_FOOTER:
+      r = ev_fill(ev_in_buf, sizeof(ceph_msg_footer));
+      if (r <= 0)
+	return r;
+      ev_in_have = 0;
+      if (ev_finish_message() < 0)
+	return -1;
+      break;
+
+    default:
+      assert(0);
+    }
+  }
+}
+
+void SimpleMessenger::Pipe::ev_append_message(Message *m)
+{
+  ceph_msg_header& header = m->get_header();
+  ceph_msg_footer& footer = m->get_footer();
+
+  header.front_len = m->get_payload().length();
+  header.middle_len = m->get_middle().length();
+  header.data_len = m->get_data().length();
+  footer.flags = CEPH_MSG_FOOTER_COMPLETE;
+  m->calc_header_crc();
+
+  ldout(msgr->cct,20) << "event writer queueing " << m->get_seq() << " " << m << dendl;
+
+  ev_out.append((char)CEPH_MSGR_TAG_MSG);
+  if (connection_state->has_feature(CEPH_FEATURE_NOSRCADDR)) {
+    ev_out.append((char*)&header, sizeof(header));
+  } else {
+    ceph_msg_header_old oldheader;
+    memcpy(&oldheader, &header, sizeof(header));
+    oldheader.src.name = header.src;
+    oldheader.src.addr = connection_state->get_peer_addr();
+    oldheader.orig_src = oldheader.src;
+    oldheader.reserved = header.reserved;
+    oldheader.crc = ceph_crc32c_le(0, (unsigned char*)&oldheader,
+				   sizeof(oldheader) - sizeof(oldheader.crc));
+    ev_out.append((char*)&oldheader, sizeof(oldheader));
+  }
+  ev_out.append(m->get_payload());
+  ev_out.append(m->get_middle());
+  ev_out.append(m->get_data());
+  ev_out.append((char*)&footer, sizeof(footer));
+  if (msgr->logger)
+    msgr->logger->inc(l_msgr_send_msgs);
+}
+
+/*
+ * Push ev_out into the socket.  Returns 0 when it is empty, 1 if the
+ * socket is full, -1 on error.
+ */
+int SimpleMessenger::Pipe::ev_flush()
+{
+  char buf[80];
+  while (ev_out.length()) {
+    struct iovec iov[64];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    int n = 0;
+    for (list<bufferptr>::const_iterator p = ev_out.buffers().begin();
+	 p != ev_out.buffers().end() && n < 64;
+	 ++p) {
+      if (!p->length())
+	continue;
+      iov[n].iov_base = (void*)p->c_str();
+      iov[n].iov_len = p->length();
+      n++;
+    }
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    int r = ::sendmsg(sd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (msgr->logger) {
+      msgr->logger->inc(l_msgr_send_syscalls);
+      if (r > 0)
+	msgr->logger->inc(l_msgr_send_bytes, r);
+    }
+    if (r < 0) {
+      if (errno == EINTR)
+	continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	return 1;
+      ldout(msgr->cct,1) << "event writer error " << strerror_r(errno, buf, sizeof(buf)) << dendl;
+      return -1;
+    }
+    ldout(msgr->cct,30) << "event writer sent " << r << " of " << ev_out.length() << dendl;
+    ev_out.splice(0, r);
+  }
+  return 0;
+}
+
+/*
+ * Queue what writer() would send next and flush.  Returns 0 when all
+ * of it went out, 1 if the socket is full, or -1 if the pipe should
+ * leave the event loop.  New messages are only taken once the previous
+ * batch is out, so a slow peer does not pile up encoded messages here.
+ */
+int SimpleMessenger::Pipe::event_write()
+{
+  static const unsigned max_batch = 16;
+  list<Message*> batch;
+  bool idle = ev_out.length() == 0;
+
+  pipe_lock.Lock();
+  if (state != STATE_OPEN) {
+    pipe_lock.Unlock();
+    return -1;
+  }
+  if (keepalive) {
+    ldout(msgr->cct,10) << "event writer keepalive" << dendl;
+    ev_out.append((char)CEPH_MSGR_TAG_KEEPALIVE);
+    keepalive = false;
+  }
+  if (in_seq > in_seq_acked) {
+    ldout(msgr->cct,10) << "event writer ack " << in_seq << dendl;
+    ceph_le64 s;
+    s = in_seq;
+    ev_out.append((char)CEPH_MSGR_TAG_ACK);
+    ev_out.append((char*)&s, sizeof(s));
+    in_seq_acked = in_seq;
+  }
+  if (idle) {
+    while (batch.size() < max_batch) {
+      Message *m = _get_next_outgoing();
+      if (!m)
+	break;
+      m->set_seq(++out_seq);
+      if (!policy.lossy || close_on_empty) {
+	// put on sent list
+	sent.push_back(m);
+	m->get();
+      }
+      batch.push_back(m);
+    }
+  }
+  if (batch.empty() && ev_out.length() == 0 &&
+      sent.empty() && close_on_empty) {
+    // this is slightly hacky
+    ldout(msgr->cct,10) << "event writer out and sent queues empty, closing" << dendl;
+    policy.lossy = true;
+    fault();
+    pipe_lock.Unlock();
+    return -1;
+  }
+  pipe_lock.Unlock();
+
+  while (!batch.empty()) {
+    Message *m = batch.front();
+    batch.pop_front();
+    // associate message with Connection (for benefit of encode_payload)
+    m->set_connection(connection_state->get());
+    m->encode(msgr->cct);
+    ev_append_message(m);
+    m->put();
+  }
+  return ev_flush();
+}
+
+
 /********************************************
  * SimpleMessenger
  */
@@ -2367,8 +3173,16 @@ int SimpleMessenger::start_with_nonce(uint64_t nonce)
   if (!did_bind)
     ms_addr.nonce = nonce;
 
+  start_logger();
   lock.Unlock();
 
+  start_fast_dispatch();
+
+  int r = start_event_workers();
+  if (r < 0)
+    lderr(cct) << "messenger.start could not start event workers: " << cpp_strerror(r)
+	       << ", using a reader and writer thread per pipe" << dendl;
+
   if (did_bind)
     accepter.start();
 
@@ -2378,6 +3192,31 @@ int SimpleMessenger::start_with_nonce(uint64_t nonce)
 }
 
 
+void SimpleMessenger::start_logger()
+{
+  assert(!logger);
+  ostringstream name;
+  name << "msgr." << get_myname() << "." << ms_addr;
+  PerfCountersBuilder plb(cct, name.str(), l_msgr_first, l_msgr_last);
+  plb.add_u64_counter(l_msgr_recv_msgs, "recv_msgs");
+  plb.add_u64_counter(l_msgr_recv_bytes, "recv_bytes");
+  plb.add_u64_counter(l_msgr_recv_syscalls, "recv_syscalls");
+  plb.add_fl_avg(l_msgr_recv_syscalls_per_msg, "recv_syscalls_per_msg");
+  plb.add_u64_counter(l_msgr_send_msgs, "send_msgs");
+  plb.add_u64_counter(l_msgr_send_bytes, "send_bytes");
+  plb.add_u64_counter(l_msgr_send_syscalls, "send_syscalls");
+  logger = plb.create_perf_counters();
+  cct->GetPerfCountersCollection()->logger_add(logger);
+}
+
+void SimpleMessenger::stop_logger()
+{
+  if (logger) {
+    cct->GetPerfCountersCollection()->logger_remove(logger);
+    logger = NULL;
+  }
+}
+
 /* connect_rank
  * NOTE: assumes messenger.lock held.
  */
@@ -2665,6 +3504,10 @@ void SimpleMessenger::wait()
   }
   lock.Unlock();
 
+  stop_event_workers();
+  stop_fast_dispatch();
+  stop_logger();
+
   ldout(cct,10) << "wait: done." << dendl;
   ldout(cct,1) << "shutdown complete." << dendl;
   started = false;
@@ -2779,3 +3622,321 @@ void SimpleMessenger::init_local_pipe()
   dispatch_queue.local_pipe->connection_state->peer_addr = msgr->ms_addr;
   dispatch_queue.local_pipe->connection_state->peer_type = msgr->my_type;
 }
+
+
+
+int SimpleMessenger::start_event_workers()
+{
+  int n = cct->_conf->ms_event_workers;
+  if (n <= 0)
+    return 0;
+#ifdef DARWIN
+  return -EOPNOTSUPP;
+#else
+  assert(event_workers.empty());
+  for (int i = 0; i < n; i++) {
+    EventWorker *w = new EventWorker(this);
+    int r = w->init();
+    if (r < 0) {
+      delete w;
+      stop_event_workers();
+      return r;
+    }
+    w->create();
+    event_workers.push_back(w);
+  }
+  num_event_workers.add(n);
+  ldout(cct,1) << "started " << n << " event workers" << dendl;
+  return 0;
+#endif
+}
+
+void SimpleMessenger::stop_event_workers()
+{
+  num_event_workers.sub(num_event_workers.read());
+  while (!event_workers.empty()) {
+    EventWorker *w = event_workers.back();
+    event_workers.pop_back();
+    w->stop();
+    delete w;
+  }
+}
+
+
+/********************************************
+ * EventWorker
+ */
+#undef dout_prefix
+#define dout_prefix _prefix(_dout, msgr) << "event_worker(" << this << ") "
+
+int SimpleMessenger::EventWorker::init()
+{
+#ifdef DARWIN
+  return -EOPNOTSUPP;
+#else
+  epfd = ::epoll_create(64);
+  if (epfd < 0)
+    return -errno;
+  if (::pipe(wake_fd) < 0) {
+    int r = -errno;
+    ::close(epfd);
+    epfd = -1;
+    return r;
+  }
+  ::fcntl(wake_fd[0], F_SETFL, O_NONBLOCK);
+  ::fcntl(wake_fd[1], F_SETFL, O_NONBLOCK);
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;  // the wakeup pipe
+  if (::epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd[0], &ev) < 0)
+    return -errno;
+  return 0;
+#endif
+}
+
+SimpleMessenger::EventWorker::~EventWorker()
+{
+  if (epfd >= 0)
+    ::close(epfd);
+  if (wake_fd[0] >= 0) {
+    ::close(wake_fd[0]);
+    ::close(wake_fd[1]);
+  }
+}
+
+void SimpleMessenger::EventWorker::stop()
+{
+  ldout(msgr->cct,10) << "stop" << dendl;
+  lock.Lock();
+  done = true;
+  lock.Unlock();
+  wakeup();
+  if (is_started())
+    join();
+
+  // normally the messenger reaped every pipe before stopping us
+  while (!pipes.empty()) {
+    Pipe *p = *pipes.begin();
+    detach(p);
+  }
+}
+
+void SimpleMessenger::EventWorker::wakeup()
+{
+  char c = 0;
+  int r = ::write(wake_fd[1], &c, 1);
+  r++; r = 0; // placate gcc; a full pipe is already a wakeup
+}
+
+/*
+ * Called with p->pipe_lock held.
+ */
+int SimpleMessenger::EventWorker::add_pipe(Pipe *p)
+{
+#ifdef DARWIN
+  return -EOPNOTSUPP;
+#else
+  ldout(msgr->cct,10) << "add_pipe " << p << " sd " << p->sd << dendl;
+  p->get();
+  lock.Lock();
+  pipes.insert(p);
+  kicked.insert(p);  // flush anything already queued
+  lock.Unlock();
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = p;
+  p->ev_events = ev.events;
+  if (::epoll_ctl(epfd, EPOLL_CTL_ADD, p->sd, &ev) < 0) {
+    int r = -errno;
+    lderr(msgr->cct) << "add_pipe epoll_ctl on sd " << p->sd << ": " << cpp_strerror(r) << dendl;
+    lock.Lock();
+    pipes.erase(p);
+    kicked.erase(p);
+    lock.Unlock();
+    p->put();
+    return r;
+  }
+  wakeup();
+  return 0;
+#endif
+}
+
+/*
+ * Called with p->pipe_lock held when p has something to send.
+ */
+void SimpleMessenger::EventWorker::kick(Pipe *p)
+{
+  lock.Lock();
+  kicked.insert(p);
+  bool wake = !wake_pending;
+  wake_pending = true;
+  lock.Unlock();
+  if (wake)
+    wakeup();
+}
+
+bool SimpleMessenger::EventWorker::is_attached(Pipe *p)
+{
+  Mutex::Locker l(lock);
+  return pipes.count(p);
+}
+
+void SimpleMessenger::EventWorker::update_events(Pipe *p)
+{
+#ifndef DARWIN
+  uint32_t want = 0;
+  if (!p->ev_throttled)
+    want |= EPOLLIN;
+  if (p->ev_out.length())
+    want |= EPOLLOUT;
+  if (want == p->ev_events)
+    return;
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = want;
+  ev.data.ptr = p;
+  if (::epoll_ctl(epfd, EPOLL_CTL_MOD, p->sd, &ev) < 0) {
+    int r = -errno;
+    lderr(msgr->cct) << "update_events epoll_ctl on sd " << p->sd << ": " << cpp_strerror(r) << dendl;
+    assert(0);
+  }
+  p->ev_events = want;
+#endif
+}
+
+void SimpleMessenger::EventWorker::handle(Pipe *p, bool readable, bool writable)
+{
+  int r = 0;
+  if (readable) {
+    r = p->event_read();
+    if (r == 1) {
+      p->ev_throttled = true;
+      throttled.insert(p);
+    } else if (p->ev_throttled) {
+      p->ev_throttled = false;
+      throttled.erase(p);
+    }
+  }
+  // always try to write after reading: there may be an ack to send
+  if (r >= 0 && (readable || writable || p->ev_out.length()))
+    r = p->event_write() < 0 ? -1 : 0;
+
+  if (r < 0) {
+    detach(p);
+    return;
+  }
+  update_events(p);
+}
+
+void SimpleMessenger::EventWorker::detach(Pipe *p)
+{
+  ldout(msgr->cct,10) << "detach " << p << " sd " << p->sd << dendl;
+  p->pipe_lock.Lock();
+  lock.Lock();
+  pipes.erase(p);
+  kicked.erase(p);
+  lock.Unlock();
+  throttled.erase(p);
+#ifndef DARWIN
+  ::epoll_ctl(epfd, EPOLL_CTL_DEL, p->sd, NULL);
+#endif
+  p->event_detached();  // drops pipe_lock
+  p->put();
+}
+
+/*
+ * Honor ms_tcp_read_timeout the way tcp_read() does for a reader
+ * thread: fault pipes we have not heard from in that long.
+ */
+void SimpleMessenger::EventWorker::check_idle()
+{
+  uint64_t timeout = msgr->cct->_conf->ms_tcp_read_timeout;
+  if (!timeout)
+    return;
+  utime_t now = ceph_clock_now(msgr->cct);
+  if (now - last_idle_check < utime_t(1, 0))
+    return;
+  last_idle_check = now;
+
+  list<Pipe*> idle;
+  lock.Lock();
+  for (set<Pipe*>::iterator p = pipes.begin(); p != pipes.end(); ++p)
+    if (now - (*p)->ev_last_rx > utime_t(timeout, 0))
+      idle.push_back(*p);
+  lock.Unlock();
+
+  for (list<Pipe*>::iterator p = idle.begin(); p != idle.end(); ++p) {
+    ldout(msgr->cct,2) << "pipe " << *p << " idle for more than " << timeout << "s, faulting" << dendl;
+    (*p)->shutdown_socket();
+    detach(*p);
+  }
+}
+
+void *SimpleMessenger::EventWorker::entry()
+{
+#ifndef DARWIN
+  static const int max_events = 128;
+  struct epoll_event events[max_events];
+
+  ldout(msgr->cct,10) << "entry start" << dendl;
+  lock.Lock();
+  while (!done) {
+    int timeout = -1;
+    if (!throttled.empty())
+      timeout = 10;
+    else if (!pipes.empty())
+      timeout = 1000;
+    lock.Unlock();
+
+    int n = ::epoll_wait(epfd, events, max_events, timeout);
+    if (n < 0 && errno != EINTR) {
+      char buf[80];
+      lderr(msgr->cct) << "epoll_wait: " << strerror_r(errno, buf, sizeof(buf)) << dendl;
+      assert(0);
+    }
+
+    for (int i = 0; i < n; i++) {
+      Pipe *p = (Pipe *)events[i].data.ptr;
+      if (!p) {
+	char c[64];
+	while (::read(wake_fd[0], c, sizeof(c)) > 0) ;
+	continue;
+      }
+      if (!is_attached(p))
+	continue;  // detached earlier in this batch
+      handle(p,
+	     events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP),
+	     events[i].events & EPOLLOUT);
+    }
+
+    // output queued by other threads
+    set<Pipe*> ready;
+    lock.Lock();
+    ready.swap(kicked);
+    wake_pending = false;
+    lock.Unlock();
+    for (set<Pipe*>::iterator p = ready.begin(); p != ready.end(); ++p)
+      if (is_attached(*p))
+	handle(*p, false, true);
+
+    // retry pipes waiting on a throttler
+    if (!throttled.empty()) {
+      set<Pipe*> retry = throttled;
+      for (set<Pipe*>::iterator p = retry.begin(); p != retry.end(); ++p)
+	if (is_attached(*p))
+	  handle(*p, true, false);
+    }
+
+    check_idle();
+    lock.Lock();
+  }
+  lock.Unlock();
+  ldout(msgr->cct,10) << "entry done" << dendl;
+#endif
+  return 0;
+}
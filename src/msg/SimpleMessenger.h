@@ -35,6 +35,19 @@ using namespace __gnu_cxx;
 #include "Message.h"
 #include "tcp.h"
 
+class PerfCounters;
+
+enum {
+  l_msgr_first = 30000,
+  l_msgr_recv_msgs,
+  l_msgr_recv_bytes,
+  l_msgr_recv_syscalls,
+  l_msgr_recv_syscalls_per_msg,
+  l_msgr_send_msgs,
+  l_msgr_send_bytes,
+  l_msgr_send_syscalls,
+  l_msgr_last,
+};
 
 /*
  * This class handles transmission and reception of messages. Generally
@@ -46,6 +59,25 @@ using namespace __gnu_cxx;
  *    pipe maintains its own message ordering, but the SimpleMessenger
  *    decides what order pipes get to deliver messages in.
  *
+ * With ms_event_workers > 0, a pipe only has threads of its own while it
+ * is handshaking or recovering from a fault.  Once it is open its socket
+ * is handed to one of a small pool of EventWorkers, each an epoll loop
+ * that drives the reads and writes of many pipes without blocking; see
+ * Pipe::event_read() and Pipe::event_write().  The wire protocol, the
+ * policies and throttles, and what the Dispatchers see are the same
+ * either way.
+ *
+ * Either way, input goes through a small per-pipe receive buffer (see
+ * Pipe::buffered_recv()), so a run of small messages costs one recv(2)
+ * rather than four or more each.  The "msgr.*" perf counters show how
+ * many system calls each message ends up taking.
+ *
+ * Messages a Dispatcher claims with ms_can_fast_dispatch() skip the
+ * dispatch queue and its single thread: they are delivered right away
+ * by whoever read them, or by one of ms_fast_dispatch_threads threads
+ * picked by connection, so each connection's fast messages stay in
+ * order.
+ *
  * This class should only be created on the heap, and it should be destroyed
  * via a call to destroy(). Making it on the stack or otherwise calling
  * the destructor will lead to badness.
@@ -59,7 +91,10 @@ using namespace __gnu_cxx;
   CEPH_FEATURE_FLOCK |           \
   CEPH_FEATURE_RECONNECT_SEQ |   \
   CEPH_FEATURE_DIRLAYOUTHASH |   \
-  CEPH_FEATURE_OBJECTLOCATOR
+  CEPH_FEATURE_OBJECTLOCATOR |   \
+  CEPH_FEATURE_CHUNKY_SCRUB |    \
+  CEPH_FEATURE_DEEP_SCRUB |      \
+  CEPH_FEATURE_OSD_COPY_FROM
 
 class SimpleMessenger : public Messenger {
 public:
@@ -92,6 +127,7 @@ public:
 
 private:
   class Pipe;
+  class EventWorker;
 
   // incoming
   class Accepter : public Thread {
@@ -143,6 +179,7 @@ private:
 
     bool reader_running, reader_joining;
     bool writer_running;
+    bool event_running;        // an EventWorker owns sd; counts like a thread
 
     map<int, list<Message*> > out_q;  // priority queue for outbound msgs
     map<int, list<Message*> > in_q; // and inbound ones
@@ -159,12 +196,68 @@ private:
     uint64_t out_seq;
     uint64_t in_seq, in_seq_acked;
     
-    int accept();   // server handshake
+    int accept();   // server handshake; 1 if sd went to an EventWorker
     int connect();  // client handshake
     void reader();
     void writer();
     void unlock_maybe_reap();
 
+    // event-driven i/o; everything but event_attach() is called only
+    // from the owning EventWorker's thread
+    enum {
+      EV_IN_TAG,
+      EV_IN_ACK,
+      EV_IN_HEADER,
+      EV_IN_THROTTLE,
+      EV_IN_FRONT,
+      EV_IN_MIDDLE,
+      EV_IN_DATA,
+      EV_IN_FOOTER,
+    };
+    EventWorker *event_worker;
+    int ev_in_state;
+    char ev_in_buf[sizeof(ceph_msg_header_old)];  // tag, ack, header or footer
+    unsigned ev_in_have;                          // bytes of the current piece
+    ceph_msg_header ev_header;
+    uint64_t ev_msg_size;
+    bool ev_policy_throttled, ev_dispatch_throttled;
+    bufferptr ev_in_bp;
+    bufferlist ev_front, ev_middle, ev_data, ev_newbuf, ev_rxbuf;
+    bufferlist::iterator ev_blp;
+    int ev_rxbuf_version;
+    bufferlist ev_out;       // encoded but not yet sent
+    uint32_t ev_events;      // what we are registered for with epoll
+    bool ev_throttled;
+    utime_t ev_last_rx;
+
+    bool event_attach();
+    void event_detached();
+    int event_read();
+    int event_write();
+    int ev_fill(char *buf, unsigned want);
+    int ev_read_data();
+    int ev_finish_message();
+    void ev_reset_in();
+    void ev_append_message(Message *m);
+    int ev_flush();
+
+    // input buffering, shared by reader() and the EventWorker (only
+    // one of them has sd at a time)
+    char *recv_buf;
+    int recv_max_prefetch;
+    int recv_ofs, recv_len;      // unread bytes are recv_buf[recv_ofs, recv_len)
+    unsigned recv_syscalls;      // since the last complete message
+    uint64_t recv_bytes;
+
+    int do_recv(char *buf, int len);
+    int buffered_recv(char *buf, int len);
+    int buffered_read_wait();
+    int buffered_read(char *buf, int len);
+    void discard_recv_buffer() {
+      recv_ofs = recv_len = 0;
+    }
+    void note_recv_message();
+
     int read_message(Message **pm);
     int write_message(Message *m);
     int do_sendmsg(int sd, struct msghdr *msg, int len, bool more=false);
@@ -226,11 +319,19 @@ private:
       state(st), 
       connection_state(new Connection),
       reader_running(false), reader_joining(false), writer_running(false),
+      event_running(false),
       in_qlen(0), keepalive(false), halt_delivery(false), 
       close_on_empty(false), disposable(false),
       connect_seq(0), peer_global_seq(0),
       out_seq(0), in_seq(0), in_seq_acked(0),
+      event_worker(NULL), ev_in_state(EV_IN_TAG), ev_in_have(0), ev_msg_size(0),
+      ev_policy_throttled(false), ev_dispatch_throttled(false),
+      ev_rxbuf_version(0), ev_events(0), ev_throttled(false),
+      recv_buf(NULL), recv_max_prefetch(MAX(msgr->cct->_conf->ms_tcp_prefetch_max_size, 0)),
+      recv_ofs(0), recv_len(0), recv_syscalls(0), recv_bytes(0),
       reader_thread(this), writer_thread(this) {
+      if (recv_max_prefetch)
+	recv_buf = new char[recv_max_prefetch];
       connection_state->pipe = get();
       msgr->timeout = msgr->cct->_conf->ms_tcp_read_timeout * 1000; //convert to ms
       if (msgr->timeout == 0)
@@ -247,18 +348,23 @@ private:
       assert(sent.empty());
       if (connection_state)
         connection_state->put();
+      delete[] recv_buf;
     }
 
 
     void start_reader() {
       assert(pipe_lock.is_locked());
       assert(!reader_running);
+      if (reader_thread.is_started())
+	reader_thread.join();  // exited after handing sd to an EventWorker
       reader_running = true;
       reader_thread.create(msgr->cct->_conf->ms_rwthread_stack_bytes);
     }
     void start_writer() {
       assert(pipe_lock.is_locked());
       assert(!writer_running);
+      if (writer_thread.is_started())
+	writer_thread.join();  // exited after handing sd to an EventWorker
       writer_running = true;
       writer_thread.create(msgr->cct->_conf->ms_rwthread_stack_bytes);
     }
@@ -328,6 +434,8 @@ private:
     void _send(Message *m) {
       out_q[m->get_priority()].push_back(m);
       cond.Signal();
+      if (event_worker)
+	event_worker->kick(this);
     }
     void send_keepalive() {
       pipe_lock.Lock();
@@ -337,6 +445,8 @@ private:
     void _send_keepalive() {
       keepalive = true;
       cond.Signal();
+      if (event_worker)
+	event_worker->kick(this);
     }
     Message *_get_next_outgoing() {
       Message *m = 0;
@@ -364,6 +474,51 @@ private:
   };
 
 
+  /*
+   * An epoll loop serving the sockets of open pipes.  A pipe is attached
+   * (with pipe_lock held) once its handshake is done and is detached by
+   * the worker itself when it faults or closes, at which point the pipe
+   * goes back to its writer thread to reconnect, linger or close.
+   *
+   * lock only covers the sets touched by other threads; it is taken
+   * under pipe_lock, never the other way around.
+   */
+  class EventWorker : public Thread {
+    SimpleMessenger *msgr;
+    int epfd;
+    int wake_fd[2];
+    Mutex lock;
+    bool done;
+    bool wake_pending;
+    set<Pipe*> pipes;        // attached; we hold a ref on each
+    set<Pipe*> kicked;       // have output queued
+    set<Pipe*> throttled;    // waiting on a throttler; worker thread only
+    utime_t last_idle_check;
+
+    void wakeup();
+    bool is_attached(Pipe *p);
+    void handle(Pipe *p, bool readable, bool writable);
+    void update_events(Pipe *p);
+    void detach(Pipe *p);
+    void check_idle();
+
+  public:
+    EventWorker(SimpleMessenger *m) :
+      msgr(m), epfd(-1), lock("SimpleMessenger::EventWorker::lock"),
+      done(false), wake_pending(false) {
+      wake_fd[0] = wake_fd[1] = -1;
+    }
+    ~EventWorker();
+
+    int init();
+    void stop();
+    void *entry();
+
+    int add_pipe(Pipe *p);
+    void kick(Pipe *p);
+  };
+
+
   struct DispatchQueue {
     Mutex lock;
     Cond cond;
@@ -428,6 +583,43 @@ private:
 
   void dispatch_throttle_release(uint64_t msize);
 
+  // event workers, if ms_event_workers > 0.  they are started before the
+  // accepter and stopped after the last pipe is reaped.
+  vector<EventWorker*> event_workers;
+  atomic_t num_event_workers;    // how many of event_workers are running
+  atomic_t next_event_worker;
+
+  EventWorker *pick_event_worker() {
+    unsigned n = num_event_workers.read();
+    if (!n)
+      return NULL;
+    return event_workers[next_event_worker.inc() % n];
+  }
+  int start_event_workers();
+  void stop_event_workers();
+
+  // fast dispatch threads, if ms_fast_dispatch_threads > 0
+  class FastDispatchThread : public Thread {
+    SimpleMessenger *msgr;
+    Mutex lock;
+    Cond cond;
+    bool stop;
+    list<Message*> q;
+  public:
+    FastDispatchThread(SimpleMessenger *m)
+      : msgr(m), lock("SimpleMessenger::FastDispatchThread::lock"), stop(false) {}
+    void queue(Message *m);
+    void shutdown();
+    void *entry();
+  };
+  vector<FastDispatchThread*> fast_dispatch_threads;
+
+  void start_fast_dispatch();
+  void stop_fast_dispatch();
+  void fast_dispatch(Message *m);
+  void deliver_message(Message *m, bool fast);
+  void drop_message(Message *m);
+
   // SimpleMessenger stuff
  public:
   Mutex lock;
@@ -554,6 +746,10 @@ private:
   SimpleMessenger *msgr; //hack to make dout macro work, will fix
   int timeout;
 
+  PerfCounters *logger;
+  void start_logger();
+  void stop_logger();
+
 public:
   SimpleMessenger(CephContext *cct) :
     Messenger(cct, entity_name_t()),
@@ -563,7 +759,7 @@ public:
     destination_stopped(true), my_type(-1),
     global_seq_lock("SimpleMessenger::global_seq_lock"), global_seq(0),
     reaper_thread(this), reaper_started(false), reaper_stop(false), 
-    dispatch_thread(this), msgr(this) {
+    dispatch_thread(this), msgr(this), logger(NULL) {
     // for local dmsg delivery
     dispatch_queue.local_pipe = new Pipe(this, Pipe::STATE_OPEN);
   }
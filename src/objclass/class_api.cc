@@ -133,7 +133,7 @@ int cls_setxattr(cls_method_context_t hctx, const char *name,
 
   op.op.op = CEPH_OSD_OP_SETXATTR;
   op.data.append(name);
-  op.data.append(value);
+  op.data.append(value, val_len);
   op.op.xattr.name_len = strlen(name);
   op.op.xattr.value_len = val_len;
   r = (*pctx)->pg->do_osd_ops(*pctx, nops, odata);
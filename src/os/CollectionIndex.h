@@ -0,0 +1,114 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2004-2006 Sage Weil <sage@newdream.net>
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OS_COLLECTIONINDEX_H
+#define CEPH_OS_COLLECTIONINDEX_H
+
+#include <string>
+#include <vector>
+#include <tr1/memory>
+
+#include "include/types.h"
+#include "common/Mutex.h"
+#include "common/RWLock.h"
+#include "osd/osd_types.h"
+#include "ObjectStore.h"
+
+/**
+ * Maps the objects of a collection onto files below the collection
+ * directory.
+ *
+ * Callers hold access_lock for read while using a path returned by
+ * lookup(), and while removing an object with unlink().  Creating an
+ * object also needs create_lock around the lookup() and created() pair,
+ * so that two creates can't pick the same slot.  access_lock is taken
+ * for write only when the tree underneath other paths has to change: a
+ * split that created() asks for, or an unlink() that has to move
+ * another object into the slot it frees.  Directories are never merged.
+ */
+class CollectionIndex {
+public:
+  /// on-disk layout tags, stored in the collection dir's version xattr
+  static const uint32_t FLAT_INDEX_TAG = 0;
+  static const uint32_t HASH_INDEX_TAG = 1;
+
+  RWLock access_lock;
+  Mutex create_lock;
+
+  CollectionIndex() : access_lock("CollectionIndex::access_lock"),
+		      create_lock("CollectionIndex::create_lock") {}
+  virtual ~CollectionIndex() {}
+
+  /// layout tag of this index
+  virtual uint32_t collection_version() = 0;
+
+  /// collection this index covers
+  virtual coll_t coll() const = 0;
+
+  /// set up the on-disk layout of a freshly created collection
+  virtual int init() = 0;
+
+  /// finish anything interrupted by a crash (e.g. a directory split)
+  virtual int cleanup() = 0;
+
+  /**
+   * Find the path for oid, whether or not it exists yet.
+   *
+   * @param exist [out] set to 1 if the object exists; may be NULL, in
+   *        which case the index avoids any syscall needed only to
+   *        establish existence.
+   */
+  virtual int lookup(const sobject_t &oid, std::string *path, int *exist) = 0;
+
+  /**
+   * Note that oid was just created at path (as returned by lookup).
+   *
+   * @return 1 if the directory oid went into should now be split, which
+   *         the caller does with split() once it holds access_lock for
+   *         write; 0 if not; or -errno
+   */
+  virtual int created(const sobject_t &oid, const char *path) = 0;
+
+  /// split the directory holding oid, if it is still over full
+  virtual int split(const sobject_t &oid) { return 0; }
+
+  /**
+   * Remove oid from the collection.
+   *
+   * @param exclusive set if the caller holds access_lock for write
+   * @return 1 if removing oid means moving another object, which the
+   *         caller does by calling unlink() again with exclusive set
+   *         once it holds access_lock for write; 0; or -errno
+   */
+  virtual int unlink(const sobject_t &oid, bool exclusive) = 0;
+
+  /// list every object in the collection
+  virtual int collection_list(vector<sobject_t> *ls) = 0;
+
+  /**
+   * List up to max_count objects with snap >= seq, resuming from *handle.
+   * A zero handle starts at the beginning; *handle is left at 0 once the
+   * listing is complete.
+   */
+  virtual int collection_list_partial(snapid_t seq, int max_count,
+				      vector<sobject_t> *ls,
+				      collection_list_handle_t *handle) = 0;
+
+  /// remove index-private structure so that the collection dir can be rmdir'd
+  virtual int prep_delete() { return 0; }
+};
+
+typedef std::tr1::shared_ptr<CollectionIndex> Index;
+
+#endif
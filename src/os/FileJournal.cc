@@ -21,6 +21,7 @@
 #include "os/ObjectStore.h"
 
 #include <fcntl.h>
+#include <limits.h>
 #include <sstream>
 #include <stdio.h>
 #include <sys/types.h>
@@ -91,7 +92,8 @@ int FileJournal::_open(bool forwrite, bool create)
   dout(1) << "_open " << fn << " fd " << fd
 	  << ": " << max_size 
 	  << " bytes, block size " << block_size
-	  << " bytes, directio = " << directio << dendl;
+	  << " bytes, directio = " << directio
+	  << ", aio = " << aio << dendl;
   return 0;
 }
 
@@ -474,8 +476,41 @@ void FileJournal::close()
 
 void FileJournal::start_writer()
 {
+  if (aio) {
+#ifdef HAVE_LIBAIO
+    if (!directio) {
+      derr << "FileJournal::start_writer: aio requires directio, "
+	   << "falling back to synchronous writes" << dendl;
+      aio = false;
+    } else if (!aio_ctx_setup) {
+      // leave some headroom for a write split at the end of the ring
+      // and for bufferlists longer than IOV_MAX
+      aio_ctx = 0;
+      int r = io_setup(g_conf->journal_aio_max_inflight + 16, &aio_ctx);
+      if (r < 0) {
+	derr << "FileJournal::start_writer: io_setup failed: "
+	     << cpp_strerror(r) << ", falling back to synchronous writes" << dendl;
+	aio = false;
+      } else {
+	aio_ctx_setup = true;
+      }
+    }
+#else
+    derr << "FileJournal::start_writer: built without libaio, "
+	 << "falling back to synchronous writes" << dendl;
+    aio = false;
+#endif
+  }
+
   write_stop = false;
   write_thread.create();
+
+#ifdef HAVE_LIBAIO
+  if (aio) {
+    aio_stop = false;
+    write_finish_thread.create();
+  }
+#endif
 }
 
 void FileJournal::stop_writer()
@@ -487,6 +522,20 @@ void FileJournal::stop_writer()
   } 
   write_lock.Unlock();
   write_thread.join();
+
+#ifdef HAVE_LIBAIO
+  if (aio) {
+    // the finisher drains whatever is still in flight before exiting
+    write_lock.Lock();
+    aio_stop = true;
+    write_finish_cond.Signal();
+    write_lock.Unlock();
+    write_finish_thread.join();
+
+    io_destroy(aio_ctx);
+    aio_ctx_setup = false;
+  }
+#endif
 }
 
 
@@ -722,7 +771,7 @@ int FileJournal::prepare_single_write(bufferlist& bl, off64_t& queue_pos, uint64
   return 0;
 }
 
-int FileJournal::write_bl(off64_t& pos, bufferlist& bl)
+void FileJournal::align_bl(off64_t pos, bufferlist& bl)
 {
   // make sure list segments are page aligned
   if (directio && (!bl.is_page_aligned() ||
@@ -734,6 +783,11 @@ int FileJournal::write_bl(off64_t& pos, bufferlist& bl)
     assert((bl.length() & ~PAGE_MASK) == 0);
     assert((pos & ~PAGE_MASK) == 0);
   }
+}
+
+int FileJournal::write_bl(off64_t& pos, bufferlist& bl)
+{
+  align_bl(pos, bl);
 
   ::lseek64(fd, pos, SEEK_SET);
   int ret = bl.write_fd(fd);
@@ -871,10 +925,259 @@ void FileJournal::do_write(bufferlist& bl)
   }
 }
 
+#ifdef HAVE_LIBAIO
+/*
+ * aio path: the write thread carves the ring exactly as do_write()
+ * does, but hands each piece to the kernel and moves on, so that
+ * several journal writes can be in flight at once.  The finish thread
+ * reaps them and advances journaled_seq only over the completed prefix
+ * of aio_queue, so completions still fire in seq order.
+ */
+void FileJournal::do_aio_write(bufferlist& bl)
+{
+  // nothing to do?
+  if (bl.length() == 0 && !must_write_header) 
+    return;
+
+  buffer::ptr hbp;
+  if (must_write_header) {
+    must_write_header = false;
+    hbp = prepare_header();
+  }
+
+  dout(15) << "do_aio_write writing " << write_pos << "~" << bl.length() 
+	   << (hbp.length() ? " + header":"")
+	   << dendl;
+
+  // entry
+  off64_t pos = write_pos;
+
+  // split?
+  if (pos + bl.length() > header.max_size) {
+    bufferlist first, second;
+    off64_t split = header.max_size - pos;
+    first.substr_of(bl, 0, split);
+    second.substr_of(bl, split, bl.length() - split);
+    assert(first.length() + second.length() == bl.length());
+    dout(10) << "do_aio_write wrapping, first bit at " << pos << " len " << first.length()
+	     << " second bit len " << second.length() << " (orig len " << bl.length() << ")" << dendl;
+
+    // the first bit carries no seq; the entries it holds are only
+    // journaled once the second bit (queued behind it) completes too.
+    if (write_aio_bl(pos, first, 0)) {
+      derr << "FileJournal::do_aio_write: write_aio_bl(pos=" << pos
+	   << ") failed" << dendl;
+      ceph_abort();
+    }
+    assert(pos == header.max_size);
+    if (hbp.length()) {
+      // be sneaky: include the header in the second fragment
+      second.push_front(hbp);
+      pos = 0;          // we included the header
+    } else
+      pos = get_top();  // no header, start after that
+    if (write_aio_bl(pos, second, writing_seq)) {
+      derr << "FileJournal::do_aio_write: write_aio_bl(pos=" << pos
+	   << ") failed" << dendl;
+      ceph_abort();
+    }
+  } else {
+    // header too?
+    if (hbp.length()) {
+      bufferlist hbl;
+      hbl.push_back(hbp);
+      off64_t hpos = 0;
+      if (write_aio_bl(hpos, hbl, 0)) {
+	derr << "FileJournal::do_aio_write: write_aio_bl(header) failed" << dendl;
+	ceph_abort();
+      }
+    }
+
+    if (write_aio_bl(pos, bl, writing_seq)) {
+      derr << "FileJournal::do_aio_write: write_aio_bl(pos=" << pos
+	   << ") failed" << dendl;
+      ceph_abort();
+    }
+  }
+
+  // wrap if we hit the end of the journal
+  if (pos == header.max_size)
+    pos = get_top();
+  write_pos = pos;
+  assert(write_pos % header.alignment == 0);
+}
+
+/**
+ * queue bl for writing at pos, as one or more iocbs
+ *
+ * Called with write_lock held; drops it around io_submit.  Only the
+ * last iocb of bl carries seq.
+ */
+int FileJournal::write_aio_bl(off64_t& pos, bufferlist& bl, uint64_t seq)
+{
+  align_bl(pos, bl);
+
+  dout(20) << "write_aio_bl " << pos << "~" << bl.length() << " seq " << seq << dendl;
+
+  while (bl.length() > 0) {
+    int max = MIN(bl.buffers().size(), IOV_MAX-1);
+    iovec *iov = new iovec[max];
+    int n = 0;
+    unsigned len = 0;
+    for (std::list<buffer::ptr>::const_iterator p = bl.buffers().begin();
+	 n < max;
+	 ++p, ++n) {
+      assert(p != bl.buffers().end());
+      iov[n].iov_base = (void *)p->c_str();
+      iov[n].iov_len = p->length();
+      len += p->length();
+    }
+
+    bufferlist tbl;
+    bl.splice(0, len, &tbl);  // move bytes from bl -> tbl
+
+    aio_queue.push_back(aio_info(tbl, pos, bl.length() > 0 ? 0 : seq));
+    aio_info& aio = aio_queue.back();
+    aio.iov = iov;
+
+    io_prep_pwritev(&aio.iocb, fd, aio.iov, n, pos);
+
+    dout(20) << "write_aio_bl .. " << aio.off << "~" << aio.len
+	     << " in " << n << dendl;
+
+    aio_num++;
+    aio_bytes += aio.len;
+
+    // aio may be reaped and freed as soon as we drop the lock
+    off64_t off = aio.off;
+    uint64_t alen = aio.len;
+    iocb *piocb = &aio.iocb;
+    int attempts = 10;
+    write_lock.Unlock();
+    int r;
+    do {
+      r = io_submit(aio_ctx, 1, &piocb);
+      if (r == -EAGAIN && attempts-- > 0) {
+	usleep(500);
+	continue;
+      }
+      break;
+    } while (true);
+    write_lock.Lock();
+    if (r < 0) {
+      derr << "io_submit to " << off << "~" << alen
+	   << " got " << cpp_strerror(r) << dendl;
+      return r;
+    }
+    write_finish_cond.Signal();
+    pos += alen;
+  }
+  return 0;
+}
+
+void FileJournal::write_finish_thread_entry()
+{
+  dout(10) << "write_finish_thread_entry enter" << dendl;
+  while (true) {
+    {
+      Mutex::Locker locker(write_lock);
+      if (aio_queue.empty()) {
+	if (aio_stop)
+	  break;
+	dout(20) << "write_finish_thread_entry sleeping" << dendl;
+	write_finish_cond.Wait(write_lock);
+	continue;
+      }
+    }
+
+    dout(20) << "write_finish_thread_entry waiting for aio(s)" << dendl;
+    io_event event[16];
+    int r = io_getevents(aio_ctx, 1, 16, event, NULL);
+    if (r < 0) {
+      if (r == -EINTR) {
+	dout(0) << "io_getevents got " << cpp_strerror(r) << dendl;
+	continue;
+      }
+      derr << "io_getevents got " << cpp_strerror(r) << dendl;
+      assert(0 == "got unexpected error from io_getevents");
+    }
+
+    Mutex::Locker locker(write_lock);
+    for (int i=0; i<r; i++) {
+      aio_info *ai = (aio_info *)event[i].obj;
+      if (event[i].res != ai->len) {
+	derr << "aio to " << ai->off << "~" << ai->len
+	     << " got " << cpp_strerror((int)event[i].res) << dendl;
+	assert(0 == "unexpected aio error");
+      }
+      dout(10) << "write_finish_thread_entry aio " << ai->off
+	       << "~" << ai->len << " done" << dendl;
+      ai->done = true;
+    }
+    check_aio_completion();
+  }
+  dout(10) << "write_finish_thread_entry exit" << dendl;
+}
+
+/**
+ * retire the completed prefix of aio_queue
+ *
+ * Called with write_lock held.
+ */
+void FileJournal::check_aio_completion()
+{
+  assert(write_lock.is_locked());
+  dout(20) << "check_aio_completion" << dendl;
+
+  bool completed_something = false;
+  uint64_t new_journaled_seq = 0;
+
+  while (!aio_queue.empty() && aio_queue.front().done) {
+    aio_info& ai = aio_queue.front();
+    dout(10) << "check_aio_completion completed seq " << ai.seq << " "
+	     << ai.off << "~" << ai.len << dendl;
+    if (ai.seq) {
+      new_journaled_seq = ai.seq;
+      completed_something = true;
+    }
+    aio_num--;
+    aio_bytes -= ai.len;
+    aio_queue.pop_front();
+  }
+  aio_cond.Signal();
+
+  if (completed_something) {
+    journaled_seq = new_journaled_seq;
+
+    // kick finisher?  
+    //  only if we haven't filled up recently!
+    if (full_state != FULL_NOTFULL) {
+      dout(10) << "check_aio_completion NOT queueing finisher seq " << journaled_seq
+	       << ", full_commit_seq|full_restart_seq" << dendl;
+    } else {
+      if (plug_journal_completions) {
+	dout(20) << "check_aio_completion NOT queueing finishers through seq " << journaled_seq
+		 << " due to completion plug" << dendl;
+      } else {
+	dout(20) << "check_aio_completion queueing finishers through seq " << journaled_seq << dendl;
+	queue_completions_thru(journaled_seq);
+      }
+    }
+  }
+
+  if (aio_queue.empty())
+    write_empty_cond.Signal();
+}
+#endif
+
 void FileJournal::flush()
 {
   write_lock.Lock();
-  while ((!writeq.empty() || writing) && !write_stop) {
+  while ((!writeq.empty() || writing
+#ifdef HAVE_LIBAIO
+	  || !aio_queue.empty()
+#endif
+	  ) && !write_stop) {
     dout(5) << "flush waiting for writeq to empty and writes to complete" << dendl;
     write_empty_cond.Wait(write_lock);
   }
@@ -900,6 +1203,15 @@ void FileJournal::write_thread_entry()
       dout(20) << "write_thread_entry woke up" << dendl;
       continue;
     }
+
+#ifdef HAVE_LIBAIO
+    if (aio && aio_num >= g_conf->journal_aio_max_inflight) {
+      dout(20) << "write_thread_entry " << aio_num << " aios in flight ("
+	       << aio_bytes << " bytes), waiting" << dendl;
+      aio_cond.Wait(write_lock);
+      continue;
+    }
+#endif
     
     uint64_t orig_ops = 0;
     uint64_t orig_bytes = 0;
@@ -913,7 +1225,14 @@ void FileJournal::write_thread_entry()
       continue;
     }
     assert(r == 0);
+#ifdef HAVE_LIBAIO
+    if (aio)
+      do_aio_write(bl);
+    else
+      do_write(bl);
+#else
     do_write(bl);
+#endif
     
     put_throttle(orig_ops, orig_bytes);
   }
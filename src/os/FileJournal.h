@@ -19,12 +19,17 @@
 #include <deque>
 using std::deque;
 
+#include "acconfig.h"
 #include "Journal.h"
 #include "common/Cond.h"
 #include "common/Mutex.h"
 #include "common/Thread.h"
 #include "common/Throttle.h"
 
+#ifdef HAVE_LIBAIO
+# include <libaio.h>
+#endif
+
 class FileJournal : public Journal {
 public:
   /*
@@ -73,7 +78,7 @@ private:
   off64_t max_size;
   size_t block_size;
   bool is_bdev;
-  bool directio;
+  bool directio, aio;
   bool writing, must_write_header;
   off64_t write_pos;      // byte where the next entry to be written will go
   off64_t read_pos;       // 
@@ -127,6 +132,53 @@ private:
 
   Cond commit_cond;
 
+#ifdef HAVE_LIBAIO
+  /// one aio write in flight; retired strictly in submission order
+  struct aio_info {
+    struct iocb iocb;
+    bufferlist bl;
+    struct iovec *iov;
+    bool done;
+    off64_t off;
+    uint64_t len;
+    uint64_t seq;   ///< journal through this seq once we (and all before us) complete; 0 if none
+
+    aio_info(bufferlist& b, off64_t o, uint64_t s)
+      : iov(NULL), done(false), off(o), len(b.length()), seq(s) {
+      bl.claim(b);
+      memset((void*)&iocb, 0, sizeof(iocb));
+    }
+    ~aio_info() {
+      delete[] iov;
+    }
+  };
+
+  // all protected by write_lock
+  io_context_t aio_ctx;
+  bool aio_ctx_setup;
+  deque<aio_info> aio_queue;
+  int aio_num;
+  uint64_t aio_bytes;
+  bool aio_stop;
+  Cond aio_cond;           ///< an aio completed
+  Cond write_finish_cond;  ///< an aio was submitted
+
+  void write_finish_thread_entry();
+  void check_aio_completion();
+  int write_aio_bl(off64_t& pos, bufferlist& bl, uint64_t seq);
+  void do_aio_write(bufferlist& bl);
+
+  class WriteFinisher : public Thread {
+    FileJournal *journal;
+  public:
+    WriteFinisher(FileJournal *fj) : journal(fj) {}
+    void *entry() {
+      journal->write_finish_thread_entry();
+      return 0;
+    }
+  } write_finish_thread;
+#endif
+
   int _open(bool wr, bool create=false);
   int _open_block_device();
   void _check_disk_write_cache() const;
@@ -145,6 +197,7 @@ private:
   int prepare_single_write(bufferlist& bl, off64_t& queue_pos, uint64_t& orig_ops, uint64_t& orig_bytes);
   void do_write(bufferlist& bl);
 
+  void align_bl(off64_t pos, bufferlist& bl);
   int write_bl(off64_t& pos, bufferlist& bl);
   void wrap_read_bl(off64_t& pos, int64_t len, bufferlist& bl);
 
@@ -163,11 +216,11 @@ private:
   }
 
  public:
-  FileJournal(uint64_t fsid, Finisher *fin, Cond *sync_cond, const char *f, bool dio=false) : 
+  FileJournal(uint64_t fsid, Finisher *fin, Cond *sync_cond, const char *f, bool dio=false, bool ai=false) :
     Journal(fsid, fin, sync_cond), fn(f),
     zero_buf(NULL),
     max_size(0), block_size(0),
-    is_bdev(false),directio(dio),
+    is_bdev(false), directio(dio), aio(ai),
     writing(false), must_write_header(false),
     write_pos(0), read_pos(0),
     last_committed_seq(0), 
@@ -177,6 +230,11 @@ private:
     plug_journal_completions(false),
     write_lock("FileJournal::write_lock"),
     write_stop(false),
+#ifdef HAVE_LIBAIO
+    aio_ctx(0), aio_ctx_setup(false),
+    aio_num(0), aio_bytes(0), aio_stop(false),
+    write_finish_thread(this),
+#endif
     write_thread(this) { }
   ~FileJournal() {
     delete[] zero_buf;
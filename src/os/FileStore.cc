@@ -17,6 +17,8 @@
 #include "include/types.h"
 
 #include "FileJournal.h"
+#include "chain_xattr.h"
+#include "LFNIndex.h"
 
 #include "osd/osd_types.h"
 
@@ -52,12 +54,13 @@
 #ifdef DARWIN
 #include <sys/param.h>
 #include <sys/mount.h>
+#else
+#include <sys/sendfile.h>
 #endif // DARWIN
 
 #include <sstream>
 
-#define ATTR_MAX_NAME_LEN  128
-#define ATTR_MAX_BLOCK_LEN 2048
+#define ATTR_MAX_NAME_LEN  CHAIN_XATTR_MAX_NAME_LEN
 
 #define COMMIT_SNAP_ITEM "snap_%lld"
 #define CLUSTER_SNAP_ITEM "clustersnap_%s"
@@ -81,250 +84,10 @@
 
 #include <map>
 
-#include "common/ceph_crypto.h"
-
-using ceph::crypto::SHA1;
-
-/*
- * long file names will have the following format:
- *
- * prefix_hash_index_cookie
- *
- * The prefix will just be the first X bytes of the original file name.
- * The cookie is a constant string that shows whether this file name
- * is hashed
- */
-
-#define FILENAME_LFN_DIGEST_SIZE CEPH_CRYPTO_SHA1_DIGESTSIZE
-
-#define FILENAME_MAX_LEN        4096    // the long file name size
-#define FILENAME_SHORT_LEN      255     // the short file name size
-#define FILENAME_COOKIE         "long"  // ceph long file name
-#define FILENAME_HASH_LEN       FILENAME_LFN_DIGEST_SIZE
-#define FILENAME_EXTRA	        4       // underscores and digit
-
-#define LFN_ATTR "user.cephos.lfn"
-
-#define FILENAME_PREFIX_LEN (FILENAME_SHORT_LEN - FILENAME_HASH_LEN - (sizeof(FILENAME_COOKIE) - 1) - FILENAME_EXTRA)
 #define ALIGN_DOWN(x, by) ((x) - ((x) % (by)))
 #define ALIGNED(x, by) (!((x) % (by)))
 #define ALIGN_UP(x, by) (ALIGNED((x), (by)) ? (x) : (ALIGN_DOWN((x), (by)) + (by)))
 
-static int do_getxattr(const char *fn, const char *name, void *val, size_t size);
-static int do_setxattr(const char *fn, const char *name, const void *val, size_t size);
-static int do_fsetxattr(int fd, const char *name, const void *val, size_t size);
-static int do_setxattr(const char *fn, const char *name, const void *val, size_t size);
-static int do_listxattr(const char *fn, char *names, size_t len);
-static int do_removexattr(const char *fn, const char *name);
-
-#ifdef DARWIN
-static int sys_getxattr(const char *fn, const char *name, void *val, size_t size)
-{
-  int r = ::getxattr(fn, name, val, size, 0, 0);
-  return (r < 0 ? -errno : r);
-}
-
-static int sys_setxattr(const char *fn, const char *name, const void *val, size_t size)
-{
-  int r = ::setxattr(fn, name, val, size, 0, 0);
-  return (r < 0 ? -errno : r);
-}
-
-static int sys_removexattr(const char *fn, const char *name)
-{
-  int r = ::removexattr(fn, name, 0);
-  return (r < 0 ? -errno : r);
-}
-
-static int sys_listxattr(const char *fn, char *names, size_t len)
-{
-  int r = ::listxattr(fn, names, len, 0);
-  return (r < 0 ? -errno : r);
-}
-#else
-
-static int sys_getxattr(const char *fn, const char *name, void *val, size_t size)
-{
-  int r = ::getxattr(fn, name, val, size);
-  return (r < 0 ? -errno : r);
-}
-
-static int sys_setxattr(const char *fn, const char *name, const void *val, size_t size)
-{
-  int r = ::setxattr(fn, name, val, size, 0);
-  return (r < 0 ? -errno : r);
-}
-
-static int sys_removexattr(const char *fn, const char *name)
-{
-  int r = ::removexattr(fn, name);
-  return (r < 0 ? -errno : r);
-}
-
-int sys_listxattr(const char *fn, char *names, size_t len)
-{
-  int r = ::listxattr(fn, names, len);
-  return (r < 0 ? -errno : r);
-}
-#endif
-
-static inline void buf_to_hex(const unsigned char *buf, int len, char *str)
-{
-  int i;
-  str[0] = '\0';
-  for (i = 0; i < len; i++) {
-    sprintf(&str[i*2], "%02x", (int)buf[i]);
-  }
-}
-
-static int hash_filename(const char *filename, char *hash, int buf_len)
-{
-  if (buf_len < FILENAME_HASH_LEN + 1)
-    return -EINVAL;
-
-  char buf[FILENAME_LFN_DIGEST_SIZE];
-  char hex[FILENAME_LFN_DIGEST_SIZE * 2];
-
-  SHA1 h;
-  h.Update((const byte *)filename, strlen(filename));
-  h.Final((byte *)buf);
-
-  buf_to_hex((byte *)buf, (FILENAME_HASH_LEN + 1) / 2, hex);
-  strncpy(hash, hex, FILENAME_HASH_LEN);
-  hash[FILENAME_HASH_LEN] = '\0';
-  return 0;
-}
-
-static void build_filename(char *filename, int len, const char *old_filename, int i)
-{
-  char hash[FILENAME_HASH_LEN + 1];
-
-  assert(len >= FILENAME_SHORT_LEN + 4);
-
-  strncpy(filename, old_filename, FILENAME_PREFIX_LEN);
-  filename[FILENAME_PREFIX_LEN] = '\0';
-  if (strlen(filename) < FILENAME_PREFIX_LEN)
-    return;
-  if (old_filename[FILENAME_PREFIX_LEN] == '\0')
-    return;
-
-  hash_filename(old_filename, hash, sizeof(hash));
-  int ofs = FILENAME_PREFIX_LEN;
-  int suffix_len;
-  while (1) {
-    suffix_len = sprintf(filename + ofs, "_%s_%d_" FILENAME_COOKIE, hash, i);
-    if (ofs + suffix_len <= FILENAME_SHORT_LEN || !ofs)
-      break;
-    ofs--;
-  }
-}
-
-/* is this a candidate? */
-static int lfn_is_hashed_filename(const char *filename)
-{
-  int len = strlen(filename);
-  if (len < FILENAME_SHORT_LEN)
-    return 0;
-  return (strcmp(filename + len - (sizeof(FILENAME_COOKIE) - 1), FILENAME_COOKIE) == 0);
-}
-
-static void lfn_translate(const char *path, const char *name, char *new_name, int len)
-{
-  if (!lfn_is_hashed_filename(name)) {
-    strncpy(new_name, name, len);
-    return;
-  }
-
-  char buf[PATH_MAX];
-
-  snprintf(buf, sizeof(buf), "%s/%s", path, name);
-  int r = do_getxattr(buf, LFN_ATTR, new_name, len - 1);
-  if (r < 0)
-    strncpy(new_name, name, len);
-  else
-    new_name[r] = '\0';
-  return;
-}
-
-/* 
- * sorry, these are sentitive to the sobject_t and coll_t typing.
- */ 
-
-  //           11111111112222222222333333333344444444445555555555
-  // 012345678901234567890123456789012345678901234567890123456789
-  // yyyyyyyyyyyyyyyy.zzzzzzzz.a_s
-
-int FileStore::append_oname(const sobject_t &oid, char *s, int len)
-{
-  //assert(sizeof(oid) == 28);
-  char *end = s + len;
-  char *t = s + strlen(s);
-
-  const char *i = oid.oid.name.c_str();
-  while (*i && t < end) {
-    if (*i == '\\') {
-      *t++ = '\\';
-      *t++ = '\\';      
-    } else if (*i == '.' && i == oid.oid.name.c_str()) {  // only escape leading .
-      *t++ = '\\';
-      *t++ = '.';
-    } else if (*i == '/') {
-      *t++ = '\\';
-      *t++ = 's';
-    } else
-      *t++ = *i;
-    i++;
-  }
-
-  int size = t - s;
-
-  if (oid.snap == CEPH_NOSNAP)
-    size += snprintf(t, end - t, "_head");
-  else if (oid.snap == CEPH_SNAPDIR)
-    size += snprintf(t, end - t, "_snapdir");
-  else
-    size += snprintf(t, end - t, "_%llx", (long long unsigned)oid.snap);
-
-  return size;
-}
-
-bool FileStore::parse_object(char *s, sobject_t& o)
-{
-  char *bar = s + strlen(s) - 1;
-  while (*bar != '_' &&
-	 bar > s)
-    bar--;
-  if (*bar == '_') {
-    char buf[bar-s + 1];
-    char *t = buf;
-    char *i = s;
-    while (i < bar) {
-      if (*i == '\\') {
-	i++;
-	switch (*i) {
-	case '\\': *t++ = '\\'; break;
-	case '.': *t++ = '.'; break;
-	case 's': *t++ = '/'; break;
-	default: assert(0);
-	}
-      } else {
-	*t++ = *i;
-      }
-      i++;
-    }
-    *t = 0;
-    o.oid.name = string(buf, t-buf);
-    if (strcmp(bar+1, "head") == 0)
-      o.snap = CEPH_NOSNAP;
-    else if (strcmp(bar+1, "snapdir") == 0)
-      o.snap = CEPH_SNAPDIR;
-    else
-      o.snap = strtoull(bar+1, &s, 16);
-    return true;
-  }
-  return false;
-}
-
   //           11111111112222222222333
   // 012345678901234567890123456789012
   // pppppppppppppppp.ssssssssssssssss
@@ -335,129 +98,81 @@ int FileStore::get_cdir(coll_t cid, char *s, int len)
   return snprintf(s, len, "%s/current/%s", basedir.c_str(), cid_str.c_str());
 }
 
-int FileStore::lfn_get(coll_t cid, const sobject_t& oid, char *pathname, int len, char *lfn, int lfn_len, int *exist, int *is_lfn)
+int FileStore::get_index(coll_t cid, Index *index)
 {
-  int i = 0;
-  char *filename;
-  int path_len = get_cdir(cid, pathname, len);
-  pathname[path_len] = '/';
-  path_len++;
-  pathname[path_len] = '\0';
-  filename = pathname + path_len;
-
-  *lfn = '\0';
-  int actual_len = append_oname(oid, lfn, lfn_len);
-
-  if (actual_len < (int)FILENAME_PREFIX_LEN) {
-    /* not a long file name, just build it as it is */
-    strncpy(filename, lfn, len - path_len);
-    *is_lfn = 0;
-    dout(20) << "lfn_get cid=" << cid << " oid=" << oid << " pathname=" << pathname << " lfn=" << lfn << " is_lfn=" << *is_lfn << dendl;
-    return 0;
-  }
-
-  *is_lfn = 1;
-  *exist = 0;
-
-  while (1) {
-    char buf[PATH_MAX];
-    int r;
-
-    build_filename(filename, len - path_len, lfn, i);
-    r = do_getxattr(pathname, LFN_ATTR, buf, sizeof(buf));
-    if (r < 0)
-      r = -errno;
-    if (r > 0) {
-      buf[MIN((int)sizeof(buf)-1, r)] = '\0';
-      dout(20) << "lfn_get cid=" << cid << " oid=" << oid << " lfn=" << lfn << " buf=" << buf << dendl;
-      if (strcmp(buf, lfn) == 0) { // a match?
-        *exist = 1;
-        return i;
-      }
-    }
-    switch (r) {
-    case -ENOENT:
-      return i;
-    case -ERANGE:
-      assert(0); // shouldn't happen
-    default:
-      break;
-    }
-    if (r < 0)
-      break;
-    i++;
-  }
-
-  dout(20) << "lfn_get cid=" << cid << " oid=" << oid << " pathname=" << pathname << " lfn=" << lfn << " is_lfn=" << *is_lfn << dendl;
-  return 0; // unreachable anyway
+  char path[PATH_MAX];
+  get_cdir(cid, path, sizeof(path));
+  return index_manager.get_index(cid, path, index);
 }
 
-int FileStore::lfn_find(coll_t cid, const sobject_t& oid, char *pathname, int len)
+int FileStore::lfn_getxattr(coll_t cid, const sobject_t& oid, const char *name, void *val, size_t size)
 {
-  char long_fn[PATH_MAX];
-  int r, exist;
-  int is_lfn;
-
-  r = lfn_get(cid, oid, pathname, len, long_fn, sizeof(long_fn), &exist, &is_lfn);
+  Index index;
+  int r = get_index(cid, &index);
   if (r < 0)
     return r;
-  if (is_lfn && !exist)
-    return -ENOENT;
-  return 0;
-}
-int FileStore::lfn_getxattr(coll_t cid, const sobject_t& oid, const char *name, void *val, size_t size)
-{
-  char new_fn[PATH_MAX];
-  int r;
-
-  r = lfn_find(cid, oid, new_fn, sizeof(new_fn));
+  RWLock::RLocker l(index->access_lock);
+  string path;
+  r = index->lookup(oid, &path, NULL);
   if (r < 0)
     return r;
-  return do_getxattr(new_fn, name, val, size);
+  return chain_getxattr(path.c_str(), name, val, size);
 }
 
 int FileStore::lfn_setxattr(coll_t cid, const sobject_t& oid, const char *name, const void *val, size_t size)
 {
-  char new_fn[PATH_MAX];
-  int r;
-
-  r = lfn_find(cid, oid, new_fn, sizeof(new_fn));
+  Index index;
+  int r = get_index(cid, &index);
+  if (r < 0)
+    return r;
+  RWLock::RLocker l(index->access_lock);
+  string path;
+  r = index->lookup(oid, &path, NULL);
   if (r < 0)
     return r;
-  return do_setxattr(new_fn, name, val, size);
+  return chain_setxattr(path.c_str(), name, val, size);
 }
 
 int FileStore::lfn_removexattr(coll_t cid, const sobject_t& oid, const char *name)
 {
-  char new_fn[PATH_MAX];
-  int r;
-
-  r = lfn_find(cid, oid, new_fn, sizeof(new_fn));
+  Index index;
+  int r = get_index(cid, &index);
+  if (r < 0)
+    return r;
+  RWLock::RLocker l(index->access_lock);
+  string path;
+  r = index->lookup(oid, &path, NULL);
   if (r < 0)
     return r;
-  return do_removexattr(new_fn, name);
+  return chain_removexattr(path.c_str(), name);
 }
 
 int FileStore::lfn_listxattr(coll_t cid, const sobject_t& oid, char *names, size_t len)
 {
-  char new_fn[PATH_MAX];
-  int r;
-
-  r = lfn_find(cid, oid, new_fn, sizeof(new_fn));
+  Index index;
+  int r = get_index(cid, &index);
   if (r < 0)
     return r;
-  return do_listxattr(new_fn, names, len);
+  RWLock::RLocker l(index->access_lock);
+  string path;
+  r = index->lookup(oid, &path, NULL);
+  if (r < 0)
+    return r;
+  return chain_listxattr(path.c_str(), names, len);
 }
 
 int FileStore::lfn_truncate(coll_t cid, const sobject_t& oid, off_t length)
 {
-  char new_fn[PATH_MAX];
-  int r;
-
-  r = lfn_find(cid, oid, new_fn, sizeof(new_fn));
+  Index index;
+  int r = get_index(cid, &index);
+  if (r < 0)
+    return r;
+  RWLock::RLocker l(index->access_lock);
+  string path;
+  r = index->lookup(oid, &path, NULL);
   if (r < 0)
     return r;
-  r = ::truncate(new_fn, length);
+  r = ::truncate(path.c_str(), length);
   if (r < 0)
     return -errno;
   return r;
@@ -465,44 +180,72 @@ int FileStore::lfn_truncate(coll_t cid, const sobject_t& oid, off_t length)
 
 int FileStore::lfn_stat(coll_t cid, const sobject_t& oid, struct stat *buf)
 {
-  char fn[PATH_MAX];
-  int r;
-
-  r = lfn_find(cid, oid, fn, sizeof(fn));
+  Index index;
+  int r = get_index(cid, &index);
   if (r < 0)
     return r;
-  r = ::stat(fn, buf);
+  RWLock::RLocker l(index->access_lock);
+  string path;
+  r = index->lookup(oid, &path, NULL);
+  if (r < 0)
+    return r;
+  r = ::stat(path.c_str(), buf);
   if (r < 0)
     return -errno;
   return 0;
 }
 
+/*
+ * returns an fd or -errno.  creating an object only excludes other
+ * creates in the collection; the index lock is taken exclusively only
+ * if the new object leaves its directory in need of a split.
+ */
 int FileStore::lfn_open(coll_t cid, const sobject_t& oid, int flags, mode_t mode)
 {
-  char long_fn[PATH_MAX];
-  char short_fn[PATH_MAX];
-  int r, fd, exist;
-  int is_lfn;
-
-  r = lfn_get(cid, oid, short_fn, sizeof(short_fn), long_fn, sizeof(long_fn), &exist, &is_lfn);
+  Index index;
+  int r = get_index(cid, &index);
   if (r < 0)
     return r;
-  if (!is_lfn)
-    return open(short_fn, flags, mode);
-
-  r = ::open(short_fn, flags, mode);
 
-  if (r < 0)
+  string path;
+  if (!(flags & O_CREAT)) {
+    RWLock::RLocker l(index->access_lock);
+    r = index->lookup(oid, &path, NULL);
+    if (r < 0)
+      return r;
+    r = ::open(path.c_str(), flags, mode);
+    if (r < 0)
+      return -errno;
     return r;
+  }
 
-  fd = r;
-
-  if (flags & O_CREAT) {
-    r = do_fsetxattr(fd, LFN_ATTR, long_fn, strlen(long_fn));
-    if (r < 0) {
-      close(fd);
+  int fd;
+  {
+    RWLock::RLocker l(index->access_lock);
+    Mutex::Locker c(index->create_lock);
+    r = index->lookup(oid, &path, NULL);
+    if (r < 0)
       return r;
+    fd = ::open(path.c_str(), flags | O_EXCL, mode);
+    if (fd < 0) {
+      if (errno != EEXIST || (flags & O_EXCL))
+	return -errno;
+      fd = ::open(path.c_str(), flags & ~O_CREAT, mode);
+      if (fd < 0)
+	return -errno;
+      return fd;
     }
+    r = index->created(oid, path.c_str());
+  }
+
+  if (r > 0) {
+    // the fd stays good; a split only moves links to the inode
+    RWLock::WLocker l(index->access_lock);
+    r = index->split(oid);
+  }
+  if (r < 0) {
+    ::close(fd);
+    return r;
   }
   return fd;
 }
@@ -514,340 +257,69 @@ int FileStore::lfn_open(coll_t cid, const sobject_t& oid, int flags)
 
 int FileStore::lfn_link(coll_t c, coll_t cid, const sobject_t& o) 
 {
-  char long_fn[PATH_MAX];
-  char short_fn_old[PATH_MAX];
-  char short_fn_new[PATH_MAX];
-  int exist, is_lfn;
-  int r;
-
-  r = lfn_get(cid, o, short_fn_new, sizeof(short_fn_new), long_fn, sizeof(long_fn), &exist, &is_lfn);
-  dout(25) << "lfn_link called lfn_get = " << r << dendl;
+  Index index_old, index_new;
+  int r = get_index(c, &index_old);
   if (r < 0)
     return r;
-  if (is_lfn && !exist)
-    return -ENOENT;
-
-  r = lfn_get(c, o, short_fn_old, sizeof(short_fn_old), long_fn, sizeof(long_fn), &exist, &is_lfn);
-  dout(25) << "lfn_link again called lfn_get = " << r << dendl;
+  r = get_index(cid, &index_new);
   if (r < 0)
     return r;
-  if (is_lfn && exist)
+  if (index_old == index_new)
     return -EEXIST;
 
-  dout(25) << "lfn_link short_fn_old: " << short_fn_old << dendl;
-  dout(25) << "lfn_link short_fn_new: " << short_fn_new << dendl;
-
-  r = link(short_fn_old, short_fn_new);
-  dout(25) << "lfn_link called link =" << r << dendl;
-  if (r < 0)
-    return -errno;
-
-  return 0;
-}
-
-int FileStore::lfn_unlink(coll_t cid, const sobject_t& o)
-{
-  char long_fn[PATH_MAX];
-  char short_fn[PATH_MAX];
-  char short_fn2[PATH_MAX];
-  int r, i, exist, err;
-  int path_len;
-  int is_lfn;
-
-  r = lfn_get(cid, o, short_fn, sizeof(short_fn), long_fn, sizeof(long_fn), &exist, &is_lfn);
-  if (r < 0)
-    return r;
-  if (!is_lfn)
-    return unlink(short_fn);
-  if (!exist)
-    return -ENOENT;
-
-  path_len = get_cdir(cid, short_fn2, sizeof(short_fn2));
-  short_fn2[path_len] = '/';
-  path_len++;
-  short_fn2[path_len] = '\0';
-
-  for (i = r + 1; ; i++) {
-    struct stat buf;
-    int ret;
-
-    build_filename(&short_fn2[path_len], sizeof(short_fn2) - path_len, long_fn, i);
-    ret = ::stat(short_fn2, &buf);
-    if (ret < 0) {
-      if (i == r + 1) {
-        err = unlink(short_fn);
-        if (err < 0)
-          return err;
-        return 0;
-      }
-      break;
-    }
-  }
-
-  build_filename(&short_fn2[path_len], sizeof(short_fn2) - path_len, long_fn, i - 1);
-  generic_dout(0) << "renaming " << short_fn2 << " -> " << short_fn << dendl;
-
-  if (rename(short_fn2, short_fn) < 0) {
-    generic_derr << "ERROR: could not rename " << short_fn2 << " -> " << short_fn << dendl;
-    assert(0);
-  }
-
-  return 0;
-}
-
-static void get_raw_xattr_name(const char *name, int i, char *raw_name, int raw_len)
-{
-  int r;
-  int pos = 0;
-
-  while (*name) {
-    switch (*name) {
-    case '@': /* escape it */
-      pos += 2;
-      assert (pos < raw_len - 1);
-      *raw_name = '@';
-      raw_name++;
-      *raw_name = '@';
-      break;
-    default:
-      pos++;
-      assert(pos < raw_len - 1);
-      *raw_name = *name;
-      break;
-    }
-    name++;
-    raw_name++;
-  }
-
-  if (!i) {
-    *raw_name = '\0';
-  } else {
-    r = snprintf(raw_name, raw_len, "@%d", i);
-    assert(r < raw_len - pos);
-  }
-}
-
-static int translate_raw_name(const char *raw_name, char *name, int name_len, bool *is_first)
-{
-  int pos = 0;
-
-  generic_dout(10) << "translate_raw_name raw_name=" << raw_name << dendl;
-  const char *n = name;
-
-  *is_first = true;
-  while (*raw_name) {
-    switch (*raw_name) {
-    case '@': /* escape it */
-      raw_name++;
-      if (!*raw_name)
-        break;
-      if (*raw_name != '@') {
-        *is_first = false;
-        goto done;
-      }
-
-    /* fall through */
-    default:
-      *name = *raw_name;
-      break;
-    }
-    pos++;
-    assert(pos < name_len);
-    name++;
-    raw_name++;
-  }
-done:
-  *name = '\0';
-  generic_dout(10) << "translate_raw_name name=" << n << dendl;
-  return pos;
-}
-
-int do_getxattr_len(const char *fn, const char *name)
-{
-  int i = 0, total = 0;
-  char raw_name[ATTR_MAX_NAME_LEN * 2 + 16];
-  int r;
-
-  do {
-    get_raw_xattr_name(name, i, raw_name, sizeof(raw_name));
-    r = sys_getxattr(fn, raw_name, 0, 0);
-    if (!i && r < 0) {
+  {
+    // take the two index locks in a fixed order
+    RWLock *first = &index_old->access_lock, *second = &index_new->access_lock;
+    if (second < first)
+      swap(first, second);
+    RWLock::RLocker l1(*first);
+    RWLock::RLocker l2(*second);
+    Mutex::Locker c(index_new->create_lock);
+
+    string path_old, path_new;
+    int exist;
+    r = index_old->lookup(o, &path_old, &exist);
+    if (r < 0)
       return r;
-    }
+    if (!exist)
+      return -ENOENT;
+    r = index_new->lookup(o, &path_new, &exist);
     if (r < 0)
-      break;
-    total += r;
-    i++;
-  } while (r == ATTR_MAX_BLOCK_LEN);
-
-  return total;
-}
-
-static int do_getxattr(const char *fn, const char *name, void *val, size_t size)
-{
-  int i = 0, pos = 0;
-  char raw_name[ATTR_MAX_NAME_LEN * 2 + 16];
-  int ret = 0;
-  int r;
-  size_t chunk_size;
-
-  if (!size)
-    return do_getxattr_len(fn, name);
-
-  do {
-    chunk_size = (size < ATTR_MAX_BLOCK_LEN ? size : ATTR_MAX_BLOCK_LEN);
-    get_raw_xattr_name(name, i, raw_name, sizeof(raw_name));
-    size -= chunk_size;
-
-    r = sys_getxattr(fn, raw_name, (char *)val + pos, chunk_size);
-    if (r < 0) {
-      ret = r;
-      break;
-    }
-
-    if (r > 0)
-      pos += r;
+      return r;
+    if (exist)
+      return -EEXIST;
 
-    i++;
-  } while (size && r == ATTR_MAX_BLOCK_LEN);
+    dout(25) << "lfn_link path_old: " << path_old << dendl;
+    dout(25) << "lfn_link path_new: " << path_new << dendl;
 
-  if (r >= 0) {
-    ret = pos;
-    /* is there another chunk? that can happen if the last read size span over
-       exactly one block */
-    if (chunk_size == ATTR_MAX_BLOCK_LEN) {
-      get_raw_xattr_name(name, i, raw_name, sizeof(raw_name));
-      r = sys_getxattr(fn, raw_name, 0, 0);
-      if (r > 0) { // there's another chunk.. the original buffer was too small
-        ret = -ERANGE;
-      }
-    }
+    r = ::link(path_old.c_str(), path_new.c_str());
+    dout(25) << "lfn_link called link =" << r << dendl;
+    if (r < 0)
+      return -errno;
+    r = index_new->created(o, path_new.c_str());
   }
-  return ret;
-}
-
-static int do_setxattr(const char *fn, const char *name, const void *val, size_t size) {
-  int i = 0, pos = 0;
-  char raw_name[ATTR_MAX_NAME_LEN * 2 + 16];
-  int ret = 0;
-  size_t chunk_size;
-
-  do {
-    chunk_size = (size < ATTR_MAX_BLOCK_LEN ? size : ATTR_MAX_BLOCK_LEN);
-    get_raw_xattr_name(name, i, raw_name, sizeof(raw_name));
-    size -= chunk_size;
-
-    int r = sys_setxattr(fn, raw_name, (char *)val + pos, chunk_size);
-    if (r < 0) {
-      ret = r;
-      break;
-    }
-    pos  += chunk_size;
-    ret = pos;
-    i++;
-  } while (size);
 
-  /* if we're exactly at a chunk size, remove the next one (if wasn't removed
-     before) */
-  if (ret >= 0 && chunk_size == ATTR_MAX_BLOCK_LEN) {
-    get_raw_xattr_name(name, i, raw_name, sizeof(raw_name));
-    do_removexattr(fn, raw_name);
+  if (r > 0) {
+    RWLock::WLocker l(index_new->access_lock);
+    r = index_new->split(o);
   }
-  
-  return ret;
+  return r;
 }
 
-static int do_fsetxattr(int fd, const char *name, const void *val, size_t size)
+int FileStore::lfn_unlink(coll_t cid, const sobject_t& o)
 {
-  int i = 0, pos = 0;
-  char raw_name[ATTR_MAX_NAME_LEN * 2 + 16];
-  int ret = 0;
-  size_t chunk_size;
-
-  do {
-    chunk_size = (size < ATTR_MAX_BLOCK_LEN ? size : ATTR_MAX_BLOCK_LEN);
-    get_raw_xattr_name(name, i, raw_name, sizeof(raw_name));
-    size -= chunk_size;
-
-    int r = ::fsetxattr(fd, raw_name, (char *)val + pos, chunk_size, 0);
-    if (r < 0) {
-      ret = r;
-      break;
-    }
-    pos  += chunk_size;
-    ret = pos;
-    i++;
-  } while (size);
-
-  /* if we're exactly at a chunk size, remove the next one (if wasn't removed
-     before) */
-  if (ret >= 0 && chunk_size == ATTR_MAX_BLOCK_LEN) {
-    get_raw_xattr_name(name, i, raw_name, sizeof(raw_name));
-    ::fremovexattr(fd, raw_name);
-  }
-  
-  return ret;
-}
-
-static int do_removexattr(const char *fn, const char *name) {
-  int i = 0;
-  char raw_name[ATTR_MAX_NAME_LEN * 2 + 16];
-  int r;
-
-  do {
-    get_raw_xattr_name(name, i, raw_name, sizeof(raw_name));
-    r = sys_removexattr(fn, raw_name);
-    if (!i && r < 0) {
-      return r;
-    }
-    i++;
-  } while (r >= 0);
-  return 0;
-}
-
-static int do_listxattr(const char *fn, char *names, size_t len) {
-  int r;
-
-  if (!len)
-   return sys_listxattr(fn, names, len);
-
-  r = sys_listxattr(fn, 0, 0);
+  Index index;
+  int r = get_index(cid, &index);
   if (r < 0)
     return r;
-
-  size_t total_len = r  * 2; // should be enough
-  char *full_buf = (char *)malloc(total_len * 2);
-  if (!full_buf)
-    return -ENOMEM;
-
-  r = sys_listxattr(fn, full_buf, total_len);
-  if (r < 0)
-    return r;
-
-  char *p = full_buf;
-  char *end = full_buf + r;
-  char *dest = names;
-  char *dest_end = names + len;
-
-  while (p < end) {
-    char name[ATTR_MAX_NAME_LEN * 2 + 16];
-    int attr_len = strlen(p);
-    bool is_first;
-    int name_len = translate_raw_name(p, name, sizeof(name), &is_first);
-    if (is_first)  {
-      if (dest + name_len > dest_end) {
-        r = -ERANGE;
-        goto done;
-      }
-      strcpy(dest, name);
-      dest += name_len + 1;
-    }
-    p += attr_len + 1;
+  {
+    RWLock::RLocker l(index->access_lock);
+    r = index->unlink(o, false);
+  }
+  if (r > 0) {
+    RWLock::WLocker l(index->access_lock);
+    r = index->unlink(o, true);
   }
-  r = dest - names;
-
-done:
-  free(full_buf);
   return r;
 }
 
@@ -861,11 +333,16 @@ FileStore::FileStore(const std::string &base, const std::string &jdev) :
   btrfs_snap_create_v2(false),
   btrfs_wait_sync(false),
   ioctl_fiemap(false),
+  copy_reflink(0), copy_splice(0), copy_sendfile(0),
   fsid_fd(-1), op_fd(-1),
   basedir_fd(-1), current_fd(-1),
   attrs(this), fake_attrs(false),
   collections(this), fake_collections(false),
   ondisk_finisher(g_ceph_context),
+  cache(NULL),
+  kv_store(NULL),
+  kv_lock("FileStore::kv_lock"), kv_next_id(0), kv_max_id(0),
+  kv_colls_lock("FileStore::kv_colls_lock"),
   lock("FileStore::lock"),
   force_sync(false), sync_epoch(0),
   sync_entry_timeo_lock("sync_entry_timeo_lock"),
@@ -960,7 +437,8 @@ int FileStore::open_journal()
 {
   if (journalpath.length()) {
     dout(10) << "open_journal at " << journalpath << dendl;
-    journal = new FileJournal(fsid, &finisher, &sync_cond, journalpath.c_str(), g_conf->journal_dio);
+    journal = new FileJournal(fsid, &finisher, &sync_cond, journalpath.c_str(),
+			      g_conf->journal_dio, g_conf->journal_aio);
   }
   return 0;
 }
@@ -1272,9 +750,9 @@ int FileStore::_detect_fs()
     int x = rand();
     int y = x+1;
     snprintf(fn, sizeof(fn), "%s/fsid", basedir.c_str());
-    int ret = do_setxattr(fn, "user.test", &x, sizeof(x));
+    int ret = chain_setxattr(fn, "user.test", &x, sizeof(x));
     if (ret >= 0)
-      ret = do_getxattr(fn, "user.test", &y, sizeof(y));
+      ret = chain_getxattr(fn, "user.test", &y, sizeof(y));
     if ((ret < 0) || (x != y)) {
       derr << "Extended attributes don't appear to work. ";
       if (ret)
@@ -1310,6 +788,13 @@ int FileStore::_detect_fs()
     return -errno;
   blk_size = st.f_bsize;
 
+  // copy offload; the kernel has the final say the first time we try
+#ifndef DARWIN
+  copy_splice.set(g_conf->filestore_copy_offload);
+  copy_sendfile.set(g_conf->filestore_copy_offload);
+#endif
+  copy_reflink.set(0);
+
   static const __SWORD_TYPE BTRFS_F_TYPE(0x9123683E);
   if (st.f_type == BTRFS_F_TYPE) {
     dout(0) << "mount detected btrfs" << dendl;      
@@ -1428,6 +913,11 @@ int FileStore::_detect_fs()
   } else {
     dout(0) << "mount did NOT detect btrfs" << dendl;
     btrfs = false;
+
+    // other file systems may implement the same clone ioctl
+#ifndef DARWIN
+    copy_reflink.set(g_conf->filestore_copy_offload);
+#endif
   }
   ::close(fd);
   return 0;
@@ -1728,6 +1218,11 @@ int FileStore::mount()
 
   dout(5) << "mount op_seq is " << initial_op_seq << dendl;
 
+  // before journal replay, which may touch kv attrs
+  ret = open_kv();
+  if (ret < 0)
+    goto close_current_fd;
+
   // journal
   open_journal();
 
@@ -1768,6 +1263,11 @@ int FileStore::mount()
     goto close_current_fd;
   }
 
+  if (g_conf->filestore_cache_size && !cache)
+    cache = new ObjectCache(g_conf->filestore_cache_shards,
+			    g_conf->filestore_cache_size,
+			    g_conf->filestore_cache_max_extent);
+
   ret = journal_replay(initial_op_seq);
   if (ret < 0) {
     derr << "mount failed to open journal " << journalpath << ": "
@@ -1793,6 +1293,8 @@ int FileStore::mount()
   return 0;
 
 close_current_fd:
+  delete kv_store;
+  kv_store = NULL;
   TEMP_FAILURE_RETRY(::close(current_fd));
   current_fd = -1;
 close_basedir_fd:
@@ -1827,6 +1329,11 @@ int FileStore::umount()
   op_finisher.stop();
   ondisk_finisher.stop();
 
+  delete cache;
+  cache = NULL;
+  delete kv_store;
+  kv_store = NULL;
+
   if (fsid_fd >= 0) {
     TEMP_FAILURE_RETRY(::close(fsid_fd));
     fsid_fd = -1;
@@ -1904,6 +1411,19 @@ void FileStore::start_logger(int whoami, utime_t tare)
   plb.add_u64_counter(l_os_bytes, "b");
   plb.add_u64(l_os_committing, "comitng");
 
+  plb.add_u64_counter(l_os_cache_attr_hit, "cache_attr_hit");
+  plb.add_u64_counter(l_os_cache_attr_miss, "cache_attr_miss");
+  plb.add_u64_counter(l_os_cache_data_hit, "cache_data_hit");
+  plb.add_u64_counter(l_os_cache_data_miss, "cache_data_miss");
+  plb.add_u64(l_os_cache_bytes, "cache_bytes");
+
+  plb.add_u64_counter(l_os_copy_reflink, "copy_reflink");
+  plb.add_u64_counter(l_os_copy_splice, "copy_splice");
+  plb.add_u64_counter(l_os_copy_sendfile, "copy_sendfile");
+  plb.add_u64_counter(l_os_copy_buffered, "copy_buffered");
+  plb.add_u64_counter(l_os_copy_bytes, "copy_bytes");
+  plb.add_fl_avg(l_os_copy_lat, "copy_lat");
+
   logger = plb.create_perf_counters();
   if (journal)
     journal->logger = logger;
@@ -2587,14 +2107,29 @@ int FileStore::read(coll_t cid, const sobject_t& oid,
 
   dout(15) << "read " << cid << "/" << oid << " " << offset << "~" << len << dendl;
 
+  uint64_t gen = 0;
+  if (cache) {
+    got = cache->read(cid, oid, offset, len, &bl);
+    if (got >= 0) {
+      if (logger)
+	logger->inc(l_os_cache_data_hit);
+      dout(10) << "FileStore::read " << cid << "/" << oid << " " << offset << "~"
+	       << got << "/" << len << " (cached)" << dendl;
+      return got;
+    }
+    if (logger)
+      logger->inc(l_os_cache_data_miss);
+    gen = cache->get_gen(oid);
+  }
+
   int fd = lfn_open(cid, oid, O_RDONLY);
   if (fd < 0) {
-    int err = errno;
     dout(10) << "FileStore::read(" << cid << "/" << oid << "): open error "
-	     << cpp_strerror(err) << dendl;
-    return -err;
+	     << cpp_strerror(fd) << dendl;
+    return fd;
   }
 
+  bool to_eof = (len == 0);
   if (len == 0) {
     struct stat st;
     memset(&st, 0, sizeof(struct stat));
@@ -2611,6 +2146,13 @@ int FileStore::read(coll_t cid, const sobject_t& oid,
     return got;
   }
   bptr.set_length(got);   // properly size the buffer
+  if (cache && (uint64_t)got <= (uint64_t)g_conf->filestore_cache_max_extent) {
+    bufferlist cbl;
+    cbl.append(bptr);    // copy; bptr is sized for the request, not what we got
+    cache->add_data(gen, cid, oid, offset, cbl, to_eof || (size_t)got < len);
+    if (logger)
+      logger->set(l_os_cache_bytes, cache->get_bytes());
+  }
   bl.push_back(bptr);   // put it in the target bufferlist
   TEMP_FAILURE_RETRY(::close(fd));
 
@@ -2640,9 +2182,8 @@ int FileStore::fiemap(coll_t cid, const sobject_t& oid,
   int r;
   int fd = lfn_open(cid, oid, O_RDONLY);
   if (fd < 0) {
-    char buf[80];
-    dout(10) << "read couldn't open " << cid << "/" << oid << " errno " << errno << " " << strerror_r(errno, buf, sizeof(buf)) << dendl;
-    r = -errno;
+    dout(10) << "read couldn't open " << cid << "/" << oid << ": " << cpp_strerror(fd) << dendl;
+    r = fd;
   } else {
     uint64_t i;
 
@@ -2702,7 +2243,9 @@ done:
 int FileStore::_remove(coll_t cid, const sobject_t& oid) 
 {
   dout(15) << "remove " << cid << "/" << oid << dendl;
-  int r = lfn_unlink(cid, oid);
+  int r = _kv_unlink(cid, oid);
+  if (cache)
+    cache->invalidate(oid);
   dout(10) << "remove " << cid << "/" << oid << " = " << r << dendl;
   return r;
 }
@@ -2711,6 +2254,8 @@ int FileStore::_truncate(coll_t cid, const sobject_t& oid, uint64_t size)
 {
   dout(15) << "truncate " << cid << "/" << oid << " size " << size << dendl;
   int r = lfn_truncate(cid, oid, size);
+  if (cache)
+    cache->invalidate_data(oid);
   dout(10) << "truncate " << cid << "/" << oid << " size " << size << " = " << r << dendl;
   return r;
 }
@@ -2727,7 +2272,7 @@ int FileStore::_touch(coll_t cid, const sobject_t& oid)
     ::close(fd);
     r = 0;
   } else
-    r = -errno;
+    r = fd;
   dout(10) << "touch " << cid << "/" << oid << " = " << r << dendl;
   return r;
 }
@@ -2745,8 +2290,8 @@ int FileStore::_write(coll_t cid, const sobject_t& oid,
   int flags = O_WRONLY|O_CREAT;
   int fd = lfn_open(cid, oid, flags, 0644);
   if (fd < 0) {
-    dout(0) << "write couldn't open " << cid << "/" << oid << " flags " << flags << " errno " << errno << " " << strerror_r(errno, buf, sizeof(buf)) << dendl;
-    r = -errno;
+    dout(0) << "write couldn't open " << cid << "/" << oid << " flags " << flags << ": " << cpp_strerror(fd) << dendl;
+    r = fd;
     goto out;
   }
     
@@ -2767,6 +2312,8 @@ int FileStore::_write(coll_t cid, const sobject_t& oid,
   r = bl.write_fd(fd);
   if (r == 0)
     r = bl.length();
+  if (cache)
+    cache->invalidate_data(oid);
 
   // flush?
 #ifdef HAVE_SYNC_FILE_RANGE
@@ -2801,12 +2348,12 @@ int FileStore::_clone(coll_t cid, const sobject_t& oldoid, const sobject_t& newo
   int o, n, r;
   o = lfn_open(cid, oldoid, O_RDONLY);
   if (o < 0) {
-    r = -errno;
+    r = o;
     goto out2;
   }
   n = lfn_open(cid, newoid, O_CREAT|O_TRUNC|O_WRONLY, 0644);
   if (n < 0) {
-    r = -errno;
+    r = n;
     goto out;
   }
   if (btrfs)
@@ -2825,6 +2372,8 @@ int FileStore::_clone(coll_t cid, const sobject_t& oldoid, const sobject_t& newo
     r = -errno;
 
   ::close(n);
+  if (cache)
+    cache->invalidate(newoid);
  out:
   ::close(o);
  out2:
@@ -2835,7 +2384,7 @@ int FileStore::_clone(coll_t cid, const sobject_t& oldoid, const sobject_t& newo
 int FileStore::_do_clone_range(int from, int to, uint64_t srcoff, uint64_t len, uint64_t dstoff)
 {
   dout(20) << "_do_clone_range " << srcoff << "~" << len << " to " << dstoff << dendl;
-  if (!btrfs_clone_range ||
+  if ((!btrfs_clone_range && !copy_reflink.read()) ||
       srcoff % blk_size != dstoff % blk_size) {
     dout(20) << "_do_clone_range using copy" << dendl;
     return _do_copy_range(from, to, srcoff, len, dstoff);
@@ -2871,6 +2420,9 @@ int FileStore::_do_clone_range(int from, int to, uint64_t srcoff, uint64_t len,
   
   dout(20) << "_do_clone_range cloning " << srcoffclone << "~" << lenclone 
 	   << " to " << dstoffclone << " = " << r << dendl;
+  utime_t start = ceph_clock_now(g_ceph_context);
+  // same request as the generic FICLONERANGE, which later kernels
+  // implement for more than btrfs
   btrfs_ioctl_clone_range_args a;
   a.src_fd = from;
   a.src_offset = srcoffclone;
@@ -2878,7 +2430,17 @@ int FileStore::_do_clone_range(int from, int to, uint64_t srcoff, uint64_t len,
   a.dest_offset = dstoffclone;
   err = ::ioctl(to, BTRFS_IOC_CLONE_RANGE, &a);
   if (err >= 0) {
-    r += err;
+    r += lenclone;
+    if (logger) {
+      logger->inc(l_os_copy_reflink);
+      logger->inc(l_os_copy_bytes, lenclone);
+      logger->finc(l_os_copy_lat, ceph_clock_now(g_ceph_context) - start);
+    }
+  } else if (!btrfs && (errno == ENOTTY || errno == EOPNOTSUPP || errno == EXDEV)) {
+    dout(0) << "_do_clone_range clone ioctl not supported here (" << cpp_strerror(errno)
+	    << "), not trying again" << dendl;
+    copy_reflink.set(0);
+    return _do_copy_range(from, to, srcoff, len, dstoff);
   } else if (errno == EINVAL) {
     // Still failed, might be compressed
     dout(20) << "_do_clone_range failed CLONE_RANGE call with -EINVAL, using copy" << dendl;
@@ -2893,30 +2455,178 @@ int FileStore::_do_clone_range(int from, int to, uint64_t srcoff, uint64_t len,
     if (err >= 0) {
       r += err;
     } else {
-      return -errno;
+      return err;
+    }
+  }
+
+  // Copy end
+  if (srcoffclone + lenclone != srcoff + len) {
+    err = _do_copy_range(from, to, 
+			 srcoffclone + lenclone, 
+			 (srcoff + len) - (srcoffclone + lenclone), 
+			 dstoffclone + lenclone);
+    if (err >= 0) {
+      r += err;
+    } else {
+      return err;
+    }
+  }
+  dout(20) << "_do_clone_range finished " << srcoff << "~" << len 
+	   << " to " << dstoff << " = " << r << dendl;
+  return r;
+}
+
+/*
+ * Copy srcoff~len of from to dstoff of to, keeping the data in the
+ * kernel where we can: splice through a pipe, then sendfile, then a
+ * plain read/write loop.  The offload helpers return -EOPNOTSUPP
+ * (having written nothing) when the kernel or file system can't do
+ * the job, and we don't ask them again.
+ *
+ * Returns the number of bytes copied.
+ */
+int FileStore::_do_copy_range(int from, int to, uint64_t srcoff, uint64_t len, uint64_t dstoff)
+{
+  dout(20) << "_do_copy_range " << srcoff << "~" << len << " to " << dstoff << dendl;
+  utime_t start = ceph_clock_now(g_ceph_context);
+  int r = -EOPNOTSUPP;
+  int path = l_os_copy_buffered;
+
+  if (copy_splice.read()) {
+    r = _do_splice_range(from, to, srcoff, len, dstoff);
+    if (r == -EOPNOTSUPP) {
+      dout(0) << "_do_copy_range splice not supported, not trying again" << dendl;
+      copy_splice.set(0);
+    }
+    path = l_os_copy_splice;
+  }
+  if (r == -EOPNOTSUPP && copy_sendfile.read()) {
+    r = _do_sendfile_range(from, to, srcoff, len, dstoff);
+    if (r == -EOPNOTSUPP) {
+      dout(0) << "_do_copy_range sendfile not supported, not trying again" << dendl;
+      copy_sendfile.set(0);
+    }
+    path = l_os_copy_sendfile;
+  }
+  if (r == -EOPNOTSUPP) {
+    r = _do_buffered_copy_range(from, to, srcoff, len, dstoff);
+    path = l_os_copy_buffered;
+  }
+
+  if (r >= 0 && logger) {
+    logger->inc(path);
+    logger->inc(l_os_copy_bytes, r);
+    logger->finc(l_os_copy_lat, ceph_clock_now(g_ceph_context) - start);
+  }
+  dout(20) << "_do_copy_range " << srcoff << "~" << len << " to " << dstoff << " = " << r << dendl;
+  return r;
+}
+
+int FileStore::_do_splice_range(int from, int to, uint64_t srcoff, uint64_t len, uint64_t dstoff)
+{
+#ifndef DARWIN
+  int pfd[2];
+  if (::pipe(pfd) < 0)
+    return -EOPNOTSUPP;
+  // a bigger pipe means fewer round trips; fine if we can't have it
+  size_t chunk = 64 << 10;
+#ifdef F_SETPIPE_SZ
+  int psize = ::fcntl(pfd[1], F_SETPIPE_SZ, 1 << 20);
+  if (psize > 0)
+    chunk = psize;
+#endif
+
+  loff_t in = srcoff, out = dstoff;
+  uint64_t done = 0;
+  int r = 0;
+  while (done < len) {
+    ssize_t n = ::splice(from, &in, pfd[1], NULL, MIN(len - done, chunk), SPLICE_F_MOVE);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      r = -errno;
+      break;
+    }
+    if (n == 0) {
+      r = -ERANGE;
+      derr << "FileStore::_do_splice_range got short read at " << in
+	   << " of " << srcoff << "~" << len << dendl;
+      break;
+    }
+    ssize_t left = n;
+    while (left > 0) {
+      ssize_t m = ::splice(pfd[0], NULL, to, &out, left, SPLICE_F_MOVE);
+      if (m < 0) {
+	if (errno == EINTR)
+	  continue;
+	r = -errno;
+	break;
+      }
+      left -= m;
+    }
+    if (r < 0)
+      break;
+    done += n;
+  }
+  ::close(pfd[0]);
+  ::close(pfd[1]);
+
+  if (r < 0) {
+    if (done == 0 && out == (loff_t)dstoff &&
+	(r == -EINVAL || r == -ENOSYS || r == -EOPNOTSUPP))
+      return -EOPNOTSUPP;
+    derr << "FileStore::_do_splice_range: error at " << in << " -> " << out
+	 << ", " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  return done;
+#else
+  return -EOPNOTSUPP;
+#endif
+}
+
+int FileStore::_do_sendfile_range(int from, int to, uint64_t srcoff, uint64_t len, uint64_t dstoff)
+{
+#ifndef DARWIN
+  // sendfile writes at the file position of the target
+  if (::lseek64(to, dstoff, SEEK_SET) < 0)
+    return -errno;
+
+  off_t in = srcoff;
+  uint64_t done = 0;
+  int r = 0;
+  while (done < len) {
+    ssize_t n = ::sendfile(to, from, &in, MIN(len - done, 1ull << 30));
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      r = -errno;
+      break;
+    }
+    if (n == 0) {
+      r = -ERANGE;
+      derr << "FileStore::_do_sendfile_range got short read at " << in
+	   << " of " << srcoff << "~" << len << dendl;
+      break;
     }
+    done += n;
   }
 
-  // Copy end
-  if (srcoffclone + lenclone != srcoff + len) {
-    err = _do_copy_range(from, to, 
-			 srcoffclone + lenclone, 
-			 (srcoff + len) - (srcoffclone + lenclone), 
-			 dstoffclone + lenclone);
-    if (err >= 0) {
-      r += err;
-    } else {
-      return -errno;
-    }
+  if (r < 0) {
+    if (done == 0 && (r == -EINVAL || r == -ENOSYS || r == -EOPNOTSUPP))
+      return -EOPNOTSUPP;
+    derr << "FileStore::_do_sendfile_range: error at " << in
+	 << ", " << cpp_strerror(r) << dendl;
+    return r;
   }
-  dout(20) << "_do_clone_range finished " << srcoff << "~" << len 
-	   << " to " << dstoff << " = " << r << dendl;
-  return r;
+  return done;
+#else
+  return -EOPNOTSUPP;
+#endif
 }
 
-int FileStore::_do_copy_range(int from, int to, uint64_t srcoff, uint64_t len, uint64_t dstoff)
+int FileStore::_do_buffered_copy_range(int from, int to, uint64_t srcoff, uint64_t len, uint64_t dstoff)
 {
-  dout(20) << "_do_copy_range " << srcoff << "~" << len << " to " << dstoff << dendl;
   int r = 0;
   ::lseek64(from, srcoff, SEEK_SET);
   ::lseek64(to, dstoff, SEEK_SET);
@@ -2958,8 +2668,9 @@ int FileStore::_do_copy_range(int from, int to, uint64_t srcoff, uint64_t len, u
       break;
     pos += r;
   }
-  dout(20) << "_do_copy_range " << srcoff << "~" << len << " to " << dstoff << " = " << r << dendl;
-  return r;
+  if (r < 0)
+    return r;
+  return pos - srcoff;
 }
 
 int FileStore::_clone_range(coll_t cid, const sobject_t& oldoid, const sobject_t& newoid,
@@ -2971,16 +2682,18 @@ int FileStore::_clone_range(coll_t cid, const sobject_t& oldoid, const sobject_t
   int o, n;
   o = lfn_open(cid, oldoid, O_RDONLY);
   if (o < 0) {
-    r = -errno;
+    r = o;
     goto out2;
   }
   n = lfn_open(cid, newoid, O_CREAT|O_WRONLY, 0644);
   if (n < 0) {
-    r = -errno;
+    r = n;
     goto out;
   }
   r = _do_clone_range(o, n, srcoff, len, dstoff);
   ::close(n);
+  if (cache)
+    cache->invalidate_data(newoid);
  out:
   ::close(o);
  out2:
@@ -3383,15 +3096,15 @@ int FileStore::_getattr(coll_t cid, const sobject_t& oid, const char *name, buff
 int FileStore::_getattr(const char *fn, const char *name, bufferptr& bp)
 {
   char val[100];
-  int l = do_getxattr(fn, name, val, sizeof(val));
+  int l = chain_getxattr(fn, name, val, sizeof(val));
   if (l >= 0) {
     bp = buffer::create(l);
     memcpy(bp.c_str(), val, l);
   } else if (l == -ERANGE) {
-    l = do_getxattr(fn, name, 0, 0);
+    l = chain_getxattr(fn, name, 0, 0);
     if (l) {
       bp = buffer::create(l);
-      l = do_getxattr(fn, name, bp.c_str(), l);
+      l = chain_getxattr(fn, name, bp.c_str(), l);
     }
   }
   return l;
@@ -3445,7 +3158,7 @@ int FileStore::_getattrs(coll_t cid, const sobject_t& oid, map<string,bufferptr>
   }
 
   delete[] names2;
-  return 0;
+  return _kv_getattrs(cid, oid, aset, user_only);
 }
 
 
@@ -3455,16 +3168,16 @@ int FileStore::_getattrs(const char *fn, map<string,bufferptr>& aset, bool user_
 {
   // get attr list
   char names1[100];
-  int len = do_listxattr(fn, names1, sizeof(names1)-1);
+  int len = chain_listxattr(fn, names1, sizeof(names1)-1);
   char *names2 = 0;
   char *name = 0;
   if (len == -ERANGE) {
-    len = do_listxattr(fn, 0, 0);
+    len = chain_listxattr(fn, 0, 0);
     if (len < 0)
       return len;
     dout(10) << " -ERANGE, len is " << len << dendl;
     names2 = new char[len+1];
-    len = do_listxattr(fn, names2, len);
+    len = chain_listxattr(fn, names2, len);
     dout(10) << " -ERANGE, got " << len << dendl;
     if (len < 0)
       return len;
@@ -3502,6 +3215,251 @@ int FileStore::_getattrs(const char *fn, map<string,bufferptr>& aset, bool user_
   return 0;
 }
 
+// kv attrs
+
+#define KV_ATTR_FILE ".attrlog"
+#define KV_ID_XATTR "user.cephos.kvid"  // not under user.ceph., so never listed
+#define KV_ID_KEY "kvid"  // shorter than any id prefix, so no object sees it
+#define KV_ID_BATCH 1024
+#define KV_COLL_XATTR "user.cephos.kvattrs"  // on collections that may hold kv attrs
+
+int FileStore::open_kv()
+{
+  KeyValueLog *kv = new KeyValueLog(current_fn + "/" KV_ATTR_FILE,
+				    g_conf->filestore_kv_compact_min);
+  int r = kv->open(g_conf->filestore_kv_attrs);
+  if (r == -ENOENT) {
+    delete kv;
+    return 0;
+  }
+  if (r < 0) {
+    derr << "open_kv " << kv->get_path() << ": " << cpp_strerror(r) << dendl;
+    delete kv;
+    return r;
+  }
+
+  // any id below the reservation may be in use
+  bufferlist bl;
+  kv_max_id = 0;
+  if (kv->get(KV_ID_KEY, &bl) == 0) {
+    bufferlist::iterator p = bl.begin();
+    ::decode(kv_max_id, p);
+  }
+  kv_next_id = kv_max_id;
+
+  dout(10) << "open_kv " << kv->get_path() << " next id " << kv_next_id << dendl;
+  kv_store = kv;
+  return 0;
+}
+
+bool FileStore::kv_spill(size_t len, size_t count)
+{
+  if (!kv_store || !g_conf->filestore_kv_attrs)
+    return false;
+  return len > (size_t)g_conf->filestore_kv_attr_size_threshold ||
+    count > (size_t)g_conf->filestore_kv_attr_count_threshold;
+}
+
+/// whether any object in c may have kv attrs
+bool FileStore::kv_coll(coll_t c)
+{
+  {
+    RWLock::RLocker l(kv_colls_lock);
+    hash_map<coll_t, bool>::iterator p = kv_colls.find(c);
+    if (p != kv_colls.end())
+      return p->second;
+  }
+  char fn[PATH_MAX];
+  get_cdir(c, fn, sizeof(fn));
+  char v;
+  bool marked = chain_getxattr(fn, KV_COLL_XATTR, &v, sizeof(v)) >= 0;
+  RWLock::WLocker l(kv_colls_lock);
+  kv_colls[c] = marked;
+  return marked;
+}
+
+/*
+ * mark c before one of its objects gets an id.  the mark is an xattr
+ * on the collection dir, so it is synced with the object's own xattrs
+ * and replayed with them.
+ */
+int FileStore::kv_mark_coll(coll_t c)
+{
+  if (kv_coll(c))
+    return 0;
+  char fn[PATH_MAX];
+  get_cdir(c, fn, sizeof(fn));
+  int r = chain_setxattr(fn, KV_COLL_XATTR, "1", 1);
+  if (r < 0)
+    return r;
+  dout(10) << "kv_mark_coll " << c << dendl;
+  RWLock::WLocker l(kv_colls_lock);
+  kv_colls[c] = true;
+  return 0;
+}
+
+/*
+ * the key prefix of oid's kv attrs: 1 if it has one, 0 if it has none
+ * (and create is not set).  objects in unmarked collections have none,
+ * and aren't asked.
+ *
+ * a new id is taken from a batch whose reservation is synced before
+ * the id is handed out, so an id is never reused after a crash, even
+ * if the xattr that holds it made it to disk and the log did not.
+ */
+int FileStore::kv_attr_prefix(coll_t cid, const sobject_t& oid, string *prefix, bool create)
+{
+  if (!create && !kv_coll(cid))
+    return 0;
+  char val[sizeof(uint64_t)];
+  int r = lfn_getxattr(cid, oid, KV_ID_XATTR, val, sizeof(val));
+  if (r == -ENODATA && create) {
+    Mutex::Locker l(kv_lock);
+    // a link in another collection may have beaten us to it
+    r = lfn_getxattr(cid, oid, KV_ID_XATTR, val, sizeof(val));
+    if (r == -ENODATA) {
+      r = kv_mark_coll(cid);
+      if (r < 0)
+	return r;
+      if (kv_next_id == kv_max_id) {
+	KeyValueLog::Transaction t;
+	bufferlist bl;
+	::encode(kv_max_id + KV_ID_BATCH, bl);
+	t.set(KV_ID_KEY, bl);
+	r = kv_store->submit(t);
+	if (r >= 0)
+	  r = kv_store->sync();
+	if (r < 0)
+	  return r;
+	kv_max_id += KV_ID_BATCH;
+      }
+      bufferlist bl;
+      ::encode(kv_next_id, bl);
+      r = lfn_setxattr(cid, oid, KV_ID_XATTR, bl.c_str(), bl.length());
+      if (r < 0)
+	return r;
+      dout(20) << "kv_attr_prefix " << cid << "/" << oid << " new id " << kv_next_id << dendl;
+      kv_next_id++;
+      memcpy(val, bl.c_str(), sizeof(val));
+      r = sizeof(val);
+    }
+  }
+  if (r == -ENODATA)
+    return 0;
+  if (r < 0)
+    return r;
+  if (r != sizeof(val))
+    return -EIO;
+  *prefix = string(val, sizeof(val));
+  return 1;
+}
+
+/// -ENOENT if name is not in the kv store
+int FileStore::_kv_getattr(coll_t cid, const sobject_t& oid, const char *name, bufferptr& bp)
+{
+  if (!kv_store)
+    return -ENOENT;
+  string prefix;
+  int r = kv_attr_prefix(cid, oid, &prefix);
+  if (r <= 0)
+    return r == 0 ? -ENOENT : r;
+  bufferlist bl;
+  r = kv_store->get(prefix + name, &bl);
+  if (r < 0)
+    return r;
+  if (bl.buffers().size() == 1)
+    bp = bl.buffers().front();
+  else {
+    bp = buffer::create(bl.length());
+    bl.copy(0, bl.length(), bp.c_str());
+  }
+  return bp.length();
+}
+
+int FileStore::_kv_getattrs(coll_t cid, const sobject_t& oid, map<string,bufferptr>& aset, bool user_only)
+{
+  if (!kv_store)
+    return 0;
+  string prefix;
+  int r = kv_attr_prefix(cid, oid, &prefix);
+  if (r <= 0)
+    return r;
+  map<string,bufferlist> vals;
+  r = kv_store->get_prefix(prefix, &vals);
+  if (r < 0)
+    return r;
+  for (map<string,bufferlist>::iterator p = vals.begin(); p != vals.end(); ++p) {
+    string name = p->first;
+    if (user_only) {
+      if (name.length() < 2 || name[0] != '_')
+	continue;
+      name = name.substr(1);
+    }
+    bufferptr &bp = aset[name];
+    if (p->second.buffers().size() == 1)
+      bp = p->second.buffers().front();
+    else {
+      bp = buffer::create(p->second.length());
+      p->second.copy(0, p->second.length(), bp.c_str());
+    }
+  }
+  return 0;
+}
+
+/// 1 if name was removed, 0 if it was not there
+int FileStore::_kv_rmattr(coll_t cid, const sobject_t& oid, const char *name)
+{
+  if (!kv_store)
+    return 0;
+  string prefix;
+  int r = kv_attr_prefix(cid, oid, &prefix);
+  if (r <= 0)
+    return r;
+  string key = prefix + name;
+  if (!kv_store->exists(key))
+    return 0;
+  KeyValueLog::Transaction t;
+  t.rm(key);
+  r = kv_store->submit(t);
+  return r < 0 ? r : 1;
+}
+
+int FileStore::_kv_rmattrs(coll_t cid, const sobject_t& oid)
+{
+  if (!kv_store)
+    return 0;
+  string prefix;
+  int r = kv_attr_prefix(cid, oid, &prefix);
+  if (r <= 0)
+    return r;
+  KeyValueLog::Transaction t;
+  if (kv_store->rm_prefix(prefix, &t) == 0)
+    return 0;
+  return kv_store->submit(t);
+}
+
+/*
+ * unlink oid from cid, dropping its kv attrs with its last link.  the
+ * link count is checked and dropped under kv_lock so that two
+ * collection_removes of the same object cannot both see the other's
+ * link.  if the unlink reaches disk before the log does and we crash,
+ * replay finds no object and the entries are orphaned; since ids are
+ * never reused, nothing will see them.
+ */
+int FileStore::_kv_unlink(coll_t cid, const sobject_t& oid)
+{
+  if (!kv_store || !kv_coll(cid))
+    return lfn_unlink(cid, oid);
+  Mutex::Locker l(kv_lock);
+  struct stat st;
+  int r = lfn_stat(cid, oid, &st);
+  if (r == 0 && st.st_nlink == 1)
+    r = _kv_rmattrs(cid, oid);
+  if (r < 0 && r != -ENOENT)
+    return r;
+  return lfn_unlink(cid, oid);
+}
+
 // objects
 
 int FileStore::getattr(coll_t cid, const sobject_t& oid, const char *name,
@@ -3510,6 +3468,17 @@ int FileStore::getattr(coll_t cid, const sobject_t& oid, const char *name,
   if (fake_attrs) return attrs.getattr(cid, oid, name, value, size);
 
   dout(15) << "getattr " << cid << "/" << oid << " '" << name << "' len " << size << dendl;
+  if (cache || kv_store) {
+    bufferptr bp;
+    int r = getattr(cid, oid, name, bp);
+    if (r > 0 && size) {   // size == 0 just asks for the length
+      if ((size_t)r > size)
+	r = -ERANGE;
+      else
+	memcpy(value, bp.c_str(), r);
+    }
+    return r;
+  }
   char n[ATTR_MAX_NAME_LEN];
   get_attrname(name, n, ATTR_MAX_NAME_LEN);
   int r = lfn_getxattr(cid, oid, n, value, size);
@@ -3522,9 +3491,32 @@ int FileStore::getattr(coll_t cid, const sobject_t& oid, const char *name, buffe
   if (fake_attrs) return attrs.getattr(cid, oid, name, bp);
 
   dout(15) << "getattr " << cid << "/" << oid << " '" << name << "'" << dendl;
+  uint64_t gen = 0;
+  if (cache) {
+    int r = cache->get_attr(cid, oid, name, &bp);
+    if (r != -ENOENT) {
+      if (logger)
+	logger->inc(l_os_cache_attr_hit);
+      if (r == 0)
+	r = bp.length();
+      dout(10) << "getattr " << cid << "/" << oid << " '" << name << "' = " << r << " (cached)" << dendl;
+      return r;
+    }
+    if (logger)
+      logger->inc(l_os_cache_attr_miss);
+    gen = cache->get_gen(oid);
+  }
+  // a spilled attr has no xattr, so only a missing one sends us to the log
   char n[ATTR_MAX_NAME_LEN];
   get_attrname(name, n, ATTR_MAX_NAME_LEN);
   int r = _getattr(cid, oid, n, bp);
+  if (r == -ENODATA) {
+    int kr = _kv_getattr(cid, oid, name, bp);
+    if (kr != -ENOENT)
+      r = kr;
+  }
+  if (cache && r >= 0)
+    cache->add_attr(gen, cid, oid, name, bp);
   dout(10) << "getattr " << cid << "/" << oid << " '" << name << "' = " << r << dendl;
   return r;
 }
@@ -3534,7 +3526,34 @@ int FileStore::getattrs(coll_t cid, const sobject_t& oid, map<string,bufferptr>&
   if (fake_attrs) return attrs.getattrs(cid, oid, aset);
 
   dout(15) << "getattrs " << cid << "/" << oid << dendl;
-  int r = _getattrs(cid, oid, aset, user_only);
+  if (!cache) {
+    int r = _getattrs(cid, oid, aset, user_only);
+    dout(10) << "getattrs " << cid << "/" << oid << " = " << r << dendl;
+    return r;
+  }
+
+  // the cache holds the full set; filter for user_only ourselves
+  map<string,bufferptr> all;
+  int r = 0;
+  if (cache->get_attrs(cid, oid, &all)) {
+    if (logger)
+      logger->inc(l_os_cache_attr_hit);
+  } else {
+    if (logger)
+      logger->inc(l_os_cache_attr_miss);
+    uint64_t gen = cache->get_gen(oid);
+    r = _getattrs(cid, oid, all, false);
+    if (r >= 0)
+      cache->add_attrs(gen, cid, oid, all);
+  }
+  if (r >= 0) {
+    for (map<string,bufferptr>::iterator p = all.begin(); p != all.end(); ++p) {
+      if (!user_only)
+	aset[p->first] = p->second;
+      else if (p->first.length() > 1 && p->first[0] == '_')
+	aset[p->first.substr(1)] = p->second;
+    }
+  }
   dout(10) << "getattrs " << cid << "/" << oid << " = " << r << dendl;
   return r;
 }
@@ -3547,7 +3566,32 @@ int FileStore::_setattr(coll_t cid, const sobject_t& oid, const char *name,
   dout(15) << "setattr " << cid << "/" << oid << " '" << name << "' len " << size << dendl;
   char n[ATTR_MAX_NAME_LEN];
   get_attrname(name, n, ATTR_MAX_NAME_LEN);
-  int r = lfn_setxattr(cid, oid, n, value, size);
+  int r;
+  if (kv_spill(size, 1)) {
+    string prefix;
+    r = kv_attr_prefix(cid, oid, &prefix, true);
+    if (r >= 0) {
+      KeyValueLog::Transaction t;
+      bufferlist bl;
+      bl.append((const char *)value, size);
+      t.set(prefix + name, bl);
+      r = kv_store->submit(t);
+      if (r >= 0) {
+	r = lfn_removexattr(cid, oid, n);   // any older, smaller value
+	if (r == -ENODATA)
+	  r = 0;
+      }
+    }
+  } else {
+    r = lfn_setxattr(cid, oid, n, value, size);
+    if (r >= 0) {
+      int kr = _kv_rmattr(cid, oid, name);
+      if (kr < 0)
+	r = kr;
+    }
+  }
+  if (cache)
+    cache->invalidate_attrs(oid);
   dout(10) << "setattr " << cid << "/" << oid << " '" << name << "' len " << size << " = " << r << dendl;
   return r;
 }
@@ -3558,11 +3602,38 @@ int FileStore::_setattrs(coll_t cid, const sobject_t& oid, map<string,bufferptr>
 
   dout(15) << "setattrs " << cid << "/" << oid << dendl;
   int r = 0;
+
+  // past the count threshold the whole set goes to the kv store, in one
+  // record, so that getattrs can fetch it with one read
+  bool spill_all = kv_spill(0, aset.size());
+  bool spill = spill_all;
+  for (map<string,bufferptr>::iterator p = aset.begin(); !spill && p != aset.end(); ++p)
+    spill = kv_spill(p->second.length(), 1);
+  string prefix;
+  bool has_prefix = false;
+  if (kv_store) {
+    r = kv_attr_prefix(cid, oid, &prefix, spill);
+    if (r < 0) {
+      dout(10) << "setattrs " << cid << "/" << oid << " = " << r << dendl;
+      return r;
+    }
+    has_prefix = r > 0;
+    r = 0;
+  }
+  KeyValueLog::Transaction t;
+  list<string> spilled;
   for (map<string,bufferptr>::iterator p = aset.begin();
        p != aset.end();
        ++p) {
     char n[ATTR_MAX_NAME_LEN];
     get_attrname(p->first.c_str(), n, ATTR_MAX_NAME_LEN);
+    if (spill_all || kv_spill(p->second.length(), 1)) {
+      bufferlist bl;
+      bl.append(p->second);
+      t.set(prefix + p->first, bl);
+      spilled.push_back(n);
+      continue;
+    }
     const char *val;
     if (p->second.length())
       val = p->second.c_str();
@@ -3571,10 +3642,22 @@ int FileStore::_setattrs(coll_t cid, const sobject_t& oid, map<string,bufferptr>
     // ??? Why do we skip setting all the other attrs if one fails?
     r = lfn_setxattr(cid, oid, n, val, p->second.length());
     if (r < 0) {
-      derr << "FileStore::_setattrs: do_setxattr returned " << r << dendl;
+      derr << "FileStore::_setattrs: chain_setxattr returned " << r << dendl;
       break;
     }
+    if (has_prefix && kv_store->exists(prefix + p->first))
+      t.rm(prefix + p->first);
+  }
+  if (r >= 0 && !t.empty()) {
+    r = kv_store->submit(t);
+    for (list<string>::iterator p = spilled.begin(); r >= 0 && p != spilled.end(); ++p) {
+      r = lfn_removexattr(cid, oid, p->c_str());
+      if (r == -ENODATA)
+	r = 0;
+    }
   }
+  if (cache)
+    cache->invalidate_attrs(oid);
   dout(10) << "setattrs " << cid << "/" << oid << " = " << r << dendl;
   return r;
 }
@@ -3588,6 +3671,13 @@ int FileStore::_rmattr(coll_t cid, const sobject_t& oid, const char *name)
   char n[ATTR_MAX_NAME_LEN];
   get_attrname(name, n, ATTR_MAX_NAME_LEN);
   int r = lfn_removexattr(cid, oid, n);
+  int kr = _kv_rmattr(cid, oid, name);
+  if (kr < 0)
+    r = kr;
+  else if (kr > 0 && r == -ENODATA)
+    r = 0;
+  if (cache)
+    cache->invalidate_attrs(oid);
   dout(10) << "rmattr " << cid << "/" << oid << " '" << name << "' = " << r << dendl;
   return r;
 }
@@ -3598,8 +3688,11 @@ int FileStore::_rmattrs(coll_t cid, const sobject_t& oid)
 
   dout(15) << "rmattrs " << cid << "/" << oid << dendl;
 
+  // kv attrs first, so that _getattrs only reports xattrs below
+  int r = _kv_rmattrs(cid, oid);
   map<string,bufferptr> aset;
-  int r = _getattrs(cid, oid, aset);
+  if (r >= 0)
+    r = _getattrs(cid, oid, aset);
   if (r >= 0) {
     for (map<string,bufferptr>::iterator p = aset.begin(); p != aset.end(); p++) {
       char n[ATTR_MAX_NAME_LEN];
@@ -3609,6 +3702,8 @@ int FileStore::_rmattrs(coll_t cid, const sobject_t& oid)
 	break;
     }
   }
+  if (cache)
+    cache->invalidate_attrs(oid);
   dout(10) << "rmattrs " << cid << "/" << oid << " = " << r << dendl;
   return r;
 }
@@ -3627,7 +3722,7 @@ int FileStore::collection_getattr(coll_t c, const char *name,
   dout(15) << "collection_getattr " << fn << " '" << name << "' len " << size << dendl;
   char n[PATH_MAX];
   get_attrname(name, n, PATH_MAX);
-  int r = do_getxattr(fn, n, value, size);   
+  int r = chain_getxattr(fn, n, value, size);   
   dout(10) << "collection_getattr " << fn << " '" << name << "' len " << size << " = " << r << dendl;
   return r;
 }
@@ -3672,7 +3767,7 @@ int FileStore::_collection_setattr(coll_t c, const char *name,
   dout(10) << "collection_setattr " << fn << " '" << name << "' len " << size << dendl;
   char n[PATH_MAX];
   get_attrname(name, n, PATH_MAX);
-  int r = do_setxattr(fn, n, value, size);
+  int r = chain_setxattr(fn, n, value, size);
   dout(10) << "collection_setattr " << fn << " '" << name << "' len " << size << " = " << r << dendl;
   return r;
 }
@@ -3686,7 +3781,7 @@ int FileStore::_collection_rmattr(coll_t c, const char *name)
   dout(15) << "collection_rmattr " << fn << dendl;
   char n[PATH_MAX];
   get_attrname(name, n, PATH_MAX);
-  int r = do_removexattr(fn, n);
+  int r = chain_removexattr(fn, n);
   dout(10) << "collection_rmattr " << fn << " = " << r << dendl;
   return r;
 }
@@ -3705,7 +3800,7 @@ int FileStore::_collection_setattrs(coll_t cid, map<string,bufferptr>& aset)
        ++p) {
     char n[PATH_MAX];
     get_attrname(p->first.c_str(), n, PATH_MAX);
-    r = do_setxattr(fn, n, p->second.c_str(), p->second.length());
+    r = chain_setxattr(fn, n, p->second.c_str(), p->second.length());
     if (r < 0) break;
   }
   dout(10) << "collection_setattrs " << fn << " = " << r << dendl;
@@ -3718,6 +3813,17 @@ int FileStore::_collection_rename(const coll_t &cid, const coll_t &ncid)
   if (::rename(cid.c_str(), ncid.c_str())) {
     ret = errno;
   }
+  index_manager.put_index(cid);
+  index_manager.put_index(ncid);
+  {
+    RWLock::WLocker l(kv_colls_lock);
+    kv_colls.erase(cid);
+    kv_colls.erase(ncid);
+  }
+  if (cache) {
+    cache->invalidate_collection(cid);
+    cache->invalidate_collection(ncid);
+  }
   dout(10) << "collection_rename '" << cid << "' to '" << ncid << "'"
 	   << ": ret = " << ret << dendl;
   return ret;
@@ -3771,7 +3877,7 @@ int FileStore::list_collections(vector<coll_t>& ls)
 	 (de->d_name[1] == '.' &&
 	  de->d_name[2] == '\0')))
       continue;
-    lfn_translate(fn, de->d_name, new_name, sizeof(new_name));
+    LFNIndex::lfn_translate(fn, de->d_name, new_name, sizeof(new_name));
     ls.push_back(coll_t(new_name));
   }
 
@@ -3809,30 +3915,18 @@ bool FileStore::collection_empty(coll_t c)
 {  
   if (fake_collections) return collections.collection_empty(c);
 
-  char buf[PATH_MAX];
-  get_cdir(c, buf, sizeof(buf));
-  dout(15) << "collection_empty " << buf << dendl;
-
-  DIR *dir = ::opendir(buf);
-  if (!dir)
-    return -errno;
-
-  bool empty = true;
-  struct dirent *de;
-  while (::readdir_r(dir, (struct dirent*)buf, &de) == 0) {
-    if (!de)
-      break;
-    // parse
-    if (de->d_name[0] == '.') continue;
-    //cout << "  got object " << de->d_name << std::endl;
-    sobject_t o;
-    if (parse_object(de->d_name, o)) {
-      empty = false;
-      break;
-    }
-  }
-  
-  ::closedir(dir);
+  dout(15) << "collection_empty " << c << dendl;
+  Index index;
+  int r = get_index(c, &index);
+  if (r < 0)
+    return false;
+  RWLock::RLocker l(index->access_lock);
+  vector<sobject_t> ls;
+  collection_list_handle_t handle = 0;
+  r = index->collection_list_partial(0, 1, &ls, &handle);
+  if (r < 0)
+    return false;
+  bool empty = ls.empty();
   dout(10) << "collection_empty " << c << " = " << empty << dendl;
   return empty;
 }
@@ -3842,70 +3936,14 @@ int FileStore::collection_list_partial(coll_t c, snapid_t seq, vector<sobject_t>
 {  
   if (fake_collections) return collections.collection_list(c, ls);
 
-  char dir_name[PATH_MAX], buf[PATH_MAX];
-  get_cdir(c, dir_name, sizeof(dir_name));
-
-  DIR *dir = NULL;
-
-  struct dirent *de;
-  bool end;
-  
-  dir = ::opendir(dir_name);
-
-  if (!dir) {
-    int err = -errno;
-    dout(0) << "error opening directory " << dir_name << dendl;
-    return err;
-  }
-
-  if (handle && *handle) {
-    dout(10) << "collection_list_partial seeking to " << *handle << dendl;
-    seekdir(dir, *handle);
-    *handle = 0;
-  }
-
-  char new_name[PATH_MAX];
-
-  int i=0;
-  while (i < max_count) {
-    errno = 0;
-    end = false;
-    ::readdir_r(dir, (struct dirent*)buf, &de);
-    int err = errno;
-    if (!de && err) {
-      dout(0) << "error reading directory for " << c << dendl;
-      ::closedir(dir);
-      return -err;
-    }
-    if (!de) {
-      end = true;
-      break;
-    }
-
-    // parse
-    if (de->d_name[0] == '.') {
-      continue;
-    }
-    //cout << "  got object " << de->d_name << std::endl;
-    lfn_translate(dir_name, de->d_name, new_name, sizeof(new_name));
-    sobject_t o;
-    if (parse_object(new_name, o)) {
-      if (o.snap >= seq) {
-	ls.push_back(o);
-	i++;
-      }
-    }
-  }
-
-  if (handle && !end) {
-    *handle = (collection_list_handle_t)telldir(dir);
-    dout(10) << "collection_list_partial finished at " << *handle << dendl;
-  }
-
-  ::closedir(dir);
-
-  dout(10) << "collection_list " << c << " = 0 (" << ls.size() << " objects)" << dendl;
-  return 0;
+  Index index;
+  int r = get_index(c, &index);
+  if (r < 0)
+    return r;
+  RWLock::RLocker l(index->access_lock);
+  r = index->collection_list_partial(seq, max_count, &ls, handle);
+  dout(10) << "collection_list_partial " << c << " = " << r << " (" << ls.size() << " objects)" << dendl;
+  return r;
 }
 
 
@@ -3913,46 +3951,15 @@ int FileStore::collection_list(coll_t c, vector<sobject_t>& ls)
 {  
   if (fake_collections) return collections.collection_list(c, ls);
 
-  char dir_name[PATH_MAX], buf[PATH_MAX], new_name[PATH_MAX];
-  get_cdir(c, dir_name, sizeof(dir_name));
-  dout(10) << "collection_list " << dir_name << dendl;
-
-  DIR *dir = ::opendir(dir_name);
-  if (!dir)
-    return -errno;
-  
-  // first, build (ino, object) list
-  vector< pair<ino_t,sobject_t> > inolist;
-
-  struct dirent *de;
-  while (::readdir_r(dir, (struct dirent*)buf, &de) == 0) {
-    if (!de)
-      break;
-    // parse
-    if (de->d_name[0] == '.')
-      continue;
-    //cout << "  got object " << de->d_name << std::endl;
-    sobject_t o;
-    lfn_translate(dir_name, de->d_name, new_name, sizeof(new_name));
-    if (parse_object(new_name, o)) {
-      inolist.push_back(pair<ino_t,sobject_t>(de->d_ino, o));
-      ls.push_back(o);
-    }
-  }
-
-  // sort
-  dout(10) << "collection_list " << c << " sorting " << inolist.size() << " objects" << dendl;
-  sort(inolist.begin(), inolist.end());
-
-  // build final list
-  ls.resize(inolist.size());
-  int i = 0;
-  for (vector< pair<ino_t,sobject_t> >::iterator p = inolist.begin(); p != inolist.end(); p++)
-    ls[i++].swap(p->second);
-  
-  dout(10) << "collection_list " << c << " = 0 (" << ls.size() << " objects)" << dendl;
-  ::closedir(dir);
-  return 0;
+  dout(10) << "collection_list " << c << dendl;
+  Index index;
+  int r = get_index(c, &index);
+  if (r < 0)
+    return r;
+  RWLock::RLocker l(index->access_lock);
+  r = index->collection_list(&ls);
+  dout(10) << "collection_list " << c << " = " << r << " (" << ls.size() << " objects)" << dendl;
+  return r;
 }
 
 
@@ -3965,6 +3972,8 @@ int FileStore::_create_collection(coll_t c)
   dout(15) << "create_collection " << fn << dendl;
   int r = ::mkdir(fn, 0755);
   if (r < 0) r = -errno;
+  if (r == 0)
+    r = index_manager.init_index(c, fn);
   dout(10) << "create_collection " << fn << " = " << r << dendl;
   return r;
 }
@@ -3976,8 +3985,23 @@ int FileStore::_destroy_collection(coll_t c)
   char fn[PATH_MAX];
   get_cdir(c, fn, sizeof(fn));
   dout(15) << "_destroy_collection " << fn << dendl;
-  int r = ::rmdir(fn);
-  if (r < 0) r = -errno;
+  Index index;
+  int r = get_index(c, &index);
+  if (r == 0) {
+    RWLock::WLocker l(index->access_lock);
+    r = index->prep_delete();
+  }
+  if (r == 0) {
+    r = ::rmdir(fn);
+    if (r < 0) r = -errno;
+  }
+  if (r == 0) {
+    index_manager.put_index(c);
+    RWLock::WLocker l(kv_colls_lock);
+    kv_colls.erase(c);
+  }
+  if (cache)
+    cache->invalidate_collection(c);
   dout(10) << "_destroy_collection " << fn << " = " << r << dendl;
   return r;
 }
@@ -3988,17 +4012,45 @@ int FileStore::_collection_add(coll_t c, coll_t cid, const sobject_t& o)
   if (fake_collections) return collections.collection_add(c, o);
 
   dout(15) << "collection_add " << c << "/" << o << " " << cid << "/" << o << dendl;
-  int r = lfn_link(cid, c, o);
+  int r;
+  string prefix;
+  if (kv_store && (r = kv_attr_prefix(cid, o, &prefix)) != 0) {
+    if (r < 0)
+      return r;
+    // the new link shares the kv attrs, so its collection needs the mark
+    Mutex::Locker l(kv_lock);  // see _kv_unlink
+    r = kv_mark_coll(c);
+    if (r >= 0)
+      r = lfn_link(cid, c, o);
+  } else {
+    r = lfn_link(cid, c, o);
+  }
   dout(10) << "collection_add " << c << "/" << o << " " << cid << "/" << o << " = " << r << dendl;
   return r;
 }
 
+void FileStore::trim_from_cache(coll_t cid, const sobject_t& oid, uint64_t offset, size_t len)
+{
+  dout(15) << "trim_from_cache " << cid << "/" << oid << " " << offset << "~" << len << dendl;
+  if (cache)
+    cache->trim(cid, oid, offset, len);
+}
+
+int FileStore::is_cached(coll_t cid, const sobject_t& oid, uint64_t offset, size_t len)
+{
+  if (cache && cache->is_cached(cid, oid, offset, len))
+    return 0;
+  return -ENOENT;
+}
+
 int FileStore::_collection_remove(coll_t c, const sobject_t& o) 
 {
   if (fake_collections) return collections.collection_remove(c, o);
 
   dout(15) << "collection_remove " << c << "/" << o << dendl;
-  int r = lfn_unlink(c, o);
+  int r = _kv_unlink(c, o);
+  if (cache)
+    cache->invalidate(c, o);
   dout(10) << "collection_remove " << c << "/" << o << " = " << r << dendl;
   return r;
 }
@@ -23,8 +23,13 @@
 #include "common/WorkQueue.h"
 
 #include "common/Mutex.h"
+#include "common/RWLock.h"
+#include "include/atomic.h"
 
 #include "Fake.h"
+#include "IndexManager.h"
+#include "ObjectCache.h"
+#include "KeyValueLog.h"
 
 #include <map>
 #include <deque>
@@ -51,6 +56,11 @@ class FileStore : public JournalingObjectStore {
   bool btrfs_snap_create_v2;
   bool btrfs_wait_sync;
   bool ioctl_fiemap;
+
+  // copy offload for clone/copy_range; each is cleared the first time
+  // the kernel tells us it can't do it for this file system.  Op
+  // threads read and clear these concurrently.
+  atomic_t copy_reflink, copy_splice, copy_sendfile;
   int fsid_fd, op_fd;
 
   int basedir_fd, current_fd;
@@ -66,10 +76,40 @@ class FileStore : public JournalingObjectStore {
   
   Finisher ondisk_finisher;
 
+  // collection layouts
+  IndexManager index_manager;
+  int get_index(coll_t c, Index *index);
+
+  // cached attrs and small extents; NULL if disabled
+  ObjectCache *cache;
+
+  // attrs too large or too numerous for xattrs live in a single
+  // KeyValueLog under current/, keyed by an id allocated when an object
+  // first spills and kept in an xattr on it, so that every link of the
+  // object (see collection_add) shares them and a file that reuses its
+  // inode number never sees them.  Opened in mount if it exists or
+  // filestore_kv_attrs is set, and fixed until umount; NULL means no
+  // object has kv attrs.  A collection is marked before any of its
+  // objects gets an id, and objects in unmarked collections never look
+  // at the log.
+  KeyValueLog *kv_store;
+  Mutex kv_lock;  // id allocation, and link counts in collection_add/remove
+  uint64_t kv_next_id, kv_max_id;  // ids below kv_max_id are reserved on disk
+  RWLock kv_colls_lock;
+  hash_map<coll_t, bool> kv_colls;  // whether a collection is marked
+  int open_kv();
+  bool kv_spill(size_t len, size_t count);
+  bool kv_coll(coll_t c);
+  int kv_mark_coll(coll_t c);
+  int kv_attr_prefix(coll_t cid, const sobject_t& oid, string *prefix, bool create=false);
+  int _kv_getattr(coll_t cid, const sobject_t& oid, const char *name, bufferptr& bp);
+  int _kv_getattrs(coll_t cid, const sobject_t& oid, map<string,bufferptr>& aset, bool user_only);
+  int _kv_rmattr(coll_t cid, const sobject_t& oid, const char *name);
+  int _kv_rmattrs(coll_t cid, const sobject_t& oid);
+  int _kv_unlink(coll_t cid, const sobject_t& oid);
+
   // helper fns
-  int append_oname(const sobject_t &oid, char *s, int len);
   int get_cdir(coll_t cid, char *s, int len);
-  bool parse_object(char *s, sobject_t& o);
   
   int lock_fsid();
 
@@ -238,8 +278,6 @@ public:
   void start_logger(int whoami, utime_t tare);
   void stop_logger();
 
-  int lfn_get(coll_t cid, const sobject_t& oid, char *pathname, int len, char *lfn, int lfn_len, int *exist, int *is_lfn);
-  int lfn_find(coll_t cid, const sobject_t& oid, char *pathname, int len);
   int lfn_getxattr(coll_t cid, const sobject_t& oid, const char *name, void *val, size_t size);
   int lfn_setxattr(coll_t cid, const sobject_t& oid, const char *name, const void *val, size_t size);
   int lfn_removexattr(coll_t cid, const sobject_t& oid, const char *name);
@@ -298,6 +336,9 @@ public:
   int _clone_range(coll_t cid, const sobject_t& oldoid, const sobject_t& newoid, uint64_t srcoff, uint64_t len, uint64_t dstoff);
   int _do_clone_range(int from, int to, uint64_t srcoff, uint64_t len, uint64_t dstoff);
   int _do_copy_range(int from, int to, uint64_t srcoff, uint64_t len, uint64_t dstoff);
+  int _do_splice_range(int from, int to, uint64_t srcoff, uint64_t len, uint64_t dstoff);
+  int _do_sendfile_range(int from, int to, uint64_t srcoff, uint64_t len, uint64_t dstoff);
+  int _do_buffered_copy_range(int from, int to, uint64_t srcoff, uint64_t len, uint64_t dstoff);
   int _remove(coll_t cid, const sobject_t& oid);
 
   void _start_sync();
@@ -348,8 +389,9 @@ public:
   int _collection_add(coll_t c, coll_t ocid, const sobject_t& o);
   int _collection_remove(coll_t c, const sobject_t& o);
 
-  void trim_from_cache(coll_t cid, const sobject_t& oid, uint64_t offset, size_t len) {}
-  int is_cached(coll_t cid, const sobject_t& oid, uint64_t offset, size_t len) { return -1; }
+  void trim_from_cache(coll_t cid, const sobject_t& oid, uint64_t offset, size_t len);
+  /// 0 if offset~len can be read without touching the disk, else -ENOENT
+  int is_cached(coll_t cid, const sobject_t& oid, uint64_t offset, size_t len);
 };
 
 #endif
@@ -0,0 +1,116 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2004-2006 Sage Weil <sage@newdream.net>
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "FlatIndex.h"
+
+#include "common/debug.h"
+
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <algorithm>
+
+#define DOUT_SUBSYS filestore
+#undef dout_prefix
+#define dout_prefix *_dout << "flatindex(" << base_path << ") "
+
+int FlatIndex::lookup(const sobject_t &oid, string *path, int *exist)
+{
+  return lfn_get(base_path, oid, path, exist, NULL);
+}
+
+int FlatIndex::created(const sobject_t &oid, const char *path)
+{
+  return lfn_created(path, oid);
+}
+
+int FlatIndex::unlink(const sobject_t &oid, bool exclusive)
+{
+  return lfn_unlink(base_path, oid, exclusive);
+}
+
+int FlatIndex::collection_list(vector<sobject_t> *ls)
+{
+  vector<dir_entry_t> entries;
+  int r = list_objects(base_path, &entries);
+  if (r < 0)
+    return r;
+
+  // sort by inode so that a walk over the list is disk-friendly
+  vector< pair<ino_t,sobject_t> > inolist;
+  inolist.reserve(entries.size());
+  for (vector<dir_entry_t>::iterator p = entries.begin(); p != entries.end(); ++p)
+    inolist.push_back(pair<ino_t,sobject_t>(p->ino, p->oid));
+  dout(10) << "collection_list sorting " << inolist.size() << " objects" << dendl;
+  sort(inolist.begin(), inolist.end());
+
+  ls->resize(inolist.size());
+  int i = 0;
+  for (vector< pair<ino_t,sobject_t> >::iterator p = inolist.begin(); p != inolist.end(); p++)
+    (*ls)[i++].swap(p->second);
+  return 0;
+}
+
+int FlatIndex::collection_list_partial(snapid_t seq, int max_count,
+				       vector<sobject_t> *ls,
+				       collection_list_handle_t *handle)
+{
+  char buf[offsetof(struct dirent, d_name) + PATH_MAX + 1];
+  DIR *dir = ::opendir(base_path.c_str());
+  if (!dir) {
+    int err = -errno;
+    dout(0) << "error opening directory " << base_path << dendl;
+    return err;
+  }
+
+  if (handle && *handle) {
+    dout(10) << "collection_list_partial seeking to " << *handle << dendl;
+    seekdir(dir, *handle);
+    *handle = 0;
+  }
+
+  struct dirent *de;
+  bool end = false;
+  int i = 0;
+  while (i < max_count) {
+    errno = 0;
+    ::readdir_r(dir, (struct dirent *)buf, &de);
+    int err = errno;
+    if (!de && err) {
+      dout(0) << "error reading directory " << base_path << dendl;
+      ::closedir(dir);
+      return -err;
+    }
+    if (!de) {
+      end = true;
+      break;
+    }
+
+    sobject_t o;
+    if (lfn_parse(base_path, de->d_name, &o)) {
+      if (o.snap >= seq) {
+	ls->push_back(o);
+	i++;
+      }
+    }
+  }
+
+  if (handle && !end) {
+    *handle = (collection_list_handle_t)telldir(dir);
+    dout(10) << "collection_list_partial finished at " << *handle << dendl;
+  }
+
+  ::closedir(dir);
+  return 0;
+}
@@ -0,0 +1,42 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2004-2006 Sage Weil <sage@newdream.net>
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OS_FLATINDEX_H
+#define CEPH_OS_FLATINDEX_H
+
+#include "LFNIndex.h"
+
+/**
+ * Legacy layout: every object of the collection lives directly in the
+ * collection directory.
+ */
+class FlatIndex : public LFNIndex {
+public:
+  FlatIndex(coll_t c, const char *path) : LFNIndex(c, path) {}
+
+  uint32_t collection_version() { return FLAT_INDEX_TAG; }
+
+  int init() { return 0; }
+  int cleanup() { return 0; }
+
+  int lookup(const sobject_t &oid, std::string *path, int *exist);
+  int created(const sobject_t &oid, const char *path);
+  int unlink(const sobject_t &oid, bool exclusive);
+  int collection_list(vector<sobject_t> *ls);
+  int collection_list_partial(snapid_t seq, int max_count,
+			      vector<sobject_t> *ls,
+			      collection_list_handle_t *handle);
+};
+
+#endif
@@ -0,0 +1,500 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2004-2006 Sage Weil <sage@newdream.net>
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "HashIndex.h"
+#include "chain_xattr.h"
+
+#include "include/ceph_hash.h"
+#include "common/debug.h"
+#include "common/errno.h"
+
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#define DOUT_SUBSYS filestore
+#undef dout_prefix
+#define dout_prefix *_dout << "hashindex(" << base_path << ") "
+
+#define SUBDIR_PREFIX "DIR_"
+#define SPLIT_ATTR "user.cephos.phash.split"
+
+// partial listing handles: valid bit, 32 bit hash, 20 bit position
+#define HANDLE_VALID    (1ull << 62)
+#define HANDLE_POS_BITS 20
+#define HANDLE_POS_MASK ((1ull << HANDLE_POS_BITS) - 1)
+
+uint32_t HashIndex::hash_oid(const sobject_t &oid)
+{
+  return ceph_str_hash_rjenkins(oid.oid.name.c_str(), oid.oid.name.length());
+}
+
+string HashIndex::subdir_name(int n)
+{
+  char buf[8];
+  snprintf(buf, sizeof(buf), SUBDIR_PREFIX "%X", n);
+  return string(buf);
+}
+
+bool HashIndex::is_subdir_name(const char *name, int *n)
+{
+  if (strncmp(name, SUBDIR_PREFIX, sizeof(SUBDIR_PREFIX) - 1) != 0)
+    return false;
+  const char *c = name + sizeof(SUBDIR_PREFIX) - 1;
+  if (!c[0] || c[1])
+    return false;
+  int v;
+  if (*c >= '0' && *c <= '9')
+    v = *c - '0';
+  else if (*c >= 'A' && *c <= 'F')
+    v = *c - 'A' + 10;
+  else
+    return false;   // objects use lower case hex for their snapid
+  if (n)
+    *n = v;
+  return true;
+}
+
+bool HashIndex::is_private_name(const char *name)
+{
+  return is_subdir_name(name, NULL);
+}
+
+int HashIndex::dir_depth(const string &dir)
+{
+  assert(dir.compare(0, base_path.length(), base_path) == 0);
+  int depth = 0;
+  for (string::size_type i = base_path.length(); i < dir.length(); i++)
+    if (dir[i] == '/')
+      depth++;
+  return depth;
+}
+
+int HashIndex::init()
+{
+  return 0;
+}
+
+int HashIndex::cleanup()
+{
+  char buf[PATH_MAX];
+  int r = chain_getxattr(base_path.c_str(), SPLIT_ATTR, buf, sizeof(buf) - 1);
+  if (r >= 0) {
+    buf[r] = '\0';
+    string dir = base_path + buf;
+    dout(0) << "cleanup: finishing interrupted split of " << dir << dendl;
+    r = complete_split(dir, dir_depth(dir));
+    if (r < 0)
+      return r;
+  } else if (r != -ENODATA) {
+    return r;
+  }
+  split_dirs.clear();
+  return load_split_dirs(base_path, 0);
+}
+
+int HashIndex::load_split_dirs(const string &dir, int depth)
+{
+  if (depth >= MAX_DEPTH)
+    return 0;
+  bool subdirs[16];
+  int r = list_subdirs(dir, subdirs);
+  if (r < 0)
+    return r;
+  for (int n = 0; n < 16; n++) {
+    if (!subdirs[n])
+      continue;
+    split_dirs.insert(dir);
+    r = load_split_dirs(dir + "/" + subdir_name(n), depth + 1);
+    if (r < 0)
+      return r;
+  }
+  return 0;
+}
+
+int HashIndex::find_dir(uint32_t hash, string *dir, int *depth)
+{
+  *dir = base_path;
+  int d;
+  for (d = 0; d < MAX_DEPTH && split_dirs.count(*dir); d++)
+    *dir += "/" + subdir_name(nibble(hash, d));
+  if (depth)
+    *depth = d;
+  return 0;
+}
+
+int HashIndex::lookup(const sobject_t &oid, string *path, int *exist)
+{
+  string dir;
+  int r = find_dir(hash_oid(oid), &dir, NULL);
+  if (r < 0)
+    return r;
+  return lfn_get(dir, oid, path, exist, NULL);
+}
+
+int HashIndex::created(const sobject_t &oid, const char *path)
+{
+  int r = lfn_created(path, oid);
+  if (r < 0)
+    return r;
+
+  string p(path);
+  string dir = p.substr(0, p.rfind('/'));
+  map<string, unsigned>::iterator q = leaf_objs.find(dir);
+  if (q == leaf_objs.end()) {
+    // first time we touch this dir; the count includes the new object
+    vector< pair<uint32_t, sobject_t> > objs;
+    r = list_dir(dir, &objs, NULL);
+    if (r < 0)
+      return r;
+    q = leaf_objs.insert(pair<string, unsigned>(dir, objs.size())).first;
+  } else {
+    q->second++;
+  }
+
+  if (q->second > split_threshold && dir_depth(dir) < MAX_DEPTH) {
+    dout(10) << "created " << oid << ", " << dir << " has " << q->second
+	     << " > " << split_threshold << " objects, needs a split" << dendl;
+    return 1;
+  }
+  return 0;
+}
+
+int HashIndex::split(const sobject_t &oid)
+{
+  // someone else may have split it while we waited for the write lock
+  string dir;
+  int depth;
+  int r = find_dir(hash_oid(oid), &dir, &depth);
+  if (r < 0)
+    return r;
+  map<string, unsigned>::iterator q = leaf_objs.find(dir);
+  if (q == leaf_objs.end() || q->second <= split_threshold || depth >= MAX_DEPTH)
+    return 0;
+  dout(10) << "split " << dir << " has " << q->second
+	   << " > " << split_threshold << " objects, splitting" << dendl;
+  return split_dir(dir, depth);
+}
+
+int HashIndex::unlink(const sobject_t &oid, bool exclusive)
+{
+  string dir;
+  int r = find_dir(hash_oid(oid), &dir, NULL);
+  if (r < 0)
+    return r;
+  r = lfn_unlink(dir, oid, exclusive);
+  if (r != 0)
+    return r;
+  Mutex::Locker l(create_lock);
+  map<string, unsigned>::iterator q = leaf_objs.find(dir);
+  if (q != leaf_objs.end() && q->second > 0)
+    q->second--;
+  return 0;
+}
+
+int HashIndex::list_dir(const string &dir,
+			vector< pair<uint32_t, sobject_t> > *objs,
+			bool *subdirs)
+{
+  char buf[offsetof(struct dirent, d_name) + PATH_MAX + 1];
+
+  if (subdirs)
+    for (int n = 0; n < 16; n++)
+      subdirs[n] = false;
+
+  DIR *d = ::opendir(dir.c_str());
+  if (!d)
+    return -errno;
+
+  int r;
+  struct dirent *de;
+  while ((r = ::readdir_r(d, (struct dirent *)buf, &de)) == 0) {
+    if (!de)
+      break;
+    int n;
+    if (is_subdir_name(de->d_name, &n)) {
+      if (subdirs)
+	subdirs[n] = true;
+      continue;
+    }
+    sobject_t o;
+    if (lfn_parse(dir, de->d_name, &o))
+      objs->push_back(pair<uint32_t, sobject_t>(hash_oid(o), o));
+  }
+  ::closedir(d);
+  if (r > 0) {
+    derr << "list_dir readdir_r " << dir << ": " << cpp_strerror(r) << dendl;
+    return -r;
+  }
+  sort(objs->begin(), objs->end());
+  return 0;
+}
+
+int HashIndex::list_subdirs(const string &dir, bool *subdirs)
+{
+  char buf[offsetof(struct dirent, d_name) + PATH_MAX + 1];
+
+  for (int n = 0; n < 16; n++)
+    subdirs[n] = false;
+
+  DIR *d = ::opendir(dir.c_str());
+  if (!d)
+    return -errno;
+
+  int r;
+  struct dirent *de;
+  while ((r = ::readdir_r(d, (struct dirent *)buf, &de)) == 0) {
+    if (!de)
+      break;
+    int n;
+    if (is_subdir_name(de->d_name, &n))
+      subdirs[n] = true;
+  }
+  ::closedir(d);
+  if (r > 0) {
+    derr << "list_subdirs readdir_r " << dir << ": " << cpp_strerror(r) << dendl;
+    return -r;
+  }
+  return 0;
+}
+
+int HashIndex::split_dir(const string &dir, int depth)
+{
+  string rel = dir.substr(base_path.length());
+  int r = chain_setxattr(base_path.c_str(), SPLIT_ATTR, rel.c_str(), rel.length());
+  if (r < 0)
+    return r;
+  return complete_split(dir, depth);
+}
+
+/*
+ * Idempotent, so that it can be rerun by cleanup() after a crash at any
+ * point: objects are linked into their subdir before any is unlinked
+ * from dir, and the split marker goes last.
+ */
+int HashIndex::complete_split(const string &dir, int depth)
+{
+  vector<dir_entry_t> objs;
+  int r = list_objects(dir, &objs);
+  if (r < 0)
+    return r;
+  dout(15) << "complete_split " << dir << " (" << objs.size() << " objects)" << dendl;
+
+  for (int n = 0; n < 16; n++) {
+    string sub = dir + "/" + subdir_name(n);
+    if (::mkdir(sub.c_str(), 0755) < 0 && errno != EEXIST) {
+      r = -errno;
+      derr << "complete_split mkdir " << sub << ": " << cpp_strerror(r) << dendl;
+      return r;
+    }
+  }
+
+  for (vector<dir_entry_t>::iterator p = objs.begin(); p != objs.end(); ++p) {
+    string sub = dir + "/" + subdir_name(nibble(hash_oid(p->oid), depth));
+    string src = dir + "/" + p->name;
+    string dst;
+    int exist;
+    r = lfn_get(sub, p->oid, &dst, &exist, NULL);
+    if (r < 0)
+      return r;
+    if (exist)
+      continue;
+    if (::link(src.c_str(), dst.c_str()) < 0 && errno != EEXIST) {
+      r = -errno;
+      derr << "complete_split link " << src << " -> " << dst << ": " << cpp_strerror(r) << dendl;
+      return r;
+    }
+  }
+
+  for (vector<dir_entry_t>::iterator p = objs.begin(); p != objs.end(); ++p) {
+    string src = dir + "/" + p->name;
+    if (::unlink(src.c_str()) < 0 && errno != ENOENT) {
+      r = -errno;
+      derr << "complete_split unlink " << src << ": " << cpp_strerror(r) << dendl;
+      return r;
+    }
+  }
+
+  split_dirs.insert(dir);
+
+  // recount lazily; after a crash the subdirs may already hold objects
+  leaf_objs.erase(dir);
+  for (int n = 0; n < 16; n++)
+    leaf_objs.erase(dir + "/" + subdir_name(n));
+
+  r = chain_removexattr(base_path.c_str(), SPLIT_ATTR);
+  if (r < 0 && r != -ENODATA)
+    return r;
+  return 0;
+}
+
+int HashIndex::list_by_hash(const string &dir, int depth, uint32_t prefix,
+			    snapid_t seq, int max_count, list_cursor_t *cursor,
+			    vector<sobject_t> *ls, bool *full)
+{
+  vector< pair<uint32_t, sobject_t> > objs;
+  bool subdirs[16];
+  int r = list_dir(dir, &objs, subdirs);
+  if (r < 0)
+    return r;
+
+  vector< pair<uint32_t, sobject_t> >::iterator p = objs.begin();
+  for (int n = 0; n < 16 || p != objs.end(); n++) {
+    // objects of slot n kept in dir itself (all of them, at the bottom)
+    for (; p != objs.end() && (depth >= MAX_DEPTH || nibble(p->first, depth) <= n); ++p) {
+      uint32_t h = p->first;
+      if (h < cursor->start_hash)
+	continue;
+      if (h == cursor->start_hash && cursor->skipped < cursor->start_skip) {
+	cursor->skipped++;
+	continue;
+      }
+      if (cursor->consumed && h == cursor->hash) {
+	cursor->pos++;
+      } else {
+	cursor->hash = h;
+	cursor->pos = (h == cursor->start_hash) ? cursor->start_skip + 1 : 1;
+      }
+      cursor->consumed = true;
+      // like FlatIndex, only entries we return count toward max_count
+      if (p->second.snap < seq)
+	continue;
+      ls->push_back(p->second);
+      if (++cursor->count >= max_count) {
+	*full = true;
+	return 0;
+      }
+    }
+    if (depth >= MAX_DEPTH || n >= 16 || !subdirs[n])
+      continue;
+
+    int shift = 28 - 4 * depth;
+    uint32_t lo = prefix | ((uint32_t)n << shift);
+    uint32_t hi = lo | (uint32_t)((1ull << shift) - 1);
+    if (hi < cursor->start_hash)
+      continue;
+    r = list_by_hash(dir + "/" + subdir_name(n), depth + 1, lo,
+		     seq, max_count, cursor, ls, full);
+    if (r < 0 || *full)
+      return r;
+  }
+  return 0;
+}
+
+int HashIndex::collection_list(vector<sobject_t> *ls)
+{
+  list_cursor_t cursor;
+  bool full = false;
+  return list_by_hash(base_path, 0, 0, 0, INT_MAX, &cursor, ls, &full);
+}
+
+int HashIndex::collection_list_partial(snapid_t seq, int max_count,
+				       vector<sobject_t> *ls,
+				       collection_list_handle_t *handle)
+{
+  list_cursor_t cursor;
+  if (handle && (*handle & HANDLE_VALID)) {
+    cursor.start_hash = (*handle >> HANDLE_POS_BITS) & 0xffffffffull;
+    cursor.start_skip = *handle & HANDLE_POS_MASK;
+    dout(10) << "collection_list_partial resuming at hash " << hex << cursor.start_hash
+	     << dec << " pos " << cursor.start_skip << dendl;
+  }
+  if (max_count <= 0)
+    return 0;
+
+  bool full = false;
+  int r = list_by_hash(base_path, 0, 0, seq, max_count, &cursor, ls, &full);
+  if (r < 0)
+    return r;
+
+  if (handle) {
+    if (full) {
+      assert(cursor.pos <= HANDLE_POS_MASK);
+      *handle = HANDLE_VALID |
+	((uint64_t)cursor.hash << HANDLE_POS_BITS) |
+	cursor.pos;
+      dout(10) << "collection_list_partial finished at " << *handle << dendl;
+    } else {
+      *handle = 0;
+    }
+  }
+  return 0;
+}
+
+int HashIndex::check_subdirs_empty(const string &dir)
+{
+  bool subdirs[16];
+  int r = list_subdirs(dir, subdirs);
+  if (r < 0)
+    return r;
+  for (int n = 0; n < 16; n++) {
+    if (!subdirs[n])
+      continue;
+    string sub = dir + "/" + subdir_name(n);
+    vector< pair<uint32_t, sobject_t> > objs;
+    bool subsubdirs[16];
+    r = list_dir(sub, &objs, subsubdirs);
+    if (r < 0)
+      return r;
+    if (!objs.empty()) {
+      dout(0) << "prep_delete " << sub << " still holds " << objs.size()
+	      << " objects" << dendl;
+      return -ENOTEMPTY;
+    }
+    r = check_subdirs_empty(sub);
+    if (r < 0)
+      return r;
+  }
+  return 0;
+}
+
+int HashIndex::remove_subdirs(const string &dir)
+{
+  vector< pair<uint32_t, sobject_t> > objs;
+  bool subdirs[16];
+  int r = list_dir(dir, &objs, subdirs);
+  if (r < 0)
+    return r;
+  for (int n = 0; n < 16; n++) {
+    if (!subdirs[n])
+      continue;
+    string sub = dir + "/" + subdir_name(n);
+    r = remove_subdirs(sub);
+    if (r < 0)
+      return r;
+    if (::rmdir(sub.c_str()) < 0) {
+      r = -errno;
+      dout(0) << "prep_delete rmdir " << sub << ": " << cpp_strerror(r) << dendl;
+      return r;
+    }
+    leaf_objs.erase(sub);
+  }
+  split_dirs.erase(dir);
+  return 0;
+}
+
+int HashIndex::prep_delete()
+{
+  // a failed rmdir part way through would leave split_dirs pointing
+  // at removed subdirs, so make sure they all go before removing any
+  int r = check_subdirs_empty(base_path);
+  if (r < 0)
+    return r;
+  return remove_subdirs(base_path);
+}
@@ -0,0 +1,128 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2004-2006 Sage Weil <sage@newdream.net>
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OS_HASHINDEX_H
+#define CEPH_OS_HASHINDEX_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "LFNIndex.h"
+
+/**
+ * Objects are spread over a tree of subdirectories keyed by the 32 bit
+ * hash of the object name, one hex digit per level, most significant
+ * digit first:
+ *
+ *   <coll>/DIR_3/DIR_A/foo_head     (hash 0x3a......)
+ *
+ * A directory without subdirectories holds the objects whose hash
+ * matches its path.  Once it holds more than split_threshold objects it
+ * is split: all 16 subdirectories are created and the objects moved one
+ * level down.  A split in progress is recorded in an xattr on the
+ * collection directory so that cleanup() can finish it after a crash.
+ *
+ * Because the tree is ordered by hash, listings come out in hash order
+ * and a partial listing can resume from a (hash, position) cursor
+ * without rereading the directories it has already covered.
+ */
+class HashIndex : public LFNIndex {
+public:
+  /// one hex digit of the hash per level
+  static const int MAX_DEPTH = 8;
+
+private:
+  const unsigned split_threshold;
+
+  /// object counts of the leaf directories we have looked at; under
+  /// create_lock or access_lock for write
+  std::map<std::string, unsigned> leaf_objs;
+
+  /// directories that have been split, so that lookups needn't stat
+  /// each level; loaded by cleanup(), changed under access_lock for write
+  std::set<std::string> split_dirs;
+
+  struct list_cursor_t {
+    uint32_t start_hash, start_skip;  ///< where to resume
+    uint32_t skipped;                 ///< entries at start_hash passed over so far
+    bool consumed;                    ///< any entry consumed yet
+    uint32_t hash, pos;               ///< last entry consumed
+    int count;                        ///< entries returned by this listing
+    list_cursor_t() : start_hash(0), start_skip(0), skipped(0),
+		      consumed(false), hash(0), pos(0), count(0) {}
+  };
+
+public:
+  HashIndex(coll_t c, const char *path, unsigned split_threshold_)
+    : LFNIndex(c, path), split_threshold(split_threshold_) {}
+
+  uint32_t collection_version() { return HASH_INDEX_TAG; }
+
+  int init();
+  int cleanup();
+
+  int lookup(const sobject_t &oid, std::string *path, int *exist);
+  int created(const sobject_t &oid, const char *path);
+  int split(const sobject_t &oid);
+  int unlink(const sobject_t &oid, bool exclusive);
+  int collection_list(vector<sobject_t> *ls);
+  int collection_list_partial(snapid_t seq, int max_count,
+			      vector<sobject_t> *ls,
+			      collection_list_handle_t *handle);
+  int prep_delete();
+
+  static uint32_t hash_oid(const sobject_t &oid);
+
+protected:
+  bool is_private_name(const char *name);
+
+private:
+  static int nibble(uint32_t hash, int depth) {
+    return (hash >> (28 - 4 * depth)) & 0xf;
+  }
+  static std::string subdir_name(int n);
+  static bool is_subdir_name(const char *name, int *n);
+
+  /// depth of dir below the collection directory
+  int dir_depth(const std::string &dir);
+
+  /// find the leaf directory that holds (or would hold) hash
+  int find_dir(uint32_t hash, std::string *dir, int *depth);
+
+  /// add dir and the split directories below it to split_dirs
+  int load_split_dirs(const std::string &dir, int depth);
+
+  /// which subdirs of dir exist, without looking at its objects
+  int list_subdirs(const std::string &dir, bool *subdirs);
+
+  /// read dir: its objects, sorted by hash, and which subdirs exist
+  int list_dir(const std::string &dir,
+	       std::vector< std::pair<uint32_t, sobject_t> > *objs,
+	       bool *subdirs);
+
+  int split_dir(const std::string &dir, int depth);
+  int complete_split(const std::string &dir, int depth);
+
+  int list_by_hash(const std::string &dir, int depth, uint32_t prefix,
+		   snapid_t seq, int max_count, list_cursor_t *cursor,
+		   vector<sobject_t> *ls, bool *full);
+
+  /// -ENOTEMPTY if any directory below dir still holds an object
+  int check_subdirs_empty(const std::string &dir);
+  int remove_subdirs(const std::string &dir);
+};
+
+#endif
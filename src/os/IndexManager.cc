@@ -0,0 +1,117 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2004-2006 Sage Weil <sage@newdream.net>
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "IndexManager.h"
+#include "FlatIndex.h"
+#include "HashIndex.h"
+#include "chain_xattr.h"
+
+#include "common/config.h"
+#include "common/debug.h"
+#include "common/errno.h"
+
+#include <errno.h>
+
+#define DOUT_SUBSYS filestore
+#undef dout_prefix
+#define dout_prefix *_dout << "indexmanager "
+
+#define VERSION_ATTR "user.cephos.collection_version"
+
+static int get_version(const char *path, uint32_t *version)
+{
+  __le32 v;
+  int r = chain_getxattr(path, VERSION_ATTR, &v, sizeof(v));
+  if (r == -ENODATA) {
+    *version = CollectionIndex::FLAT_INDEX_TAG;
+    return 0;
+  }
+  if (r < 0)
+    return r;
+  if (r != sizeof(v))
+    return -EINVAL;
+  *version = v;
+  return 0;
+}
+
+int IndexManager::init_index(coll_t c, const char *path)
+{
+  Mutex::Locker l(lock);
+  col_indices.erase(c);
+
+  uint32_t version = g_conf->filestore_index_hashed ?
+    CollectionIndex::HASH_INDEX_TAG : CollectionIndex::FLAT_INDEX_TAG;
+  __le32 v = version;
+  int r = chain_setxattr(path, VERSION_ATTR, &v, sizeof(v));
+  if (r < 0)
+    return r;
+
+  Index index;
+  r = build_index(c, path, &index);
+  if (r < 0)
+    return r;
+  r = index->init();
+  if (r < 0)
+    return r;
+  col_indices[c] = index;
+  return 0;
+}
+
+int IndexManager::build_index(coll_t c, const char *path, Index *index)
+{
+  uint32_t version;
+  int r = get_version(path, &version);
+  if (r < 0) {
+    dout(0) << "build_index " << c << " can't read layout version: "
+	    << cpp_strerror(r) << dendl;
+    return r;
+  }
+
+  switch (version) {
+  case CollectionIndex::FLAT_INDEX_TAG:
+    index->reset(new FlatIndex(c, path));
+    return 0;
+  case CollectionIndex::HASH_INDEX_TAG:
+    index->reset(new HashIndex(c, path, g_conf->filestore_index_split_threshold));
+    return 0;
+  default:
+    derr << "build_index " << c << " has unknown layout version " << version << dendl;
+    return -EINVAL;
+  }
+}
+
+int IndexManager::get_index(coll_t c, const char *path, Index *index)
+{
+  Mutex::Locker l(lock);
+  __gnu_cxx::hash_map<coll_t, Index>::iterator p = col_indices.find(c);
+  if (p != col_indices.end()) {
+    *index = p->second;
+    return 0;
+  }
+
+  int r = build_index(c, path, index);
+  if (r < 0)
+    return r;
+  r = (*index)->cleanup();
+  if (r < 0)
+    return r;
+  col_indices[c] = *index;
+  return 0;
+}
+
+void IndexManager::put_index(coll_t c)
+{
+  Mutex::Locker l(lock);
+  col_indices.erase(c);
+}
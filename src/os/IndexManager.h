@@ -0,0 +1,48 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2004-2006 Sage Weil <sage@newdream.net>
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OS_INDEXMANAGER_H
+#define CEPH_OS_INDEXMANAGER_H
+
+#include <ext/hash_map>
+
+#include "common/Mutex.h"
+#include "CollectionIndex.h"
+
+/**
+ * Hands out (and caches) the CollectionIndex of each collection.
+ *
+ * The layout of a collection is fixed when it is created and recorded in
+ * an xattr on the collection directory; collections without one predate
+ * the index and use the flat layout.
+ */
+class IndexManager {
+  Mutex lock;
+  __gnu_cxx::hash_map<coll_t, Index> col_indices;
+
+  int build_index(coll_t c, const char *path, Index *index);
+public:
+  IndexManager() : lock("IndexManager::lock") {}
+
+  /// set up a freshly created collection dir for the configured layout
+  int init_index(coll_t c, const char *path);
+
+  /// get the index for c, whose directory is path
+  int get_index(coll_t c, const char *path, Index *index);
+
+  /// forget c, e.g. once it has been removed or renamed
+  void put_index(coll_t c);
+};
+
+#endif
@@ -2,6 +2,7 @@
 #include "JournalingObjectStore.h"
 
 #include "common/debug.h"
+#include "common/perf_counters.h"
 
 #define DOUT_SUBSYS journal
 #undef dout_prefix
@@ -19,6 +20,7 @@ void JournalingObjectStore::journal_stop()
 {
   dout(10) << "journal_stop" << dendl;
   finisher.stop();
+  stop_replay_logger();
   if (journal) {
     journal->close();
     delete journal;
@@ -46,46 +48,279 @@ int JournalingObjectStore::journal_replay(uint64_t fs_op_seq)
     return err;
   }
 
+  start_replay_logger();
+  replay_start = ceph_clock_now(g_ceph_context);
+  replay_ops = replay_bytes = 0;
+
   int count = 0;
+  if (g_conf->journal_replay_threads > 1) {
+    count = journal_replay_parallel(g_conf->journal_replay_threads);
+  } else {
+    while (1) {
+      bufferlist bl;
+      uint64_t seq = op_seq + 1;
+      if (!journal->read_entry(bl, seq)) {
+	dout(3) << "journal_replay: end of journal, done." << dendl;
+	break;
+      }
+
+      if (seq <= op_seq) {
+	dout(3) << "journal_replay: skipping old op seq " << seq << " <= " << op_seq << dendl;
+	continue;
+      }
+      assert(op_seq == seq-1);
+
+      replay_op_t *op = replay_decode_entry(bl, seq);
+      replay_lock.Lock();
+      replay_read_seq = replay_dispatched_seq = seq;
+      replay_lock.Unlock();
+      replay_apply(op);
+      op_seq++;
+      count++;
+
+      dout(3) << "journal_replay: op now seq " << op_seq << dendl;
+      assert(op_seq == seq);
+    }
+  }
+
+  committed_seq = op_seq;
+  applied_seq = op_seq;
+
+  utime_t dur = ceph_clock_now(g_ceph_context) - replay_start;
+  dout(1) << "journal_replay: replayed " << count << " entries ("
+	  << replay_bytes << " bytes) in " << dur
+	  << ", op_seq now " << op_seq << dendl;
+
+  // done reading, make writeable.
+  journal->make_writeable();
+
+  return count;
+}
+
+void JournalingObjectStore::start_replay_logger()
+{
+  if (replay_logger)
+    return;
+
+  PerfCountersBuilder plb(g_ceph_context, "journal_replay",
+			  l_jos_replay_first, l_jos_replay_last);
+  plb.add_u64_counter(l_jos_replay_ops, "ops");
+  plb.add_u64_counter(l_jos_replay_bytes, "bytes");
+  plb.add_u64(l_jos_replay_read_seq, "read_seq");
+  plb.add_u64(l_jos_replay_applied_seq, "applied_seq");
+  plb.add_u64(l_jos_replay_queued, "queued");
+  plb.add_u64(l_jos_replay_inflight, "inflight");
+  plb.add_fl(l_jos_replay_ops_per_sec, "ops_per_sec");
+  plb.add_fl(l_jos_replay_mb_per_sec, "mb_per_sec");
+
+  replay_logger = plb.create_perf_counters();
+  g_ceph_context->GetPerfCountersCollection()->logger_add(replay_logger);
+}
+
+void JournalingObjectStore::stop_replay_logger()
+{
+  if (replay_logger) {
+    g_ceph_context->GetPerfCountersCollection()->logger_remove(replay_logger);
+    replay_logger = NULL;
+  }
+}
+
+JournalingObjectStore::replay_op_t *
+JournalingObjectStore::replay_decode_entry(bufferlist& bl, uint64_t seq)
+{
+  replay_op_t *op = new replay_op_t(seq, bl.length());
+  bufferlist::iterator p = bl.begin();
+  while (!p.end()) {
+    Transaction *t = new Transaction(p);
+    if (!op->barrier && !t->get_colls(&op->colls, &op->oids))
+      op->barrier = true;
+    op->tls.push_back(t);
+  }
+  dout(20) << "replay_decode_entry seq " << seq << " " << op->tls.size()
+	   << " transactions on " << op->colls
+	   << (op->barrier ? " (barrier)" : "") << dendl;
+  return op;
+}
+
+/*
+ * The reader thread; stays at most journal_replay_queue_max_{ops,bytes}
+ * ahead of dispatch.
+ */
+void JournalingObjectStore::replay_read_entries()
+{
+  uint64_t last = op_seq;
   while (1) {
     bufferlist bl;
-    uint64_t seq = op_seq + 1;
+    uint64_t seq = last + 1;
     if (!journal->read_entry(bl, seq)) {
       dout(3) << "journal_replay: end of journal, done." << dendl;
       break;
     }
 
-    if (seq <= op_seq) {
-      dout(3) << "journal_replay: skipping old op seq " << seq << " <= " << op_seq << dendl;
+    if (seq <= last) {
+      dout(3) << "journal_replay: skipping old op seq " << seq << " <= " << last << dendl;
       continue;
     }
-    assert(op_seq == seq-1);
-    
-    dout(3) << "journal_replay: applying op seq " << seq << " (op_seq " << op_seq << ")" << dendl;
-    bufferlist::iterator p = bl.begin();
-    list<Transaction*> tls;
-    while (!p.end()) {
-      Transaction *t = new Transaction(p);
-      tls.push_back(t);
+    assert(last == seq-1);
+    last = seq;
+
+    replay_op_t *op = replay_decode_entry(bl, seq);
+
+    Mutex::Locker l(replay_lock);
+    while (!replay_readq.empty() &&
+	   (replay_readq.size() >= (unsigned)g_conf->journal_replay_queue_max_ops ||
+	    replay_readq_bytes >= (uint64_t)g_conf->journal_replay_queue_max_bytes))
+      replay_room_cond.Wait(replay_lock);
+    replay_readq.push_back(op);
+    replay_readq_bytes += op->bytes;
+    replay_read_seq = seq;
+    _replay_update_stats();
+    replay_cond.Signal();
+  }
+
+  Mutex::Locker l(replay_lock);
+  replay_read_done = true;
+  replay_cond.Signal();
+}
+
+bool JournalingObjectStore::replay_can_dispatch(replay_op_t *op)
+{
+  assert(replay_lock.is_locked());
+  if (replay_barrier)
+    return false;
+  if (op->barrier)
+    return replay_applying.empty();
+  for (vector<coll_t>::iterator p = op->colls.begin(); p != op->colls.end(); ++p)
+    if (replay_busy.count(*p))
+      return false;
+  for (vector<sobject_t>::iterator p = op->oids.begin(); p != op->oids.end(); ++p)
+    if (replay_busy_oids.count(*p))
+      return false;
+  return true;
+}
+
+void JournalingObjectStore::replay_apply(replay_op_t *op)
+{
+  dout(3) << "journal_replay: applying op seq " << op->seq << dendl;
+  int r = do_transactions(op->tls, op->seq - 1);
+  dout(3) << "journal_replay: r = " << r << " on op seq " << op->seq << dendl;
+
+  while (!op->tls.empty()) {
+    delete op->tls.front();
+    op->tls.pop_front();
+  }
+
+  Mutex::Locker l(replay_lock);
+  for (vector<coll_t>::iterator p = op->colls.begin(); p != op->colls.end(); ++p) {
+    hash_map<coll_t, int>::iterator q = replay_busy.find(*p);
+    if (q != replay_busy.end() && --q->second == 0)
+      replay_busy.erase(q);
+  }
+  for (vector<sobject_t>::iterator p = op->oids.begin(); p != op->oids.end(); ++p) {
+    hash_map<sobject_t, int>::iterator q = replay_busy_oids.find(*p);
+    if (q != replay_busy_oids.end() && --q->second == 0)
+      replay_busy_oids.erase(q);
+  }
+  if (op->barrier)
+    replay_barrier = false;
+  replay_applying.erase(op->seq);
+  replay_ops++;
+  replay_bytes += op->bytes;
+  if (replay_logger) {
+    replay_logger->inc(l_jos_replay_ops);
+    replay_logger->inc(l_jos_replay_bytes, op->bytes);
+  }
+  _replay_update_stats();
+  replay_cond.Signal();
+  delete op;
+}
+
+void JournalingObjectStore::_replay_update_stats()
+{
+  assert(replay_lock.is_locked());
+  if (!replay_logger)
+    return;
+
+  // everything up to the oldest entry still being applied is done
+  uint64_t applied = replay_dispatched_seq;
+  if (!replay_applying.empty())
+    applied = *replay_applying.begin() - 1;
+
+  replay_logger->set(l_jos_replay_read_seq, replay_read_seq);
+  replay_logger->set(l_jos_replay_applied_seq, applied);
+  replay_logger->set(l_jos_replay_queued, replay_readq.size());
+  replay_logger->set(l_jos_replay_inflight, replay_applying.size());
+
+  double elapsed = ceph_clock_now(g_ceph_context) - replay_start;
+  if (elapsed > 0) {
+    replay_logger->fset(l_jos_replay_ops_per_sec, (double)replay_ops / elapsed);
+    replay_logger->fset(l_jos_replay_mb_per_sec,
+			(double)replay_bytes / elapsed / (1024*1024));
+  }
+}
+
+int JournalingObjectStore::journal_replay_parallel(int threads)
+{
+  dout(3) << "journal_replay: applying with " << threads << " threads" << dendl;
+
+  ThreadPool tp(g_ceph_context, "JournalingObjectStore::replay_tp", threads);
+  ReplayWQ wq(this, g_conf->filestore_op_thread_timeout, &tp);
+  ReplayReader reader(this);
+
+  replay_lock.Lock();
+  replay_read_done = false;
+  replay_barrier = false;
+  replay_read_seq = replay_dispatched_seq = op_seq;
+  replay_lock.Unlock();
+
+  tp.start();
+  reader.create();
+
+  int count = 0;
+  replay_lock.Lock();
+  while (1) {
+    if (replay_readq.empty()) {
+      if (replay_read_done)
+	break;
+      replay_cond.Wait(replay_lock);
+      continue;
     }
-    int r = do_transactions(tls, op_seq);
-    op_seq++;
-    while (!tls.empty()) {
-      delete tls.front(); 
-      tls.pop_front();
+    replay_op_t *op = replay_readq.front();
+    if (!replay_can_dispatch(op)) {
+      dout(20) << "journal_replay: seq " << op->seq << " waiting on "
+	       << replay_applying.size() << " in flight" << dendl;
+      replay_cond.Wait(replay_lock);
+      continue;
     }
 
-    dout(3) << "journal_replay: r = " << r << ", op now seq " << op_seq << dendl;
-    assert(op_seq == seq);
-    seq++;  // we expect the next op
+    replay_readq.pop_front();
+    replay_readq_bytes -= op->bytes;
+    if (op->barrier)
+      replay_barrier = true;
+    for (vector<coll_t>::iterator p = op->colls.begin(); p != op->colls.end(); ++p)
+      replay_busy[*p]++;
+    for (vector<sobject_t>::iterator p = op->oids.begin(); p != op->oids.end(); ++p)
+      replay_busy_oids[*p]++;
+    replay_applying.insert(op->seq);
+    replay_dispatched_seq = op->seq;
+    count++;
+    _replay_update_stats();
+    replay_room_cond.Signal();
+
+    replay_lock.Unlock();
+    wq.queue(op);
+    replay_lock.Lock();
   }
+  while (!replay_applying.empty())
+    replay_cond.Wait(replay_lock);
+  op_seq = replay_dispatched_seq;
+  replay_lock.Unlock();
 
-  committed_seq = op_seq;
-  applied_seq = op_seq;
-
-  // done reading, make writeable.
-  journal->make_writeable();
+  reader.join();
+  tp.stop();
 
+  assert(replay_busy.empty());
+  assert(replay_busy_oids.empty());
   return count;
 }
 
@@ -18,6 +18,28 @@
 #include "ObjectStore.h"
 #include "Journal.h"
 #include "common/RWLock.h"
+#include "common/Thread.h"
+#include "common/WorkQueue.h"
+
+#include <deque>
+#include <set>
+#include <ext/hash_map>
+using __gnu_cxx::hash_map;
+
+class PerfCounters;
+
+enum {
+  l_jos_replay_first = 84500,
+  l_jos_replay_ops,
+  l_jos_replay_bytes,
+  l_jos_replay_read_seq,
+  l_jos_replay_applied_seq,
+  l_jos_replay_queued,
+  l_jos_replay_inflight,
+  l_jos_replay_ops_per_sec,
+  l_jos_replay_mb_per_sec,
+  l_jos_replay_last,
+};
 
 class JournalingObjectStore : public ObjectStore {
 protected:
@@ -38,6 +60,92 @@ protected:
   list<uint64_t> ops_submitting;
   list<Cond*> ops_apply_blocked;
 
+  // -- replay --
+  /*
+   * A reader thread decodes journal entries ahead of the appliers.
+   * Entries are dispatched in seq order, but an entry only waits for
+   * those before it that touch one of the same collections or
+   * objects, so entries for disjoint collections are applied
+   * concurrently.  Objects are compared by name, which an object
+   * linked into several collections keeps in each of them.
+   */
+  struct replay_op_t {
+    uint64_t seq;
+    list<Transaction*> tls;
+    vector<coll_t> colls;
+    vector<sobject_t> oids;
+    bool barrier;   ///< may touch anything; apply alone
+    uint64_t bytes;
+    replay_op_t(uint64_t s, uint64_t b) : seq(s), barrier(false), bytes(b) {}
+  };
+
+  Mutex replay_lock;
+  Cond replay_cond;        ///< dispatcher: an entry was read, or one was applied
+  Cond replay_room_cond;   ///< reader: the dispatcher took an entry off replay_readq
+  deque<replay_op_t*> replay_readq;  ///< decoded, not yet dispatched
+  uint64_t replay_readq_bytes;
+  bool replay_read_done;
+  uint64_t replay_read_seq;          ///< last seq decoded by the reader
+  hash_map<coll_t, int> replay_busy; ///< collections with an entry being applied
+  hash_map<sobject_t, int> replay_busy_oids; ///< and objects
+  std::set<uint64_t> replay_applying;
+  bool replay_barrier;
+  uint64_t replay_dispatched_seq;
+  uint64_t replay_ops, replay_bytes;
+  utime_t replay_start;
+  PerfCounters *replay_logger;
+
+  deque<replay_op_t*> replay_wq_items;
+
+  struct ReplayWQ : public ThreadPool::WorkQueue<replay_op_t> {
+    JournalingObjectStore *store;
+    ReplayWQ(JournalingObjectStore *s, time_t ti, ThreadPool *tp)
+      : ThreadPool::WorkQueue<replay_op_t>("JournalingObjectStore::ReplayWQ", ti, tp),
+	store(s) {}
+
+    bool _enqueue(replay_op_t *op) {
+      store->replay_wq_items.push_back(op);
+      return true;
+    }
+    void _dequeue(replay_op_t *op) {
+      assert(0);
+    }
+    bool _empty() {
+      return store->replay_wq_items.empty();
+    }
+    replay_op_t *_dequeue() {
+      if (store->replay_wq_items.empty())
+	return NULL;
+      replay_op_t *op = store->replay_wq_items.front();
+      store->replay_wq_items.pop_front();
+      return op;
+    }
+    void _process(replay_op_t *op) {
+      store->replay_apply(op);
+    }
+    void _clear() {
+      assert(store->replay_wq_items.empty());
+    }
+  };
+
+  struct ReplayReader : public Thread {
+    JournalingObjectStore *store;
+    ReplayReader(JournalingObjectStore *s) : store(s) {}
+    void *entry() {
+      store->replay_read_entries();
+      return 0;
+    }
+  };
+
+  void start_replay_logger();
+  void stop_replay_logger();
+  replay_op_t *replay_decode_entry(bufferlist& bl, uint64_t seq);
+  void replay_read_entries();
+  bool replay_can_dispatch(replay_op_t *op);
+  void replay_apply(replay_op_t *op);
+  void _replay_update_stats();
+  int journal_replay_parallel(int threads);
+
 protected:
   void journal_start();
   void journal_stop();
@@ -71,7 +179,13 @@ public:
 			    open_ops(0), blocked(false),
 			    journal(NULL), finisher(g_ceph_context),
 			    journal_lock("JournalingObjectStore::journal_lock"),
-			    com_lock("JournalingObjectStore::com_lock") { }
+			    com_lock("JournalingObjectStore::com_lock"),
+			    replay_lock("JournalingObjectStore::replay_lock"),
+			    replay_readq_bytes(0), replay_read_done(false),
+			    replay_read_seq(0), replay_barrier(false),
+			    replay_dispatched_seq(0),
+			    replay_ops(0), replay_bytes(0),
+			    replay_logger(NULL) { }
   
 };
 
@@ -0,0 +1,440 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2004-2006 Sage Weil <sage@newdream.net>
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "KeyValueLog.h"
+
+#include "include/crc32c.h"
+#include "include/encoding.h"
+#include "common/config.h"
+#include "common/debug.h"
+#include "common/errno.h"
+#include "common/safe_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#define DOUT_SUBSYS filestore
+#undef dout_prefix
+#define dout_prefix *_dout << "kvlog(" << path << ") "
+
+using std::map;
+using std::pair;
+using std::string;
+using std::vector;
+
+/// values this close together in the file are fetched with one read
+static const uint64_t COALESCE_GAP = 4096;
+/// payload size of the records written by compaction
+static const unsigned COMPACT_RECORD_BYTES = 4 << 20;
+
+KeyValueLog::~KeyValueLog()
+{
+  close();
+}
+
+int KeyValueLog::open(bool create)
+{
+  Mutex::Locker l(lock);
+  assert(fd < 0);
+
+  // a compaction that did not make it to the rename
+  string tmp = path + ".tmp";
+  ::unlink(tmp.c_str());
+
+  int flags = O_RDWR;
+  if (create)
+    flags |= O_CREAT;
+  fd = ::open(path.c_str(), flags, 0644);
+  if (fd < 0) {
+    int r = -errno;
+    if (r != -ENOENT || create)
+      derr << "open: " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  int r = _load();
+  if (r < 0) {
+    ::close(fd);
+    fd = -1;
+  }
+  return r;
+}
+
+void KeyValueLog::close()
+{
+  Mutex::Locker l(lock);
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+  index.clear();
+  end = live_bytes = 0;
+}
+
+int KeyValueLog::destroy()
+{
+  close();
+  if (::unlink(path.c_str()) < 0 && errno != ENOENT) {
+    int r = -errno;
+    derr << "destroy: " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  return 0;
+}
+
+int KeyValueLog::_load()
+{
+  struct stat st;
+  if (::fstat(fd, &st) < 0)
+    return -errno;
+
+  bufferptr bp = buffer::create(st.st_size);
+  int r = safe_pread_exact(fd, bp.c_str(), st.st_size, 0);
+  if (r < 0) {
+    derr << "_load: read failed: " << cpp_strerror(r) << dendl;
+    return r;
+  }
+
+  index.clear();
+  live_bytes = 0;
+  uint64_t dead = 0;
+  uint64_t pos = 0;
+  unsigned records = 0;
+  while (pos + HEADER_LEN <= (uint64_t)st.st_size) {
+    const char *h = bp.c_str() + pos;
+    uint32_t magic = *(__le32*)h;
+    uint32_t len = *(__le32*)(h + 4);
+    uint32_t crc = *(__le32*)(h + 8);
+    if (magic != MAGIC ||
+	pos + HEADER_LEN + len > (uint64_t)st.st_size ||
+	ceph_crc32c_le(0, (unsigned char *)h + HEADER_LEN, len) != crc)
+      break;
+
+    bufferlist payload;
+    payload.push_back(bufferptr(bp, pos + HEADER_LEN, len));
+    bufferlist::iterator p = payload.begin();
+    uint64_t base = pos + HEADER_LEN;
+    map<string, loc_t> sets;
+    vector<string> rms;
+    try {
+      __u32 n;
+      ::decode(n, p);
+      while (n--) {
+	__u8 op;
+	string key;
+	::decode(op, p);
+	::decode(key, p);
+	if (op == OP_SET) {
+	  __u32 vlen;
+	  ::decode(vlen, p);
+	  sets[key] = loc_t(base + p.get_off(), vlen);
+	  p.advance(vlen);
+	} else if (op == OP_RM) {
+	  rms.push_back(key);
+	} else {
+	  throw buffer::malformed_input("bad op");
+	}
+      }
+    }
+    catch (buffer::error& e) {
+      derr << "_load: undecodable record at " << pos << dendl;
+      break;
+    }
+
+    for (vector<string>::iterator q = rms.begin(); q != rms.end(); ++q) {
+      map<string, loc_t>::iterator i = index.find(*q);
+      if (i != index.end()) {
+	live_bytes -= i->second.len;
+	dead += i->second.len;
+	index.erase(i);
+      }
+    }
+    for (map<string, loc_t>::iterator q = sets.begin(); q != sets.end(); ++q) {
+      map<string, loc_t>::iterator i = index.find(q->first);
+      if (i != index.end()) {
+	live_bytes -= i->second.len;
+	dead += i->second.len;
+      }
+      index[q->first] = q->second;
+      live_bytes += q->second.len;
+    }
+    pos += HEADER_LEN + len;
+    records++;
+  }
+
+  if (pos < (uint64_t)st.st_size) {
+    dout(0) << "_load: discarding " << (st.st_size - pos) << " bytes of torn or corrupt tail at "
+	    << pos << dendl;
+    if (::ftruncate(fd, pos) < 0) {
+      r = -errno;
+      derr << "_load: ftruncate failed: " << cpp_strerror(r) << dendl;
+      return r;
+    }
+  }
+  end = pos;
+  dout(10) << "_load " << records << " records, " << index.size() << " keys, "
+	   << live_bytes << " live bytes, " << dead << " dead bytes" << dendl;
+  return 0;
+}
+
+int KeyValueLog::_append(const Transaction &t)
+{
+  bufferlist payload;
+  __u32 n = t.sets.size() + t.rms.size();
+  ::encode(n, payload);
+
+  // value offsets relative to the payload, for the index
+  map<string, loc_t> locs;
+  for (map<string, bool>::const_iterator p = t.rms.begin(); p != t.rms.end(); ++p) {
+    __u8 op = OP_RM;
+    ::encode(op, payload);
+    ::encode(p->first, payload);
+  }
+  for (map<string, bufferlist>::const_iterator p = t.sets.begin(); p != t.sets.end(); ++p) {
+    __u8 op = OP_SET;
+    ::encode(op, payload);
+    ::encode(p->first, payload);
+    __u32 vlen = p->second.length();
+    ::encode(vlen, payload);
+    locs[p->first] = loc_t(payload.length(), vlen);
+    payload.append(p->second);
+  }
+
+  bufferlist bl;
+  __le32 h[3];
+  h[0] = MAGIC;
+  h[1] = payload.length();
+  h[2] = payload.crc32c(0);
+  bl.append((char *)h, sizeof(h));
+  bl.claim_append(payload);
+  bl.rebuild();
+
+  int r = safe_pwrite(fd, bl.c_str(), bl.length(), end);
+  if (r < 0) {
+    derr << "_append: write at " << end << " failed: " << cpp_strerror(r) << dendl;
+    // leave no partial record behind for the next append to follow
+    if (::ftruncate(fd, end) < 0)
+      derr << "_append: ftruncate failed: " << cpp_strerror(errno) << dendl;
+    return r;
+  }
+
+  uint64_t base = end + HEADER_LEN;
+  for (map<string, bool>::const_iterator p = t.rms.begin(); p != t.rms.end(); ++p) {
+    map<string, loc_t>::iterator i = index.find(p->first);
+    if (i != index.end()) {
+      live_bytes -= i->second.len;
+      index.erase(i);
+    }
+  }
+  for (map<string, loc_t>::iterator p = locs.begin(); p != locs.end(); ++p) {
+    map<string, loc_t>::iterator i = index.find(p->first);
+    if (i != index.end())
+      live_bytes -= i->second.len;
+    index[p->first] = loc_t(base + p->second.off, p->second.len);
+    live_bytes += p->second.len;
+  }
+  end += bl.length();
+  return 0;
+}
+
+int KeyValueLog::submit(const Transaction &t)
+{
+  if (t.empty())
+    return 0;
+  Mutex::Locker l(lock);
+  assert(fd >= 0);
+  dout(15) << "submit " << t.sets.size() << " sets, " << t.rms.size() << " rms" << dendl;
+  int r = _append(t);
+  if (r < 0)
+    return r;
+  _maybe_compact();
+  return 0;
+}
+
+int KeyValueLog::sync()
+{
+  Mutex::Locker l(lock);
+  assert(fd >= 0);
+  if (::fsync(fd) < 0) {
+    int r = -errno;
+    derr << "sync " << path << ": " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  return 0;
+}
+
+int KeyValueLog::_read(const loc_t &l, bufferlist *bl)
+{
+  bufferptr bp = buffer::create(l.len);
+  int r = safe_pread_exact(fd, bp.c_str(), l.len, l.off);
+  if (r < 0) {
+    derr << "_read " << l.off << "~" << l.len << " failed: " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  bl->push_back(bp);
+  return 0;
+}
+
+bool KeyValueLog::exists(const string &key)
+{
+  Mutex::Locker l(lock);
+  return index.count(key);
+}
+
+bool KeyValueLog::empty()
+{
+  Mutex::Locker l(lock);
+  return index.empty();
+}
+
+int KeyValueLog::get(const string &key, bufferlist *bl)
+{
+  Mutex::Locker l(lock);
+  map<string, loc_t>::iterator p = index.find(key);
+  if (p == index.end())
+    return -ENOENT;
+  return _read(p->second, bl);
+}
+
+int KeyValueLog::get_prefix(const string &prefix, map<string, bufferlist> *out)
+{
+  Mutex::Locker l(lock);
+
+  // (offset, index entry) of everything under prefix, in file order
+  vector< pair<uint64_t, const pair<const string, loc_t>*> > ls;
+  for (map<string, loc_t>::iterator p = index.lower_bound(prefix);
+       p != index.end() && p->first.compare(0, prefix.length(), prefix) == 0;
+       ++p)
+    ls.push_back(make_pair(p->second.off, &*p));
+  if (ls.empty())
+    return 0;
+  sort(ls.begin(), ls.end());
+
+  unsigned reads = 0;
+  unsigned i = 0;
+  while (i < ls.size()) {
+    uint64_t start = ls[i].first;
+    uint64_t stop = start + ls[i].second->second.len;
+    unsigned j = i + 1;
+    while (j < ls.size() && ls[j].first <= stop + COALESCE_GAP) {
+      stop = std::max(stop, ls[j].first + ls[j].second->second.len);
+      j++;
+    }
+    bufferlist chunk;
+    int r = _read(loc_t(start, stop - start), &chunk);
+    if (r < 0)
+      return r;
+    reads++;
+    for (; i < j; i++) {
+      const loc_t &l = ls[i].second->second;
+      bufferlist &v = (*out)[ls[i].second->first.substr(prefix.length())];
+      v.clear();
+      v.substr_of(chunk, l.off - start, l.len);
+    }
+  }
+  dout(20) << "get_prefix " << ls.size() << " keys in " << reads << " reads" << dendl;
+  return 0;
+}
+
+int KeyValueLog::rm_prefix(const string &prefix, Transaction *t)
+{
+  Mutex::Locker l(lock);
+  int n = 0;
+  for (map<string, loc_t>::iterator p = index.lower_bound(prefix);
+       p != index.end() && p->first.compare(0, prefix.length(), prefix) == 0;
+       ++p, ++n)
+    t->rm(p->first);
+  return n;
+}
+
+void KeyValueLog::_maybe_compact()
+{
+  uint64_t dead = end - live_bytes;
+  if (dead < compact_min || dead < live_bytes)
+    return;
+  int r = _compact();
+  if (r < 0)
+    derr << "_maybe_compact: compaction failed: " << cpp_strerror(r) << dendl;
+}
+
+int KeyValueLog::_compact()
+{
+  dout(10) << "_compact " << index.size() << " keys, " << live_bytes << " of "
+	   << end << " bytes live" << dendl;
+
+  string tmp = path + ".tmp";
+  KeyValueLog n(tmp, compact_min);
+  int r = n.open(true);
+  if (r < 0)
+    return r;
+  // a leftover from an earlier failed attempt
+  if (n.end) {
+    n.close();
+    ::unlink(tmp.c_str());
+    r = n.open(true);
+    if (r < 0)
+      return r;
+  }
+
+  Transaction t;
+  unsigned bytes = 0;
+  for (map<string, loc_t>::iterator p = index.begin(); p != index.end(); ++p) {
+    bufferlist v;
+    r = _read(p->second, &v);
+    if (r < 0)
+      goto fail;
+    t.set(p->first, v);
+    bytes += p->first.length() + v.length();
+    if (bytes >= COMPACT_RECORD_BYTES) {
+      r = n._append(t);
+      if (r < 0)
+	goto fail;
+      t = Transaction();
+      bytes = 0;
+    }
+  }
+  if (!t.empty()) {
+    r = n._append(t);
+    if (r < 0)
+      goto fail;
+  }
+
+  // the new file must be complete before it replaces the old one
+  if (::fsync(n.fd) < 0) {
+    r = -errno;
+    goto fail;
+  }
+  if (::rename(tmp.c_str(), path.c_str()) < 0) {
+    r = -errno;
+    goto fail;
+  }
+
+  ::close(fd);
+  fd = n.fd;
+  n.fd = -1;
+  index.swap(n.index);
+  end = n.end;
+  live_bytes = n.live_bytes;
+  dout(10) << "_compact done, " << end << " bytes" << dendl;
+  return 0;
+
+ fail:
+  n.close();
+  ::unlink(tmp.c_str());
+  return r;
+}
@@ -0,0 +1,124 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2004-2006 Sage Weil <sage@newdream.net>
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OS_KEYVALUELOG_H
+#define CEPH_OS_KEYVALUELOG_H
+
+#include <map>
+#include <string>
+
+#include "include/types.h"
+#include "include/buffer.h"
+#include "common/Mutex.h"
+
+/**
+ * A small embedded key/value store kept in a single append-only file.
+ *
+ * Every update is a record
+ *
+ *   [__le32 magic][__le32 len][__le32 crc32c][len bytes of payload]
+ *
+ * whose payload is a batch of sets and removes, so a Transaction is
+ * made durable (or lost) as a unit.  open() replays the file into an
+ * in-memory index of key -> (offset, length) of the current value and
+ * cuts off a torn or corrupt tail.  Values are only read from disk on
+ * demand; a prefix lookup coalesces values that are adjacent in the
+ * file into one read.
+ *
+ * Records are never rewritten in place.  Once the dead bytes outgrow
+ * the live ones (and compact_min) the live set is copied to a new file
+ * that replaces the old one with rename(2).
+ *
+ * There is no fsync on the update path: the caller is expected to sync
+ * the file system before it considers the updates committed, and to be
+ * able to replay them after a crash.
+ */
+class KeyValueLog {
+public:
+  class Transaction {
+    friend class KeyValueLog;
+    std::map<std::string, bufferlist> sets;
+    std::map<std::string, bool> rms;
+  public:
+    void set(const std::string &key, const bufferlist &val) {
+      rms.erase(key);
+      sets[key] = val;
+    }
+    void rm(const std::string &key) {
+      sets.erase(key);
+      rms[key] = true;
+    }
+    bool empty() const {
+      return sets.empty() && rms.empty();
+    }
+  };
+
+private:
+  struct loc_t {
+    uint64_t off;
+    uint32_t len;
+    loc_t() : off(0), len(0) {}
+    loc_t(uint64_t o, uint32_t l) : off(o), len(l) {}
+  };
+
+  enum {
+    OP_SET = 1,
+    OP_RM = 2,
+  };
+  static const uint32_t MAGIC = 0x6b766c31;  // "kvl1"
+  static const unsigned HEADER_LEN = 12;
+
+  std::string path;
+  uint64_t compact_min;
+  Mutex lock;
+  int fd;
+  uint64_t end;          ///< append position
+  uint64_t live_bytes;   ///< payload bytes of current values
+  std::map<std::string, loc_t> index;
+
+  int _load();
+  int _append(const Transaction &t);
+  int _read(const loc_t &l, bufferlist *bl);
+  void _maybe_compact();
+  int _compact();
+
+public:
+  KeyValueLog(const std::string &p, uint64_t compact_min_)
+    : path(p), compact_min(compact_min_), lock("KeyValueLog::lock"),
+      fd(-1), end(0), live_bytes(0) {}
+  ~KeyValueLog();
+
+  const std::string &get_path() const { return path; }
+
+  /// open the log, creating it if create is set; -ENOENT if it does not exist
+  int open(bool create);
+  void close();
+  /// close and remove the log file
+  int destroy();
+
+  /// apply t atomically
+  int submit(const Transaction &t);
+  /// make everything submitted so far durable
+  int sync();
+
+  bool exists(const std::string &key);
+  bool empty();
+  int get(const std::string &key, bufferlist *bl);
+  /// read all keys starting with prefix; the map is keyed by the rest of the key
+  int get_prefix(const std::string &prefix, std::map<std::string, bufferlist> *out);
+  /// add the removal of all keys starting with prefix to t; return how many
+  int rm_prefix(const std::string &prefix, Transaction *t);
+};
+
+#endif
@@ -0,0 +1,366 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2004-2006 Sage Weil <sage@newdream.net>
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "LFNIndex.h"
+#include "chain_xattr.h"
+
+#include "common/debug.h"
+#include "common/errno.h"
+#include "common/ceph_crypto.h"
+
+#include <errno.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define DOUT_SUBSYS filestore
+#undef dout_prefix
+#define dout_prefix *_dout << "lfnindex(" << base_path << ") "
+
+using ceph::crypto::SHA1;
+
+/*
+ * long file names will have the following format:
+ *
+ * prefix_hash_index_cookie
+ *
+ * The prefix will just be the first X bytes of the original file name.
+ * The cookie is a constant string that shows whether this file name
+ * is hashed
+ */
+
+#define FILENAME_LFN_DIGEST_SIZE CEPH_CRYPTO_SHA1_DIGESTSIZE
+
+#define FILENAME_MAX_LEN        4096    // the long file name size
+#define FILENAME_SHORT_LEN      255     // the short file name size
+#define FILENAME_COOKIE         "long"  // ceph long file name
+#define FILENAME_HASH_LEN       FILENAME_LFN_DIGEST_SIZE
+#define FILENAME_EXTRA	        4       // underscores and digit
+
+#define LFN_ATTR "user.cephos.lfn"
+
+#define FILENAME_PREFIX_LEN (FILENAME_SHORT_LEN - FILENAME_HASH_LEN - (sizeof(FILENAME_COOKIE) - 1) - FILENAME_EXTRA)
+
+static inline void buf_to_hex(const unsigned char *buf, int len, char *str)
+{
+  int i;
+  str[0] = '\0';
+  for (i = 0; i < len; i++) {
+    sprintf(&str[i*2], "%02x", (int)buf[i]);
+  }
+}
+
+static int hash_filename(const char *filename, char *hash, int buf_len)
+{
+  if (buf_len < FILENAME_HASH_LEN + 1)
+    return -EINVAL;
+
+  char buf[FILENAME_LFN_DIGEST_SIZE];
+  char hex[FILENAME_LFN_DIGEST_SIZE * 2];
+
+  SHA1 h;
+  h.Update((const byte *)filename, strlen(filename));
+  h.Final((byte *)buf);
+
+  buf_to_hex((byte *)buf, (FILENAME_HASH_LEN + 1) / 2, hex);
+  strncpy(hash, hex, FILENAME_HASH_LEN);
+  hash[FILENAME_HASH_LEN] = '\0';
+  return 0;
+}
+
+static void build_filename(char *filename, int len, const char *old_filename, int i)
+{
+  char hash[FILENAME_HASH_LEN + 1];
+
+  assert(len >= FILENAME_SHORT_LEN + 4);
+
+  strncpy(filename, old_filename, FILENAME_PREFIX_LEN);
+  filename[FILENAME_PREFIX_LEN] = '\0';
+  if (strlen(filename) < FILENAME_PREFIX_LEN)
+    return;
+  if (old_filename[FILENAME_PREFIX_LEN] == '\0')
+    return;
+
+  hash_filename(old_filename, hash, sizeof(hash));
+  int ofs = FILENAME_PREFIX_LEN;
+  int suffix_len;
+  while (1) {
+    suffix_len = sprintf(filename + ofs, "_%s_%d_" FILENAME_COOKIE, hash, i);
+    if (ofs + suffix_len <= FILENAME_SHORT_LEN || !ofs)
+      break;
+    ofs--;
+  }
+}
+
+/* is this a candidate? */
+static int lfn_is_hashed_filename(const char *filename)
+{
+  int len = strlen(filename);
+  if (len < FILENAME_SHORT_LEN)
+    return 0;
+  return (strcmp(filename + len - (sizeof(FILENAME_COOKIE) - 1), FILENAME_COOKIE) == 0);
+}
+
+void LFNIndex::lfn_translate(const char *path, const char *name, char *new_name, int len)
+{
+  if (!lfn_is_hashed_filename(name)) {
+    strncpy(new_name, name, len);
+    return;
+  }
+
+  char buf[PATH_MAX];
+
+  snprintf(buf, sizeof(buf), "%s/%s", path, name);
+  int r = chain_getxattr(buf, LFN_ATTR, new_name, len - 1);
+  if (r < 0)
+    strncpy(new_name, name, len);
+  else
+    new_name[r] = '\0';
+  return;
+}
+
+/* 
+ * sorry, these are sentitive to the sobject_t and coll_t typing.
+ */ 
+
+  //           11111111112222222222333333333344444444445555555555
+  // 012345678901234567890123456789012345678901234567890123456789
+  // yyyyyyyyyyyyyyyy.zzzzzzzz.a_s
+
+int LFNIndex::append_oname(const sobject_t &oid, char *s, int len)
+{
+  //assert(sizeof(oid) == 28);
+  char *end = s + len;
+  char *t = s + strlen(s);
+
+  const char *i = oid.oid.name.c_str();
+  while (*i && t < end) {
+    if (*i == '\\') {
+      *t++ = '\\';
+      *t++ = '\\';      
+    } else if (*i == '.' && i == oid.oid.name.c_str()) {  // only escape leading .
+      *t++ = '\\';
+      *t++ = '.';
+    } else if (*i == '/') {
+      *t++ = '\\';
+      *t++ = 's';
+    } else
+      *t++ = *i;
+    i++;
+  }
+
+  int size = t - s;
+
+  if (oid.snap == CEPH_NOSNAP)
+    size += snprintf(t, end - t, "_head");
+  else if (oid.snap == CEPH_SNAPDIR)
+    size += snprintf(t, end - t, "_snapdir");
+  else
+    size += snprintf(t, end - t, "_%llx", (long long unsigned)oid.snap);
+
+  return size;
+}
+
+bool LFNIndex::parse_object(char *s, sobject_t& o)
+{
+  char *bar = s + strlen(s) - 1;
+  while (*bar != '_' &&
+	 bar > s)
+    bar--;
+  if (*bar == '_') {
+    char buf[bar-s + 1];
+    char *t = buf;
+    char *i = s;
+    while (i < bar) {
+      if (*i == '\\') {
+	i++;
+	switch (*i) {
+	case '\\': *t++ = '\\'; break;
+	case '.': *t++ = '.'; break;
+	case 's': *t++ = '/'; break;
+	default: assert(0);
+	}
+      } else {
+	*t++ = *i;
+      }
+      i++;
+    }
+    *t = 0;
+    o.oid.name = string(buf, t-buf);
+    if (strcmp(bar+1, "head") == 0)
+      o.snap = CEPH_NOSNAP;
+    else if (strcmp(bar+1, "snapdir") == 0)
+      o.snap = CEPH_SNAPDIR;
+    else
+      o.snap = strtoull(bar+1, &s, 16);
+    return true;
+  }
+  return false;
+}
+
+
+int LFNIndex::lfn_get(const string &dir, const sobject_t &oid,
+		      string *path, int *exist, int *lfn_index)
+{
+  char lfn[PATH_MAX];
+  char short_fn[PATH_MAX];
+
+  *lfn = '\0';
+  int actual_len = append_oname(oid, lfn, sizeof(lfn));
+
+  if (actual_len < (int)FILENAME_PREFIX_LEN) {
+    /* not a long file name, just build it as it is */
+    *path = dir + "/" + lfn;
+    if (lfn_index)
+      *lfn_index = -1;
+    if (exist) {
+      struct stat st;
+      int r = ::stat(path->c_str(), &st);
+      if (r < 0 && errno != ENOENT)
+	return -errno;
+      *exist = (r == 0);
+    }
+    dout(20) << "lfn_get " << oid << " path=" << *path << dendl;
+    return 0;
+  }
+
+  for (int i = 0; ; i++) {
+    char buf[PATH_MAX];
+
+    build_filename(short_fn, sizeof(short_fn), lfn, i);
+    *path = dir + "/" + short_fn;
+    if (lfn_index)
+      *lfn_index = i;
+    int r = chain_getxattr(path->c_str(), LFN_ATTR, buf, sizeof(buf));
+    if (r > 0) {
+      buf[MIN((int)sizeof(buf)-1, r)] = '\0';
+      dout(20) << "lfn_get " << oid << " lfn=" << lfn << " buf=" << buf << dendl;
+      if (strcmp(buf, lfn) == 0) { // a match?
+	if (exist)
+	  *exist = 1;
+	return 0;
+      }
+      continue;
+    }
+    if (r == -ENOENT) {  // free slot
+      if (exist)
+	*exist = 0;
+      return 0;
+    }
+    assert(r != -ERANGE); // shouldn't happen
+    return r < 0 ? r : -EIO;
+  }
+}
+
+int LFNIndex::lfn_created(const string &path, const sobject_t &oid)
+{
+  char lfn[PATH_MAX];
+  *lfn = '\0';
+  int actual_len = append_oname(oid, lfn, sizeof(lfn));
+  if (actual_len < (int)FILENAME_PREFIX_LEN)
+    return 0;
+  int r = chain_setxattr(path.c_str(), LFN_ATTR, lfn, strlen(lfn));
+  if (r < 0)
+    return r;
+  return 0;
+}
+
+int LFNIndex::lfn_unlink(const string &dir, const sobject_t &oid, bool exclusive)
+{
+  string path;
+  int exist, i;
+  int r = lfn_get(dir, oid, &path, &exist, &i);
+  if (r < 0)
+    return r;
+  if (i < 0) {
+    r = ::unlink(path.c_str());
+    return r < 0 ? -errno : 0;
+  }
+  if (!exist)
+    return -ENOENT;
+
+  // keep creates from taking slots after ours while we look at them
+  Mutex::Locker l(create_lock);
+
+  // move the last slot sharing our short name into the hole we leave
+  char lfn[PATH_MAX];
+  char short_fn[PATH_MAX];
+  *lfn = '\0';
+  append_oname(oid, lfn, sizeof(lfn));
+  int last = i;
+  for (int j = i + 1; ; j++) {
+    struct stat st;
+    build_filename(short_fn, sizeof(short_fn), lfn, j);
+    string candidate = dir + "/" + short_fn;
+    if (::stat(candidate.c_str(), &st) < 0)
+      break;
+    last = j;
+  }
+
+  if (last == i) {
+    r = ::unlink(path.c_str());
+    return r < 0 ? -errno : 0;
+  }
+  if (!exclusive)
+    return 1;   // another object's path changes
+
+  build_filename(short_fn, sizeof(short_fn), lfn, last);
+  string last_path = dir + "/" + short_fn;
+  dout(0) << "renaming " << last_path << " -> " << path << dendl;
+  if (::rename(last_path.c_str(), path.c_str()) < 0) {
+    r = -errno;
+    derr << "ERROR: could not rename " << last_path << " -> " << path
+	 << ": " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  return 0;
+}
+
+bool LFNIndex::lfn_parse(const string &dir, const char *name, sobject_t *oid)
+{
+  char new_name[PATH_MAX];
+  if (name[0] == '.' || is_private_name(name))
+    return false;
+  lfn_translate(dir.c_str(), name, new_name, sizeof(new_name));
+  return parse_object(new_name, *oid);
+}
+
+int LFNIndex::list_objects(const string &dir, vector<dir_entry_t> *ls)
+{
+  char buf[offsetof(struct dirent, d_name) + PATH_MAX + 1];
+
+  DIR *d = ::opendir(dir.c_str());
+  if (!d)
+    return -errno;
+
+  int r;
+  struct dirent *de;
+  while ((r = ::readdir_r(d, (struct dirent *)buf, &de)) == 0) {
+    if (!de)
+      break;
+    sobject_t o;
+    if (lfn_parse(dir, de->d_name, &o))
+      ls->push_back(dir_entry_t(de->d_ino, de->d_name, o));
+  }
+  ::closedir(d);
+  if (r > 0) {
+    derr << "list_objects readdir_r " << dir << ": " << cpp_strerror(r) << dendl;
+    return -r;
+  }
+  return 0;
+}
@@ -0,0 +1,95 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2004-2006 Sage Weil <sage@newdream.net>
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OS_LFNINDEX_H
+#define CEPH_OS_LFNINDEX_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <sys/types.h>
+
+#include "CollectionIndex.h"
+
+/**
+ * Common base for indices that store each object as a single file.
+ *
+ * Object names are escaped into file names; names too long for the
+ * underlying fs are shortened to
+ *
+ *   prefix_hash_index_cookie
+ *
+ * where the full name is kept in the LFN xattr and index disambiguates
+ * the (unlikely) case of two long names hashing to the same short name.
+ */
+class LFNIndex : public CollectionIndex {
+protected:
+  const coll_t collection;
+  const std::string base_path;   ///< collection directory
+
+public:
+  /// (inode, dentry name, object) for one object file
+  struct dir_entry_t {
+    ino_t ino;
+    std::string name;
+    sobject_t oid;
+    dir_entry_t(ino_t i, const std::string &n, const sobject_t &o)
+      : ino(i), name(n), oid(o) {}
+  };
+
+  LFNIndex(coll_t c, const char *path) : collection(c), base_path(path) {}
+  virtual ~LFNIndex() {}
+
+  coll_t coll() const { return collection; }
+
+  /// escape oid into (possibly overlong) on-disk form, appended to s
+  static int append_oname(const sobject_t &oid, char *s, int len);
+  /// inverse of append_oname
+  static bool parse_object(char *s, sobject_t& o);
+  /// recover the full name of a (possibly shortened) dentry in path
+  static void lfn_translate(const char *path, const char *name, char *new_name, int len);
+
+protected:
+  /**
+   * Get the path of oid within dir.
+   *
+   * @param exist [out] set to 1 if the object exists (may be NULL)
+   * @param lfn_index [out] slot used by a long name, or -1
+   */
+  int lfn_get(const std::string &dir, const sobject_t &oid,
+	      std::string *path, int *exist, int *lfn_index);
+
+  /// record the full name of a newly created object at path
+  int lfn_created(const std::string &path, const sobject_t &oid);
+
+  /**
+   * Unlink oid from dir, keeping long name slots dense.
+   *
+   * @param exclusive caller holds access_lock for write; if not, a
+   *        removal that has to move another object's slot is left undone
+   * @return 1 if the removal was left undone, 0, or -errno
+   */
+  int lfn_unlink(const std::string &dir, const sobject_t &oid, bool exclusive);
+
+  /// map a dentry of dir back to its object; false if it isn't one
+  bool lfn_parse(const std::string &dir, const char *name, sobject_t *oid);
+
+  /// hook for subclasses that keep their own dentries next to objects
+  virtual bool is_private_name(const char *name) { return false; }
+
+  /// read all object entries of dir
+  int list_objects(const std::string &dir, std::vector<dir_entry_t> *ls);
+};
+
+#endif
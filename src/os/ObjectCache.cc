@@ -0,0 +1,368 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2004-2006 Sage Weil <sage@newdream.net>
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "ObjectCache.h"
+
+#include "common/config.h"
+#include "common/debug.h"
+
+#include <errno.h>
+
+#define DOUT_SUBSYS filestore
+#undef dout_prefix
+#define dout_prefix *_dout << "objectcache "
+
+using std::list;
+using std::map;
+using std::string;
+
+ObjectCache::ObjectCache(unsigned num_shards, uint64_t max_bytes,
+			 uint64_t max_extent_)
+  : max_extent(max_extent_)
+{
+  if (num_shards < 1)
+    num_shards = 1;
+  for (unsigned i = 0; i < num_shards; i++)
+    shards.push_back(new shard_t);
+  max_shard_bytes = max_bytes / num_shards;
+}
+
+ObjectCache::~ObjectCache()
+{
+  clear();
+  for (unsigned i = 0; i < shards.size(); i++)
+    delete shards[i];
+}
+
+ObjectCache::shard_t *ObjectCache::get_shard(const sobject_t &oid)
+{
+  static __gnu_cxx::hash<sobject_t> H;
+  return shards[H(oid) % shards.size()];
+}
+
+ObjectCache::entry_t *ObjectCache::_lookup(shard_t *s, coll_t cid,
+					   const sobject_t &oid)
+{
+  __gnu_cxx::hash_map<sobject_t, list<entry_t*> >::iterator p =
+    s->objects.find(oid);
+  if (p == s->objects.end())
+    return NULL;
+  for (list<entry_t*>::iterator q = p->second.begin(); q != p->second.end(); ++q)
+    if ((*q)->cid == cid)
+      return *q;
+  return NULL;
+}
+
+ObjectCache::entry_t *ObjectCache::_get_or_create(shard_t *s, coll_t cid,
+						  const sobject_t &oid)
+{
+  entry_t *e = _lookup(s, cid, oid);
+  if (!e) {
+    e = new entry_t(cid, oid);
+    s->objects[oid].push_back(e);
+    s->lru.push_front(e);
+    e->lru_pos = s->lru.begin();
+  }
+  return e;
+}
+
+void ObjectCache::_touch(shard_t *s, entry_t *e)
+{
+  s->lru.erase(e->lru_pos);
+  s->lru.push_front(e);
+  e->lru_pos = s->lru.begin();
+}
+
+void ObjectCache::_account(shard_t *s, entry_t *e)
+{
+  uint64_t bytes = sizeof(*e) + e->data.length();
+  for (map<string, bufferptr>::iterator p = e->attrs.begin(); p != e->attrs.end(); ++p)
+    bytes += p->first.length() + p->second.length();
+  s->bytes -= e->bytes;
+  s->bytes += bytes;
+  e->bytes = bytes;
+}
+
+void ObjectCache::_remove(shard_t *s, entry_t *e)
+{
+  __gnu_cxx::hash_map<sobject_t, list<entry_t*> >::iterator p =
+    s->objects.find(e->oid);
+  assert(p != s->objects.end());
+  p->second.remove(e);
+  if (p->second.empty())
+    s->objects.erase(p);
+  s->lru.erase(e->lru_pos);
+  s->bytes -= e->bytes;
+  delete e;
+}
+
+void ObjectCache::_trim(shard_t *s)
+{
+  while (s->bytes > max_shard_bytes && !s->lru.empty()) {
+    entry_t *e = s->lru.back();
+    dout(20) << "trim " << e->cid << "/" << e->oid << " " << e->bytes << " bytes" << dendl;
+    _remove(s, e);
+  }
+}
+
+void ObjectCache::_drop_data(entry_t *e)
+{
+  e->have_data = false;
+  e->data_off = 0;
+  e->data.clear();
+  e->data_eof = false;
+}
+
+uint64_t ObjectCache::get_gen(const sobject_t &oid)
+{
+  shard_t *s = get_shard(oid);
+  Mutex::Locker l(s->lock);
+  return s->gen;
+}
+
+
+// attrs
+
+int ObjectCache::get_attr(coll_t cid, const sobject_t &oid, const string &name,
+			  bufferptr *bp)
+{
+  shard_t *s = get_shard(oid);
+  Mutex::Locker l(s->lock);
+  entry_t *e = _lookup(s, cid, oid);
+  if (!e)
+    return -ENOENT;
+  map<string, bufferptr>::iterator p = e->attrs.find(name);
+  if (p == e->attrs.end())
+    return e->attrs_complete ? -ENODATA : -ENOENT;
+  _touch(s, e);
+  *bp = p->second;
+  return 0;
+}
+
+bool ObjectCache::get_attrs(coll_t cid, const sobject_t &oid,
+			    map<string, bufferptr> *aset)
+{
+  shard_t *s = get_shard(oid);
+  Mutex::Locker l(s->lock);
+  entry_t *e = _lookup(s, cid, oid);
+  if (!e || !e->attrs_complete)
+    return false;
+  _touch(s, e);
+  *aset = e->attrs;
+  return true;
+}
+
+void ObjectCache::add_attr(uint64_t gen, coll_t cid, const sobject_t &oid,
+			   const string &name, const bufferptr &bp)
+{
+  shard_t *s = get_shard(oid);
+  Mutex::Locker l(s->lock);
+  if (gen != s->gen)
+    return;
+  entry_t *e = _get_or_create(s, cid, oid);
+  e->attrs[name] = bp;
+  _account(s, e);
+  _trim(s);
+}
+
+void ObjectCache::add_attrs(uint64_t gen, coll_t cid, const sobject_t &oid,
+			    const map<string, bufferptr> &aset)
+{
+  shard_t *s = get_shard(oid);
+  Mutex::Locker l(s->lock);
+  if (gen != s->gen)
+    return;
+  entry_t *e = _get_or_create(s, cid, oid);
+  e->attrs = aset;
+  e->attrs_complete = true;
+  _account(s, e);
+  _trim(s);
+}
+
+
+// data
+
+int ObjectCache::read(coll_t cid, const sobject_t &oid, uint64_t off, size_t len,
+		      bufferlist *bl)
+{
+  shard_t *s = get_shard(oid);
+  Mutex::Locker l(s->lock);
+  entry_t *e = _lookup(s, cid, oid);
+  if (!e || !e->have_data || off < e->data_off)
+    return -ENOENT;
+
+  uint64_t end = e->data_off + e->data.length();
+  if (len == 0) {
+    if (!e->data_eof)
+      return -ENOENT;
+    len = end > off ? end - off : 0;
+  }
+  if (off + len > end) {
+    if (!e->data_eof)
+      return -ENOENT;
+    len = end > off ? end - off : 0;  // short read at eof
+  }
+
+  if (len) {
+    bufferlist t;
+    t.substr_of(e->data, off - e->data_off, len);
+    bl->claim_append(t);
+  }
+  _touch(s, e);
+  return len;
+}
+
+void ObjectCache::add_data(uint64_t gen, coll_t cid, const sobject_t &oid,
+			   uint64_t off, const bufferlist &bl, bool eof)
+{
+  if (bl.length() > max_extent)
+    return;
+
+  shard_t *s = get_shard(oid);
+  Mutex::Locker l(s->lock);
+  if (gen != s->gen)
+    return;
+  entry_t *e = _get_or_create(s, cid, oid);
+  e->have_data = true;
+  e->data_off = off;
+  e->data = bl;
+  e->data_eof = eof;
+  _account(s, e);
+  _trim(s);
+}
+
+bool ObjectCache::is_cached(coll_t cid, const sobject_t &oid, uint64_t off, size_t len)
+{
+  shard_t *s = get_shard(oid);
+  Mutex::Locker l(s->lock);
+  entry_t *e = _lookup(s, cid, oid);
+  if (!e || !e->have_data || off < e->data_off)
+    return false;
+  return e->data_eof || off + len <= e->data_off + e->data.length();
+}
+
+void ObjectCache::trim(coll_t cid, const sobject_t &oid, uint64_t off, size_t len)
+{
+  shard_t *s = get_shard(oid);
+  Mutex::Locker l(s->lock);
+  entry_t *e = _lookup(s, cid, oid);
+  if (!e || !e->have_data)
+    return;
+  uint64_t end = e->data_off + e->data.length();
+  if (off < end && off + len > e->data_off) {
+    dout(15) << "trim " << cid << "/" << oid << " " << off << "~" << len << dendl;
+    _drop_data(e);
+    _account(s, e);
+  }
+}
+
+
+// invalidation
+
+void ObjectCache::invalidate(const sobject_t &oid)
+{
+  shard_t *s = get_shard(oid);
+  Mutex::Locker l(s->lock);
+  s->gen++;
+  __gnu_cxx::hash_map<sobject_t, list<entry_t*> >::iterator p =
+    s->objects.find(oid);
+  if (p == s->objects.end())
+    return;
+  list<entry_t*> ls;
+  ls.swap(p->second);
+  s->objects.erase(p);
+  for (list<entry_t*>::iterator q = ls.begin(); q != ls.end(); ++q) {
+    s->lru.erase((*q)->lru_pos);
+    s->bytes -= (*q)->bytes;
+    delete *q;
+  }
+}
+
+void ObjectCache::invalidate_data(const sobject_t &oid)
+{
+  shard_t *s = get_shard(oid);
+  Mutex::Locker l(s->lock);
+  s->gen++;
+  __gnu_cxx::hash_map<sobject_t, list<entry_t*> >::iterator p =
+    s->objects.find(oid);
+  if (p == s->objects.end())
+    return;
+  for (list<entry_t*>::iterator q = p->second.begin(); q != p->second.end(); ++q) {
+    _drop_data(*q);
+    _account(s, *q);
+  }
+}
+
+void ObjectCache::invalidate_attrs(const sobject_t &oid)
+{
+  shard_t *s = get_shard(oid);
+  Mutex::Locker l(s->lock);
+  s->gen++;
+  __gnu_cxx::hash_map<sobject_t, list<entry_t*> >::iterator p =
+    s->objects.find(oid);
+  if (p == s->objects.end())
+    return;
+  for (list<entry_t*>::iterator q = p->second.begin(); q != p->second.end(); ++q) {
+    (*q)->attrs.clear();
+    (*q)->attrs_complete = false;
+    _account(s, *q);
+  }
+}
+
+void ObjectCache::invalidate(coll_t cid, const sobject_t &oid)
+{
+  shard_t *s = get_shard(oid);
+  Mutex::Locker l(s->lock);
+  s->gen++;
+  entry_t *e = _lookup(s, cid, oid);
+  if (e)
+    _remove(s, e);
+}
+
+void ObjectCache::invalidate_collection(coll_t cid)
+{
+  for (unsigned i = 0; i < shards.size(); i++) {
+    shard_t *s = shards[i];
+    Mutex::Locker l(s->lock);
+    s->gen++;
+    list<entry_t*>::iterator p = s->lru.begin();
+    while (p != s->lru.end()) {
+      entry_t *e = *p;
+      ++p;
+      if (e->cid == cid)
+	_remove(s, e);
+    }
+  }
+}
+
+void ObjectCache::clear()
+{
+  for (unsigned i = 0; i < shards.size(); i++) {
+    shard_t *s = shards[i];
+    Mutex::Locker l(s->lock);
+    s->gen++;
+    while (!s->lru.empty())
+      _remove(s, s->lru.front());
+  }
+}
+
+uint64_t ObjectCache::get_bytes()
+{
+  uint64_t bytes = 0;
+  for (unsigned i = 0; i < shards.size(); i++) {
+    Mutex::Locker l(shards[i]->lock);
+    bytes += shards[i]->bytes;
+  }
+  return bytes;
+}
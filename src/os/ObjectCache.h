@@ -0,0 +1,132 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2004-2006 Sage Weil <sage@newdream.net>
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OS_OBJECTCACHE_H
+#define CEPH_OS_OBJECTCACHE_H
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <ext/hash_map>
+
+#include "include/types.h"
+#include "include/buffer.h"
+#include "include/object.h"
+#include "common/Mutex.h"
+#include "osd/osd_types.h"
+
+/**
+ * Bounded cache of object xattrs and small data extents.
+ *
+ * Entries are kept per (collection, object), but invalidated per
+ * object: an object linked into several collections shares one inode,
+ * so a change made through any of them affects them all.
+ *
+ * The cache is split into shards by object hash, each with its own
+ * lock and LRU.  Fills race with invalidations, so callers take a
+ * ticket with get_gen() before going to disk and pass it back when
+ * adding what they read; the add is dropped if the shard has seen an
+ * invalidation in the meantime.
+ */
+class ObjectCache {
+  struct entry_t {
+    coll_t cid;
+    sobject_t oid;
+
+    std::map<std::string, bufferptr> attrs;
+    bool attrs_complete;     ///< attrs holds every attr of the object
+
+    bool have_data;
+    uint64_t data_off;
+    bufferlist data;
+    bool data_eof;           ///< the object ends where data does
+
+    std::list<entry_t*>::iterator lru_pos;
+    uint64_t bytes;
+
+    entry_t(coll_t c, const sobject_t &o)
+      : cid(c), oid(o), attrs_complete(false),
+	have_data(false), data_off(0), data_eof(false), bytes(0) {}
+  };
+
+  struct shard_t {
+    Mutex lock;
+    __gnu_cxx::hash_map<sobject_t, std::list<entry_t*> > objects;
+    std::list<entry_t*> lru;   ///< most recently used at the front
+    uint64_t bytes;
+    uint64_t gen;              ///< bumped by every invalidation
+    shard_t() : lock("ObjectCache::shard_t::lock"), bytes(0), gen(0) {}
+  };
+
+  std::vector<shard_t*> shards;
+  uint64_t max_shard_bytes;
+  uint64_t max_extent;
+
+  shard_t *get_shard(const sobject_t &oid);
+  entry_t *_lookup(shard_t *s, coll_t cid, const sobject_t &oid);
+  entry_t *_get_or_create(shard_t *s, coll_t cid, const sobject_t &oid);
+  void _touch(shard_t *s, entry_t *e);
+  void _account(shard_t *s, entry_t *e);
+  void _remove(shard_t *s, entry_t *e);
+  void _trim(shard_t *s);
+  void _drop_data(entry_t *e);
+
+public:
+  ObjectCache(unsigned num_shards, uint64_t max_bytes, uint64_t max_extent);
+  ~ObjectCache();
+
+  /// invalidation ticket to pass to the add_* calls below
+  uint64_t get_gen(const sobject_t &oid);
+
+  // attrs; names are as given to ObjectStore::getattr
+  /// 0 (and *bp) on hit, -ENODATA if known absent, -ENOENT on a miss
+  int get_attr(coll_t cid, const sobject_t &oid, const std::string &name,
+	       bufferptr *bp);
+  /// true if the complete attr set is cached
+  bool get_attrs(coll_t cid, const sobject_t &oid,
+		 std::map<std::string, bufferptr> *aset);
+  void add_attr(uint64_t gen, coll_t cid, const sobject_t &oid,
+		const std::string &name, const bufferptr &bp);
+  void add_attrs(uint64_t gen, coll_t cid, const sobject_t &oid,
+		 const std::map<std::string, bufferptr> &aset);
+
+  // data
+  /**
+   * Serve a read from cache.  len == 0 means to the end of the object.
+   *
+   * @return bytes read, or -ENOENT on a miss
+   */
+  int read(coll_t cid, const sobject_t &oid, uint64_t off, size_t len,
+	   bufferlist *bl);
+  /// remember bl read from off; eof if the object ends at off + bl.length()
+  void add_data(uint64_t gen, coll_t cid, const sobject_t &oid,
+		uint64_t off, const bufferlist &bl, bool eof);
+  bool is_cached(coll_t cid, const sobject_t &oid, uint64_t off, size_t len);
+  /// drop cached data of cid/oid overlapping off~len
+  void trim(coll_t cid, const sobject_t &oid, uint64_t off, size_t len);
+
+  // invalidation
+  void invalidate(const sobject_t &oid);
+  void invalidate_data(const sobject_t &oid);
+  void invalidate_attrs(const sobject_t &oid);
+  /// forget cid/oid only (the object was unlinked from cid)
+  void invalidate(coll_t cid, const sobject_t &oid);
+  void invalidate_collection(coll_t cid);
+  void clear();
+
+  uint64_t get_bytes();
+};
+
+#endif
@@ -63,6 +63,17 @@ enum {
   l_os_oq_bytes,
   l_os_bytes,
   l_os_committing,
+  l_os_cache_attr_hit,
+  l_os_cache_attr_miss,
+  l_os_cache_data_hit,
+  l_os_cache_data_miss,
+  l_os_cache_bytes,
+  l_os_copy_reflink,
+  l_os_copy_splice,
+  l_os_copy_sendfile,
+  l_os_copy_buffered,
+  l_os_copy_bytes,
+  l_os_copy_lat,
   l_os_last,
 };
 
@@ -262,6 +273,141 @@ public:
       ::decode(aset, p);
     }
 
+    /**
+     * List the collections, and optionally the objects, this
+     * transaction touches, each once.  An object linked into several
+     * collections has the same name in each of them.
+     *
+     * Walks the encoded ops without disturbing the position used by
+     * get_op() and friends.  Returns false on an op we don't know, in
+     * which case the caller must assume it may touch anything.
+     */
+    bool get_colls(vector<coll_t> *ls, vector<sobject_t> *oids = NULL) {
+      bufferlist::iterator q = tbl.begin();
+      while (!q.end()) {
+	__u32 op;
+	coll_t cid, ncid;
+	sobject_t oid, noid;
+	uint64_t len;
+	string name;
+	bufferlist bl;
+	map<string,bufferptr> aset;
+	::decode(op, q);
+	switch (op) {
+	case OP_NOP:
+	case OP_STARTSYNC:
+	  break;
+	case OP_TOUCH:
+	case OP_REMOVE:
+	case OP_RMATTRS:
+	case OP_COLL_REMOVE:
+	  ::decode(cid, q);
+	  ::decode(oid, q);
+	  break;
+	case OP_WRITE:
+	  ::decode(cid, q);
+	  ::decode(oid, q);
+	  ::decode(len, q);
+	  ::decode(len, q);
+	  ::decode(bl, q);
+	  break;
+	case OP_ZERO:
+	case OP_TRIMCACHE:
+	  ::decode(cid, q);
+	  ::decode(oid, q);
+	  ::decode(len, q);
+	  ::decode(len, q);
+	  break;
+	case OP_TRUNCATE:
+	  ::decode(cid, q);
+	  ::decode(oid, q);
+	  ::decode(len, q);
+	  break;
+	case OP_SETATTR:
+	  ::decode(cid, q);
+	  ::decode(oid, q);
+	  ::decode(name, q);
+	  ::decode(bl, q);
+	  break;
+	case OP_SETATTRS:
+	  ::decode(cid, q);
+	  ::decode(oid, q);
+	  ::decode(aset, q);
+	  break;
+	case OP_RMATTR:
+	  ::decode(cid, q);
+	  ::decode(oid, q);
+	  ::decode(name, q);
+	  break;
+	case OP_CLONE:
+	  ::decode(cid, q);
+	  ::decode(oid, q);
+	  ::decode(noid, q);
+	  break;
+	case OP_CLONERANGE:
+	case OP_CLONERANGE2:
+	  ::decode(cid, q);
+	  ::decode(oid, q);
+	  ::decode(noid, q);
+	  ::decode(len, q);
+	  ::decode(len, q);
+	  if (op == OP_CLONERANGE2)
+	    ::decode(len, q);
+	  break;
+	case OP_MKCOLL:
+	case OP_RMCOLL:
+	  ::decode(cid, q);
+	  break;
+	case OP_COLL_ADD:
+	case OP_COLL_RENAME:
+	  ::decode(cid, q);
+	  ::decode(ncid, q);
+	  if (op == OP_COLL_ADD)
+	    ::decode(oid, q);
+	  add_coll(ls, ncid);
+	  break;
+	case OP_COLL_SETATTR:
+	  ::decode(cid, q);
+	  ::decode(name, q);
+	  ::decode(bl, q);
+	  break;
+	case OP_COLL_RMATTR:
+	  ::decode(cid, q);
+	  ::decode(name, q);
+	  break;
+	case OP_COLL_SETATTRS:
+	  ::decode(cid, q);
+	  ::decode(aset, q);
+	  break;
+	default:
+	  return false;
+	}
+	if (op != OP_NOP && op != OP_STARTSYNC)
+	  add_coll(ls, cid);
+	if (oids) {
+	  if (oid.oid.name.length())
+	    add_oid(oids, oid);
+	  if (noid.oid.name.length())
+	    add_oid(oids, noid);
+	}
+      }
+      return true;
+    }
+  private:
+    static void add_coll(vector<coll_t> *ls, const coll_t &c) {
+      for (vector<coll_t>::iterator p = ls->begin(); p != ls->end(); ++p)
+	if (*p == c)
+	  return;
+      ls->push_back(c);
+    }
+    static void add_oid(vector<sobject_t> *ls, const sobject_t &o) {
+      for (vector<sobject_t>::iterator p = ls->begin(); p != ls->end(); ++p)
+	if (*p == o)
+	  return;
+      ls->push_back(o);
+    }
+  public:
+
     // -----------------------------
 
     void start_sync() {
@@ -291,7 +437,13 @@ public:
       assert(len == data.length());
       if (data.length() > largest_data_len) {
 	largest_data_len = data.length();
-	largest_data_off = off;
+	// only the offset within a page matters here; take it from the
+	// buffer itself so the journal can lay the payload out to match
+	// and write it with O_DIRECT without copying it
+	if (data.buffers().front().length() >= PAGE_SIZE)
+	  largest_data_off = (unsigned long)data.buffers().front().c_str() & ~PAGE_MASK;
+	else
+	  largest_data_off = off;
 	largest_data_off_in_tbl = tbl.length() + sizeof(__u32);  // we are about to 
       }
       ::encode(data, tbl);
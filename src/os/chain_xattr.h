@@ -0,0 +1,36 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*- 
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2004-2006 Sage Weil <sage@newdream.net>
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software 
+ * Foundation.  See file COPYING.
+ * 
+ */
+
+#ifndef CEPH_OS_CHAIN_XATTR_H
+#define CEPH_OS_CHAIN_XATTR_H
+
+#include <sys/types.h>
+
+#define CHAIN_XATTR_MAX_NAME_LEN  128
+#define CHAIN_XATTR_MAX_BLOCK_LEN 2048
+
+/*
+ * Extended attributes that do not fit in a single xattr (the underlying fs
+ * may limit the value size) are chained over several raw xattrs named
+ * "name", "name@1", "name@2", ...  These helpers hide the chaining; they
+ * return the number of bytes read/written or -errno.
+ */
+
+int chain_getxattr(const char *fn, const char *name, void *val, size_t size);
+int chain_setxattr(const char *fn, const char *name, const void *val, size_t size);
+int chain_fsetxattr(int fd, const char *name, const void *val, size_t size);
+int chain_removexattr(const char *fn, const char *name);
+int chain_listxattr(const char *fn, char *names, size_t len);
+
+#endif
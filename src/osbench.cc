@@ -0,0 +1,599 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2004-2006 Sage Weil <sage@newdream.net>
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * ObjectStore microbenchmark.
+ *
+ * Runs a weighted mix of operations against a FileStore in a local
+ * directory, keeping up to --qd transactions in flight, and reports
+ * throughput and latency percentiles for each kind of operation.
+ * Writes are timed both to apply (readable) and to commit (on disk);
+ * the synchronous ops (list, getxattr) just to completion.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "os/FileStore.h"
+#include "global/global_init.h"
+#include "common/ceph_argparse.h"
+#include "common/Cond.h"
+#include "common/Mutex.h"
+#include "common/debug.h"
+
+#undef dout_prefix
+#define dout_prefix *_dout
+
+enum {
+  OP_SEQ_WRITE,
+  OP_RAND_WRITE,
+  OP_OVERWRITE,
+  OP_XATTR,
+  OP_GETXATTR,
+  OP_CLONE,
+  OP_LIST,
+  OP_REMOVE,
+  NUM_OPS
+};
+
+static const char *op_names[NUM_OPS] = {
+  "seq_write",
+  "rand_write",
+  "overwrite",
+  "xattr",
+  "getxattr",
+  "clone",
+  "list",
+  "remove",
+};
+
+void usage()
+{
+  cout << "usage: osbench [options] <dir>\n"
+       << "  --journal <path>      journal file or device (default: none)\n"
+       << "  --no-mkfs             use the existing store in <dir>\n"
+       << "  --seconds <n>         run time (default 30)\n"
+       << "  --ops <n>             stop after n ops (default: no limit)\n"
+       << "  --qd <n>              transactions in flight (default 16)\n"
+       << "  --write-size <bytes>  seq_write/rand_write size (default 1M)\n"
+       << "  --small-size <bytes>  overwrite size (default 4K)\n"
+       << "  --object-size <bytes> object size (default 4M)\n"
+       << "  --objects <n>         objects in the working set (default 256)\n"
+       << "  --attrs <n>           attrs per xattr op (default 16)\n"
+       << "  --attr-size <bytes>   attr value size (default 256)\n"
+       << "  --list-max <n>        entries per collection_list_partial (default 1024)\n"
+       << "  --mix <op:w,...>      op weights (default: 1 each); ops are\n"
+       << "                        ";
+  for (int i = 0; i < NUM_OPS; i++)
+    cout << op_names[i] << (i + 1 < NUM_OPS ? ", " : "\n");
+  cout << "  --seed <n>            random seed" << std::endl;
+  exit(1);
+}
+
+
+// -- latency accounting
+
+struct op_stats_t {
+  uint64_t count;
+  uint64_t bytes;
+  vector<double> apply_lat, commit_lat;   // seconds
+  op_stats_t() : count(0), bytes(0) {}
+};
+
+Mutex lock("osbench::lock");
+Cond cond;
+op_stats_t stats[NUM_OPS];
+int inflight = 0;        // not yet applied; what --qd limits
+int uncommitted = 0;
+vector<int> unapplied;   // per object (clones count with their object)
+
+struct op_t {
+  int type;
+  int obj;
+  uint64_t bytes;
+  utime_t start, applied;
+  bool is_applied, is_committed;
+  op_t(int t, int o, uint64_t b)
+    : type(t), obj(o), bytes(b), is_applied(false), is_committed(false) {}
+};
+
+void op_applied(op_t *op)
+{
+  Mutex::Locker l(lock);
+  op->applied = ceph_clock_now(g_ceph_context);
+  op->is_applied = true;
+  stats[op->type].apply_lat.push_back(op->applied - op->start);
+  inflight--;
+  unapplied[op->obj]--;
+  if (op->is_committed)
+    delete op;
+  cond.Signal();
+}
+
+void op_committed(op_t *op)
+{
+  Mutex::Locker l(lock);
+  utime_t now = ceph_clock_now(g_ceph_context);
+  stats[op->type].commit_lat.push_back(now - op->start);
+  stats[op->type].count++;
+  stats[op->type].bytes += op->bytes;
+  op->is_committed = true;
+  uncommitted--;
+  if (op->is_applied)
+    delete op;
+  cond.Signal();
+}
+
+struct C_Applied : public Context {
+  op_t *op;
+  C_Applied(op_t *o) : op(o) {}
+  void finish(int r) {
+    op_applied(op);
+  }
+};
+
+struct C_Committed : public Context {
+  op_t *op;
+  C_Committed(op_t *o) : op(o) {}
+  void finish(int r) {
+    op_committed(op);
+  }
+};
+
+void record_sync(int type, utime_t start, uint64_t bytes)
+{
+  Mutex::Locker l(lock);
+  double lat = ceph_clock_now(g_ceph_context) - start;
+  stats[type].apply_lat.push_back(lat);
+  stats[type].commit_lat.push_back(lat);
+  stats[type].count++;
+  stats[type].bytes += bytes;
+}
+
+double percentile(vector<double> &v, double p)
+{
+  if (v.empty())
+    return 0;
+  unsigned i = (unsigned)(p * v.size());
+  if (i >= v.size())
+    i = v.size() - 1;
+  return v[i];
+}
+
+void report(double elapsed)
+{
+  char buf[200];
+  snprintf(buf, sizeof(buf), "%-11s %9s %9s %9s   %-26s   %-26s",
+	   "op", "count", "ops/s", "MB/s",
+	   "apply p50/p99/p999 ms", "commit p50/p99/p999 ms");
+  cout << buf << std::endl;
+  for (int i = 0; i < NUM_OPS; i++) {
+    op_stats_t &s = stats[i];
+    if (!s.count)
+      continue;
+    sort(s.apply_lat.begin(), s.apply_lat.end());
+    sort(s.commit_lat.begin(), s.commit_lat.end());
+    snprintf(buf, sizeof(buf),
+	     "%-11s %9llu %9.1f %9.2f   %8.2f/%8.2f/%8.2f   %8.2f/%8.2f/%8.2f",
+	     op_names[i], (unsigned long long)s.count,
+	     (double)s.count / elapsed,
+	     (double)s.bytes / elapsed / (1024 * 1024),
+	     percentile(s.apply_lat, .5) * 1000,
+	     percentile(s.apply_lat, .99) * 1000,
+	     percentile(s.apply_lat, .999) * 1000,
+	     percentile(s.commit_lat, .5) * 1000,
+	     percentile(s.commit_lat, .99) * 1000,
+	     percentile(s.commit_lat, .999) * 1000);
+    cout << buf << std::endl;
+  }
+}
+
+
+// -- workload
+
+struct bench_t {
+  ObjectStore *fs;
+  coll_t cid;
+  uint64_t write_size, small_size, object_size;
+  int num_objects, num_attrs, attr_size, list_max;
+
+  vector<bool> exists;
+  vector<bool> clone_exists;
+  // ops on one object share a sequencer, so they apply in order while
+  // ops on different objects can proceed in parallel
+  int num_osr;
+  ObjectStore::Sequencer *osr;
+  int seq_obj;
+  uint64_t seq_off;
+  bufferlist write_bl, small_bl;
+  map<string,bufferptr> attrs;
+
+  bench_t(ObjectStore *f)
+    : fs(f), cid(string("osbench")),
+      write_size(1 << 20), small_size(4096), object_size(4 << 20),
+      num_objects(256), num_attrs(16), attr_size(256), list_max(1024),
+      num_osr(0), osr(NULL), seq_obj(0), seq_off(0) {}
+  ~bench_t() {
+    delete[] osr;
+  }
+
+  void init(int qd) {
+    exists.resize(num_objects);
+    clone_exists.resize(num_objects);
+    unapplied.resize(num_objects);
+    num_osr = MIN(qd, num_objects);
+    osr = new ObjectStore::Sequencer[num_osr];
+    bufferptr bp(write_size);
+    memset(bp.c_str(), 0xa5, write_size);
+    write_bl.push_back(bp);
+    bufferptr sp(small_size);
+    memset(sp.c_str(), 0x5a, small_size);
+    small_bl.push_back(sp);
+    for (int i = 0; i < num_attrs; i++) {
+      char n[20];
+      snprintf(n, sizeof(n), "_attr%d", i);
+      bufferptr ap(attr_size);
+      memset(ap.c_str(), 'a' + i % 26, attr_size);
+      attrs[n] = ap;
+    }
+  }
+
+  sobject_t obj(int i, bool clone = false) {
+    char n[40];
+    snprintf(n, sizeof(n), "osbench_%d%s", i, clone ? "_clone" : "");
+    return sobject_t(object_t(n), CEPH_NOSNAP);
+  }
+
+  int random_existing() {
+    for (int tries = 0; tries < num_objects; tries++) {
+      int i = rand() % num_objects;
+      if (exists[i])
+	return i;
+    }
+    return -1;
+  }
+
+  uint64_t random_off(uint64_t len) {
+    uint64_t slots = object_size > len ? object_size / len : 1;
+    return (rand() % slots) * len;
+  }
+
+  void queue(int type, int i, uint64_t bytes, ObjectStore::Transaction *t) {
+    op_t *op = new op_t(type, i, bytes);
+    {
+      Mutex::Locker l(lock);
+      inflight++;
+      uncommitted++;
+      unapplied[i]++;
+    }
+    op->start = ceph_clock_now(g_ceph_context);
+    fs->queue_transaction(&osr[i % num_osr], t, new C_Applied(op), new C_Committed(op));
+  }
+
+  void do_op(int type) {
+    ObjectStore::Transaction *t = new ObjectStore::Transaction;
+    switch (type) {
+    case OP_SEQ_WRITE:
+      if (seq_off + write_size > object_size) {
+	seq_obj = (seq_obj + 1) % num_objects;
+	seq_off = 0;
+      }
+      t->write(cid, obj(seq_obj), seq_off, write_size, write_bl);
+      exists[seq_obj] = true;
+      seq_off += write_size;
+      queue(type, seq_obj, write_size, t);
+      return;
+
+    case OP_RAND_WRITE:
+    case OP_OVERWRITE:
+      {
+	int i = rand() % num_objects;
+	bufferlist &bl = type == OP_RAND_WRITE ? write_bl : small_bl;
+	t->write(cid, obj(i), random_off(bl.length()), bl.length(), bl);
+	exists[i] = true;
+	queue(type, i, bl.length(), t);
+      }
+      return;
+
+    case OP_XATTR:
+      {
+	int i = rand() % num_objects;
+	if (!exists[i]) {
+	  t->touch(cid, obj(i));
+	  exists[i] = true;
+	}
+	t->setattrs(cid, obj(i), attrs);
+	queue(type, i, num_attrs * attr_size, t);
+      }
+      return;
+
+    case OP_CLONE:
+      {
+	int i = random_existing();
+	if (i < 0)
+	  break;
+	t->clone(cid, obj(i), obj(i, true));
+	clone_exists[i] = true;
+	queue(type, i, 0, t);
+      }
+      return;
+
+    case OP_REMOVE:
+      {
+	int i = random_existing();
+	if (i < 0)
+	  break;
+	t->remove(cid, obj(i));
+	exists[i] = false;
+	if (clone_exists[i]) {
+	  t->remove(cid, obj(i, true));
+	  clone_exists[i] = false;
+	}
+	queue(type, i, 0, t);
+      }
+      return;
+
+    case OP_GETXATTR:
+      {
+	delete t;
+	int i = random_existing();
+	if (i < 0)
+	  return;
+	// only what has been applied can be read back
+	wait_applied(i);
+	map<string,bufferptr> aset;
+	utime_t start = ceph_clock_now(g_ceph_context);
+	fs->getattrs(cid, obj(i), aset);
+	uint64_t bytes = 0;
+	for (map<string,bufferptr>::iterator p = aset.begin(); p != aset.end(); ++p)
+	  bytes += p->second.length();
+	record_sync(type, start, bytes);
+      }
+      return;
+
+    case OP_LIST:
+      {
+	delete t;
+	utime_t start = ceph_clock_now(g_ceph_context);
+	collection_list_handle_t handle = 0;
+	while (true) {
+	  vector<sobject_t> ls;
+	  int r = fs->collection_list_partial(cid, 0, ls, list_max, &handle);
+	  // the handle goes back to 0 once the listing is done
+	  if (r < 0 || ls.empty() || handle == 0)
+	    break;
+	}
+	record_sync(type, start, 0);
+      }
+      return;
+    }
+    delete t;
+  }
+
+  void wait_applied() {
+    Mutex::Locker l(lock);
+    while (inflight > 0)
+      cond.Wait(lock);
+  }
+
+  void wait_applied(int i) {
+    Mutex::Locker l(lock);
+    while (unapplied[i] > 0)
+      cond.Wait(lock);
+  }
+};
+
+bool parse_mix(const char *s, int *weights)
+{
+  for (int i = 0; i < NUM_OPS; i++)
+    weights[i] = 0;
+  string mix(s);
+  size_t pos = 0;
+  while (pos < mix.length()) {
+    size_t end = mix.find(',', pos);
+    if (end == string::npos)
+      end = mix.length();
+    string item = mix.substr(pos, end - pos);
+    size_t colon = item.find(':');
+    string name = item.substr(0, colon);
+    int w = colon == string::npos ? 1 : atoi(item.c_str() + colon + 1);
+    int i;
+    for (i = 0; i < NUM_OPS; i++)
+      if (name == op_names[i])
+	break;
+    if (i == NUM_OPS || w < 0) {
+      cerr << "osbench: bad --mix entry '" << item << "'" << std::endl;
+      return false;
+    }
+    weights[i] = w;
+    pos = end + 1;
+  }
+  return true;
+}
+
+int main(int argc, const char **argv)
+{
+  vector<const char*> args;
+  argv_to_vec(argc, argv, args);
+  env_to_vec(args);
+  DEFINE_CONF_VARS(usage);
+
+  global_init(args, CEPH_ENTITY_TYPE_CLIENT, CODE_ENVIRONMENT_UTILITY,
+	      CINIT_FLAG_NO_DEFAULT_CONFIG_FILE);
+  common_init_finish(g_ceph_context);
+
+  const char *dir = 0;
+  const char *journal = 0;
+  const char *mix = 0;
+  bool no_mkfs = false;
+  int seconds = 30;
+  int max_ops = 0;
+  int qd = 16;
+  int seed = getpid();
+  int write_size = 0, small_size = 0, object_size = 0;
+  int objects = 0, attrs = -1, attr_size = 0, list_max = 0;
+
+  FOR_EACH_ARG(args) {
+    if (CEPH_ARGPARSE_EQ("help", 'h')) {
+      usage();
+    } else if (CEPH_ARGPARSE_EQ("journal", '\0')) {
+      CEPH_ARGPARSE_SET_ARG_VAL(&journal, OPT_STR);
+    } else if (CEPH_ARGPARSE_EQ("no_mkfs", '\0')) {
+      CEPH_ARGPARSE_SET_ARG_VAL(&no_mkfs, OPT_BOOL);
+    } else if (CEPH_ARGPARSE_EQ("seconds", '\0')) {
+      CEPH_ARGPARSE_SET_ARG_VAL(&seconds, OPT_INT);
+    } else if (CEPH_ARGPARSE_EQ("ops", '\0')) {
+      CEPH_ARGPARSE_SET_ARG_VAL(&max_ops, OPT_INT);
+    } else if (CEPH_ARGPARSE_EQ("qd", '\0')) {
+      CEPH_ARGPARSE_SET_ARG_VAL(&qd, OPT_INT);
+    } else if (CEPH_ARGPARSE_EQ("write_size", '\0')) {
+      CEPH_ARGPARSE_SET_ARG_VAL(&write_size, OPT_INT);
+    } else if (CEPH_ARGPARSE_EQ("small_size", '\0')) {
+      CEPH_ARGPARSE_SET_ARG_VAL(&small_size, OPT_INT);
+    } else if (CEPH_ARGPARSE_EQ("object_size", '\0')) {
+      CEPH_ARGPARSE_SET_ARG_VAL(&object_size, OPT_INT);
+    } else if (CEPH_ARGPARSE_EQ("objects", '\0')) {
+      CEPH_ARGPARSE_SET_ARG_VAL(&objects, OPT_INT);
+    } else if (CEPH_ARGPARSE_EQ("attrs", '\0')) {
+      CEPH_ARGPARSE_SET_ARG_VAL(&attrs, OPT_INT);
+    } else if (CEPH_ARGPARSE_EQ("attr_size", '\0')) {
+      CEPH_ARGPARSE_SET_ARG_VAL(&attr_size, OPT_INT);
+    } else if (CEPH_ARGPARSE_EQ("list_max", '\0')) {
+      CEPH_ARGPARSE_SET_ARG_VAL(&list_max, OPT_INT);
+    } else if (CEPH_ARGPARSE_EQ("mix", '\0')) {
+      CEPH_ARGPARSE_SET_ARG_VAL(&mix, OPT_STR);
+    } else if (CEPH_ARGPARSE_EQ("seed", '\0')) {
+      CEPH_ARGPARSE_SET_ARG_VAL(&seed, OPT_INT);
+    } else if (!dir) {
+      dir = args[i];
+    } else {
+      usage();
+    }
+  }
+  if (!dir)
+    usage();
+
+  int weights[NUM_OPS];
+  for (int i = 0; i < NUM_OPS; i++)
+    weights[i] = 1;
+  if (mix && !parse_mix(mix, weights))
+    usage();
+  int total_weight = 0;
+  for (int i = 0; i < NUM_OPS; i++)
+    total_weight += weights[i];
+  if (!total_weight) {
+    cerr << "osbench: --mix selects no ops" << std::endl;
+    usage();
+  }
+  if (qd < 1)
+    qd = 1;
+  srand(seed);
+
+  FileStore *fs = new FileStore(dir, journal ? journal : "");
+  if (!no_mkfs && fs->mkfs() < 0) {
+    cerr << "osbench: mkfs failed" << std::endl;
+    return 1;
+  }
+  if (fs->mount() < 0) {
+    cerr << "osbench: mount failed" << std::endl;
+    return 1;
+  }
+
+  bench_t b(fs);
+  if (write_size > 0)
+    b.write_size = write_size;
+  if (small_size > 0)
+    b.small_size = small_size;
+  if (object_size > 0)
+    b.object_size = object_size;
+  if (objects > 0)
+    b.num_objects = objects;
+  if (attrs >= 0)
+    b.num_attrs = attrs;
+  if (attr_size > 0)
+    b.attr_size = attr_size;
+  if (list_max > 0)
+    b.list_max = list_max;
+  b.init(qd);
+
+  if (!fs->collection_exists(b.cid)) {
+    ObjectStore::Transaction t;
+    t.create_collection(b.cid);
+    fs->apply_transaction(t);
+  } else {
+    // pick up what an earlier run left behind
+    for (int i = 0; i < b.num_objects; i++) {
+      b.exists[i] = fs->exists(b.cid, b.obj(i));
+      b.clone_exists[i] = fs->exists(b.cid, b.obj(i, true));
+    }
+  }
+
+  cout << "osbench " << dir << " journal " << (journal ? journal : "(none)")
+       << " qd " << qd << " seconds " << seconds << " ops " << max_ops
+       << " seed " << seed << std::endl;
+  cout << "mix";
+  for (int i = 0; i < NUM_OPS; i++)
+    if (weights[i])
+      cout << " " << op_names[i] << ":" << weights[i];
+  cout << std::endl;
+
+  utime_t start = ceph_clock_now(g_ceph_context);
+  utime_t end = start;
+  end += seconds;
+  int issued = 0;
+  while (true) {
+    if (max_ops && issued >= max_ops)
+      break;
+    if (ceph_clock_now(g_ceph_context) >= end)
+      break;
+    {
+      Mutex::Locker l(lock);
+      while (inflight >= qd)
+	cond.Wait(lock);
+    }
+    int w = rand() % total_weight;
+    int type = 0;
+    while (w >= weights[type]) {
+      w -= weights[type];
+      type++;
+    }
+    b.do_op(type);
+    issued++;
+  }
+
+  // let everything commit
+  b.wait_applied();
+  fs->sync();
+  {
+    Mutex::Locker l(lock);
+    while (uncommitted > 0)
+      cond.Wait(lock);
+  }
+  double elapsed = ceph_clock_now(g_ceph_context) - start;
+
+  fs->umount();
+  delete fs;
+
+  cout << issued << " ops in " << std::fixed << std::setprecision(2) << elapsed
+       << " seconds" << std::endl;
+  report(elapsed);
+  return 0;
+}
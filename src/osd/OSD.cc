@@ -420,9 +420,10 @@ OSD::OSD(int id, Messenger *internal_messenger, Messenger *external_messenger,
 	     ceph_osd_feature_ro_compat,
 	     ceph_osd_feature_incompat),
   state(STATE_BOOTING), boot_epoch(0), up_epoch(0),
-  op_tp(external_messenger->cct, "OSD::op_tp", g_conf->osd_op_threads),
+  op_tp(external_messenger->cct, "OSD::op_tp", 1),
   recovery_tp(external_messenger->cct, "OSD::recovery_tp", g_conf->osd_recovery_threads),
   disk_tp(external_messenger->cct, "OSD::disk_tp", g_conf->osd_disk_threads),
+  scrub_tp(external_messenger->cct, "OSD::scrub_tp", g_conf->osd_scrub_threads),
   heartbeat_lock("OSD::heartbeat_lock"),
   heartbeat_stop(false), heartbeat_epoch(0),
   hbin_messenger(hbinm),
@@ -431,7 +432,7 @@ OSD::OSD(int id, Messenger *internal_messenger, Messenger *external_messenger,
   heartbeat_dispatcher(this),
   stat_lock("OSD::stat_lock"),
   finished_lock("OSD::finished_lock"),
-  op_wq(this, g_conf->osd_op_thread_timeout, &op_tp),
+  op_queue_lock("OSD::op_queue_lock"),
   osdmap(NULL),
   map_lock("OSD::map_lock"),
   peer_map_epoch_lock("OSD::peer_map_epoch_lock"),
@@ -441,8 +442,10 @@ OSD::OSD(int id, Messenger *internal_messenger, Messenger *external_messenger,
   osd_stat_updated(false),
   last_tid(0),
   tid_lock("OSD::tid_lock"),
+  copy_fetch_lock("OSD::copy_fetch_lock"),
   backlog_wq(this, g_conf->osd_backlog_thread_timeout, &disk_tp),
   recovery_ops_active(0),
+  recovery_bytes_inflight(0),
   recovery_wq(this, g_conf->osd_recovery_thread_timeout, &recovery_tp),
   remove_list_lock("OSD::remove_list_lock"),
   replay_queue_lock("OSD::replay_queue_lock"),
@@ -450,9 +453,11 @@ OSD::OSD(int id, Messenger *internal_messenger, Messenger *external_messenger,
   sched_scrub_lock("OSD::sched_scrub_lock"),
   scrubs_pending(0),
   scrubs_active(0),
-  scrub_wq(this, g_conf->osd_scrub_thread_timeout, &disk_tp),
+  scrub_wq(this, g_conf->osd_scrub_thread_timeout, &scrub_tp),
   scrub_finalize_wq(this, g_conf->osd_scrub_finalize_thread_timeout, &op_tp),
-  rep_scrub_wq(this, g_conf->osd_scrub_thread_timeout, &disk_tp),
+  rep_scrub_wq(this, g_conf->osd_scrub_thread_timeout, &scrub_tp),
+  scrub_sleep_lock("OSD::scrub_sleep_lock"),
+  scrub_sleep_timer(external_messenger->cct, scrub_sleep_lock),
   remove_wq(this, g_conf->osd_remove_thread_timeout, &disk_tp),
   watch_lock("OSD::watch_lock"),
   watch_timer(external_messenger->cct, watch_lock)
@@ -463,8 +468,12 @@ OSD::OSD(int id, Messenger *internal_messenger, Messenger *external_messenger,
   
   osdmap = 0;
 
-  pending_ops = 0;
-  waiting_for_no_ops = false;
+  int nshards = MAX(g_conf->osd_op_shards, 1);
+  for (int i = 0; i < nshards; i++) {
+    char name[40];
+    snprintf(name, sizeof(name), "OSD::op_tp.%d", i);
+    op_shards.push_back(new OpShard(this, name));
+  }
 }
 
 OSD::~OSD()
@@ -473,6 +482,11 @@ OSD::~OSD()
   delete class_handler;
   g_ceph_context->GetPerfCountersCollection()->logger_remove(logger);
   delete logger;
+  for (vector<OpShard*>::iterator p = op_shards.begin(); p != op_shards.end(); ++p) {
+    if ((*p)->wq.logger)
+      g_ceph_context->GetPerfCountersCollection()->logger_remove((*p)->wq.logger);
+    delete *p;
+  }
   delete store;
 }
 
@@ -520,6 +534,7 @@ int OSD::init()
 
   timer.init();
   watch_timer.init();
+  scrub_sleep_timer.init();
   watch = new Watch();
 
   // mount.
@@ -602,8 +617,11 @@ int OSD::init()
   osd_lock.Lock();
 
   op_tp.start();
+  for (vector<OpShard*>::iterator p = op_shards.begin(); p != op_shards.end(); ++p)
+    (*p)->tp.start();
   recovery_tp.start();
   disk_tp.start();
+  scrub_tp.start();
 
   // start the heartbeat
   heartbeat_thread.create();
@@ -671,8 +689,10 @@ void OSD::create_logger()
   osd_plb.add_u64_counter(l_osd_pull,      "pull");       // pull requests sent
   osd_plb.add_u64_counter(l_osd_push,      "push");       // push messages
   osd_plb.add_u64_counter(l_osd_push_outb, "push_outb");  // pushed bytes
+  osd_plb.add_u64_counter(l_osd_pull_inb, "pull_inb");    // pulled bytes
 
   osd_plb.add_u64_counter(l_osd_rop, "rop");       // recovery ops (started)
+  osd_plb.add_u64(l_osd_rop_inflightb, "rop_inflightb");  // recovery bytes in flight
 
   osd_plb.add_fl(l_osd_loadavg, "loadavg");
   osd_plb.add_u64(l_osd_buf, "buf");       // total ceph::buffer bytes
@@ -687,8 +707,23 @@ void OSD::create_logger()
   osd_plb.add_u64_counter(l_osd_mape, "mape");         // osdmap epochs
   osd_plb.add_u64_counter(l_osd_mape_dup, "mape_dup"); // dup osdmap epochs
 
+  osd_plb.add_u64_counter(l_osd_obc_hit, "obc_hit");    // object_info_t found in memory
+  osd_plb.add_u64_counter(l_osd_obc_miss, "obc_miss");  // object_info_t read from store
+  osd_plb.add_u64_counter(l_osd_ssc_hit, "ssc_hit");    // SnapSet found in memory
+  osd_plb.add_u64_counter(l_osd_ssc_miss, "ssc_miss");  // SnapSet read from store
+
   logger = osd_plb.create_perf_counters();
   g_ceph_context->GetPerfCountersCollection()->logger_add(logger);
+
+  for (unsigned i = 0; i < op_shards.size(); i++) {
+    snprintf(name, sizeof(name), "osd.%d.opq.%d", whoami, i);
+    PerfCountersBuilder opq_plb(g_ceph_context, name, l_osd_opq_first, l_osd_opq_last);
+    opq_plb.add_u64(l_osd_opq_depth, "depth");      // ops waiting for a thread
+    opq_plb.add_u64_counter(l_osd_opq_ops, "ops");  // ops dequeued
+    opq_plb.add_fl_avg(l_osd_opq_wait, "wait");     // time spent waiting
+    op_shards[i]->wq.logger = opq_plb.create_perf_counters();
+    g_ceph_context->GetPerfCountersCollection()->logger_add(op_shards[i]->wq.logger);
+  }
 }
 
 int OSD::shutdown()
@@ -701,6 +736,7 @@ int OSD::shutdown()
   derr << "OSD::shutdown" << dendl;
 
   state = STATE_STOPPING;
+  share_map_epoch.set(0);
 
   timer.shutdown();
 
@@ -708,6 +744,10 @@ int OSD::shutdown()
   watch_timer.shutdown();
   watch_lock.Unlock();
 
+  scrub_sleep_lock.Lock();
+  scrub_sleep_timer.shutdown();
+  scrub_sleep_lock.Unlock();
+
   heartbeat_lock.Lock();
   heartbeat_stop = true;
   heartbeat_cond.Signal();
@@ -720,11 +760,14 @@ int OSD::shutdown()
 
   recovery_tp.stop();
   dout(10) << "recovery tp stopped" << dendl;
+  for (vector<OpShard*>::iterator p = op_shards.begin(); p != op_shards.end(); ++p)
+    (*p)->tp.stop();
   op_tp.stop();
   dout(10) << "op tp stopped" << dendl;
 
   // pause _new_ disk work first (to avoid racing with thread pool),
   disk_tp.pause_new();
+  scrub_tp.pause_new();
   dout(10) << "disk tp paused (new), kicking all pgs" << dendl;
 
   // then kick all pgs,
@@ -741,6 +784,8 @@ int OSD::shutdown()
   // then stop thread.
   disk_tp.stop();
   dout(10) << "disk tp stopped" << dendl;
+  scrub_tp.stop();
+  dout(10) << "scrub tp stopped" << dendl;
 
   // tell pgs we're shutting down
   for (hash_map<pg_t, PG*>::iterator p = pg_map.begin();
@@ -761,6 +806,18 @@ int OSD::shutdown()
   finished.clear();
   finished_lock.Unlock();
 
+  copy_fetch_lock.Lock();
+  for (map<osd_reqid_t, CopyFetch*>::iterator p = copy_fetches.begin();
+       p != copy_fetches.end();
+       ++p) {
+    if (p->second->op)
+      p->second->op->put();
+    delete p->second;
+  }
+  copy_fetches.clear();
+  copy_fetch_tids.clear();
+  copy_fetch_lock.Unlock();
+
   // note unmount epoch
   dout(10) << "noting clean unmount in epoch " << osdmap->get_epoch() << dendl;
   superblock.mounted = boot_epoch;
@@ -1720,6 +1777,8 @@ void OSD::tick()
   remove_list.clear();
   remove_list_lock.Unlock();
 
+  check_copy_fetches();
+
   map_lock.put_read();
 
   timer.add_event_after(1.0, new C_Tick(this));
@@ -2356,14 +2415,16 @@ bool OSD::_share_map_incoming(const entity_inst_t& inst, epoch_t epoch,
 }
 
 
+/*
+ * caller holds osd_lock, or map_lock for read having checked that
+ * share_map_epoch matches osdmap (see dequeue_op)
+ */
 void OSD::_share_map_outgoing(const entity_inst_t& inst) 
 {
   assert(inst.name.is_osd());
 
   int peer = inst.name.num();
 
-  assert(!is_booting());
-
   // send map?
   epoch_t pe = get_peer_epoch(peer);
   if (pe) {
@@ -2626,6 +2687,11 @@ void OSD::_dispatch(Message *m)
       case MSG_OSD_SUBOPREPLY:
         handle_sub_op_reply((MOSDSubOpReply*)m);
         break;
+
+	// our own copy-from fetches
+      case CEPH_MSG_OSD_OPREPLY:
+	handle_copy_fetch_reply((MOSDOpReply*)m);
+	break;
       }
     }
   }
@@ -2660,6 +2726,8 @@ void OSD::handle_scrub(MOSDScrub *m)
       if (pg->is_primary()) {
 	if (m->repair)
 	  pg->state_set(PG_STATE_REPAIR);
+	if (m->deep)
+	  pg->state_set(PG_STATE_DEEP_SCRUB);
 	if (pg->queue_scrub()) {
 	  dout(10) << "queueing " << *pg << " for scrub" << dendl;
 	}
@@ -2676,6 +2744,8 @@ void OSD::handle_scrub(MOSDScrub *m)
 	if (pg->is_primary()) {
 	  if (m->repair)
 	    pg->state_set(PG_STATE_REPAIR);
+	  if (m->deep)
+	    pg->state_set(PG_STATE_DEEP_SCRUB);
 	  if (pg->queue_scrub()) {
 	    dout(10) << "queueing " << *pg << " for scrub" << dendl;
 	  }
@@ -2913,30 +2983,36 @@ void OSD::handle_osd_map(MOSDMap *m)
   osd_lock.Unlock();
 
   op_tp.pause();
+  for (vector<OpShard*>::iterator p = op_shards.begin(); p != op_shards.end(); ++p)
+    (*p)->tp.pause();
 
   // requeue under osd_lock to preserve ordering of _dispatch() wrt incoming messages
   osd_lock.Lock();  
 
-  op_wq.lock();
-
+  // each PG's ops are in a single shard, so this keeps them in order
   list<Message*> rq;
-  while (!op_queue.empty()) {
-    PG *pg = op_queue.back();
-    op_queue.pop_back();
-    pending_ops--;
-    logger->set(l_osd_opq, pending_ops);
-
-    Message *mess = pg->op_queue.back();
-    pg->op_queue.pop_back();
-    pg->put();
-    dout(15) << " will requeue " << *mess << dendl;
-    rq.push_front(mess);
+  for (vector<OpShard*>::reverse_iterator p = op_shards.rbegin(); p != op_shards.rend(); ++p) {
+    OpWQ &wq = (*p)->wq;
+    wq.lock();
+    while (!wq.pgs.empty()) {
+      PG *pg = wq.pgs.back().first;
+      wq.pgs.pop_back();
+      put_pending_op();
+
+      Message *mess = pg->op_queue.back();
+      pg->op_queue.pop_back();
+      pg->put();
+      dout(15) << " will requeue " << *mess << dendl;
+      rq.push_front(mess);
+    }
+    wq.logger->set(l_osd_opq_depth, 0);
+    wq.unlock();
   }
   push_waiters(rq);  // requeue under osd_lock!
-  op_wq.unlock();
 
   recovery_tp.pause();
   disk_tp.pause_new();   // _process() may be waiting for a replica message
+  scrub_tp.pause_new();
 
   ObjectStore::Transaction t;
 
@@ -2950,6 +3026,7 @@ void OSD::handle_osd_map(MOSDMap *m)
       bufferlist& bl = p->second;
       
       o->decode(bl);
+      maybe_update_mapping(o);
       add_map(o);
 
       sobject_t fulloid = get_osdmap_pobject_name(e);
@@ -2982,6 +3059,7 @@ void OSD::handle_osd_map(MOSDMap *m)
 	assert(0 == "bad fsid");
       }
 
+      maybe_update_mapping(o);
       add_map(o);
 
       bufferlist fbl;
@@ -3171,10 +3249,14 @@ void OSD::handle_osd_map(MOSDMap *m)
   // that in cache
   keep_map_from(osdmap->get_epoch()+1);
   trim_map_bl_cache(osdmap->get_epoch()+1);
+  share_map_epoch.set(is_booting() || is_stopping() ? 0 : osdmap->get_epoch());
 
   op_tp.unpause();
+  for (vector<OpShard*>::iterator p = op_shards.begin(); p != op_shards.end(); ++p)
+    (*p)->tp.unpause();
   recovery_tp.unpause();
   disk_tp.unpause();
+  scrub_tp.unpause();
 
   m->put();
 
@@ -3408,6 +3490,27 @@ bool OSD::get_inc_map_bl(epoch_t e, bufferlist& bl)
   return store->read(coll_t::META_COLL, get_inc_osdmap_pobject_name(e), 0, 0, bl) >= 0;
 }
 
+/*
+ * Each of our pgs looks itself up in every new map (and again in the
+ * prior one while tracking intervals).  Once that adds up to about as
+ * many lookups as the map has pgs, computing the whole table up front
+ * is cheaper than running crush for each of them.
+ */
+void OSD::maybe_update_mapping(OSDMap *o)
+{
+  assert(osd_lock.is_locked());
+  unsigned num_pgs = o->get_num_pgs();
+  if (2 * pg_map.size() < num_pgs) {
+    dout(20) << "maybe_update_mapping e" << o->get_epoch() << " " << pg_map.size()
+	     << " local pgs of " << num_pgs << ", not precomputing" << dendl;
+    return;
+  }
+  utime_t start = ceph_clock_now(g_ceph_context);
+  o->update_mapping(g_conf->osd_map_mapping_threads);
+  dout(10) << "maybe_update_mapping e" << o->get_epoch() << " " << num_pgs << " pgs in "
+	   << (ceph_clock_now(g_ceph_context) - start) << dendl;
+}
+
 void OSD::add_map(OSDMap *o)
 {
   Mutex::Locker l(map_cache_lock);
@@ -4370,6 +4473,15 @@ void OSD::_remove_pg(PG *pg)
     return;
   }
   
+  // every log segment object we know of, live or preserved, goes with
+  // the pg even if this deletion is interrupted and restarted
+  for (map<uint64_t,PG::OndiskLog::segment_t>::iterator p = pg->ondisklog.segments.begin();
+       p != pg->ondisklog.segments.end();
+       ++p)
+    pg->removed_log_segments.insert(p->first);
+  pg->removed_log_segments.insert(pg->ondisklog.preserved.begin(),
+				  pg->ondisklog.preserved.end());
+
   // reset log, last_complete, in case deletion gets canceled
   pg->info.last_complete = eversion_t();
   pg->info.last_update = eversion_t();
@@ -4464,6 +4576,10 @@ void OSD::_remove_pg(PG *pg)
 
   {
     rmt->remove(coll_t::META_COLL, pg->log_oid);
+    for (set<uint64_t>::iterator p = pg->removed_log_segments.begin();
+	 p != pg->removed_log_segments.end();
+	 ++p)
+      rmt->remove(coll_t::META_COLL, pg->log_segment_oid(*p));
     rmt->remove(coll_t::META_COLL, pg->biginfo_oid);
     rmt->remove_collection(coll_t(pgid));
     int tr = store->queue_transaction(NULL, rmt);
@@ -4755,6 +4871,15 @@ void OSD::finish_recovery_op(PG *pg, const sobject_t& soid, bool dequeue)
   recovery_wq.unlock();
 }
 
+void OSD::note_recovery_inflight(int64_t bytes)
+{
+  recovery_wq.lock();
+  recovery_bytes_inflight += bytes;
+  assert(recovery_bytes_inflight >= 0);
+  logger->set(l_osd_rop_inflightb, recovery_bytes_inflight);
+  recovery_wq.unlock();
+}
+
 void OSD::defer_recovery(PG *pg)
 {
   dout(10) << "defer_recovery " << *pg << dendl;
@@ -4805,6 +4930,276 @@ void OSD::handle_misdirected_op(PG *pg, MOSDOp *op)
   }
 }
 
+// -- copy-from --
+
+/*
+ * Where the source of f lives now: its acting primary, or -1 if it has
+ * none in this map.  Caller holds map_lock.
+ */
+int OSD::get_copy_fetch_target(CopyFetch *f, pg_t *raw)
+{
+  if (!osdmap->have_pg_pool(f->src_oloc.get_pool()))
+    return -ENOENT;
+  *raw = osdmap->object_locator_to_pg(f->src.oid, f->src_oloc);
+  vector<int> acting;
+  osdmap->pg_to_acting_osds(osdmap->raw_pg_to_pg(*raw), acting);
+  if (acting.empty())
+    return -1;
+  return acting[0];
+}
+
+/*
+ * (Re)send the read for f's source: a stat, all the user xattrs and at
+ * most osd_copy_from_max_bytes of data, in one op.  A bigger source
+ * fails the copy with EOPNOTSUPP when the reply comes back.  Returns <0
+ * if the source can't exist.  Caller holds map_lock and copy_fetch_lock.
+ */
+int OSD::send_copy_fetch(CopyFetch *f)
+{
+  assert(copy_fetch_lock.is_locked());
+  if (f->tid) {
+    copy_fetch_tids.erase(f->tid);
+    f->tid = 0;
+  }
+
+  pg_t raw;
+  f->target = get_copy_fetch_target(f, &raw);
+  if (f->target == -ENOENT)
+    return -ENOENT;
+  if (f->target < 0) {
+    dout(10) << "send_copy_fetch " << f->reqid << " " << f->src
+	     << " has no primary, waiting for a new map" << dendl;
+    return 0;
+  }
+
+  f->tid = get_tid();
+  copy_fetch_tids[f->tid] = f;
+
+  MOSDOp *m = new MOSDOp(0, f->tid, f->src.oid, f->src_oloc, raw, osdmap->get_epoch(),
+			 CEPH_OSD_FLAG_READ | CEPH_OSD_FLAG_ACK);
+  m->set_snapid(f->src.snap);
+  m->add_simple_op(CEPH_OSD_OP_STAT, 0, 0);
+  m->add_simple_op(CEPH_OSD_OP_GETXATTRS, 0, 0);
+  m->add_simple_op(CEPH_OSD_OP_READ, 0, g_conf->osd_copy_from_max_bytes);
+  dout(10) << "send_copy_fetch " << f->reqid << " " << f->src << " tid " << f->tid
+	   << " to osd" << f->target << dendl;
+
+  Connection *con = cluster_messenger->get_connection(osdmap->get_cluster_inst(f->target));
+  if (!con) {
+    m->put();
+    f->target = -1;  // try again on the next tick
+    return 0;
+  }
+  if (f->target == whoami) {
+    // the local pipe never goes through ms_verify_authorizer, so it has
+    // no session (and no caps) unless we give it one
+    Session *s = (Session *)con->get_priv();
+    if (!s) {
+      s = new Session;
+      s->caps.set_allow_all(true);
+      s->caps.set_peer_type(CEPH_ENTITY_TYPE_OSD);
+      con->set_priv(s->get());
+      s->con = con->get();
+    }
+    s->put();
+  }
+  cluster_messenger->send_message(m, con);
+  con->put();
+  return 0;
+}
+
+/*
+ * Make sure the source of op's COPY_FROM is being (or has been) fetched.
+ * Returns true if op is parked until it is, false if do_op can go ahead
+ * and take_copy_source().
+ */
+bool OSD::fetch_copy_source(MOSDOp *op, const sobject_t& src, const object_locator_t& src_oloc)
+{
+  RWLock::RLocker rl(map_lock);
+  Mutex::Locker l(copy_fetch_lock);
+
+  osd_reqid_t reqid = op->get_reqid();
+  map<osd_reqid_t, CopyFetch*>::iterator p = copy_fetches.find(reqid);
+  if (p != copy_fetches.end()) {
+    CopyFetch *f = p->second;
+    if (f->src == src && !(f->src_oloc != src_oloc)) {
+      if (f->done) {
+	f->stamp = ceph_clock_now(g_ceph_context);  // don't expire before do_op takes it
+	return false;
+      }
+      // a resend of the same request; park the new copy instead
+      dout(10) << "fetch_copy_source " << reqid << " " << src << " already in flight" << dendl;
+      if (f->op)
+	f->op->put();
+      f->op = op;
+      return true;
+    }
+    if (f->tid)
+      copy_fetch_tids.erase(f->tid);
+    if (f->op)
+      f->op->put();
+    delete f;
+    copy_fetches.erase(p);
+  }
+
+  CopyFetch *f = new CopyFetch;
+  f->reqid = reqid;
+  f->op = op;
+  f->src = src;
+  f->src_oloc = src_oloc;
+  f->stamp = ceph_clock_now(g_ceph_context);
+  copy_fetches[reqid] = f;
+
+  int r = send_copy_fetch(f);
+  if (r < 0) {
+    f->op = NULL;
+    f->done = true;
+    f->result = r;
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Hand over a completed fetch for reqid; the caller deletes it.
+ */
+OSD::CopyFetch *OSD::take_copy_source(const osd_reqid_t& reqid, const sobject_t& src)
+{
+  Mutex::Locker l(copy_fetch_lock);
+  map<osd_reqid_t, CopyFetch*>::iterator p = copy_fetches.find(reqid);
+  if (p == copy_fetches.end() || !p->second->done || p->second->src != src)
+    return NULL;
+  CopyFetch *f = p->second;
+  copy_fetches.erase(p);
+  return f;
+}
+
+/*
+ * Whether reqid's COPY_FROM is still fetching, or fetched and waiting
+ * for do_op to take it.
+ */
+bool OSD::copy_fetch_pending(const osd_reqid_t& reqid)
+{
+  Mutex::Locker l(copy_fetch_lock);
+  return copy_fetches.count(reqid);
+}
+
+void OSD::handle_copy_fetch_reply(MOSDOpReply *m)
+{
+  Mutex::Locker l(copy_fetch_lock);
+  map<tid_t, CopyFetch*>::iterator p = copy_fetch_tids.find(m->get_tid());
+  if (p == copy_fetch_tids.end()) {
+    dout(10) << "handle_copy_fetch_reply " << *m << " not in flight, dropping" << dendl;
+    m->put();
+    return;
+  }
+  CopyFetch *f = p->second;
+  copy_fetch_tids.erase(p);
+  f->tid = 0;
+
+  int r = m->get_result();
+  if (r == -ENXIO) {
+    // it wasn't the primary after all; resend on the next tick
+    dout(10) << "handle_copy_fetch_reply " << *m << " misdirected" << dendl;
+    f->target = -1;
+    m->put();
+    return;
+  }
+  if (r == 0) {
+    try {
+      bufferlist::iterator bp = m->get_data().begin();
+      uint64_t size;
+      utime_t mtime;
+      ::decode(size, bp);
+      ::decode(mtime, bp);
+      ::decode(f->attrs, bp);
+      if (size > g_conf->osd_copy_from_max_bytes) {
+	// only the first chunk was read; let the client copy it
+	f->attrs.clear();
+	r = -EOPNOTSUPP;
+      } else {
+	bp.copy(size, f->data);
+      }
+    }
+    catch (buffer::error& e) {
+      r = -EIO;
+    }
+  }
+  dout(10) << "handle_copy_fetch_reply " << f->reqid << " " << f->src << " = " << r
+	   << ", " << f->data.length() << " bytes, " << f->attrs.size() << " xattrs" << dendl;
+
+  f->result = r;
+  f->done = true;
+  f->stamp = ceph_clock_now(g_ceph_context);
+  if (f->op) {
+    list<Message*> ls;
+    ls.push_back(f->op);
+    f->op = NULL;
+    take_waiters(ls);
+  }
+  m->put();
+}
+
+/*
+ * From tick(): resend fetches whose source moved, and give up on those
+ * that have been around too long.  Caller holds map_lock.
+ */
+void OSD::check_copy_fetches()
+{
+  Mutex::Locker l(copy_fetch_lock);
+  utime_t cutoff = ceph_clock_now(g_ceph_context);
+  cutoff -= g_conf->osd_copy_from_timeout;
+
+  map<osd_reqid_t, CopyFetch*>::iterator p = copy_fetches.begin();
+  while (p != copy_fetches.end()) {
+    CopyFetch *f = p->second;
+    if (f->stamp < cutoff && f->op) {
+      // send the op back through do_op to fail, so that the ops behind
+      // it on the target object are woken
+      dout(10) << "check_copy_fetches " << f->reqid << " " << f->src << " timed out" << dendl;
+      if (f->tid)
+	copy_fetch_tids.erase(f->tid);
+      f->tid = 0;
+      f->result = -ETIMEDOUT;
+      f->done = true;
+      f->stamp = ceph_clock_now(g_ceph_context);
+      list<Message*> ls;
+      ls.push_back(f->op);
+      f->op = NULL;
+      take_waiters(ls);
+      ++p;
+      continue;
+    }
+    if (f->stamp < cutoff) {
+      dout(10) << "check_copy_fetches " << f->reqid << " " << f->src << " was never taken" << dendl;
+      if (f->tid)
+	copy_fetch_tids.erase(f->tid);
+      delete f;
+      copy_fetches.erase(p++);
+      continue;
+    }
+    if (!f->done) {
+      pg_t raw;
+      int target = get_copy_fetch_target(f, &raw);
+      if (target != f->target || target < 0) {
+	int r = send_copy_fetch(f);
+	if (r < 0) {
+	  f->result = r;
+	  f->done = true;
+	  if (f->op) {
+	    list<Message*> ls;
+	    ls.push_back(f->op);
+	    f->op = NULL;
+	    take_waiters(ls);
+	  }
+	}
+      }
+    }
+    ++p;
+  }
+}
+
+
 void OSD::handle_op(MOSDOp *op)
 {
   // require same or newer map
@@ -4886,6 +5281,31 @@ void OSD::handle_op(MOSDOp *op)
     err = 0;
   }
 
+  // copy-from also reads the source's pool
+  for (vector<OSDOp>::iterator p = op->ops.begin(); err == 0 && p != op->ops.end(); ++p) {
+    if (p->op.op != CEPH_OSD_OP_COPY_FROM)
+      continue;
+    object_locator_t src_oloc;
+    try {
+      bufferlist::iterator bp = p->data.begin();
+      ::decode(src_oloc, bp);
+    }
+    catch (buffer::error& e) {
+      err = -EINVAL;
+      break;
+    }
+    const pg_pool_t *spool = osdmap->get_pg_pool(src_oloc.get_pool());
+    if (!spool) {
+      err = -ENOENT;
+      break;
+    }
+    string sname = osdmap->get_pool_name(src_oloc.get_pool());
+    if (!(caps.get_pool_cap(sname, spool->get_auid()) & OSD_POOL_CAP_R)) {
+      dout(10) << "no READ permission to copy from pool " << sname << dendl;
+      err = -EPERM;
+    }
+  }
+
   if (err < 0) {
     reply_op_error(op, err);
     pg->unlock();
@@ -5091,12 +5511,37 @@ void OSD::handle_sub_op_reply(MOSDSubOpReply *op)
 void OSD::enqueue_op(PG *pg, Message *op)
 {
   dout(15) << *pg << " enqueue_op " << op << " " << *op << dendl;
-  // add to pg's op_queue
+  OpShard *shard = get_op_shard(pg);
+
+  // add to pg's op_queue before the pg goes on the shard's queue, so
+  // a worker never finds the pg without an op
+  shard->wq.lock();
   pg->op_queue.push_back(op);
-  pending_ops++;
-  logger->set(l_osd_opq, pending_ops);
-  
-  op_wq.queue(pg);
+  shard->wq.unlock();
+
+  logger->set(l_osd_opq, pending_ops.inc());
+  shard->wq.queue(pg);
+}
+
+bool OSD::OpWQ::_enqueue(PG *pg)
+{
+  pg->get();
+  pgs.push_back(make_pair(pg, ceph_clock_now(g_ceph_context)));
+  logger->set(l_osd_opq_depth, pgs.size());
+  return true;
+}
+
+PG *OSD::OpWQ::_dequeue()
+{
+  if (pgs.empty())
+    return NULL;
+  PG *pg = pgs.front().first;
+  utime_t wait = ceph_clock_now(g_ceph_context) - pgs.front().second;
+  pgs.pop_front();
+  logger->set(l_osd_opq_depth, pgs.size());
+  logger->inc(l_osd_opq_ops);
+  logger->finc(l_osd_opq_wait, (double)wait);
+  return pg;
 }
 
 /*
@@ -5106,26 +5551,34 @@ void OSD::dequeue_op(PG *pg)
 {
   Message *op = 0;
 
-  osd_lock.Lock();
-  {
-    // lock pg and get pending op
-    pg->lock();
+  // lock pg and get pending op
+  pg->lock();
 
-    assert(!pg->op_queue.empty());
-    op = pg->op_queue.front();
-    pg->op_queue.pop_front();
+  OpShard *shard = get_op_shard(pg);
+  shard->wq.lock();
+  assert(!pg->op_queue.empty());
+  op = pg->op_queue.front();
+  pg->op_queue.pop_front();
+  shard->wq.unlock();
     
-    dout(10) << "dequeue_op " << *op << " pg " << *pg
-	     << ", " << (pending_ops-1) << " more pending"
-	     << dendl;
+  dout(10) << "dequeue_op " << *op << " pg " << *pg
+	   << ", " << (pending_ops.read()-1) << " more pending"
+	   << dendl;
 
-    // share map?
-    //  do this preemptively while we hold osd_lock and pg->lock
-    //  to avoid lock ordering issues later.
-    for (unsigned i=1; i<pg->acting.size(); i++) 
-      _share_map_outgoing( osdmap->get_cluster_inst(pg->acting[i]) );
+  // share map?
+  //  map_lock keeps osdmap still while we look at it; the peer epochs
+  //  have their own lock.  like the rest of the pg code, take it
+  //  under pg->lock.  share_map_epoch stands in for the osd state and
+  //  superblock, which are osd_lock's: it is only set once the map is
+  //  committed, and cleared while we boot or stop.
+  epoch_t share_epoch = share_map_epoch.read();
+  if (share_epoch) {
+    map_lock.get_read();
+    if (osdmap->get_epoch() == share_epoch)
+      for (unsigned i=1; i<pg->acting.size(); i++)
+	_share_map_outgoing( osdmap->get_cluster_inst(pg->acting[i]) );
+    map_lock.put_read();
   }
-  osd_lock.Unlock();
 
   // do it
   if (op->get_type() == CEPH_MSG_OSD_OP)
@@ -5145,44 +5598,57 @@ void OSD::dequeue_op(PG *pg)
   //scrub_wq.queue(pg);
 
   // finish
-  osd_lock.Lock();
-  {
-    dout(10) << "dequeue_op " << op << " finish" << dendl;
-    assert(pending_ops > 0);
-    
-    if (pending_ops > g_conf->osd_max_opq) 
-      op_queue_cond.Signal();
-    
-    pending_ops--;
-    logger->set(l_osd_opq, pending_ops);
-    if (pending_ops == 0 && waiting_for_no_ops)
-      no_pending_ops.Signal();
-  }
-  osd_lock.Unlock();
+  dout(10) << "dequeue_op " << op << " finish" << dendl;
+  put_pending_op();
 }
 
+/*
+ * An op left the queue for good.  Only take op_queue_lock if this
+ * might be what throttle_op_queue() or wait_for_no_ops() are waiting
+ * for.  Both wait on op_queue_cond, so wake everyone and let them
+ * recheck.
+ */
+void OSD::put_pending_op()
+{
+  int left = pending_ops.dec();
+  assert(left >= 0);
+  logger->set(l_osd_opq, left);
+  if (left == g_conf->osd_max_opq || left == 0) {
+    op_queue_lock.Lock();
+    op_queue_cond.SignalAll();
+    op_queue_lock.Unlock();
+  }
+}
 
-
-
+/*
+ * Called with osd_lock held, which we drop while we wait.
+ */
 void OSD::throttle_op_queue()
 {
   // throttle?  FIXME PROBABLY!
-  while (pending_ops > g_conf->osd_max_opq) {
-    dout(10) << "enqueue_op waiting for pending_ops " << pending_ops 
-	     << " to drop to " << g_conf->osd_max_opq << dendl;
-    op_queue_cond.Wait(osd_lock);
-  }
+  if ((int)pending_ops.read() <= g_conf->osd_max_opq)
+    return;
+
+  dout(10) << "enqueue_op waiting for pending_ops " << pending_ops.read()
+	   << " to drop to " << g_conf->osd_max_opq << dendl;
+  osd_lock.Unlock();
+  op_queue_lock.Lock();
+  while ((int)pending_ops.read() > g_conf->osd_max_opq)
+    op_queue_cond.Wait(op_queue_lock);
+  op_queue_lock.Unlock();
+  osd_lock.Lock();
 }
 
 void OSD::wait_for_no_ops()
 {
-  if (pending_ops > 0) {
-    dout(7) << "wait_for_no_ops - waiting for " << pending_ops << dendl;
-    waiting_for_no_ops = true;
-    while (pending_ops > 0)
-      no_pending_ops.Wait(osd_lock);
-    waiting_for_no_ops = false;
-    assert(pending_ops == 0);
+  if (pending_ops.read() > 0) {
+    dout(7) << "wait_for_no_ops - waiting for " << pending_ops.read() << dendl;
+    osd_lock.Unlock();
+    op_queue_lock.Lock();
+    while (pending_ops.read() > 0)
+      op_queue_cond.Wait(op_queue_lock);
+    op_queue_lock.Unlock();
+    osd_lock.Lock();
   } 
   dout(7) << "wait_for_no_ops - none" << dendl;
 }
@@ -81,8 +81,10 @@ enum {
   l_osd_pull,
   l_osd_push,
   l_osd_push_outb,
+  l_osd_pull_inb,
 
   l_osd_rop,
+  l_osd_rop_inflightb,
 
   l_osd_loadavg,
   l_osd_buf,
@@ -97,9 +99,23 @@ enum {
   l_osd_mape,
   l_osd_mape_dup,
 
+  l_osd_obc_hit,
+  l_osd_obc_miss,
+  l_osd_ssc_hit,
+  l_osd_ssc_miss,
+
   l_osd_last,
 };
 
+// per op queue shard
+enum {
+  l_osd_opq_first = 11000,
+  l_osd_opq_depth,
+  l_osd_opq_ops,
+  l_osd_opq_wait,
+  l_osd_opq_last,
+};
+
 class Messenger;
 class Message;
 class MonClient;
@@ -214,9 +230,10 @@ public:
 
 private:
 
-  ThreadPool op_tp;
+  ThreadPool op_tp;      // scrub finalize only; ops go to op_shards
   ThreadPool recovery_tp;
   ThreadPool disk_tp;
+  ThreadPool scrub_tp;   // scrub scans, kept apart from the other disk work
 
   // -- sessions --
 public:
@@ -313,46 +330,63 @@ private:
   void do_waiters();
   
   // -- op queue --
-  deque<PG*> op_queue;
-  
+  /*
+   * Client ops and sub-ops wait in one of osd_op_shards shards, picked
+   * by hashing the pgid.  A PG always maps to the same shard, so its
+   * ops keep their order, and each shard has its own lock, queue and
+   * osd_op_threads worker threads.  dequeue_op() does not take
+   * osd_lock (map sharing needs map_lock for read, and share_map_epoch
+   * instead of the osd state), and the only thing the shards share is
+   * the pending_ops count.
+   *
+   * A shard queues the PG once per op in pg->op_queue; pg->op_queue is
+   * protected by the shard lock and the ops are popped in order under
+   * pg->lock.
+   */
   struct OpWQ : public ThreadPool::WorkQueue<PG> {
     OSD *osd;
+    deque<pair<PG*, utime_t> > pgs;  // and when they were queued
+    PerfCounters *logger;
+
     OpWQ(OSD *o, time_t ti, ThreadPool *tp)
-      : ThreadPool::WorkQueue<PG>("OSD::OpWQ", ti, tp), osd(o) {}
+      : ThreadPool::WorkQueue<PG>("OSD::OpWQ", ti, tp), osd(o), logger(NULL) {}
 
-    bool _enqueue(PG *pg) {
-      pg->get();
-      osd->op_queue.push_back(pg);
-      return true;
-    }
+    bool _enqueue(PG *pg);
     void _dequeue(PG *pg) {
       assert(0);
     }
     bool _empty() {
-      return osd->op_queue.empty();
-    }
-    PG *_dequeue() {
-      if (osd->op_queue.empty())
-	return NULL;
-      PG *pg = osd->op_queue.front();
-      osd->op_queue.pop_front();
-      return pg;
+      return pgs.empty();
     }
+    PG *_dequeue();
     void _process(PG *pg) {
       osd->dequeue_op(pg);
     }
     void _clear() {
-      assert(osd->op_queue.empty());
+      assert(pgs.empty());
     }
-  } op_wq;
+  };
+
+  struct OpShard {
+    ThreadPool tp;
+    OpWQ wq;
+    OpShard(OSD *o, string name)
+      : tp(g_ceph_context, name, g_conf->osd_op_threads),
+	wq(o, g_conf->osd_op_thread_timeout, &tp) {}
+  };
+  vector<OpShard*> op_shards;
+
+  OpShard *get_op_shard(PG *pg) {
+    return op_shards[__gnu_cxx::hash<pg_t>()(pg->info.pgid) % op_shards.size()];
+  }
 
-  int   pending_ops;
-  bool  waiting_for_no_ops;
-  Cond  no_pending_ops;
+  atomic_t pending_ops;      // queued in any shard, or being processed
+  Mutex op_queue_lock;       // for waiting on pending_ops
   Cond  op_queue_cond;
   
   void wait_for_no_ops();
   void throttle_op_queue();
+  void put_pending_op();
   void enqueue_op(PG *pg, Message *op);
   void dequeue_op(PG *pg);
   static void static_dequeueop(OSD *o, PG *pg) {
@@ -374,6 +408,10 @@ private:
 
   Mutex peer_map_epoch_lock;
   map<int, epoch_t> peer_map_epoch;
+
+  /// epoch of the committed osdmap that op workers may send to peers,
+  /// or 0 while we are booting or stopping; set under osd_lock
+  atomic_t share_map_epoch;
   
   epoch_t get_peer_epoch(int p);
   epoch_t note_peer_epoch(int p, epoch_t e);
@@ -399,6 +437,7 @@ private:
   epoch_t map_cache_keep_from;
 
   OSDMap* get_map(epoch_t e);
+  void maybe_update_mapping(OSDMap *o);
   void add_map(OSDMap *o);
   void add_map_bl(epoch_t e, bufferlist& bl);
   void add_map_inc_bl(epoch_t e, bufferlist& bl);
@@ -564,6 +603,40 @@ protected:
     return t;
   }
 
+  // -- copy-from --
+  /*
+   * A COPY_FROM whose source object lives in another pg is parked here
+   * while we read the source (data and user xattrs) from that pg's
+   * primary, keyed by the client's reqid.  When the reply comes back the
+   * op is requeued, and the second pass through do_op picks the data up.
+   */
+  struct CopyFetch {
+    osd_reqid_t reqid;
+    MOSDOp *op;               // parked op; NULL once requeued
+    sobject_t src;
+    object_locator_t src_oloc;
+    tid_t tid;
+    int target;               // osd the read went to, or -1
+    utime_t stamp;
+    bool done;
+    int result;
+    bufferlist data;
+    map<string,bufferlist> attrs;
+    CopyFetch() : op(NULL), tid(0), target(-1), done(false), result(0) {}
+  };
+  Mutex copy_fetch_lock;
+  map<osd_reqid_t, CopyFetch*> copy_fetches;
+  map<tid_t, CopyFetch*> copy_fetch_tids;
+
+  int get_copy_fetch_target(CopyFetch *f, pg_t *raw);
+  int send_copy_fetch(CopyFetch *f);
+  void handle_copy_fetch_reply(class MOSDOpReply *m);
+  void check_copy_fetches();
+
+  bool fetch_copy_source(MOSDOp *op, const sobject_t& src, const object_locator_t& src_oloc);
+  CopyFetch *take_copy_source(const osd_reqid_t& reqid, const sobject_t& src);
+  bool copy_fetch_pending(const osd_reqid_t& reqid);
+
 
 
   // -- generic pg peering --
@@ -640,6 +713,7 @@ protected:
   xlist<PG*> recovery_queue;
   utime_t defer_recovery_until;
   int recovery_ops_active;
+  int64_t recovery_bytes_inflight;   // push/pull chunks sent but not yet acked
 #ifdef DEBUG_RECOVERY_OIDS
   map<pg_t, set<sobject_t> > recovery_oids;
 #endif
@@ -695,6 +769,7 @@ protected:
   bool queue_for_recovery(PG *pg);
   void start_recovery_op(PG *pg, const sobject_t& soid);
   void finish_recovery_op(PG *pg, const sobject_t& soid, bool dequeue);
+  void note_recovery_inflight(int64_t bytes);
   void defer_recovery(PG *pg);
   void do_recovery(PG *pg);
   bool _recover_now();
@@ -912,6 +987,10 @@ protected:
     }
   } rep_scrub_wq;
 
+  // delays the next chunk of a throttled scrub
+  Mutex scrub_sleep_lock;
+  SafeTimer scrub_sleep_timer;
+
   // -- removing --
   xlist<PG*> remove_queue;
 
@@ -24,6 +24,7 @@
 #include "common/config.h"
 #include "include/types.h"
 #include "osd_types.h"
+#include "OSDMapMapping.h"
 #include "msg/Message.h"
 #include "common/Mutex.h"
 #include "common/Clock.h"
@@ -285,12 +286,15 @@ private:
   epoch_t cluster_snapshot_epoch;
   string cluster_snapshot;
 
+  OSDMapMapping mapping;  // optional precomputed pg mappings; not saved
+
  public:
   CrushWrapper     crush;       // hierarchical map
 
   friend class OSDMonitor;
   friend class PGMonitor;
   friend class MDS;
+  friend class OSDMapMapping;
 
  public:
   OSDMap() : epoch(0), 
@@ -305,10 +309,14 @@ private:
   void set_fsid(ceph_fsid_t& f) { fsid = f; }
 
   epoch_t get_epoch() const { return epoch; }
-  void inc_epoch() { epoch++; }
+  void inc_epoch() {
+    epoch++;
+    mapping.clear();
+  }
 
   void set_epoch(epoch_t e) {
     epoch = e;
+    mapping.clear();
     for (map<int,pg_pool_t>::iterator p = pools.begin();
 	 p != pools.end();
 	 p++)
@@ -358,6 +366,7 @@ private:
     osd_hb_addr.resize(m);
 
     calc_num_osds();
+    mapping.clear();
   }
 
   int get_num_osds() const {
@@ -403,6 +412,7 @@ private:
   void set_state(int o, unsigned s) {
     assert(o < max_osd);
     osd_state[o] = s;
+    mapping.clear();
   }
   void set_weightf(int o, float w) {
     set_weight(o, (int)((float)CEPH_OSD_IN * w));
@@ -412,6 +422,7 @@ private:
     osd_weight[o] = w;
     if (w)
       osd_state[o] |= CEPH_OSD_EXISTS;
+    mapping.clear();
   }
   unsigned get_weight(int o) const {
     assert(o < max_osd);
@@ -542,6 +553,7 @@ private:
     assert(inc.epoch == epoch+1);
     epoch++;
     modified = inc.modified;
+    mapping.clear();
 
     // full map?
     if (inc.fullmap.length()) {
@@ -702,6 +714,7 @@ private:
   }
   
   void decode(bufferlist& bl) {
+    mapping.clear();
     bufferlist::iterator p = bl.begin();
     __u16 v;
     ::decode(v, p);
@@ -795,7 +808,7 @@ private:
     return pg;
   }
 
-  object_locator_t file_to_object_locator(const ceph_file_layout& layout) {
+  static object_locator_t file_to_object_locator(const ceph_file_layout& layout) {
     return object_locator_t(layout.fl_pg_pool, layout.fl_pg_preferred);
   }
 
@@ -824,23 +837,26 @@ private:
 
   // pg -> (osd list)
 private:
-  int _pg_to_osds(const pg_pool_t& pool, pg_t pg, vector<int>& osds) {
+  int _pg_to_osds(CrushWrapper& c, const pg_pool_t& pool, pg_t pg, vector<int>& osds) {
     // map to osds[]
     ps_t pps = pool.raw_pg_to_pps(pg);  // placement ps
     unsigned size = pool.get_size();
     {
       int preferred = pg.preferred();
-      if (preferred >= max_osd || preferred >= crush.get_max_devices())
+      if (preferred >= max_osd || preferred >= c.get_max_devices())
 	preferred = -1;
 
       // what crush rule?
-      int ruleno = crush.find_rule(pool.get_crush_ruleset(), pool.get_type(), size);
+      int ruleno = c.find_rule(pool.get_crush_ruleset(), pool.get_type(), size);
       if (ruleno >= 0)
-	crush.do_rule(ruleno, pps, osds, size, preferred, osd_weight);
+	c.do_rule(ruleno, pps, osds, size, preferred, osd_weight);
     }
   
     return osds.size();
   }
+  int _pg_to_osds(const pg_pool_t& pool, pg_t pg, vector<int>& osds) {
+    return _pg_to_osds(crush, pool, pg, osds);
+  }
 
   // pg -> (up osd list)
   void _raw_to_up_osds(pg_t pg, vector<int>& raw, vector<int>& up) {
@@ -867,11 +883,49 @@ private:
     return false;
   }
 
+  // full computation, with the given crush map (see OSDMapMapping)
+  void _pg_to_raw_up_acting_osds(CrushWrapper& c, const pg_pool_t& pool, pg_t pg,
+				 vector<int>& raw, vector<int>& up, vector<int>& acting) {
+    _pg_to_osds(c, pool, pg, raw);
+    _raw_to_up_osds(pg, raw, up);
+    if (!_raw_to_temp_osds(pool, pg, raw, acting))
+      acting = up;
+  }
+
+  bool _get_mapping(const pg_pool_t& pool, pg_t pg,
+		    vector<int> *raw, vector<int> *up, vector<int> *acting) const {
+    return mapping.is_current(epoch, crush.get_generation()) &&
+      mapping.get(pool, pg, raw, up, acting);
+  }
+
 public:
+  /*
+   * Precompute every pg's mapping for this epoch so that the pg_to_*
+   * lookups below don't have to run crush.  The table is dropped by
+   * any change to the map, and ignored once crush has been modified
+   * (see CrushWrapper::get_generation()); lookups then go back to
+   * computing the mapping directly until the next update_mapping().
+   */
+  void update_mapping(int threads) {
+    mapping.update(*this, threads);
+  }
+  const OSDMapMapping& get_mapping() const { return mapping; }
+  bool have_mapping() const {
+    return mapping.is_current(epoch, crush.get_generation());
+  }
+  unsigned get_num_pgs() const {
+    unsigned n = 0;
+    for (map<int,pg_pool_t>::const_iterator p = pools.begin(); p != pools.end(); ++p)
+      n += p->second.get_pg_num();
+    return n;
+  }
+
   int pg_to_osds(pg_t pg, vector<int>& raw) {
     const pg_pool_t *pool = get_pg_pool(pg.pool());
     if (!pool)
       return 0;
+    if (_get_mapping(*pool, pg, &raw, NULL, NULL))
+      return raw.size();
     return _pg_to_osds(*pool, pg, raw);
   }
 
@@ -879,6 +933,8 @@ public:
     const pg_pool_t *pool = get_pg_pool(pg.pool());
     if (!pool)
       return 0;
+    if (_get_mapping(*pool, pg, NULL, NULL, &acting))
+      return acting.size();
     vector<int> raw;
     _pg_to_osds(*pool, pg, raw);
     if (!_raw_to_temp_osds(*pool, pg, raw, acting))
@@ -890,6 +946,8 @@ public:
     const pg_pool_t *pool = get_pg_pool(pg.pool());
     if (!pool)
       return;
+    if (_get_mapping(*pool, pg, NULL, &up, NULL))
+      return;
     vector<int> raw;
     _pg_to_osds(*pool, pg, raw);
     _raw_to_up_osds(pg, raw, up);
@@ -899,6 +957,8 @@ public:
     const pg_pool_t *pool = get_pg_pool(pg.pool());
     if (!pool)
       return;
+    if (_get_mapping(*pool, pg, NULL, &up, &acting))
+      return;
     vector<int> raw;
     _pg_to_osds(*pool, pg, raw);
     _raw_to_up_osds(pg, raw, up);
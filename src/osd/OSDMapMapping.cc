@@ -0,0 +1,233 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2011 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "OSDMapMapping.h"
+#include "OSDMap.h"
+
+#include "common/Thread.h"
+
+
+// -- PoolMapping --
+
+void OSDMapMapping::PoolMapping::set(unsigned ps, const vector<int>& raw,
+				     const vector<int>& up,
+				     const vector<int>& acting)
+{
+  assert(raw.size() <= width && up.size() <= width && acting.size() <= width);
+  int32_t *r = row(ps);
+  r[0] = raw.size();
+  r[1] = up.size();
+  r[2] = acting.size();
+  int32_t *p = r + 3;
+  for (unsigned i = 0; i < raw.size(); i++)
+    p[i] = raw[i];
+  p += width;
+  for (unsigned i = 0; i < up.size(); i++)
+    p[i] = up[i];
+  p += width;
+  for (unsigned i = 0; i < acting.size(); i++)
+    p[i] = acting[i];
+}
+
+void OSDMapMapping::PoolMapping::get(unsigned ps, vector<int> *raw,
+				     vector<int> *up,
+				     vector<int> *acting) const
+{
+  const int32_t *r = row(ps);
+  const int32_t *p = r + 3;
+  if (raw)
+    raw->assign(p, p + r[0]);
+  p += width;
+  if (up)
+    up->assign(p, p + r[1]);
+  p += width;
+  if (acting)
+    acting->assign(p, p + r[2]);
+}
+
+bool OSDMapMapping::PoolMapping::same(unsigned ps, const PoolMapping& o) const
+{
+  const int32_t *a = row(ps);
+  const int32_t *b = o.row(ps);
+  if (a[1] != b[1] || a[2] != b[2])
+    return false;
+  for (int i = 0; i < a[1]; i++)
+    if (a[3 + width + i] != b[3 + o.width + i])
+      return false;
+  for (int i = 0; i < a[2]; i++)
+    if (a[3 + 2*width + i] != b[3 + 2*o.width + i])
+      return false;
+  return true;
+}
+
+
+// -- OSDMapMapping --
+
+struct OSDMapMapping::Worker : public Thread {
+  OSDMap *osdmap;
+  CrushWrapper crush;   // crush_do_rule isn't reentrant; each worker gets its own
+  vector<Range> ranges;
+
+  Worker(OSDMap *o, bufferlist& crushbl) : osdmap(o) {
+    bufferlist::iterator p = crushbl.begin();
+    crush.decode(p);
+  }
+  void *entry() {
+    for (vector<Range>::iterator p = ranges.begin(); p != ranges.end(); ++p)
+      OSDMapMapping::_update_range(*osdmap, crush, *p);
+    return 0;
+  }
+};
+
+void OSDMapMapping::_update_range(OSDMap& osdmap, CrushWrapper& crush,
+				  const Range& r)
+{
+  vector<int> raw, up, acting;
+  for (unsigned ps = r.begin; ps < r.end; ps++) {
+    pg_t pg(ps, r.pool, -1);
+    osdmap._pg_to_raw_up_acting_osds(crush, *r.pi, pg, raw, up, acting);
+    r.pm->set(ps, raw, up, acting);
+  }
+}
+
+void OSDMapMapping::update(OSDMap& osdmap, int threads)
+{
+  clear();
+  epoch = osdmap.get_epoch();
+
+  // size the tables; a pg_temp entry may be longer than the pool size
+  map<int,unsigned> temp_width;
+  for (map<pg_t,vector<int> >::iterator p = osdmap.pg_temp.begin();
+       p != osdmap.pg_temp.end();
+       ++p)
+    if (p->second.size() > temp_width[p->first.pool()])
+      temp_width[p->first.pool()] = p->second.size();
+
+  vector<Range> work;
+  unsigned total = 0;
+  for (map<int,pg_pool_t>::iterator p = osdmap.pools.begin();
+       p != osdmap.pools.end();
+       ++p) {
+    PoolMapping& pm = pools[p->first];
+    pm.pg_num = p->second.get_pg_num();
+    pm.raw_ok = p->second.get_pgp_num() <= p->second.get_pg_num();
+    pm.width = MAX(p->second.get_size(), temp_width[p->first]);
+    pm.table.resize(pm.pg_num * pm.row_size());
+    work.push_back(Range(p->first, &p->second, &pm, 0, pm.pg_num));
+    total += pm.pg_num;
+  }
+
+  unsigned nthreads = total / MIN_PGS_PER_THREAD;
+  if (threads > 0 && nthreads > (unsigned)threads)
+    nthreads = threads;
+  if (threads <= 1 || nthreads <= 1) {
+    for (vector<Range>::iterator p = work.begin(); p != work.end(); ++p)
+      _update_range(osdmap, osdmap.crush, *p);
+    crush_generation = osdmap.crush.get_generation();
+    built = true;
+    return;
+  }
+
+  // hand each worker an equal share of pgs, splitting pools as needed
+  bufferlist crushbl;
+  osdmap.crush.encode(crushbl);
+  vector<Worker*> workers;
+  unsigned per = (total + nthreads - 1) / nthreads;
+  vector<Range>::iterator p = work.begin();
+  unsigned pos = 0;
+  while (p != work.end()) {
+    Worker *w = new Worker(&osdmap, crushbl);
+    unsigned left = per;
+    while (left && p != work.end()) {
+      unsigned n = MIN(left, p->end - pos);
+      if (n)
+	w->ranges.push_back(Range(p->pool, p->pi, p->pm, pos, pos + n));
+      left -= n;
+      pos += n;
+      if (pos == p->end) {
+	++p;
+	pos = 0;
+      }
+    }
+    workers.push_back(w);
+    w->create();
+  }
+  for (vector<Worker*>::iterator w = workers.begin(); w != workers.end(); ++w) {
+    (*w)->join();
+    delete *w;
+  }
+  crush_generation = osdmap.crush.get_generation();
+  built = true;
+}
+
+unsigned OSDMapMapping::get_num_pgs() const
+{
+  unsigned n = 0;
+  for (map<int,PoolMapping>::const_iterator p = pools.begin(); p != pools.end(); ++p)
+    n += p->second.pg_num;
+  return n;
+}
+
+bool OSDMapMapping::get(const pg_pool_t& pool, pg_t pg,
+			vector<int> *raw, vector<int> *up,
+			vector<int> *acting) const
+{
+  if (pg.preferred() >= 0)
+    return false;
+  map<int,PoolMapping>::const_iterator p = pools.find(pg.pool());
+  if (p == pools.end())
+    return false;
+  const PoolMapping& pm = p->second;
+  unsigned ps = pg.ps();
+  if (ps >= pm.pg_num) {
+    if (!pm.raw_ok)
+      return false;
+    ps = pool.raw_pg_to_pg(pg).ps();
+    if (ps >= pm.pg_num)
+      return false;
+  }
+  pm.get(ps, raw, up, acting);
+  return true;
+}
+
+void OSDMapMapping::diff(const OSDMapMapping& a, const OSDMapMapping& b,
+			 set<pg_t> *changed)
+{
+  map<int,PoolMapping>::const_iterator pa = a.pools.begin();
+  map<int,PoolMapping>::const_iterator pb = b.pools.begin();
+  while (pa != a.pools.end() || pb != b.pools.end()) {
+    if (pb == b.pools.end() ||
+	(pa != a.pools.end() && pa->first < pb->first)) {
+      // pool removed
+      for (unsigned ps = 0; ps < pa->second.pg_num; ps++)
+	changed->insert(pg_t(ps, pa->first, -1));
+      ++pa;
+    } else if (pa == a.pools.end() || pb->first < pa->first) {
+      // pool created
+      for (unsigned ps = 0; ps < pb->second.pg_num; ps++)
+	changed->insert(pg_t(ps, pb->first, -1));
+      ++pb;
+    } else {
+      unsigned common = MIN(pa->second.pg_num, pb->second.pg_num);
+      unsigned most = MAX(pa->second.pg_num, pb->second.pg_num);
+      for (unsigned ps = 0; ps < common; ps++)
+	if (!pa->second.same(ps, pb->second))
+	  changed->insert(pg_t(ps, pa->first, -1));
+      for (unsigned ps = common; ps < most; ps++)
+	changed->insert(pg_t(ps, pa->first, -1));
+      ++pa;
+      ++pb;
+    }
+  }
+}
@@ -0,0 +1,121 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2011 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OSDMAPMAPPING_H
+#define CEPH_OSDMAPMAPPING_H
+
+#include "include/types.h"
+#include "osd_types.h"
+
+#include <vector>
+#include <map>
+#include <set>
+using namespace std;
+
+class OSDMap;
+class CrushWrapper;
+
+/*
+ * OSDMapMapping - the raw, up and acting set of every pg in one OSDMap
+ * epoch, computed up front.
+ *
+ * Running CRUSH dominates the cost of a pg lookup.  Anyone who looks up
+ * a large share of the cluster's pgs against each new map (the monitor,
+ * an osd holding many pgs, a client with many ops in flight) can build
+ * this table once per epoch instead and have every lookup be a couple of
+ * array reads.  Big pools are split across worker threads.
+ *
+ * Localized pgs (preferred >= 0) are not covered; get() returns false for
+ * them and the caller computes the mapping directly.
+ */
+class OSDMapMapping {
+  struct PoolMapping {
+    unsigned pg_num;
+    bool raw_ok;         // raw pgs (ps >= pg_num) fold onto the same placement
+    unsigned width;      // max osds in any one raw/up/acting set
+    vector<int32_t> table;  // per pg: nraw nup nacting raw[width] up[width] acting[width]
+
+    PoolMapping() : pg_num(0), raw_ok(false), width(0) {}
+
+    unsigned row_size() const {
+      return 3 + 3 * width;
+    }
+    const int32_t *row(unsigned ps) const {
+      return &table[ps * row_size()];
+    }
+    int32_t *row(unsigned ps) {
+      return &table[ps * row_size()];
+    }
+
+    void set(unsigned ps, const vector<int>& raw, const vector<int>& up,
+	     const vector<int>& acting);
+    void get(unsigned ps, vector<int> *raw, vector<int> *up,
+	     vector<int> *acting) const;
+    bool same(unsigned ps, const PoolMapping& o) const;
+  };
+
+  struct Range {
+    int pool;
+    const pg_pool_t *pi;
+    PoolMapping *pm;
+    unsigned begin, end;
+    Range(int p, const pg_pool_t *i, PoolMapping *m, unsigned b, unsigned e)
+      : pool(p), pi(i), pm(m), begin(b), end(e) {}
+  };
+  struct Worker;
+
+  bool built;
+  epoch_t epoch;
+  unsigned crush_generation;  // CrushWrapper::get_generation() we were built from
+  map<int,PoolMapping> pools;
+
+  static void _update_range(OSDMap& osdmap, CrushWrapper& crush,
+			    const Range& r);
+
+public:
+  // don't bother with threads for less than this many pgs per thread
+  static const unsigned MIN_PGS_PER_THREAD = 1024;
+
+  OSDMapMapping() : built(false), epoch(0), crush_generation(0) {}
+
+  epoch_t get_epoch() const { return epoch; }
+  bool is_current(epoch_t e, unsigned crush_gen) const {
+    return built && epoch == e && crush_generation == crush_gen;
+  }
+  unsigned get_num_pgs() const;
+
+  void clear() {
+    built = false;
+    epoch = 0;
+    crush_generation = 0;
+    pools.clear();
+  }
+
+  /// recompute everything for @osdmap, using up to @threads threads
+  void update(OSDMap& osdmap, int threads);
+
+  /**
+   * look up a (possibly raw) pg
+   *
+   * @return false if the pg isn't covered by the table
+   */
+  bool get(const pg_pool_t& pool, pg_t pg,
+	   vector<int> *raw, vector<int> *up, vector<int> *acting) const;
+
+  /// pgs whose up or acting set differs between @a and @b (incl. new/removed pgs)
+  static void diff(const OSDMapMapping& a, const OSDMapMapping& b,
+		   set<pg_t> *changed);
+};
+
+#endif
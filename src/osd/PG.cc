@@ -1777,6 +1777,11 @@ bool PG::queue_scrub()
   return true;
 }
 
+void PG::requeue_scrub()
+{
+  osd->scrub_wq.queue(this);
+}
+
 struct C_PG_FinishRecovery : public Context {
   PG *pg;
   C_PG_FinishRecovery(PG *p) : pg(p) {
@@ -2014,44 +2019,91 @@ void PG::write_info(ObjectStore::Transaction& t)
   dirty_info = false;
 }
 
+sobject_t PG::log_segment_oid(uint64_t seg) const
+{
+  char s[30];
+  snprintf(s, sizeof(s), ".%llu", (unsigned long long)seg);
+  return sobject_t(object_t(log_oid.oid.name + s), 0);
+}
+
+static void encode_ondisk_log_entry(const PG::Log::Entry& e, bufferlist& bl)
+{
+  bufferlist ebl(sizeof(e)*2);
+  ::encode(e, ebl);
+  __u32 crc = ebl.crc32c(0);
+  ::encode(ebl, bl);
+  ::encode(crc, bl);
+}
+
 void PG::write_log(ObjectStore::Transaction& t)
 {
   dout(10) << "write_log" << dendl;
 
-  // assemble buffer
-  bufferlist bl;
+  if (!ondisklog.is_segmented()) {
+    // moving off the single log object.  keep it (empty), since
+    // removal and corrupt log handling expect it to be there.
+    ondisklog.segment_entries = MAX(1, g_conf->osd_pg_log_segment_entries);
+    ondisklog.segments.clear();
+    ondisklog.preserved.clear();
+    ondisklog.zero();
+    t.touch(coll_t::META_COLL, log_oid);
+    t.truncate(coll_t::META_COLL, log_oid, 0);
+    dout(10) << "write_log switching to segments of " << ondisklog.segment_entries
+	     << " entries" << dendl;
+  }
 
-  // build buffer
-  ondisklog.tail = 0;
-  ondisklog.block_map.clear();
+  // lay the log out in segments
+  map<uint64_t,bufferlist> bls;
+  map<uint64_t,OndiskLog::segment_t> segs;
   for (list<Log::Entry>::iterator p = log.log.begin();
        p != log.log.end();
        p++) {
-    uint64_t startoff = bl.length();
-
-    bufferlist ebl(sizeof(*p)*2);
-    ::encode(*p, ebl);
-    __u32 crc = ebl.crc32c(0);
-    ::encode(ebl, bl);
-    ::encode(crc, bl);
-    uint64_t endoff = ebl.length();
-    if (startoff / 4096 != endoff / 4096) {
-      // we reached a new block. *p was the last entry with bytes in previous block
-      ondisklog.block_map[startoff] = p->version;
-    }
-  }
-  ondisklog.head = bl.length();
-  ondisklog.has_checksums = true;
-
-  // write it
-  t.remove(coll_t::META_COLL, log_oid );
-  t.write(coll_t::META_COLL, log_oid , 0, bl.length(), bl);
+    uint64_t seg = ondisklog.segment_of(p->version);
+    encode_ondisk_log_entry(*p, bls[seg]);
+    segs[seg].last = p->version;
+  }
+
+  // rewrite only the segments that changed
+  unsigned rewrote = 0;
+  uint64_t bytes = 0;
+  for (map<uint64_t,bufferlist>::iterator p = bls.begin(); p != bls.end(); ++p) {
+    OndiskLog::segment_t& seg = segs[p->first];
+    seg.length = p->second.length();
+    seg.crc = p->second.crc32c(0);
+
+    map<uint64_t,OndiskLog::segment_t>::iterator o = ondisklog.segments.find(p->first);
+    if (o != ondisklog.segments.end() &&
+	o->second.length == seg.length &&
+	o->second.crc == seg.crc)
+      continue;
+    sobject_t oid = log_segment_oid(p->first);
+    t.remove(coll_t::META_COLL, oid);
+    t.write(coll_t::META_COLL, oid, 0, seg.length, p->second);
+    rewrote++;
+    bytes += seg.length;
+  }
+  for (map<uint64_t,OndiskLog::segment_t>::iterator o = ondisklog.segments.begin();
+       o != ondisklog.segments.end();
+       ++o)
+    if (!segs.count(o->first))
+      t.remove(coll_t::META_COLL, log_segment_oid(o->first));
+  ondisklog.segments.swap(segs);
+
+  // like the old single object log, a full write drops anything
+  // preserved from earlier trims.
+  for (set<uint64_t>::iterator o = ondisklog.preserved.begin();
+       o != ondisklog.preserved.end();
+       ++o)
+    if (!bls.count(*o))
+      t.remove(coll_t::META_COLL, log_segment_oid(*o));
+  ondisklog.preserved.clear();
 
   bufferlist blb(sizeof(ondisklog));
   ::encode(ondisklog, blb);
   t.collection_setattr(coll, "ondisklog", blb);
   
-  dout(10) << "write_log to " << ondisklog.tail << "~" << ondisklog.length() << dendl;
+  dout(10) << "write_log " << ondisklog.segments.size() << " segments, rewrote "
+	   << rewrote << " (" << bytes << " bytes)" << dendl;
   dirty_log = false;
 }
 
@@ -2074,6 +2126,29 @@ void PG::trim_ondisklog_to(ObjectStore::Transaction& t, eversion_t v)
 {
   dout(15) << "trim_ondisk_log_to v " << v << dendl;
 
+  if (ondisklog.is_segmented()) {
+    // drop whole segments, but never the one we are appending to
+    uint64_t head_seg = ondisklog.segment_of(info.last_update);
+    map<uint64_t,OndiskLog::segment_t>::iterator p = ondisklog.segments.begin();
+    if (p == ondisklog.segments.end() || p->first >= head_seg || p->second.last > v)
+      return;  // can't trim anything!
+    while (p != ondisklog.segments.end() &&
+	   p->first < head_seg &&
+	   p->second.last <= v) {
+      dout(10) << "  trimming segment " << p->first << " last " << p->second.last << dendl;
+      if (g_conf->osd_preserve_trimmed_log)
+	ondisklog.preserved.insert(p->first);
+      else
+	t.remove(coll_t::META_COLL, log_segment_oid(p->first));
+      ondisklog.segments.erase(p++);
+    }
+
+    bufferlist blb(sizeof(ondisklog));
+    ::encode(ondisklog, blb);
+    t.collection_setattr(coll, "ondisklog", blb);
+    return;
+  }
+
   map<uint64_t,eversion_t>::iterator p = ondisklog.block_map.begin();
   while (p != ondisklog.block_map.end()) {
     //dout(15) << "    " << p->first << " -> " << p->second << dendl;
@@ -2120,7 +2195,7 @@ void PG::trim_peers()
   }
 }
 
-void PG::add_log_entry(Log::Entry& e, bufferlist& log_bl)
+void PG::add_log_entry(Log::Entry& e)
 {
   // raise last_complete only if we were previously up to date
   if (info.last_complete == info.last_update)
@@ -2132,37 +2207,94 @@ void PG::add_log_entry(Log::Entry& e, bufferlist& log_bl)
 
   // log mutation
   log.add(e);
-  if (ondisklog.has_checksums) {
-    bufferlist ebl(sizeof(e)*2);
-    ::encode(e, ebl);
-    __u32 crc = ebl.crc32c(0);
-    ::encode(ebl, log_bl);
-    ::encode(crc, log_bl);
-  } else {
-    ::encode(e, log_bl);
-  }
   dout(10) << "add_log_entry " << e << dendl;
 }
 
 
-void PG::append_log(ObjectStore::Transaction &t, bufferlist& bl,
-		    eversion_t log_version)
+void PG::append_log(ObjectStore::Transaction &t, vector<Log::Entry>& logv)
 {
-  dout(10) << "append_log " << ondisklog.tail << "~" << ondisklog.length()
-	   << " adding " << bl.length() <<  dendl;
- 
-  // update block map?
-  if (ondisklog.head % 4096 < (ondisklog.head + bl.length()) % 4096)
-    ondisklog.block_map[ondisklog.head] = log_version;  // log_version is last event in prev. block
+  if (!ondisklog.is_segmented()) {
+    // old style log; the entries are already in log.log, so this
+    // rewrites everything once and gets us onto segments.
+    write_log(t);
+    return;
+  }
 
-  t.write(coll_t::META_COLL, log_oid, ondisklog.head, bl.length(), bl );
-  
-  ondisklog.head += bl.length();
+  map<uint64_t,bufferlist> bls;
+  for (vector<Log::Entry>::iterator p = logv.begin(); p != logv.end(); ++p)
+    encode_ondisk_log_entry(*p, bls[ondisklog.segment_of(p->version)]);
+
+  for (map<uint64_t,bufferlist>::iterator p = bls.begin(); p != bls.end(); ++p) {
+    sobject_t oid = log_segment_oid(p->first);
+    if (ondisklog.preserved.count(p->first)) {
+      // we trimmed all of it earlier, but kept it around
+      t.remove(coll_t::META_COLL, oid);
+      ondisklog.preserved.erase(p->first);
+    }
+    OndiskLog::segment_t& seg = ondisklog.segments[p->first];
+    dout(10) << "append_log segment " << p->first << " " << seg.length
+	     << " adding " << p->second.length() << dendl;
+    t.write(coll_t::META_COLL, oid, seg.length, p->second.length(), p->second);
+    seg.length += p->second.length();
+    seg.crc = p->second.crc32c(seg.crc);
+  }
+  for (vector<Log::Entry>::iterator p = logv.begin(); p != logv.end(); ++p)
+    ondisklog.segments[ondisklog.segment_of(p->version)].last = p->version;
 
   bufferlist blb(sizeof(ondisklog));
   ::encode(ondisklog, blb);
   t.collection_setattr(coll, "ondisklog", blb);
-  dout(10) << "append_log  now " << ondisklog.tail << "~" << ondisklog.length() << dendl;
+}
+
+/*
+ * decode the entry at p, sanity check it, and add it to the log.
+ * returns false if it was skipped.
+ */
+bool PG::read_log_entry(bufferlist::iterator& p, uint64_t pos, Log::Entry& e,
+			eversion_t& last, bool& reorder)
+{
+  if (ondisklog.has_checksums) {
+    bufferlist ebl;
+    ::decode(ebl, p);
+    __u32 crc;
+    ::decode(crc, p);
+	
+    __u32 got = ebl.crc32c(0);
+    if (crc == got) {
+      bufferlist::iterator q = ebl.begin();
+      ::decode(e, q);
+    } else {
+      std::ostringstream oss;
+      oss << "read_log " << pos << " bad crc got " << got << " expected" << crc;
+      throw read_log_error(oss.str().c_str());
+    }
+  } else {
+    ::decode(e, p);
+  }
+  dout(20) << "read_log " << pos << " " << e << dendl;
+
+  // [repair] in order?
+  if (e.version < last) {
+    dout(0) << "read_log " << pos << " out of order entry " << e << " follows " << last << dendl;
+    osd->clog.error() << info.pgid << " log has out of order entry "
+		      << e << " following " << last << "\n";
+    reorder = true;
+  }
+
+  if (e.version <= log.tail && !log.backlog) {
+    dout(20) << "read_log  ignoring entry at " << pos << " below log.tail" << dendl;
+    return false;
+  }
+  if (last.version == e.version.version) {
+    dout(0) << "read_log  got dup " << e.version << " (last was " << last << ", dropping that one)" << dendl;
+    log.log.pop_back();
+    osd->clog.error() << info.pgid << " read_log got dup "
+		      << e.version << " after " << last << "\n";
+  }
+      
+  log.log.push_back(e);
+  last = e.version;
+  return true;
 }
 
 void PG::read_log(ObjectStore *store)
@@ -2175,12 +2307,45 @@ void PG::read_log(ObjectStore *store)
   bufferlist::iterator p = blb.begin();
   ::decode(ondisklog, p);
 
-  dout(10) << "read_log " << ondisklog.tail << "~" << ondisklog.length() << dendl;
+  if (ondisklog.is_segmented())
+    dout(10) << "read_log " << ondisklog.segments.size() << " segments, "
+	     << ondisklog.length() << " bytes" << dendl;
+  else
+    dout(10) << "read_log " << ondisklog.tail << "~" << ondisklog.length() << dendl;
 
   log.backlog = info.log_backlog;
   log.tail = info.log_tail;
   
-  if (ondisklog.head > 0) {
+  PG::Log::Entry e;
+  eversion_t last;
+  bool reorder = false;
+  assert(log.log.empty());
+
+  if (ondisklog.is_segmented()) {
+    for (map<uint64_t,OndiskLog::segment_t>::iterator s = ondisklog.segments.begin();
+	 s != ondisklog.segments.end();
+	 ++s) {
+      bufferlist bl;
+      store->read(coll_t::META_COLL, log_segment_oid(s->first), 0, s->second.length, bl);
+      if (bl.length() < s->second.length) {
+	std::ostringstream oss;
+	oss << "read_log segment " << s->first << " got " << bl.length()
+	    << " bytes, expected " << s->second.length;
+	throw read_log_error(oss.str().c_str());
+      }
+      __u32 got = bl.crc32c(0);
+      if (got != s->second.crc) {
+	std::ostringstream oss;
+	oss << "read_log segment " << s->first << " bad crc got " << got
+	    << " expected " << s->second.crc;
+	throw read_log_error(oss.str().c_str());
+      }
+      dout(20) << "read_log segment " << s->first << dendl;
+      bufferlist::iterator p = bl.begin();
+      while (!p.end())
+	read_log_entry(p, p.get_off(), e, last, reorder);
+    }
+  } else if (ondisklog.head > 0) {
     // read
     bufferlist bl;
     store->read(coll_t::META_COLL, log_oid, ondisklog.tail, ondisklog.length(), bl);
@@ -2192,57 +2357,15 @@ void PG::read_log(ObjectStore *store)
       throw read_log_error(oss.str().c_str());
     }
     
-    PG::Log::Entry e;
     bufferlist::iterator p = bl.begin();
-    assert(log.log.empty());
-    eversion_t last;
-    bool reorder = false;
     while (!p.end()) {
       uint64_t pos = ondisklog.tail + p.get_off();
-      if (ondisklog.has_checksums) {
-	bufferlist ebl;
-	::decode(ebl, p);
-	__u32 crc;
-	::decode(crc, p);
-	
-	__u32 got = ebl.crc32c(0);
-	if (crc == got) {
-	  bufferlist::iterator q = ebl.begin();
-	  ::decode(e, q);
-	} else {
-	  std::ostringstream oss;
-	  oss << "read_log " << pos << " bad crc got " << got << " expected" << crc;
-	  throw read_log_error(oss.str().c_str());
-	}
-      } else {
-	::decode(e, p);
-      }
-      dout(20) << "read_log " << pos << " " << e << dendl;
-
-      // [repair] in order?
-      if (e.version < last) {
-	dout(0) << "read_log " << pos << " out of order entry " << e << " follows " << last << dendl;
-	osd->clog.error() << info.pgid << " log has out of order entry "
-	      << e << " following " << last << "\n";
-	reorder = true;
-      }
-
-      if (e.version <= log.tail && !log.backlog) {
-	dout(20) << "read_log  ignoring entry at " << pos << " below log.tail" << dendl;
+      if (!read_log_entry(p, pos, e, last, reorder))
 	continue;
-      }
-      if (last.version == e.version.version) {
-	dout(0) << "read_log  got dup " << e.version << " (last was " << last << ", dropping that one)" << dendl;
-	log.log.pop_back();
-	osd->clog.error() << info.pgid << " read_log got dup "
-	      << e.version << " after " << last << "\n";
-      }
       
       uint64_t endpos = ondisklog.tail + p.get_off();
       if (endpos / 4096 != pos / 4096)
 	ondisklog.block_map[pos] = e.version;  // last event in prior block
-      log.log.push_back(e);
-      last = e.version;
 
       // [repair] at end of log?
       if (!p.end() && e.version == info.last_update) {
@@ -2256,16 +2379,16 @@ void PG::read_log(ObjectStore *store)
 	break;
       }
     }
+  }
   
-    if (reorder) {
-      dout(0) << "read_log reordering log" << dendl;
-      map<eversion_t, Log::Entry> m;
-      for (list<Log::Entry>::iterator p = log.log.begin(); p != log.log.end(); p++)
-	m[p->version] = *p;
-      log.log.clear();
-      for (map<eversion_t, Log::Entry>::iterator p = m.begin(); p != m.end(); p++)
-	log.log.push_back(p->second);
-    }
+  if (reorder) {
+    dout(0) << "read_log reordering log" << dendl;
+    map<eversion_t, Log::Entry> m;
+    for (list<Log::Entry>::iterator p = log.log.begin(); p != log.log.end(); p++)
+      m[p->version] = *p;
+    log.log.clear();
+    for (map<eversion_t, Log::Entry>::iterator p = m.begin(); p != m.end(); p++)
+      log.log.push_back(p->second);
   }
 
   log.head = info.last_update;
@@ -2319,7 +2442,45 @@ bool PG::check_log_for_corruption(ObjectStore *store)
 
   bool ok = true;
   uint64_t pos = 0;
-  if (bounds.head > 0) {
+  if (bounds.is_segmented()) {
+    for (map<uint64_t,OndiskLog::segment_t>::iterator q = bounds.segments.begin();
+	 ok && q != bounds.segments.end();
+	 ++q) {
+      bufferlist bl;
+      store->read(coll_t::META_COLL, log_segment_oid(q->first), 0, q->second.length, bl);
+      if (bl.length() < q->second.length) {
+	ss << "short segment " << q->first << ", " << bl.length() << " bytes, expected "
+	   << q->second.length;
+	ok = false;
+	break;
+      }
+      if (bl.crc32c(0) != q->second.crc) {
+	ss << "bad crc on segment " << q->first;
+	ok = false;
+	break;
+      }
+      bufferlist::iterator p = bl.begin();
+      while (!p.end()) {
+	pos = p.get_off();
+	try {
+	  bufferlist ebl;
+	  __u32 crc;
+	  ::decode(ebl, p);
+	  ::decode(crc, p);
+	  PG::Log::Entry e;
+	  bufferlist::iterator ep = ebl.begin();
+	  ::decode(e, ep);
+	  dout(30) << " " << q->first << " " << pos << " " << e << dendl;
+	}
+	catch (const buffer::error &e) {
+	  dout(0) << "corrupt entry in segment " << q->first << " at " << pos << dendl;
+	  ss << "corrupt entry in segment " << q->first << " at offset " << pos;
+	  ok = false;
+	  break;
+	}
+      }
+    }
+  } else if (bounds.head > 0) {
     // read
     struct stat st;
     store->stat(coll_t::META_COLL, log_oid, &st);
@@ -2452,6 +2613,15 @@ void PG::read_state(ObjectStore *store)
     t.collection_add(cr_log_coll, coll_t::META_COLL, log_oid);
     t.collection_remove(coll_t::META_COLL, log_oid);
     t.touch(coll_t::META_COLL, log_oid);
+    for (map<uint64_t,OndiskLog::segment_t>::iterator q = ondisklog.segments.begin();
+	 q != ondisklog.segments.end();
+	 ++q) {
+      sobject_t oid = log_segment_oid(q->first);
+      t.collection_add(cr_log_coll, coll_t::META_COLL, oid);
+      t.collection_remove(coll_t::META_COLL, oid);
+    }
+    ondisklog.segments.clear();
+    ondisklog.preserved.clear();
     write_info(t);
     store->apply_transaction(t);
   }
@@ -2610,6 +2780,11 @@ bool PG::sched_scrub()
       ret = true;
     } else if (scrub_reserved_peers.size() == acting.size()) {
       dout(20) << "sched_scrub: success, reserved self and replicas" << dendl;
+      if (info.history.last_deep_scrub_stamp + g_conf->osd_deep_scrub_interval <=
+	  ceph_clock_now(g_ceph_context)) {
+	dout(20) << "sched_scrub: deep scrub is due" << dendl;
+	state_set(PG_STATE_DEEP_SCRUB);
+      }
       queue_scrub();
       ret = true;
     } else {
@@ -2633,6 +2808,12 @@ void PG::sub_op_scrub_map(MOSDSubOp *op)
     return;
   }
 
+  if (!finalizing_scrub) {
+    dout(10) << "sub_op_scrub_map no scrub chunk in progress, discarding" << dendl;
+    op->put();
+    return;
+  }
+
   int from = op->get_source().num();
 
   dout(10) << " got osd" << from << " scrub map" << dendl;
@@ -2648,7 +2829,6 @@ void PG::sub_op_scrub_map(MOSDSubOp *op)
   }
 
   if (--scrub_waiting_on == 0) {
-    assert(last_update_applied == info.last_update);
     osd->scrub_finalize_wq.queue(this);
   }
 
@@ -2657,8 +2837,11 @@ void PG::sub_op_scrub_map(MOSDSubOp *op)
 
 /* 
  * pg lock may or may not be held
+ *
+ * a deep scan also reads each object in osd_deep_scrub_stride pieces
+ * and records a crc32c of its data.
  */
-void PG::_scan_list(ScrubMap &map, vector<sobject_t> &ls)
+void PG::_scan_list(ScrubMap &map, vector<sobject_t> &ls, bool deep)
 {
   dout(10) << "_scan_list scanning " << ls.size() << " objects" << dendl;
   int i = 0;
@@ -2674,6 +2857,31 @@ void PG::_scan_list(ScrubMap &map, vector<sobject_t> &ls)
       o.size = st.st_size;
       assert(!o.negative);
       osd->store->getattrs(coll, poid, o.attrs);
+
+      if (deep) {
+	uint32_t crc = -1;
+	uint64_t pos = 0;
+	int stride = MAX(g_conf->osd_deep_scrub_stride, 4096);
+	while (true) {
+	  bufferlist bl;
+	  int rr = osd->store->read(coll, poid, pos, stride, bl);
+	  if (rr < 0) {
+	    derr << "_scan_list  " << poid << " read at " << pos << " got " << rr << dendl;
+	    o.read_error = true;
+	    break;
+	  }
+	  if (rr == 0)
+	    break;
+	  crc = bl.crc32c(crc);
+	  pos += rr;
+	  if (rr < stride)
+	    break;
+	}
+	if (!o.read_error) {
+	  o.digest = crc;
+	  o.digest_present = true;
+	}
+      }
       dout(25) << "_scan_list  " << poid << dendl;
     } else {
       dout(25) << "_scan_list  " << poid << " got " << r << ", skipping" << dendl;
@@ -2690,6 +2898,17 @@ void PG::_request_scrub_map(int replica, eversion_t version)
 					 osd->osdmap->get_cluster_inst(replica));
 }
 
+void PG::_request_scrub_map_chunk(int replica)
+{
+  dout(10) << "scrub  requesting scrubmap for [" << scrub_start << "," << scrub_end
+	   << ") from osd" << replica << dendl;
+  MOSDRepScrub *repscrubop = new MOSDRepScrub(info.pgid, scrub_start, scrub_end,
+					      scrub_subset_last_update,
+					      osd->osdmap->get_epoch(), scrub_deep);
+  osd->cluster_messenger->send_message(repscrubop,
+					 osd->osdmap->get_cluster_inst(replica));
+}
+
 void PG::sub_op_scrub_reserve(MOSDSubOp *op)
 {
   dout(7) << "sub_op_scrub_reserve" << dendl;
@@ -2847,9 +3066,9 @@ void PG::build_scrub_map(ScrubMap &map)
   // pg attrs
   osd->store->collection_getattrs(coll, map.attrs);
 
-  // log
-  osd->store->read(coll_t(), log_oid, 0, 0, map.logbl);
-  dout(10) << " done.  pg log is " << map.logbl.length() << " bytes" << dendl;
+  // the log lives in segments now and nobody compares it; logbl stays
+  // empty
+  dout(10) << " done." << dendl;
 }
 
 
@@ -2884,9 +3103,154 @@ void PG::build_inc_scrub_map(ScrubMap &map, eversion_t v)
   _scan_list(map, ls);
   // pg attrs
   osd->store->collection_getattrs(coll, map.attrs);
+}
+
+/*
+ * take the sorted listing that scrub chunks are cut from.  objects
+ * created after scrub_ls_version are picked up from the log instead.
+ * drops the pg lock; returns false if the pg changed meanwhile.
+ */
+bool PG::build_scrub_list()
+{
+  epoch_t epoch = info.history.same_acting_since;
+  eversion_t v = info.last_update;
+  scrub_ls.clear();
+
+  unlock();
+
+  // everything up to v is on disk once this returns
+  osr.flush();
 
-  // log
-  osd->store->read(coll_t(), log_oid, 0, 0, map.logbl);
+  vector<sobject_t> ls;
+  osd->store->collection_list(coll, ls);
+  sort(ls.begin(), ls.end());
+  lock();
+
+  if (epoch != info.history.same_acting_since) {
+    dout(10) << "build_scrub_list pg changed, aborting" << dendl;
+    return false;
+  }
+
+  scrub_ls.swap(ls);
+  scrub_ls_version = v;
+  dout(10) << "build_scrub_list " << scrub_ls.size() << " objects as of "
+	   << scrub_ls_version << dendl;
+  return true;
+}
+
+/*
+ * objects that may exist in [scrub_start, scrub_end): the listing, plus
+ * anything the log has touched since.  deleted ones fail the stat in
+ * _scan_list and drop out.
+ */
+void PG::scrub_list_chunk(vector<sobject_t>& ls)
+{
+  set<sobject_t> s;
+  for (vector<sobject_t>::iterator p = lower_bound(scrub_ls.begin(), scrub_ls.end(),
+						   scrub_start);
+       p != scrub_ls.end() && scrub_in_chunk(*p);
+       ++p)
+    s.insert(*p);
+  for (list<Log::Entry>::reverse_iterator p = log.log.rbegin();
+       p != log.log.rend() && p->version > scrub_ls_version;
+       ++p)
+    if (scrub_in_chunk(p->soid))
+      s.insert(p->soid);
+  ls.assign(s.begin(), s.end());
+}
+
+/*
+ * choose the chunk starting at scrub_start: osd_scrub_chunk_max listed
+ * objects, stretched so that a head and its clones stay together.
+ */
+void PG::scrub_pick_chunk()
+{
+  int max = MAX(g_conf->osd_scrub_chunk_max, 1);
+  vector<sobject_t>::iterator p = lower_bound(scrub_ls.begin(), scrub_ls.end(),
+					      scrub_start);
+  if (!scrub_chunky)
+    p = scrub_ls.end();
+  for (int n = 0; p != scrub_ls.end() && n < max; n++)
+    ++p;
+  while (p != scrub_ls.end() && p != scrub_ls.begin() && p->oid == (p - 1)->oid)
+    ++p;
+  if (p == scrub_ls.end())
+    scrub_end = sobject_t();
+  else
+    scrub_end = sobject_t(p->oid, 0);  // sorts before any clone or head
+
+  // the newest update to the chunk must be applied before we look at it
+  scrub_subset_last_update = eversion_t();
+  for (list<Log::Entry>::reverse_iterator q = log.log.rbegin();
+       q != log.log.rend();
+       ++q) {
+    if (scrub_in_chunk(q->soid)) {
+      scrub_subset_last_update = q->version;
+      break;
+    }
+  }
+  scrub_chunk_stamp = ceph_clock_now(g_ceph_context);
+  dout(10) << "scrub_pick_chunk [" << scrub_start << "," << scrub_end
+	   << ") last update " << scrub_subset_last_update << dendl;
+}
+
+/*
+ * an old replica ignores the range in a chunky request and scans the
+ * whole pg, so only cut the pg into chunks if every replica knows how.
+ * caller holds map_lock.
+ */
+bool PG::scrub_replicas_chunky()
+{
+  bool chunky = true;
+  for (unsigned i=1; i<acting.size(); i++) {
+    Connection *con = osd->cluster_messenger->get_connection(
+      osd->osdmap->get_cluster_inst(acting[i]));
+    if (!con || !con->has_feature(CEPH_FEATURE_CHUNKY_SCRUB)) {
+      dout(10) << "scrub  osd" << acting[i] << " can't do chunky scrub" << dendl;
+      chunky = false;
+    }
+    if (con)
+      con->put();
+  }
+  return chunky;
+}
+
+/*
+ * build a summary of the objects in [scrub_start, scrub_end).
+ * drops the pg lock; returns false if the pg changed meanwhile.
+ */
+bool PG::build_scrub_map_chunk(ScrubMap &map)
+{
+  dout(10) << "build_scrub_map_chunk [" << scrub_start << "," << scrub_end << ")" << dendl;
+
+  map.valid_through = last_update_applied;
+  epoch_t epoch = info.history.same_acting_since;
+
+  vector<sobject_t> ls;
+  scrub_list_chunk(ls);
+
+  unlock();
+  _scan_list(map, ls, scrub_deep);
+  lock();
+
+  if (epoch != info.history.same_acting_since) {
+    dout(10) << "scrub  pg changed, aborting" << dendl;
+    return false;
+  }
+  return true;
+}
+
+/*
+ * writes to chunks we already scrubbed are not seen again; carry their
+ * effect on the stats into the running total.
+ */
+void PG::scrub_note_stat_change(const sobject_t& soid,
+				const pg_stat_t& before, const pg_stat_t& after)
+{
+  if (!scrub_started || !(soid < scrub_start))
+    return;
+  scrub_cstat.add(after);
+  scrub_cstat.sub(before);
 }
 
 void PG::repair_object(const sobject_t& soid, ScrubMap::object *po, int bad_peer, int ok_peer)
@@ -2909,7 +3273,19 @@ void PG::repair_object(const sobject_t& soid, ScrubMap::object *po, int bad_peer
   osd->queue_for_recovery(this);
 }
 
+bool PG::rep_scrub_ready(MOSDRepScrub *msg)
+{
+  if (msg->chunky)
+    return last_update_applied >= msg->scrub_to;
+  return last_update_applied == info.last_update;
+}
+
 /* replica_scrub
+ *
+ * If msg->chunky is set, replica_scrub waits until everything up to
+ * msg->scrub_to is applied (the primary holds off newer writes to the
+ * range), then builds a map of [msg->start, msg->end) only.  The first
+ * chunk of a scrub takes a fresh listing.
  *
  * If msg->scrub_from is not set, replica_scrub calls build_scrubmap to
  * build a complete map (with the pg lock dropped).
@@ -2922,9 +3298,15 @@ void PG::repair_object(const sobject_t& soid, ScrubMap::object *po, int bad_peer
  */
 void PG::replica_scrub(MOSDRepScrub *msg)
 {
-  assert(!active_rep_scrub);
   dout(7) << "replica_scrub" << dendl;
 
+  if (active_rep_scrub) {
+    // the primary has moved on (new chunk or restarted scrub)
+    dout(10) << "replica_scrub dropping pending " << *active_rep_scrub << dendl;
+    active_rep_scrub->put();
+    active_rep_scrub = 0;
+  }
+
   if (msg->map_epoch < info.history.same_acting_since) {
     if (finalizing_scrub) {
       dout(10) << "scrub  pg changed, aborting" << dendl;
@@ -2939,7 +3321,28 @@ void PG::replica_scrub(MOSDRepScrub *msg)
   }
 
   ScrubMap map;
-  if (msg->scrub_from > eversion_t()) {
+  if (msg->chunky) {
+    if (!rep_scrub_ready(msg)) {
+      dout(10) << "replica_scrub waiting for " << msg->scrub_to << " to apply" << dendl;
+      active_rep_scrub = msg;
+      return;
+    }
+    if (msg->start == sobject_t() || scrub_ls_version < log.tail) {
+      if (!build_scrub_list()) {
+	msg->put();
+	return;
+      }
+    }
+    scrub_start = msg->start;
+    scrub_end = msg->end;
+    scrub_deep = msg->deep;
+    if (!build_scrub_map_chunk(map)) {
+      msg->put();
+      return;
+    }
+    if (scrub_end == sobject_t())
+      vector<sobject_t>().swap(scrub_ls);
+  } else if (msg->scrub_from > eversion_t()) {
     if (finalizing_scrub) {
       assert(last_update_applied == info.last_update);
     } else {
@@ -2968,7 +3371,7 @@ void PG::replica_scrub(MOSDRepScrub *msg)
   osd_reqid_t reqid;
   MOSDSubOp *subop = new MOSDSubOp(reqid, info.pgid, poid, false, 0,
 				   msg->map_epoch, osd->get_tid(), v);
-  ::encode(map, subop->get_data());
+  map.encode(subop->get_data(), msg->get_connection()->get_features());
   subop->ops = scrub;
 
   osd->cluster_messenger->send_message(subop, msg->get_connection());
@@ -2978,26 +3381,32 @@ void PG::replica_scrub(MOSDRepScrub *msg)
 
 /* Scrub:
  * PG_STATE_SCRUBBING is set when the scrub is queued
- * 
- * Once the initial scrub has completed and the requests have gone out to 
- * replicas for maps, finalizing_scrub is set.  scrub_waiting_on is set to 
- * the number of maps outstanding (active.size()).
  *
- * If last_update_applied is behind the head of the log, scrub returns to be
- * requeued by op_applied.
+ * The pg is scrubbed in chunks of about osd_scrub_chunk_max objects, in
+ * the order of a sorted listing taken when the scrub starts (see
+ * build_scrub_list).  A chunk never splits a head from its clones.  If
+ * a replica lacks CEPH_FEATURE_CHUNKY_SCRUB it would scan the whole pg
+ * for every chunk, so the whole pg is then scrubbed as one chunk.
  *
- * Once last_update_applied == info.last_update, scrub catches itself up and
- * decrements scrub_waiting_on.
+ * For each chunk, scrub picks [scrub_start, scrub_end) and sets
+ * finalizing_scrub, from which point client writes to that range wait
+ * (see do_op).  Replicas are asked for a map of the range as of the
+ * newest log entry touching it, scrub_subset_last_update.
+ * scrub_waiting_on is set to the number of maps outstanding
+ * (acting.size()).
+ *
+ * If last_update_applied is behind scrub_subset_last_update, scrub
+ * returns to be requeued by op_applied.  Otherwise it builds its own map
+ * of the range (with the pg lock dropped) and decrements
+ * scrub_waiting_on.
  *
  * sub_op_scrub_map similarly decrements scrub_waiting_on for each map received.
- * 
- * Once scrub_waiting_on hits 0 (either in scrub or sub_op_scrub_map) 
- * scrub_finalize is queued.
- * 
- * In scrub_finalize, if any replica maps are too old, new ones are requested,
- * scrub_waiting_on is reset, and scrub_finalize returns to be requeued by
- * sub_op_scrub_map.  If all maps are up to date, scrub_finalize checks 
- * the maps and performs repairs.
+ *
+ * Once scrub_waiting_on hits 0 (either in scrub or sub_op_scrub_map)
+ * scrub_finalize is queued.  It compares the maps and repairs, then
+ * releases the blocked writes and queues the next chunk, after a delay
+ * if osd_scrub_max_bytes_per_sec or osd_scrub_max_objects_per_sec ask
+ * for one.  After the last chunk the accumulated stats are checked.
  */
 void PG::scrub()
 {
@@ -3005,17 +3414,24 @@ void PG::scrub()
   osd->map_lock.get_read();
   lock();
 
-  if (!is_primary() || !is_active() || !is_clean() || !is_scrubbing()) {
+  if (!is_primary() || !is_active() || !is_scrubbing() ||
+      (!scrub_started && !is_clean())) {
     dout(10) << "scrub -- not primary or active or not clean" << dendl;
-    state_clear(PG_STATE_REPAIR);
-    state_clear(PG_STATE_SCRUBBING);
-    clear_scrub_reserved();
+    if (scrub_started) {
+      scrub_clear_state();
+      scrub_unreserve_replicas();
+    } else {
+      state_clear(PG_STATE_REPAIR);
+      state_clear(PG_STATE_DEEP_SCRUB);
+      state_clear(PG_STATE_SCRUBBING);
+      clear_scrub_reserved();
+    }
     unlock();
     osd->map_lock.put_read();
     return;
   }
 
-  if (!finalizing_scrub) {
+  if (!scrub_started) {
     dout(10) << "scrub start" << dendl;
     update_stats();
     scrub_received_maps.clear();
@@ -3031,64 +3447,85 @@ void PG::scrub()
     ++(osd->scrubs_active);
     osd->sched_scrub_lock.Unlock();
 
-    /* scrub_waiting_on == 0 iff all replicas have sent the requested maps and
-     * the primary has done a final scrub (which in turn can only happen if
-     * last_update_applied == info.last_update)
-     */
-    scrub_waiting_on = acting.size();
-
-    // request maps from replicas
-    for (unsigned i=1; i<acting.size(); i++) {
-      _request_scrub_map(acting[i], eversion_t());
-    }
+    scrub_started = true;
+    scrub_deep = state_test(PG_STATE_DEEP_SCRUB);
+    scrub_chunky = scrub_replicas_chunky();
+    scrub_start = scrub_end = sobject_t();
+    scrub_cstat = pg_stat_t();
+    scrub_errors = scrub_fixed = 0;
     osd->map_lock.put_read();
 
     // Unlocks and relocks...
-    primary_scrubmap = ScrubMap();
-    build_scrub_map(primary_scrubmap);
-
-    if (scrub_epoch_start != info.history.same_acting_since) {
-      dout(10) << "scrub  pg changed, aborting" << dendl;
+    if (!build_scrub_list()) {
       scrub_clear_state();
       scrub_unreserve_replicas();
       unlock();
       return;
     }
 
-    finalizing_scrub = true;
-    if (last_update_applied != info.last_update) {
-      dout(10) << "wait for cleanup" << dendl;
-      unlock();
-      return;
-    }
-  } else {
-    osd->map_lock.put_read();
+    // come back with the map_lock for the first chunk
+    osd->scrub_wq.queue(this);
+    unlock();
+    return;
   }
-    
 
-  dout(10) << "clean up scrub" << dendl;
-  assert(last_update_applied == info.last_update);
-  
   if (scrub_epoch_start != info.history.same_acting_since) {
     dout(10) << "scrub  pg changed, aborting" << dendl;
     scrub_clear_state();
     scrub_unreserve_replicas();
     unlock();
+    osd->map_lock.put_read();
     return;
   }
-  
-  if (primary_scrubmap.valid_through != log.head) {
-    ScrubMap incr;
-    build_inc_scrub_map(incr, primary_scrubmap.valid_through);
-    primary_scrubmap.merge_incr(incr);
+
+  if (!finalizing_scrub) {
+    scrub_pick_chunk();
+
+    // writes to the chunk wait from here on
+    finalizing_scrub = true;
+    scrub_primary_map_started = false;
+    primary_scrubmap = ScrubMap();
+    scrub_received_maps.clear();
+
+    /* scrub_waiting_on == 0 iff all replicas have sent the requested maps and
+     * the primary has built its own (which in turn can only happen once
+     * last_update_applied has reached scrub_subset_last_update)
+     */
+    scrub_waiting_on = acting.size();
+
+    // request maps from replicas
+    for (unsigned i=1; i<acting.size(); i++) {
+      _request_scrub_map_chunk(acting[i]);
+    }
   }
-  
+  osd->map_lock.put_read();
+
+  if (scrub_primary_map_started) {
+    dout(20) << "scrub  already built our map for this chunk" << dendl;
+    unlock();
+    return;
+  }
+
+  if (last_update_applied < scrub_subset_last_update) {
+    dout(10) << "scrub  waiting for " << scrub_subset_last_update << " to apply" << dendl;
+    unlock();
+    return;
+  }
+
+  // Unlocks and relocks...
+  scrub_primary_map_started = true;
+  if (!build_scrub_map_chunk(primary_scrubmap)) {
+    scrub_clear_state();
+    scrub_unreserve_replicas();
+    unlock();
+    return;
+  }
+
   --scrub_waiting_on;
   if (scrub_waiting_on == 0) {
-    assert(last_update_applied == info.last_update);
     osd->scrub_finalize_wq.queue(this);
   }
-  
+
   unlock();
 }
 
@@ -3097,17 +3534,34 @@ void PG::scrub_clear_state()
   assert(_lock.is_locked());
   state_clear(PG_STATE_SCRUBBING);
   state_clear(PG_STATE_REPAIR);
+  state_clear(PG_STATE_DEEP_SCRUB);
   update_stats();
 
   // active -> nothing.
-  osd->dec_scrubs_active();
+  if (scrub_started)
+    osd->dec_scrubs_active();
 
   osd->take_waiters(waiting_for_active);
 
   finalizing_scrub = false;
+  scrub_started = false;
+  scrub_primary_map_started = false;
+  scrub_chunky = false;
+  scrub_deep = false;
   scrub_received_maps.clear();
+  primary_scrubmap = ScrubMap();
+  vector<sobject_t>().swap(scrub_ls);
+  scrub_start = scrub_end = sobject_t();
+
+  // the snap trimmer holds off while we scrub
+  if (!snap_trimq.empty())
+    queue_snap_trim();
 }
 
+/*
+ * replicas that predate chunky scrub answer with a full map of whatever
+ * they had applied; ask them to catch up to the chunk if needed.
+ */
 bool PG::scrub_gather_replica_maps() {
   assert(scrub_waiting_on == 0);
   assert(_lock.is_locked());
@@ -3116,7 +3570,7 @@ bool PG::scrub_gather_replica_maps() {
        p != scrub_received_maps.end();
        p++) {
     
-    if (scrub_received_maps[p->first].valid_through != log.head) {
+    if (p->second.valid_through < scrub_subset_last_update) {
       scrub_waiting_on++;
       // Need to request another incremental map
       _request_scrub_map(p->first, p->second.valid_through);
@@ -3140,6 +3594,20 @@ bool PG::_compare_scrub_objects(ScrubMap::object &auth,
     errorstream << "size " << candidate.size 
 		<< " != known size " << auth.size;
   }
+  if (candidate.read_error) {
+    if (!ok)
+      errorstream << ", ";
+    ok = false;
+    errorstream << "read error";
+  }
+  if (auth.digest_present && candidate.digest_present &&
+      auth.digest != candidate.digest) {
+    if (!ok)
+      errorstream << ", ";
+    ok = false;
+    errorstream << "digest 0x" << std::hex << candidate.digest
+		<< " != known digest 0x" << auth.digest << std::dec;
+  }
   for (map<string,bufferptr>::const_iterator i = auth.attrs.begin();
        i != auth.attrs.end();
        i++) {
@@ -3192,12 +3660,20 @@ void PG::_compare_scrubmaps(const map<int,ScrubMap*> &maps,
     map<int, ScrubMap *>::const_iterator auth = maps.end();
     set<int> cur_missing;
     set<int> cur_inconsistent;
+    // Take first osd to have a readable copy as authoritative
+    for (j = maps.begin(); j != maps.end(); j++) {
+      map<sobject_t,ScrubMap::object>::const_iterator o = j->second->objects.find(*k);
+      if (o == j->second->objects.end())
+	continue;
+      if (auth == maps.end() || !o->second.read_error) {
+	auth = j;
+	if (!o->second.read_error)
+	  break;
+      }
+    }
     for (j = maps.begin(); j != maps.end(); j++) {
       if (j->second->objects.count(*k)) {
-	if (auth == maps.end()) {
-	  // Take first osd to have it as authoritative
-	  auth = j;
-	} else {
+	if (j != auth) {
 	  // Compare 
 	  stringstream ss;
 	  if (!_compare_scrub_objects(auth->second->objects[*k],
@@ -3227,10 +3703,29 @@ void PG::_compare_scrubmaps(const map<int,ScrubMap*> &maps,
   }
 }
 
+struct C_PG_ScrubNextChunk : public Context {
+  PG *pg;
+  C_PG_ScrubNextChunk(PG *p) : pg(p) {
+    pg->get();
+  }
+  ~C_PG_ScrubNextChunk() {
+    pg->put();
+  }
+  void finish(int r) {
+    pg->requeue_scrub();
+  }
+};
+
 void PG::scrub_finalize() {
   osd->map_lock.get_read();
   lock();
-  assert(last_update_applied == info.last_update);
+
+  if (!scrub_started || !finalizing_scrub) {
+    dout(10) << "scrub_finalize no scrub chunk in progress" << dendl;
+    unlock();
+    osd->map_lock.put_read();
+    return;
+  }
 
   if (scrub_epoch_start != info.history.same_acting_since) {
     dout(10) << "scrub  pg changed, aborting" << dendl;
@@ -3249,10 +3744,23 @@ void PG::scrub_finalize() {
   }
   osd->map_lock.put_read();
 
-  dout(10) << "scrub_finalize has maps, analyzing" << dendl;
-  int errors = 0, fixed = 0;
+  // full maps from old replicas cover more than this chunk
+  for (map<int,ScrubMap>::iterator p = scrub_received_maps.begin();
+       p != scrub_received_maps.end();
+       p++) {
+    map<sobject_t,ScrubMap::object>::iterator q = p->second.objects.begin();
+    while (q != p->second.objects.end()) {
+      if (scrub_in_chunk(q->first))
+	q++;
+      else
+	p->second.objects.erase(q++);
+    }
+  }
+
+  dout(10) << "scrub_finalize has maps for [" << scrub_start << "," << scrub_end
+	   << "), analyzing" << dendl;
   bool repair = state_test(PG_STATE_REPAIR);
-  const char *mode = repair ? "repair":"scrub";
+  const char *mode = repair ? "repair" : (scrub_deep ? "deep-scrub" : "scrub");
   if (acting.size() > 1) {
     dout(10) << "scrub  comparing replica scrub maps" << dendl;
 
@@ -3317,25 +3825,76 @@ void PG::scrub_finalize() {
   }
 
   // ok, do the pg-type specific scrubbing
-  _scrub(primary_scrubmap, errors, fixed);
+  _scrub(primary_scrubmap, scrub_errors, scrub_fixed);
+
+  // only a deep scrub reads object data
+  uint64_t chunk_objects = primary_scrubmap.objects.size();
+  uint64_t chunk_bytes = 0;
+  if (scrub_deep) {
+    for (map<sobject_t,ScrubMap::object>::iterator p = primary_scrubmap.objects.begin();
+	 p != primary_scrubmap.objects.end();
+	 p++)
+      chunk_bytes += p->second.size;
+  }
+
+  // done with this chunk; let its writes go
+  primary_scrubmap = ScrubMap();
+  scrub_received_maps.clear();
+  finalizing_scrub = false;
+  osd->take_waiters(waiting_for_active);
+
+  if (scrub_end == sobject_t()) {
+    scrub_finish();
+    return;
+  }
+  scrub_start = scrub_end;
+
+  // stay within the configured budget
+  double want = 0;
+  if (g_conf->osd_scrub_max_bytes_per_sec)
+    want = MAX(want, (double)chunk_bytes / (double)g_conf->osd_scrub_max_bytes_per_sec);
+  if (g_conf->osd_scrub_max_objects_per_sec > 0)
+    want = MAX(want, (double)chunk_objects / (double)g_conf->osd_scrub_max_objects_per_sec);
+  double delay = want - (double)(ceph_clock_now(g_ceph_context) - scrub_chunk_stamp);
+  if (delay > 0) {
+    dout(10) << "scrub  chunk was " << chunk_objects << " objects, " << chunk_bytes
+	     << " bytes; next chunk in " << delay << "s" << dendl;
+    osd->scrub_sleep_lock.Lock();
+    osd->scrub_sleep_timer.add_event_after(delay, new C_PG_ScrubNextChunk(this));
+    osd->scrub_sleep_lock.Unlock();
+  } else {
+    osd->scrub_wq.queue(this);
+  }
+  unlock();
+}
+
+/*
+ * all chunks are done: check the accumulated stats and record the scrub.
+ * called with the pg lock held; drops it.
+ */
+void PG::scrub_finish() {
+  bool repair = state_test(PG_STATE_REPAIR);
+  const char *mode = repair ? "repair" : (scrub_deep ? "deep-scrub" : "scrub");
+
+  _scrub_finish(scrub_errors, scrub_fixed);
 
   {
     stringstream oss;
     oss << info.pgid << " " << mode << " ";
-    if (errors)
-      oss << errors << " errors";
+    if (scrub_errors)
+      oss << scrub_errors << " errors";
     else
       oss << "ok";
     if (repair)
-      oss << ", " << fixed << " fixed";
+      oss << ", " << scrub_fixed << " fixed";
     oss << "\n";
-    if (errors)
+    if (scrub_errors)
       osd->clog.error(oss);
     else
       osd->clog.info(oss);
   }
 
-  if (errors == 0 || (repair && (errors - fixed) == 0))
+  if (scrub_errors == 0 || (repair && (scrub_errors - scrub_fixed) == 0))
     state_clear(PG_STATE_INCONSISTENT);
 
   // finish up
@@ -3343,6 +3902,10 @@ void PG::scrub_finalize() {
   info.history.last_scrub = info.last_update;
   info.history.last_scrub_stamp = ceph_clock_now(g_ceph_context);
   osd->reg_last_pg_scrub(info.pgid, info.history.last_scrub_stamp);
+  if (scrub_deep) {
+    info.history.last_deep_scrub = info.history.last_scrub;
+    info.history.last_deep_scrub_stamp = info.history.last_scrub_stamp;
+  }
 
   {
     ObjectStore::Transaction *t = new ObjectStore::Transaction;
@@ -190,6 +190,8 @@ public:
 
       eversion_t last_scrub;
       utime_t last_scrub_stamp;
+      eversion_t last_deep_scrub;
+      utime_t last_deep_scrub_stamp;
 
       History() : 	      
 	epoch_created(0),
@@ -210,10 +212,14 @@ public:
 	  last_scrub = other.last_scrub;
 	if (other.last_scrub_stamp > last_scrub_stamp)
 	  last_scrub_stamp = other.last_scrub_stamp;
+	if (other.last_deep_scrub > last_deep_scrub)
+	  last_deep_scrub = other.last_deep_scrub;
+	if (other.last_deep_scrub_stamp > last_deep_scrub_stamp)
+	  last_deep_scrub_stamp = other.last_deep_scrub_stamp;
       }
 
       void encode(bufferlist &bl) const {
-	__u8 struct_v = 3;
+	__u8 struct_v = 4;
 	::encode(struct_v, bl);
 	::encode(epoch_created, bl);
 	::encode(last_epoch_started, bl);
@@ -224,6 +230,8 @@ public:
 	::encode(same_primary_since, bl);
 	::encode(last_scrub, bl);
 	::encode(last_scrub_stamp, bl);
+	::encode(last_deep_scrub, bl);
+	::encode(last_deep_scrub_stamp, bl);
       }
       void decode(bufferlist::iterator &bl) {
 	__u8 struct_v;
@@ -242,6 +250,10 @@ public:
 	  ::decode(last_scrub, bl);
 	  ::decode(last_scrub_stamp, bl);
 	}
+	if (struct_v >= 4) {
+	  ::decode(last_deep_scrub, bl);
+	  ::decode(last_deep_scrub_stamp, bl);
+	}
       }
     } history;
     
@@ -593,20 +605,58 @@ public:
 
   /**
    * OndiskLog - some info about how we store the log on disk.
+   *
+   * The log is kept in segment objects.  Segment n holds the entries
+   * whose version.version is in [n * segment_entries, (n+1) *
+   * segment_entries), in order.  New entries are appended to the
+   * last segment, trimming removes whole segments, and write_log only
+   * rewrites the segments whose contents changed.
+   *
+   * Logs written before segments (struct_v < 3) are a single object,
+   * log_oid, with the live part between tail and head.  We can still
+   * read those; the next append converts them.
    */
   class OndiskLog {
   public:
-    // ok
+    struct segment_t {
+      uint32_t length;
+      uint32_t crc;      // crc32c of the whole segment
+      eversion_t last;   // last entry in it
+      segment_t() : length(0), crc(0) {}
+    };
+
+    // segmented
+    uint32_t segment_entries;          // 0 if we are still a legacy log
+    map<uint64_t,segment_t> segments;
+    set<uint64_t> preserved;           // trimmed, but still on disk (osd_preserve_trimmed_log)
+
+    // legacy
     uint64_t tail;                     // first byte of log. 
     uint64_t head;                        // byte following end of log.
     bool has_checksums;
     map<uint64_t,eversion_t> block_map;  // offset->version of _last_ entry with _any_ bytes in each block
 
-    OndiskLog() : tail(0), head(0) {}
+    OndiskLog() : segment_entries(0), tail(0), head(0), has_checksums(true) {}
+
+    bool is_segmented() const { return segment_entries > 0; }
+    uint64_t segment_of(eversion_t v) const {
+      return v.version / segment_entries;
+    }
 
-    uint64_t length() { return head - tail; }
+    uint64_t length() {
+      if (!is_segmented())
+	return head - tail;
+      uint64_t len = 0;
+      for (map<uint64_t,segment_t>::iterator p = segments.begin(); p != segments.end(); ++p)
+	len += p->second.length;
+      return len;
+    }
     bool trim_to(eversion_t v, ObjectStore::Transaction& t);
 
+    /*
+     * forget the legacy bounds.  segments are left alone so that the
+     * next write_log knows which objects to remove.
+     */
     void zero() {
       tail = 0;
       head = 0;
@@ -614,10 +664,20 @@ public:
     }
 
     void encode(bufferlist& bl) const {
-      __u8 struct_v = 2;
+      __u8 struct_v = 3;
       ::encode(struct_v, bl);
       ::encode(tail, bl);
       ::encode(head, bl);
+      ::encode(segment_entries, bl);
+      __u32 n = segments.size();
+      ::encode(n, bl);
+      for (map<uint64_t,segment_t>::const_iterator p = segments.begin(); p != segments.end(); ++p) {
+	::encode(p->first, bl);
+	::encode(p->second.length, bl);
+	::encode(p->second.crc, bl);
+	::encode(p->second.last, bl);
+      }
+      ::encode(preserved, bl);
     }
     void decode(bufferlist::iterator& bl) {
       __u8 struct_v;
@@ -625,6 +685,24 @@ public:
       has_checksums = (struct_v >= 2);
       ::decode(tail, bl);
       ::decode(head, bl);
+      segments.clear();
+      if (struct_v >= 3) {
+	::decode(segment_entries, bl);
+	__u32 n;
+	::decode(n, bl);
+	while (n--) {
+	  uint64_t seg;
+	  ::decode(seg, bl);
+	  segment_t& s = segments[seg];
+	  ::decode(s.length, bl);
+	  ::decode(s.crc, bl);
+	  ::decode(s.last, bl);
+	}
+	::decode(preserved, bl);
+      } else {
+	segment_entries = 0;
+	preserved.clear();
+      }
     }
   };
   WRITE_CLASS_ENCODER(OndiskLog)
@@ -706,6 +784,7 @@ protected:
 
 public:
   bool deleting;  // true while RemoveWQ should be chewing on us
+  set<uint64_t> removed_log_segments;  // log segment objects _remove_pg must remove
 
   void lock(bool no_lockdep=false) {
     //generic_dout(0) << this << " " << info.pgid << " lock" << dendl;
@@ -1451,6 +1530,33 @@ public:
   ScrubMap primary_scrubmap;
   MOSDRepScrub *active_rep_scrub;
 
+  // chunky scrub: the pg is scrubbed in [scrub_start, scrub_end) pieces,
+  // cut from a sorted listing taken at scrub_ls_version.  While
+  // finalizing_scrub is set on the primary, writes to the current chunk
+  // wait.  scrub_end == sobject_t() means the end of the pg.  If a
+  // replica predates chunky scrub the whole pg is a single chunk.
+  bool scrub_started, scrub_primary_map_started;
+  bool scrub_chunky;
+  bool scrub_deep;  // reading data and comparing digests
+  vector<sobject_t> scrub_ls;
+  eversion_t scrub_ls_version;
+  sobject_t scrub_start, scrub_end;
+  eversion_t scrub_subset_last_update;
+  pg_stat_t scrub_cstat;  // scrubbed chunks, plus later writes to them
+  int scrub_errors, scrub_fixed;
+  utime_t scrub_chunk_stamp;
+
+  bool scrub_in_chunk(const sobject_t& soid) const {
+    return soid >= scrub_start &&
+      (scrub_end == sobject_t() || soid < scrub_end);
+  }
+  bool scrub_blocks_write(const sobject_t& soid) const {
+    return finalizing_scrub && scrub_in_chunk(soid);
+  }
+  void scrub_note_stat_change(const sobject_t& soid,
+			      const pg_stat_t& before, const pg_stat_t& after);
+  bool scrub_replicas_chunky();
+
   void repair_object(const sobject_t& soid, ScrubMap::object *po, int bad_peer, int ok_peer);
   bool _compare_scrub_objects(ScrubMap::object &auth,
 			      ScrubMap::object &candidate,
@@ -1464,11 +1570,19 @@ public:
   void scrub_finalize();
   void scrub_clear_state();
   bool scrub_gather_replica_maps();
-  void _scan_list(ScrubMap &map, vector<sobject_t> &ls);
+  void _scan_list(ScrubMap &map, vector<sobject_t> &ls, bool deep=false);
   void _request_scrub_map(int replica, eversion_t version);
+  void _request_scrub_map_chunk(int replica);
   void build_scrub_map(ScrubMap &map);
   void build_inc_scrub_map(ScrubMap &map, eversion_t v);
+  bool build_scrub_list();
+  void scrub_list_chunk(vector<sobject_t>& ls);
+  void scrub_pick_chunk();
+  bool build_scrub_map_chunk(ScrubMap &map);
+  bool rep_scrub_ready(MOSDRepScrub *msg);
+  void scrub_finish();
   virtual int _scrub(ScrubMap &map, int& errors, int& fixed) { return 0; }
+  virtual void _scrub_finish(int& errors, int& fixed) { }
   void clear_scrub_reserved();
   void scrub_reserve_replicas();
   void scrub_unreserve_replicas();
@@ -1503,7 +1617,10 @@ public:
     finalizing_scrub(false),
     scrub_reserved(false), scrub_reserve_failed(false),
     scrub_waiting_on(0),
-    active_rep_scrub(0)
+    active_rep_scrub(0),
+    scrub_started(false), scrub_primary_map_started(false),
+    scrub_chunky(false), scrub_deep(false),
+    scrub_errors(0), scrub_fixed(0)
   {
     pool->get();
   }
@@ -1549,14 +1666,16 @@ public:
 
   bool  is_empty() const { return info.last_update == eversion_t(0,0); }
 
-  void add_log_entry(Log::Entry& e, bufferlist& log_bl);
+  void add_log_entry(Log::Entry& e);
 
   // pg on-disk state
   void write_info(ObjectStore::Transaction& t);
+  sobject_t log_segment_oid(uint64_t seg) const;
   void write_log(ObjectStore::Transaction& t);
-  void append_log(ObjectStore::Transaction &t, bufferlist& bl,
-		  eversion_t log_version);
+  void append_log(ObjectStore::Transaction &t, vector<Log::Entry>& logv);
   void read_log(ObjectStore *store);
+  bool read_log_entry(bufferlist::iterator& p, uint64_t pos, Log::Entry& e,
+		      eversion_t& last, bool& reorder);
   bool check_log_for_corruption(ObjectStore *store);
   void trim(ObjectStore::Transaction& t, eversion_t v);
   void trim_ondisklog_to(ObjectStore::Transaction& t, eversion_t v);
@@ -1572,6 +1691,7 @@ public:
 
   void queue_snap_trim();
   bool queue_scrub();
+  void requeue_scrub();
 
   void share_pg_info();
   void share_pg_log(const eversion_t &oldver);
@@ -18,6 +18,7 @@
 
 #include "common/errno.h"
 #include "common/perf_counters.h"
+#include "common/zero_runs.h"
 
 #include "messages/MOSDOp.h"
 #include "messages/MOSDOpReply.h"
@@ -384,6 +385,62 @@ ReplicatedPG::ReplicatedPG(OSD *o, PGPool *_pool, pg_t p, const sobject_t& oid,
   snap_trimmer_machine.initiate();
 }
 
+/*
+ * Decode a COPY_FROM's source locator and work out whether the source
+ * object lives in this pg.
+ */
+int ReplicatedPG::get_copy_source(OSDOp& osd_op, object_locator_t *src_oloc, bool *local)
+{
+  try {
+    bufferlist::iterator bp = osd_op.data.begin();
+    ::decode(*src_oloc, bp);
+  }
+  catch (buffer::error& e) {
+    return -EINVAL;
+  }
+  if (!osd->osdmap->have_pg_pool(src_oloc->get_pool()))
+    return -ENOENT;
+  pg_t raw = osd->osdmap->object_locator_to_pg(osd_op.soid.oid, *src_oloc);
+  *local = (osd->osdmap->raw_pg_to_pg(raw) == info.pgid);
+  return 0;
+}
+
+/*
+ * If op copies from an object in another pg, have the osd fetch it
+ * first.  Only one such COPY_FROM per op.  Returns true if op is parked
+ * until the fetch completes; later ops to the same object then wait in
+ * waiting_for_copy_source until it comes back through do_op.
+ */
+bool ReplicatedPG::wait_for_copy_source(MOSDOp *op)
+{
+  for (vector<OSDOp>::iterator p = op->ops.begin(); p != op->ops.end(); ++p) {
+    if (p->op.op != CEPH_OSD_OP_COPY_FROM)
+      continue;
+    object_locator_t src_oloc;
+    bool local;
+    if (get_copy_source(*p, &src_oloc, &local) < 0 || local)
+      return false;
+    if (osd->fetch_copy_source(op, p->soid, src_oloc)) {
+      dout(10) << "do_op " << *op << " waiting for copy source " << p->soid << dendl;
+      copy_source_blocked[sobject_t(op->get_oid(), CEPH_NOSNAP)] = op->get_reqid();
+      return true;
+    }
+    return false;
+  }
+  return false;
+}
+
+void ReplicatedPG::wake_copy_source_waiters(const sobject_t& soid)
+{
+  copy_source_blocked.erase(soid);
+  map<sobject_t, list<Message*> >::iterator p = waiting_for_copy_source.find(soid);
+  if (p != waiting_for_copy_source.end()) {
+    dout(10) << "wake_copy_source_waiters " << soid << " " << p->second.size() << " ops" << dendl;
+    osd->take_waiters(p->second);
+    waiting_for_copy_source.erase(p);
+  }
+}
+
 /** do_op - do an op
  * pg lock will be held (if multithreaded)
  * osd_lock NOT held.
@@ -394,12 +451,30 @@ void ReplicatedPG::do_op(MOSDOp *op)
     return do_pg_op(op);
 
   dout(10) << "do_op " << *op << dendl;
-  if (finalizing_scrub && op->may_write()) {
+  if (op->may_write() &&
+      scrub_blocks_write(sobject_t(op->get_oid(), CEPH_NOSNAP))) {
     dout(20) << __func__ << ": waiting for scrub" << dendl;
     waiting_for_active.push_back(op);
     return;
   }
 
+  // don't pass a COPY_FROM to this object that is still fetching its source
+  sobject_t head(op->get_oid(), CEPH_NOSNAP);
+  map<sobject_t, osd_reqid_t>::iterator cb = copy_source_blocked.find(head);
+  if (cb != copy_source_blocked.end()) {
+    if (cb->second != op->get_reqid() && osd->copy_fetch_pending(cb->second)) {
+      dout(10) << "do_op " << *op << " waiting for copy_from " << cb->second
+	       << " to " << head << dendl;
+      waiting_for_copy_source[head].push_back(op);
+      return;
+    }
+    // it's back (or gone for good); the waiters go after it
+    wake_copy_source_waiters(head);
+  }
+
+  if (op->may_write() && wait_for_copy_source(op))
+    return;
+
   entity_inst_t client = op->get_source_inst();
 
   ObjectContext *obc;
@@ -477,10 +552,18 @@ void ReplicatedPG::do_op(MOSDOp *op)
   for (vector<OSDOp>::iterator p = op->ops.begin(); p != op->ops.end(); p++) {
     OSDOp& osd_op = *p;
     if (osd_op.soid.oid.name.length()) {
+      object_locator_t src_oloc = op->get_object_locator();
+      bool copy_from = (osd_op.op.op == CEPH_OSD_OP_COPY_FROM);
+      if (copy_from) {
+	// a source in another pg was fetched already; a bad one fails in do_osd_ops
+	bool local;
+	if (get_copy_source(osd_op, &src_oloc, &local) < 0 || !local)
+	  continue;
+      }
       if (!src_obc.count(osd_op.soid)) {
 	ObjectContext *sobc;
 	snapid_t ssnapid;
-	int r = find_object_context(osd_op.soid.oid, op->get_object_locator(), osd_op.soid.snap,
+	int r = find_object_context(osd_op.soid.oid, src_oloc, osd_op.soid.snap,
 				    &sobc, false, &ssnapid);
 	if (r == -EAGAIN) {
 	  // missing the specific snap we need; requeue and wait.
@@ -490,7 +573,8 @@ void ReplicatedPG::do_op(MOSDOp *op)
 	  osd->reply_op_error(op, r);
 	} else if (is_degraded_object(sobc->obs.oi.soid)) { 
 	  wait_for_degraded_object(sobc->obs.oi.soid, op);
-	} else if (sobc->obs.oi.oloc.key != obc->obs.oi.oloc.key &&
+	} else if (!copy_from &&
+		   sobc->obs.oi.oloc.key != obc->obs.oi.oloc.key &&
 		   sobc->obs.oi.oloc.key != obc->obs.oi.soid.oid.name &&
 		   sobc->obs.oi.soid.oid.name != obc->obs.oi.oloc.key) {
 	  dout(1) << " src_oid " << osd_op.soid << " oloc " << sobc->obs.oi.oloc << " != "
@@ -622,7 +706,10 @@ void ReplicatedPG::do_op(MOSDOp *op)
     MOSDOpReply *reply = ctx->reply;
     ctx->reply = NULL;
     reply->add_flags(CEPH_OSD_FLAG_ACK | CEPH_OSD_FLAG_ONDISK);
-    osd->client_messenger->send_message(reply, op->get_connection());
+    if (op->get_source().is_osd())
+      osd->cluster_messenger->send_message(reply, op->get_connection());  // a copy-from fetch
+    else
+      osd->client_messenger->send_message(reply, op->get_connection());
     op->put();
     delete ctx;
     put_object_context(obc);
@@ -854,6 +941,9 @@ ReplicatedPG::RepGather *ReplicatedPG::trim_object(const sobject_t &coid,
   if (newsnaps.empty()) {
     // remove clone
     dout(10) << coid << " snaps " << snaps << " -> " << newsnaps << " ... deleting" << dendl;
+    // so that nobody sees it while the repop is in flight, and it isn't
+    // cached once the last ref goes
+    obc->obs.exists = false;
     t->remove(coll, coid);
     t->collection_remove(coll_t(info.pgid, snaps[0]), coid);
     if (snaps.size() > 1)
@@ -972,7 +1062,7 @@ bool ReplicatedPG::snap_trimmer()
       */
     }
 
-    if (!finalizing_scrub) {
+    if (!is_scrubbing()) {
       dout(10) << "snap_trimmer posting" << dendl;
       snap_trimmer_machine.process_event(SnapTrim());
     }
@@ -1148,8 +1238,10 @@ int ReplicatedPG::do_osd_ops(OpContext *ctx, vector<OSDOp>& ops,
 
     ObjectContext *src_obc = 0;
     if (ceph_osd_op_type_multi(op.op)) {
-      src_obc = ctx->src_obc[osd_op.soid];
-      assert(src_obc);
+      map<sobject_t,ObjectContext*>::iterator q = ctx->src_obc.find(osd_op.soid);
+      if (q != ctx->src_obc.end())
+	src_obc = q->second;
+      assert(src_obc || op.op == CEPH_OSD_OP_COPY_FROM);  // remote source, fetched
     }
 
     // munge ZERO -> TRUNCATE?  (don't munge to DELETE or we risk hosing attributes)
@@ -1661,6 +1753,103 @@ int ReplicatedPG::do_osd_ops(OpContext *ctx, vector<OSDOp>& ops,
 				    op.clonerange.offset, op.clonerange.length, false);
       }
       break;
+
+    case CEPH_OSD_OP_COPY_FROM:
+      {
+	// replicas get the resulting transaction, never the op; they
+	// couldn't fetch the source themselves
+	if (ctx->op && (((MOSDOp*)ctx->op)->get_flags() & CEPH_OSD_FLAG_PARALLELEXEC)) {
+	  result = -EINVAL;
+	  break;
+	}
+
+	bufferlist data;
+	map<string,bufferlist> attrs;
+	if (src_obc) {
+	  const sobject_t& src = src_obc->obs.oi.soid;
+	  if (src_obc->obs.oi.size > g_conf->osd_copy_from_max_bytes) {
+	    dout(10) << " copy_from " << src << " is " << src_obc->obs.oi.size
+		     << " bytes, too big" << dendl;
+	    result = -EOPNOTSUPP;
+	    break;
+	  }
+	  map<string,bufferptr> attrset;
+	  dout(10) << " ondisk_read_lock for " << src << dendl;
+	  src_obc->ondisk_read_lock();
+	  result = osd->store->read(coll, src, 0, 0, data);
+	  if (result >= 0)
+	    result = osd->store->getattrs(coll, src, attrset, true);
+	  dout(10) << " ondisk_read_unlock on " << src << dendl;
+	  src_obc->ondisk_read_unlock();
+	  if (result < 0)
+	    break;
+	  for (map<string,bufferptr>::iterator q = attrset.begin(); q != attrset.end(); ++q)
+	    attrs[q->first].push_back(q->second);
+	} else {
+	  OSD::CopyFetch *f = osd->take_copy_source(ctx->reqid, osd_op.soid);
+	  if (!f) {
+	    dout(10) << " copy_from " << osd_op.soid << " was not fetched" << dendl;
+	    result = -EINVAL;
+	    break;
+	  }
+	  result = f->result;
+	  data.claim(f->data);
+	  attrs.swap(f->attrs);
+	  delete f;
+	  if (result < 0)
+	    break;
+	}
+	uint64_t len = data.length();
+	dout(10) << " copy_from " << osd_op.soid << " " << len << " bytes, "
+		 << attrs.size() << " xattrs" << dendl;
+
+	// replace data and user xattrs
+	if (obs.exists) {
+	  t.truncate(coll, soid, 0);
+	  map<string,bufferptr> old_attrs;
+	  osd->store->getattrs(coll, soid, old_attrs, true);
+	  for (map<string,bufferptr>::iterator q = old_attrs.begin(); q != old_attrs.end(); ++q)
+	    if (!attrs.count(q->first)) {
+	      string name = "_" + q->first;
+	      t.rmattr(coll, soid, name);
+	    }
+	} else {
+	  t.touch(coll, soid);
+	  maybe_created = true;
+	}
+
+	// leave zeroed runs as holes
+	map<uint64_t, uint64_t> runs;
+	get_data_runs(data.c_str(), len, ZERO_RUN_GRANULARITY, &runs);
+	for (map<uint64_t, uint64_t>::iterator q = runs.begin(); q != runs.end(); ++q) {
+	  bufferlist bl;
+	  bl.substr_of(data, q->first, q->second);
+	  t.write(coll, soid, q->first, q->second, bl);
+	}
+	t.truncate(coll, soid, len);
+
+	for (map<string,bufferlist>::iterator q = attrs.begin(); q != attrs.end(); ++q) {
+	  string name = "_" + q->first;
+	  t.setattr(coll, soid, name, q->second);
+	}
+
+	if (ssc->snapset.clones.size() && oi.size > 0) {
+	  interval_set<uint64_t> ch;
+	  ch.insert(0, oi.size);
+	  ctx->modified_ranges.union_of(ch);
+	  oi.size = 0;
+	}
+	if (len != oi.size) {
+	  ctx->new_stats.num_bytes -= oi.size;
+	  ctx->new_stats.num_kb -= SHIFT_ROUND_UP(oi.size, 10);
+	  ctx->new_stats.num_bytes += len;
+	  ctx->new_stats.num_kb += SHIFT_ROUND_UP(len, 10);
+	  oi.size = len;
+	}
+	ctx->new_stats.num_wr++;
+	ctx->new_stats.num_wr_kb += SHIFT_ROUND_UP(len, 10);
+      }
+      break;
       
     case CEPH_OSD_OP_WATCH:
       {
@@ -2560,6 +2749,7 @@ int ReplicatedPG::prepare_transaction(OpContext *ctx)
   // apply new object state.
   ctx->obc->obs = ctx->new_obs;
   ctx->obc->ssc->snapset = ctx->new_snapset;
+  scrub_note_stat_change(soid, info.stats, ctx->new_stats);
   info.stats = ctx->new_stats;
 
   return result;
@@ -2570,12 +2760,11 @@ void ReplicatedPG::log_op(vector<Log::Entry>& logv, eversion_t trim_to,
 {
   dout(10) << "log_op " << log << dendl;
 
-  bufferlist log_bl;
   for (vector<Log::Entry>::iterator p = logv.begin();
        p != logv.end();
        p++)
-    add_log_entry(*p, log_bl);
-  append_log(t, log_bl, logv[0].version);
+    add_log_entry(*p);
+  append_log(t, logv);
   trim(t, trim_to);
 
   // update the local pg, pg log
@@ -2686,8 +2875,9 @@ void ReplicatedPG::op_applied(RepGather *repop)
   repop->obc = 0;
 
   last_update_applied = repop->v;
-  if (last_update_applied == info.last_update && finalizing_scrub) {
-    dout(10) << "requeueing scrub for cleanup" << dendl;
+  if (finalizing_scrub && !scrub_primary_map_started &&
+      last_update_applied >= scrub_subset_last_update) {
+    dout(10) << "requeueing scrub for chunk" << dendl;
     osd->scrub_wq.queue(this);
   }
   update_stats();
@@ -2969,8 +3159,10 @@ ReplicatedPG::ObjectContext *ReplicatedPG::get_object_context(const sobject_t& s
     obc = p->second;
     dout(10) << "get_object_context " << soid << " " << obc->ref
 	     << " -> " << (obc->ref+1) << dendl;
+    osd->logger->inc(l_osd_obc_hit);
   } else {
     // check disk
+    osd->logger->inc(l_osd_obc_miss);
     bufferlist bv;
     int r = osd->store->getattr(coll, soid, OI_ATTR, bv);
     if (r < 0) {
@@ -3019,7 +3211,7 @@ ReplicatedPG::ObjectContext *ReplicatedPG::get_object_context(const sobject_t& s
     }
     dout(10) << "get_object_context " << soid << " read " << obc->obs.oi << dendl;
   }
-  obc->ref++;
+  obc->get();
   return obc;
 }
 
@@ -3133,18 +3325,44 @@ void ReplicatedPG::put_object_context(ObjectContext *obc)
 
   --obc->ref;
   if (obc->ref == 0) {
-    if (obc->ssc)
-      put_snapset_context(obc->ssc);
-
-    if (obc->registered)
-      object_contexts.erase(obc->obs.oi.soid);
-    delete obc;
+    // keep it around if it is the truth about an object we have.  a
+    // replica's store is changed by sub_ops without going through
+    // here, so only the primary caches.
+    if (obc->registered && obc->obs.exists && is_primary() &&
+	g_conf->osd_object_context_cache_size > 0) {
+      object_context_lru.push_front(&obc->lru_item);
+      trim_object_context_lru(g_conf->osd_object_context_cache_size);
+    } else {
+      release_object_context(obc);
+    }
 
-    if (object_contexts.empty())
+    if (!is_write_in_progress())
       kick();
   }
 }
 
+void ReplicatedPG::release_object_context(ObjectContext *obc)
+{
+  assert(obc->ref == 0);
+  assert(!obc->lru_item.is_on_list());
+  if (obc->ssc)
+    put_snapset_context(obc->ssc);
+
+  if (obc->registered)
+    object_contexts.erase(obc->obs.oi.soid);
+  delete obc;
+}
+
+void ReplicatedPG::trim_object_context_lru(unsigned max)
+{
+  while ((unsigned)object_context_lru.size() > max) {
+    ObjectContext *obc = object_context_lru.back();
+    object_context_lru.pop_back();
+    dout(20) << "trim_object_context_lru " << obc->obs.oi.soid << dendl;
+    release_object_context(obc);
+  }
+}
+
 void ReplicatedPG::put_object_contexts(map<sobject_t,ObjectContext*>& obcv)
 {
   for (map<sobject_t,ObjectContext*>::iterator p = obcv.begin(); p != obcv.end(); ++p)
@@ -3158,7 +3376,9 @@ ReplicatedPG::SnapSetContext *ReplicatedPG::get_snapset_context(const object_t&
   map<object_t, SnapSetContext*>::iterator p = snapset_contexts.find(oid);
   if (p != snapset_contexts.end()) {
     ssc = p->second;
+    osd->logger->inc(l_osd_ssc_hit);
   } else {
+    osd->logger->inc(l_osd_ssc_miss);
     bufferlist bv;
     sobject_t head(oid, CEPH_NOSNAP);
     int r = osd->store->getattr(coll, head, SS_ATTR, bv);
@@ -3179,7 +3399,7 @@ ReplicatedPG::SnapSetContext *ReplicatedPG::get_snapset_context(const object_t&
   assert(ssc);
   dout(10) << "get_snapset_context " << ssc->oid << " "
 	   << ssc->ref << " -> " << (ssc->ref+1) << dendl;
-  ssc->ref++;
+  ssc->get();
   return ssc;
 }
 
@@ -3190,9 +3410,32 @@ void ReplicatedPG::put_snapset_context(SnapSetContext *ssc)
 
   --ssc->ref;
   if (ssc->ref == 0) {
-    if (ssc->registered)
-      snapset_contexts.erase(ssc->oid);
-    delete ssc;
+    if (ssc->registered && is_primary() &&
+	g_conf->osd_object_context_cache_size > 0) {
+      snapset_context_lru.push_front(&ssc->lru_item);
+      trim_snapset_context_lru(g_conf->osd_object_context_cache_size);
+    } else {
+      release_snapset_context(ssc);
+    }
+  }
+}
+
+void ReplicatedPG::release_snapset_context(SnapSetContext *ssc)
+{
+  assert(ssc->ref == 0);
+  assert(!ssc->lru_item.is_on_list());
+  if (ssc->registered)
+    snapset_contexts.erase(ssc->oid);
+  delete ssc;
+}
+
+void ReplicatedPG::trim_snapset_context_lru(unsigned max)
+{
+  while ((unsigned)snapset_context_lru.size() > max) {
+    SnapSetContext *ssc = snapset_context_lru.back();
+    snapset_context_lru.pop_back();
+    dout(20) << "trim_snapset_context_lru " << ssc->oid << dendl;
+    release_snapset_context(ssc);
   }
 }
 
@@ -3319,10 +3562,8 @@ void ReplicatedPG::sub_op_modify_applied(RepModify *rm)
   bool done = rm->applied && rm->committed;
 
   last_update_applied = rm->op->version;
-  if (last_update_applied == info.last_update && finalizing_scrub) {
-    assert(active_rep_scrub);
+  if (active_rep_scrub && rep_scrub_ready(active_rep_scrub)) {
     osd->rep_scrub_wq.queue(active_rep_scrub);
-    active_rep_scrub->put();
     active_rep_scrub = 0;
   }
 
@@ -3589,10 +3830,6 @@ int ReplicatedPG::pull(const sobject_t& soid)
     data_subset.insert(0, (uint64_t)-1);
   }
 
-  // only pull so much at a time
-  interval_set<uint64_t> pullsub;
-  pullsub.span_of(data_subset, 0, g_conf->osd_recovery_max_chunk);
-
   // take note
   assert(pulling.count(soid) == 0);
   pull_from_peer[fromosd].insert(soid);
@@ -3600,15 +3837,53 @@ int ReplicatedPG::pull(const sobject_t& soid)
   p.version = v;
   p.from = fromosd;
   p.data_subset = data_subset;
-  p.data_subset_pulling = pullsub;
   p.need_size = need_size;
 
-  send_pull_op(soid, v, true, p.data_subset_pulling, fromosd);
+  send_pull_chunks(soid, &p, true);
   
   start_recovery_op(soid);
   return PULL_YES;
 }
 
+/*
+ * request the next chunks of an object, up to the window.  until we
+ * learn the object size we don't know where it ends, so only one chunk
+ * is outstanding then.
+ */
+void ReplicatedPG::send_pull_chunks(const sobject_t& soid, pull_info_t *pi, bool first)
+{
+  unsigned window = pi->need_size ? 1 : MAX(1, g_conf->osd_recovery_chunk_window);
+  while (pi->chunks_in_flight.size() < window) {
+    interval_set<uint64_t> sub;
+    if (first) {
+      // even if there is no data to pull, we still need the attrs
+      sub.span_of(pi->data_subset, 0, g_conf->osd_recovery_max_chunk);
+    } else {
+      if (pi->data_subset.empty() || pi->data_subset_pulling.empty() ||
+	  pi->data_subset_pulling.range_end() >= pi->data_subset.range_end())
+	break;  // all requested
+      sub.span_of(pi->data_subset, pi->data_subset_pulling.range_end(),
+		  g_conf->osd_recovery_max_chunk);
+      if (sub.empty())
+	break;
+    }
+    pi->data_subset_pulling = sub;
+    pi->chunks_in_flight.push_back(sub.size());
+    osd->note_recovery_inflight(sub.size());
+    send_pull_op(soid, pi->version, first, sub, pi->from);
+    first = false;
+  }
+}
+
+void ReplicatedPG::finish_pull(const sobject_t& soid)
+{
+  map<sobject_t, pull_info_t>::iterator p = pulling.find(soid);
+  assert(p != pulling.end());
+  osd->note_recovery_inflight(-(int64_t)chunk_bytes(p->second.chunks_in_flight));
+  pull_from_peer[p->second.from].erase(soid);
+  pulling.erase(p);
+}
+
 void ReplicatedPG::send_pull_op(const sobject_t& soid, eversion_t v, bool first,
 				const interval_set<uint64_t>& data_subset, int fromosd)
 {
@@ -3723,18 +3998,50 @@ void ReplicatedPG::push_start(const sobject_t& soid, int peer,
 			      map<sobject_t, interval_set<uint64_t> >& clone_subsets)
 {
   // take note.
+  if (pushing.count(soid) && pushing[soid].count(peer))
+    finish_push(soid, peer);  // start over
   push_info_t *pi = &pushing[soid][peer];
   pi->size = size;
   pi->version = version;
   pi->data_subset = data_subset;
   pi->clone_subsets = clone_subsets;
-
-  pi->data_subset_pushing.span_of(pi->data_subset, 0, g_conf->osd_recovery_max_chunk);
-  bool complete = pi->data_subset_pushing == pi->data_subset;
+  push_to_peer[peer].insert(soid);
 
   dout(10) << "push_start " << soid << " size " << size << " data " << data_subset
-	   << " cloning " << clone_subsets << dendl;    
-  send_push_op(soid, version, peer, size, true, complete, pi->data_subset_pushing, pi->clone_subsets);
+	   << " cloning " << clone_subsets
+	   << ", " << push_to_peer[peer].size() << " objects in flight to osd" << peer << dendl;
+  send_push_chunks(soid, peer, pi);
+}
+
+void ReplicatedPG::send_push_chunks(const sobject_t& soid, int peer, push_info_t *pi)
+{
+  unsigned window = MAX(1, g_conf->osd_recovery_chunk_window);
+  while (!pi->sent_all && pi->chunks_in_flight.size() < window) {
+    bool first = pi->data_subset_pushing.empty() && pi->chunks_in_flight.empty();
+    uint64_t from = first ? 0 : pi->data_subset_pushing.range_end();
+    pi->data_subset_pushing.span_of(pi->data_subset, from, g_conf->osd_recovery_max_chunk);
+    pi->sent_all = pi->data_subset.empty() ||
+      pi->data_subset_pushing.range_end() == pi->data_subset.range_end();
+    pi->chunks_in_flight.push_back(pi->data_subset_pushing.size());
+    osd->note_recovery_inflight(pi->data_subset_pushing.size());
+    int r = send_push_op(soid, pi->version, peer, pi->size, first, pi->sent_all,
+			 pi->data_subset_pushing, pi->clone_subsets);
+    if (r < 0) {
+      osd->note_recovery_inflight(-(int64_t)pi->chunks_in_flight.back());
+      pi->chunks_in_flight.pop_back();
+      break;
+    }
+  }
+}
+
+void ReplicatedPG::finish_push(const sobject_t& soid, int peer)
+{
+  push_info_t *pi = &pushing[soid][peer];
+  osd->note_recovery_inflight(-(int64_t)chunk_bytes(pi->chunks_in_flight));
+  pushing[soid].erase(peer);
+  push_to_peer[peer].erase(soid);
+  if (push_to_peer[peer].empty())
+    push_to_peer.erase(peer);
 }
 
 
@@ -3839,24 +4146,25 @@ void ReplicatedPG::sub_op_push_reply(MOSDSubOpReply *reply)
   } else {
     push_info_t *pi = &pushing[soid][peer];
 
-    bool complete = false;
-    if (pi->data_subset.empty() ||
-	pi->data_subset.range_end() == pi->data_subset_pushing.range_end())
-      complete = true;
+    // this chunk is no longer in flight
+    if (!pi->chunks_in_flight.empty()) {
+      osd->note_recovery_inflight(-(int64_t)pi->chunks_in_flight.front());
+      pi->chunks_in_flight.pop_front();
+    }
 
-    if (!complete) {
+    if (!pi->sent_all) {
       // push more
-      uint64_t from = pi->data_subset_pushing.range_end();
-      pi->data_subset_pushing.span_of(pi->data_subset, from, g_conf->osd_recovery_max_chunk);
-      dout(10) << " pushing more, " << pi->data_subset_pushing << " of " << pi->data_subset << dendl;
-      complete = pi->data_subset.range_end() == pi->data_subset_pushing.range_end();
-      send_push_op(soid, pi->version, peer, pi->size, false, complete,
-		   pi->data_subset_pushing, pi->clone_subsets);
+      send_push_chunks(soid, peer, pi);
+      dout(10) << " pushing more, up to " << pi->data_subset_pushing << " of " << pi->data_subset
+	       << ", " << pi->chunks_in_flight.size() << " chunks in flight" << dendl;
+    } else if (!pi->chunks_in_flight.empty()) {
+      dout(10) << " sent all of " << soid << ", waiting for " << pi->chunks_in_flight.size()
+	       << " more acks" << dendl;
     } else {
       // done!
       peer_missing[peer].got(soid, pi->version);
       
-      pushing[soid].erase(peer);
+      finish_push(soid, peer);
       pi = NULL;
       
       update_stats();
@@ -4024,6 +4332,19 @@ void ReplicatedPG::sub_op_push(MOSDSubOp *op)
       return;
     }
     pi = &pulling[soid];
+    if (op->get_source().num() != pi->from) {
+      dout(10) << " pulling from osd" << pi->from << ", not " << op->get_source()
+	       << ", ignoring" << dendl;
+      op->put();
+      return;
+    }
+
+    // this chunk is no longer in flight
+    if (!pi->chunks_in_flight.empty()) {
+      osd->note_recovery_inflight(-(int64_t)pi->chunks_in_flight.front());
+      pi->chunks_in_flight.pop_front();
+    }
+    osd->logger->inc(l_osd_pull_inb, data.length());
     
     // did we learn object size?
     if (pi->need_size) {
@@ -4237,16 +4558,16 @@ void ReplicatedPG::sub_op_push(MOSDSubOp *op)
 
     if (complete) {
       // close out pull op
-      pulling.erase(soid);
-      pull_from_peer[pi->from].erase(soid);
+      finish_pull(soid);
+      pi = NULL;
       finish_recovery_op(soid);
       
       update_stats();
     } else {
       // pull more
-      pi->data_subset_pulling.span_of(pi->data_subset, data_subset.range_end(), g_conf->osd_recovery_max_chunk);
-      dout(10) << " pulling more, " << pi->data_subset_pulling << " of " << pi->data_subset << dendl;
-      send_pull_op(soid, v, false, pi->data_subset_pulling, pi->from);
+      send_pull_chunks(soid, pi, false);
+      dout(10) << " pulling more, up to " << pi->data_subset_pulling << " of " << pi->data_subset
+	       << ", " << pi->chunks_in_flight.size() << " chunks in flight" << dendl;
     }
 
 
@@ -4295,6 +4616,16 @@ void ReplicatedPG::_failed_push(MOSDSubOp *op)
 {
   const sobject_t& soid = op->poid;
   int from = op->get_source().num();
+
+  // with several chunks in flight we may hear about the same failure more than once
+  map<sobject_t, pull_info_t>::iterator q = pulling.find(soid);
+  if (q == pulling.end() || q->second.from != from) {
+    dout(10) << "_failed_push " << soid << " from osd" << from
+	     << ", but not pulling it from there (any more)" << dendl;
+    op->put();
+    return;
+  }
+
   map<sobject_t,set<int> >::iterator p = missing_loc.find(soid);
   if (p != missing_loc.end()) {
     dout(0) << "_failed_push " << soid << " from osd" << from
@@ -4309,8 +4640,7 @@ void ReplicatedPG::_failed_push(MOSDSubOp *op)
   }
 
   finish_recovery_op(soid);  // close out this attempt,
-  pull_from_peer[from].erase(soid);
-  pulling.erase(soid);
+  finish_pull(soid);
 
   op->put();
 }
@@ -4356,6 +4686,7 @@ void ReplicatedPG::on_shutdown()
   dout(10) << "on_shutdown" << dendl;
   apply_and_flush_repops(false);
   remove_watchers();
+  clear_object_context_cache();
 }
 
 void ReplicatedPG::on_change()
@@ -4363,23 +4694,38 @@ void ReplicatedPG::on_change()
   dout(10) << "on_change" << dendl;
   apply_and_flush_repops(is_primary());
 
+  // we may be a replica now, or have a different view of what is
+  // on disk; start over.
+  clear_object_context_cache();
+
   // clear reserved scrub state
   clear_scrub_reserved();
 
   // clear scrub state
-  if (finalizing_scrub) {
+  if (scrub_started) {
     scrub_clear_state();
   } else if (is_scrubbing()) {
     state_clear(PG_STATE_SCRUBBING);
     state_clear(PG_STATE_REPAIR);
+    state_clear(PG_STATE_DEEP_SCRUB);
+  }
+  finalizing_scrub = false;
+  if (active_rep_scrub) {
+    active_rep_scrub->put();
+    active_rep_scrub = 0;
   }
 
   // take object waiters
   take_object_waiters(waiting_for_missing_object);
   take_object_waiters(waiting_for_degraded_object);
+  take_object_waiters(waiting_for_copy_source);
+  waiting_for_copy_source.clear();
+  copy_source_blocked.clear();
 
   // clear pushing/pulling maps
+  release_recovery_inflight();
   pushing.clear();
+  push_to_peer.clear();
   pulling.clear();
   pull_from_peer.clear();
 
@@ -4408,11 +4754,27 @@ void ReplicatedPG::_clear_recovery_state()
 #ifdef DEBUG_RECOVERY_OIDS
   recovering_oids.clear();
 #endif
+  release_recovery_inflight();
   pulling.clear();
   pushing.clear();
+  push_to_peer.clear();
   pull_from_peer.clear();
 }
 
+void ReplicatedPG::release_recovery_inflight()
+{
+  uint64_t bytes = 0;
+  for (map<sobject_t, pull_info_t>::iterator p = pulling.begin(); p != pulling.end(); ++p)
+    bytes += chunk_bytes(p->second.chunks_in_flight);
+  for (map<sobject_t, map<int, push_info_t> >::iterator p = pushing.begin();
+       p != pushing.end();
+       ++p)
+    for (map<int, push_info_t>::iterator q = p->second.begin(); q != p->second.end(); ++q)
+      bytes += chunk_bytes(q->second.chunks_in_flight);
+  if (bytes)
+    osd->note_recovery_inflight(-(int64_t)bytes);
+}
+
 void ReplicatedPG::check_recovery_op_pulls(const OSDMap *osdmap)
 {
   for (map<int, set<sobject_t> >::iterator j = pull_from_peer.begin();
@@ -4429,6 +4791,7 @@ void ReplicatedPG::check_recovery_op_pulls(const OSDMap *osdmap)
 	 i != j->second.end();
 	 ++i) {
       assert(pulling.count(*i) == 1);
+      osd->note_recovery_inflight(-(int64_t)chunk_bytes(pulling[*i].chunks_in_flight));
       pulling.erase(*i);
       finish_recovery_op(*i);
     }
@@ -4899,7 +5262,18 @@ int ReplicatedPG::_scrub(ScrubMap& scrubmap, int& errors, int& fixed)
       // it's unversioned.
     }
   }  
-  
+
+  scrub_cstat.add(stat);
+  dout(10) << "_scrub (" << mode << ") finish" << dendl;
+  return errors;
+}
+
+void ReplicatedPG::_scrub_finish(int& errors, int& fixed)
+{
+  bool repair = state_test(PG_STATE_REPAIR);
+  const char *mode = repair ? "repair":"scrub";
+  const pg_stat_t& stat = scrub_cstat;
+
   dout(10) << mode << " got "
 	   << stat.num_objects << "/" << info.stats.num_objects << " objects, "
 	   << stat.num_object_clones << "/" << info.stats.num_object_clones << " clones, "
@@ -4936,9 +5310,6 @@ int ReplicatedPG::_scrub(ScrubMap& scrubmap, int& errors, int& fixed)
       }
     }
   }
-
-  dout(10) << "_scrub (" << mode << ") finish" << dendl;
-  return errors;
 }
 
 /*---SnapTrimmer Logging---*/
@@ -4986,9 +5357,8 @@ boost::statechart::result ReplicatedPG::NotTrimming::react(const SnapTrim&)
   } else if (!pg->is_primary() || !pg->is_active() || !pg->is_clean()) {
     dout(10) << "NotTrimming not primary, active, clean" << dendl;
     return discard_event();
-  } else if (pg->finalizing_scrub) {
-    dout(10) << "NotTrimming finalizing scrub" << dendl;
-    pg->queue_snap_trim();
+  } else if (pg->is_scrubbing()) {
+    dout(10) << "NotTrimming scrubbing, scrub_clear_state will requeue" << dendl;
     return discard_event();
   }
 
@@ -5089,6 +5459,12 @@ boost::statechart::result ReplicatedPG::TrimmingObjects::react(const SnapTrim&)
   snapid_t &snap_to_trim = context<SnapTrimmer>().snap_to_trim;
   set<RepGather *> &repops = context<SnapTrimmer>().repops;
 
+  // Scrub may be counting these objects; it will requeue us when done.
+  if (pg->is_scrubbing()) {
+    dout(10) << "TrimmingObjects waiting for scrub" << dendl;
+    return discard_event();
+  }
+
   // Done, 
   if (position == obs_to_trim.end()) {
     post_event(SnapTrim());
@@ -99,8 +99,15 @@ public:
     int ref;
     bool registered; 
     SnapSet snapset;
+    xlist<SnapSetContext*>::item lru_item;  // on snapset_context_lru while unreferenced
 
-    SnapSetContext(const object_t& o) : oid(o), ref(0), registered(false) { }
+    SnapSetContext(const object_t& o) : oid(o), ref(0), registered(false), lru_item(this) { }
+
+    void get() {
+      if (lru_item.is_on_list())
+	lru_item.remove_myself();
+      ++ref;
+    }
   };
 
   struct ObjectState {
@@ -266,6 +273,8 @@ public:
 
     SnapSetContext *ssc;  // may be null
 
+    xlist<ObjectContext*>::item lru_item;  // on object_context_lru while unreferenced
+
     Mutex lock;
     Cond cond;
     int unstable_writes, readers, writers_waiting, readers_waiting;
@@ -280,11 +289,15 @@ public:
       lock("ReplicatedPG::ObjectContext::lock"),
       unstable_writes(0), readers(0), writers_waiting(0), readers_waiting(0) {}*/
     ObjectContext(const object_info_t &oi_, bool exists_, SnapSetContext *ssc_)
-      : ref(0), registered(false), obs(oi_, exists_), ssc(ssc_),
+      : ref(0), registered(false), obs(oi_, exists_), ssc(ssc_), lru_item(this),
       lock("ReplicatedPG::ObjectContext::lock"),
       unstable_writes(0), readers(0), writers_waiting(0), readers_waiting(0) {}
 
-    void get() { ++ref; }
+    void get() {
+      if (lru_item.is_on_list())
+	lru_item.remove_myself();
+      ++ref;
+    }
 
     // do simple synchronous mutual exclusion, for now.  now waitqueues or anything fancy.
     void ondisk_write_lock() {
@@ -489,10 +502,21 @@ protected:
   map<sobject_t, ObjectContext*> object_contexts;
   map<object_t, SnapSetContext*> snapset_contexts;
 
+  /*
+   * registered contexts nobody holds a ref on, most recently used
+   * first.  we keep up to osd_object_context_cache_size of each
+   * around on the primary so that hot objects don't go back to the
+   * store for their object_info_t and SnapSet on every op.  they are
+   * exactly what is in memory once all ops have finished, and are
+   * dropped on any interval change.
+   */
+  xlist<ObjectContext*> object_context_lru;
+  xlist<SnapSetContext*> snapset_context_lru;
+
   ObjectContext *lookup_object_context(const sobject_t& soid) {
     if (object_contexts.count(soid)) {
       ObjectContext *obc = object_contexts[soid];
-      obc->ref++;
+      obc->get();
       return obc;
     }
     return NULL;
@@ -509,6 +533,8 @@ protected:
   }
   void put_object_context(ObjectContext *obc);
   void put_object_contexts(map<sobject_t,ObjectContext*>& obcv);
+  void release_object_context(ObjectContext *obc);
+  void trim_object_context_lru(unsigned max);
   int find_object_context(const object_t& oid, const object_locator_t& oloc,
 			  snapid_t snapid, ObjectContext **pobc,
 			  bool can_create, snapid_t *psnapid=NULL);
@@ -521,19 +547,35 @@ protected:
     }
   }
   void put_snapset_context(SnapSetContext *ssc);
+  void release_snapset_context(SnapSetContext *ssc);
+  void trim_snapset_context_lru(unsigned max);
+
+  void clear_object_context_cache() {
+    trim_object_context_lru(0);
+    trim_snapset_context_lru(0);
+  }
 
   bool is_write_in_progress() {
-    return !object_contexts.empty();
+    return object_contexts.size() > (unsigned)object_context_lru.size();
   }
 
 
   
+  /*
+   * Pushes and pulls move an object in osd_recovery_max_chunk pieces,
+   * keeping up to osd_recovery_chunk_window of them in flight.  Chunks
+   * of one object all travel over the same connection and are applied
+   * in order, so the ack for the last chunk is the last ack.
+   * chunks_in_flight holds the size of each unacked chunk, oldest first.
+   */
+
   // pull
   struct pull_info_t {
     eversion_t version;
     int from;
     bool need_size;
-    interval_set<uint64_t> data_subset, data_subset_pulling;
+    interval_set<uint64_t> data_subset, data_subset_pulling;  // pulling = last chunk requested
+    list<uint64_t> chunks_in_flight;
   };
   map<sobject_t, pull_info_t> pulling;
 
@@ -544,11 +586,24 @@ protected:
   struct push_info_t {
     uint64_t size;
     eversion_t version;
-    interval_set<uint64_t> data_subset, data_subset_pushing;
+    interval_set<uint64_t> data_subset, data_subset_pushing;  // pushing = last chunk sent
     map<sobject_t, interval_set<uint64_t> > clone_subsets;
+    list<uint64_t> chunks_in_flight;
+    bool sent_all;
+    push_info_t() : size(0), sent_all(false) {}
   };
   map<sobject_t, map<int, push_info_t> > pushing;
 
+  // objects being pushed to each peer
+  map<int, set<sobject_t> > push_to_peer;
+
+  static uint64_t chunk_bytes(const list<uint64_t>& chunks) {
+    uint64_t b = 0;
+    for (list<uint64_t>::const_iterator p = chunks.begin(); p != chunks.end(); ++p)
+      b += *p;
+    return b;
+  }
+
   int recover_object_replicas(const sobject_t& soid, eversion_t v);
   void calc_head_subsets(SnapSet& snapset, const sobject_t& head,
 			 Missing& missing,
@@ -563,16 +618,28 @@ protected:
 		  uint64_t size, eversion_t version,
 		  interval_set<uint64_t> &data_subset,
 		  map<sobject_t, interval_set<uint64_t> >& clone_subsets);
+  void send_push_chunks(const sobject_t& soid, int peer, push_info_t *pi);
   int send_push_op(const sobject_t& oid, eversion_t version, int dest,
 		   uint64_t size, bool first, bool complete,
 		   interval_set<uint64_t>& data_subset, 
 		   map<sobject_t, interval_set<uint64_t> >& clone_subsets);
   void send_push_op_blank(const sobject_t& soid, int peer);
+  void finish_push(const sobject_t& soid, int peer);
 
   // Cancels/resets pulls from peer
   void check_recovery_op_pulls(const OSDMap *map);
   int pull(const sobject_t& oid);
+  void send_pull_chunks(const sobject_t& soid, pull_info_t *pi, bool first);
   void send_pull_op(const sobject_t& soid, eversion_t v, bool first, const interval_set<uint64_t>& data_subset, int fromosd);
+  void finish_pull(const sobject_t& soid);
+  void release_recovery_inflight();
+
+
+  // copy-from: ops to an object whose COPY_FROM is still fetching its
+  // source from another pg wait here, so they don't pass it
+  map<sobject_t, osd_reqid_t> copy_source_blocked;
+  map<sobject_t, list<Message*> > waiting_for_copy_source;
+  void wake_copy_source_waiters(const sobject_t& soid);
 
 
   // low level ops
@@ -688,6 +755,7 @@ protected:
 
   // -- scrub --
   virtual int _scrub(ScrubMap& map, int& errors, int& fixed);
+  virtual void _scrub_finish(int& errors, int& fixed);
 
   void apply_and_flush_repops(bool requeue);
 
@@ -700,7 +768,9 @@ protected:
 
 public:
   ReplicatedPG(OSD *o, PGPool *_pool, pg_t p, const sobject_t& oid, const sobject_t& ioid);
-  ~ReplicatedPG() {}
+  ~ReplicatedPG() {
+    clear_object_context_cache();
+  }
 
 
   void do_op(MOSDOp *op);
@@ -714,6 +784,8 @@ public:
   bool snap_trimmer();
   int do_osd_ops(OpContext *ctx, vector<OSDOp>& ops,
 		 bufferlist& odata);
+  int get_copy_source(OSDOp& osd_op, object_locator_t *src_oloc, bool *local);
+  bool wait_for_copy_source(MOSDOp *op);
   void do_osd_op_effects(OpContext *ctx);
 private:
   struct NotTrimming;
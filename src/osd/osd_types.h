@@ -563,6 +563,7 @@ inline ostream& operator<<(ostream& out, const osd_stat_t& s) {
 #define PG_STATE_PEERING      (1<<12) // pg is (re)peering
 #define PG_STATE_REPAIR       (1<<13) // pg should repair on next scrub
 #define PG_STATE_SCANNING     (1<<14) // scanning content to generate backlog
+#define PG_STATE_DEEP_SCRUB   (1<<15) // deep scrub: also check object data digests
 
 static inline std::string pg_state_string(int state)
 {
@@ -597,6 +598,8 @@ static inline std::string pg_state_string(int state)
     oss << "repair+";
   if (state & PG_STATE_SCANNING)
     oss << "scanning+";
+  if (state & PG_STATE_DEEP_SCRUB)
+    oss << "deep+";
   string ret(oss.str());
   if (ret.length() > 0)
     ret.resize(ret.length() - 1);
@@ -1530,15 +1533,29 @@ struct ScrubMap {
     uint64_t size;
     bool negative;
     map<string,bufferptr> attrs;
+    __u32 digest;          // crc32c of the data, for deep scrub
+    bool digest_present;
+    bool read_error;       // deep scrub could not read the data
 
-    object(): size(0),negative(0),attrs() {}
+    object(): size(0),negative(0),attrs(),
+	      digest(0),digest_present(false),read_error(false) {}
 
-    void encode(bufferlist& bl) const {
-      __u8 struct_v = 1;
+    // v1 decoders don't skip trailing fields; only send v2 to peers
+    // with CEPH_FEATURE_DEEP_SCRUB
+    void encode(bufferlist& bl, uint64_t features) const {
+      __u8 struct_v = (features & CEPH_FEATURE_DEEP_SCRUB) ? 2 : 1;
       ::encode(struct_v, bl);
       ::encode(size, bl);
       ::encode(negative, bl);
       ::encode(attrs, bl);
+      if (struct_v >= 2) {
+	::encode(digest, bl);
+	::encode(digest_present, bl);
+	::encode(read_error, bl);
+      }
+    }
+    void encode(bufferlist& bl) const {
+      encode(bl, -1ull);
     }
     void decode(bufferlist::iterator& bl) {
       __u8 struct_v;
@@ -1546,6 +1563,11 @@ struct ScrubMap {
       ::decode(size, bl);
       ::decode(negative, bl);
       ::decode(attrs, bl);
+      if (struct_v >= 2) {
+	::decode(digest, bl);
+	::decode(digest_present, bl);
+	::decode(read_error, bl);
+      }
     }
   };
   WRITE_CLASS_ENCODER(object)
@@ -1577,15 +1599,25 @@ struct ScrubMap {
   }
           
 
-  void encode(bufferlist& bl) const {
+  void encode(bufferlist& bl, uint64_t features) const {
     __u8 struct_v = 1;
     ::encode(struct_v, bl);
-    ::encode(objects, bl);
+    __u32 n = objects.size();
+    ::encode(n, bl);
+    for (map<sobject_t,object>::const_iterator p = objects.begin();
+	 p != objects.end();
+	 ++p) {
+      ::encode(p->first, bl);
+      p->second.encode(bl, features);
+    }
     ::encode(attrs, bl);
     ::encode(logbl, bl);
     ::encode(valid_through, bl);
     ::encode(incr_since, bl);
   }
+  void encode(bufferlist& bl) const {
+    encode(bl, -1ull);
+  }
   void decode(bufferlist::iterator& bl) {
     __u8 struct_v;
     ::decode(struct_v, bl);
@@ -1669,6 +1701,9 @@ inline ostream& operator<<(ostream& out, const OSDOp& op) {
       out << " v" << op.op.watch.ver
 	  << " of " << op.soid;
       break;
+    case CEPH_OSD_OP_COPY_FROM:
+      out << " " << op.soid;
+      break;
     case CEPH_OSD_OP_SRC_CMPXATTR:
       out << " " << op.soid;
       if (op.op.xattr.name_len && op.data.length()) {
@@ -305,7 +305,12 @@ void Filer::_do_purge_range(PurgeRange *pr, int fin)
 
 // -----------------------
 
-void Filer::file_to_extents(inodeno_t ino, ceph_file_layout *layout,
+// static; there's no objecter to get a name from
+#undef dout_prefix
+#define dout_prefix *_dout << "filer "
+
+void Filer::file_to_extents(CephContext *cct, inodeno_t ino,
+			    ceph_file_layout *layout,
                             uint64_t offset, uint64_t len,
                             vector<ObjectExtent>& extents)
 {
@@ -345,7 +350,7 @@ void Filer::file_to_extents(inodeno_t ino, ceph_file_layout *layout,
     else {
       ex = &object_extents[oid];
       ex->oid = oid;
-      ex->oloc = objecter->osdmap->file_to_object_locator(*layout);
+      ex->oloc = OSDMap::file_to_object_locator(*layout);
     }
     
     // map range into object
@@ -98,11 +98,18 @@ class Filer {
 
   /*
    * map (ino, layout, offset, len) to a (list of) OSDExtents (byte
-   * ranges in objects on (primary) osds)
+   * ranges in objects on (primary) osds).  this is pure striping math;
+   * the static version can be used without an Objecter.
    */
+  static void file_to_extents(CephContext *cct, inodeno_t ino,
+			      ceph_file_layout *layout,
+			      uint64_t offset, uint64_t len,
+			      vector<ObjectExtent>& extents);
   void file_to_extents(inodeno_t ino, ceph_file_layout *layout,
 		       uint64_t offset, uint64_t len,
-		       vector<ObjectExtent>& extents);
+		       vector<ObjectExtent>& extents) {
+    file_to_extents(cct, ino, layout, offset, len, extents);
+  }
 
 
   
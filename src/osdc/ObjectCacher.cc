@@ -1,9 +1,8 @@
 // -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*- 
 // vim: ts=8 sw=2 smarttab
 
-#include "msg/Messenger.h"
 #include "ObjectCacher.h"
-#include "Objecter.h"
+#include "WritebackHandler.h"
 
 
 
@@ -14,12 +13,17 @@
 
 #define DOUT_SUBSYS objectcacher
 #undef dout_prefix
-#define dout_prefix *_dout << oc->objecter->messenger->get_myname() << ".objectcacher.object(" << oid << ") "
+#define dout_prefix *_dout << oc->name << ".objectcacher.object(" << oid << ") "
 
 ObjectCacher::
-ObjectCacher(CephContext *cct_, Objecter *o, Mutex& l, flush_set_callback_t flush_callback,
-	       flush_set_callback_t commit_callback, void *callback_arg) : 
-    cct(cct_), objecter(o), filer(o), lock(l),
+ObjectCacher(CephContext *cct_, string name_, WritebackHandler& wb, Mutex& l,
+	     flush_set_callback_t flush_callback,
+	     flush_set_callback_t commit_callback, void *callback_arg,
+	     uint64_t max_size_, uint64_t max_dirty_, uint64_t target_dirty_,
+	     double max_dirty_age_) :
+    cct(cct_), name(name_), writeback_handler(wb), lock(l),
+    max_dirty(max_dirty_), target_dirty(target_dirty_), max_size(max_size_),
+    max_dirty_age(max_dirty_age_),
     flush_set_callback(flush_callback), commit_set_callback(commit_callback), flush_set_callback_arg(callback_arg),
     flusher_stop(false), flusher_thread(this),
     stat_waiter(0),
@@ -424,7 +428,7 @@ void ObjectCacher::Object::truncate(loff_t s)
 /*** ObjectCacher ***/
 
 #undef dout_prefix
-#define dout_prefix *_dout << objecter->messenger->get_myname() << ".objectcacher "
+#define dout_prefix *_dout << name << ".objectcacher "
 
 
 /* private */
@@ -455,11 +459,10 @@ void ObjectCacher::bh_read(BufferHead *bh)
   ObjectSet *oset = bh->ob->oset;
 
   // go
-  objecter->read_trunc(bh->ob->get_oid(), bh->ob->get_oloc(), 
-		 bh->start(), bh->length(), bh->ob->get_snap(),
-		 &onfinish->bl, 0,
-		 oset->truncate_size, oset->truncate_seq,
-		 onfinish);
+  writeback_handler.read(bh->ob->get_oid(), bh->ob->get_oloc(),
+			 bh->start(), bh->length(), bh->ob->get_snap(),
+			 &onfinish->bl, oset->truncate_size, oset->truncate_seq,
+			 onfinish);
 }
 
 void ObjectCacher::bh_read_finish(int poolid, sobject_t oid, loff_t start, uint64_t length, bufferlist &bl)
@@ -551,11 +554,11 @@ void ObjectCacher::bh_write(BufferHead *bh)
   ObjectSet *oset = bh->ob->oset;
 
   // go
-  tid_t tid = objecter->write_trunc(bh->ob->get_oid(), bh->ob->get_oloc(),
-			      bh->start(), bh->length(),
-			      bh->snapc, bh->bl, bh->last_write, 0,
-			      oset->truncate_size, oset->truncate_seq,
-			      onack, oncommit);
+  tid_t tid = writeback_handler.write(bh->ob->get_oid(), bh->ob->get_oloc(),
+				      bh->start(), bh->length(),
+				      bh->snapc, bh->bl, bh->last_write,
+				      oset->truncate_size, oset->truncate_seq,
+				      onack, oncommit);
 
   // set bh last_write_tid
   onack->tid = tid;
@@ -745,7 +748,6 @@ void ObjectCacher::bh_write_commit(int poolid, sobject_t oid, loff_t start, uint
 void ObjectCacher::flush(loff_t amount)
 {
   utime_t cutoff = ceph_clock_now(cct);
-  //cutoff.sec_ref() -= cct->_conf->client_oc_max_dirty_age;
 
   ldout(cct, 10) << "flush " << amount << dendl;
   
@@ -769,7 +771,7 @@ void ObjectCacher::flush(loff_t amount)
 void ObjectCacher::trim(loff_t max)
 {
   if (max < 0) 
-    max = cct->_conf->client_oc_size;
+    max = max_size;
   
   ldout(cct, 10) << "trim  start: max " << max 
            << "  clean " << get_stat_clean()
@@ -1029,13 +1031,12 @@ int ObjectCacher::writex(OSDWrite *wr, ObjectSet *oset)
 bool ObjectCacher::wait_for_write(uint64_t len, Mutex& lock)
 {
   int blocked = 0;
-  const md_config_t *conf = cct->_conf;
 
   // wait for writeback?
-  while (get_stat_dirty() + get_stat_tx() >= conf->client_oc_max_dirty) {
+  while (get_stat_dirty() + get_stat_tx() >= (loff_t)max_dirty) {
     ldout(cct, 10) << "wait_for_write waiting on " << len << ", dirty|tx " 
 	     << (get_stat_dirty() + get_stat_tx()) 
-	     << " >= " << conf->client_oc_max_dirty 
+	     << " >= " << max_dirty
 	     << dendl;
     flusher_cond.Signal();
     stat_waiter++;
@@ -1046,9 +1047,9 @@ bool ObjectCacher::wait_for_write(uint64_t len, Mutex& lock)
   }
 
   // start writeback anyway?
-  if (get_stat_dirty() > conf->client_oc_target_dirty) {
+  if (get_stat_dirty() > (loff_t)target_dirty) {
     ldout(cct, 10) << "wait_for_write " << get_stat_dirty() << " > target "
-	     << conf->client_oc_target_dirty << ", nudging flusher" << dendl;
+	     << target_dirty << ", nudging flusher" << dendl;
     flusher_cond.Signal();
   }
   return blocked;
@@ -1056,33 +1057,32 @@ bool ObjectCacher::wait_for_write(uint64_t len, Mutex& lock)
 
 void ObjectCacher::flusher_entry()
 {
-  const md_config_t *conf = cct->_conf;
   ldout(cct, 10) << "flusher start" << dendl;
   lock.Lock();
   while (!flusher_stop) {
     while (!flusher_stop) {
       loff_t all = get_stat_tx() + get_stat_rx() + get_stat_clean() + get_stat_dirty();
       ldout(cct, 11) << "flusher "
-               << all << " / " << conf->client_oc_size << ":  "
+               << all << " / " << max_size << ":  "
                << get_stat_tx() << " tx, "
                << get_stat_rx() << " rx, "
                << get_stat_clean() << " clean, "
                << get_stat_dirty() << " dirty ("
-	       << conf->client_oc_target_dirty << " target, "
-	       << conf->client_oc_max_dirty << " max)"
+	       << target_dirty << " target, "
+	       << max_dirty << " max)"
                << dendl;
-      if (get_stat_dirty() > conf->client_oc_target_dirty) {
+      if (get_stat_dirty() > (loff_t)target_dirty) {
         // flush some dirty pages
         ldout(cct, 10) << "flusher " 
                  << get_stat_dirty() << " dirty > target "
-		 << conf->client_oc_target_dirty
+		 << target_dirty
                  << ", flushing some dirty bhs" << dendl;
-        flush(get_stat_dirty() - conf->client_oc_target_dirty);
+        flush(get_stat_dirty() - target_dirty);
       }
       else {
         // check tail of lru for old dirty items
         utime_t cutoff = ceph_clock_now(cct);
-        cutoff.sec_ref()--;
+        cutoff -= max_dirty_age;
         BufferHead *bh = 0;
         while ((bh = (BufferHead*)lru_dirty.lru_get_next_expire()) != 0 &&
                bh->last_write < cutoff) {
@@ -1114,11 +1114,11 @@ int ObjectCacher::atomic_sync_readx(OSDRead *rd, ObjectSet *oset, Mutex& lock)
     Mutex flock("ObjectCacher::atomic_sync_readx flock 1");
     Cond cond;
     bool done = false;
-    objecter->read_trunc(rd->extents[0].oid, rd->extents[0].oloc, 
-		   rd->extents[0].offset, rd->extents[0].length,
-		   rd->snap, rd->bl, 0,
-		   oset->truncate_size, oset->truncate_seq,
-		   new C_SafeCond(&flock, &cond, &done));
+    writeback_handler.read(rd->extents[0].oid, rd->extents[0].oloc,
+			   rd->extents[0].offset, rd->extents[0].length,
+			   rd->snap, rd->bl,
+			   oset->truncate_size, oset->truncate_seq,
+			   new C_SafeCond(&flock, &cond, &done));
 
     // block
     while (!done) cond.Wait(flock);
@@ -1196,9 +1196,11 @@ int ObjectCacher::atomic_sync_writex(OSDWrite *wr, ObjectSet *oset, Mutex& lock)
       Mutex flock("ObjectCacher::atomic_sync_writex flock");
       Cond cond;
       bool done = false;
-      objecter->sg_write_trunc(wr->extents, wr->snapc, wr->bl, wr->mtime, 0,
-			 oset->truncate_size, oset->truncate_seq,
-			 new C_SafeCond(&flock, &cond, &done), 0);
+      ObjectExtent& ex = wr->extents.front();
+      writeback_handler.write(ex.oid, ex.oloc, ex.offset, ex.length,
+			      wr->snapc, wr->bl, wr->mtime,
+			      oset->truncate_size, oset->truncate_seq,
+			      new C_SafeCond(&flock, &cond, &done), NULL);
       
       // block
       while (!done) cond.Wait(flock);
@@ -1264,7 +1266,7 @@ void ObjectCacher::rdlock(Object *o)
     
     commit->tid = 
       ack->tid = 
-      o->last_write_tid = objecter->lock(o->get_oid(), o->get_oloc(), CEPH_OSD_OP_RDLOCK, 0, ack, commit);
+      o->last_write_tid = writeback_handler.lock(o->get_oid(), o->get_oloc(), CEPH_OSD_OP_RDLOCK, 0, ack, commit);
   }
   
   // stake our claim.
@@ -1309,7 +1311,7 @@ void ObjectCacher::wrlock(Object *o)
     
     commit->tid = 
       ack->tid = 
-      o->last_write_tid = objecter->lock(o->get_oid(), o->get_oloc(), op, 0, ack, commit);
+      o->last_write_tid = writeback_handler.lock(o->get_oid(), o->get_oloc(), op, 0, ack, commit);
   }
   
   // stake our claim.
@@ -1354,7 +1356,7 @@ void ObjectCacher::rdunlock(Object *o)
                                             o->get_soid(), 0, 0);
   commit->tid = 
     lockack->tid = 
-    o->last_write_tid = objecter->lock(o->get_oid(), o->get_oloc(), CEPH_OSD_OP_RDUNLOCK, 0, lockack, commit);
+    o->last_write_tid = writeback_handler.lock(o->get_oid(), o->get_oloc(), CEPH_OSD_OP_RDUNLOCK, 0, lockack, commit);
 }
 
 void ObjectCacher::wrunlock(Object *o)
@@ -1387,7 +1389,7 @@ void ObjectCacher::wrunlock(Object *o)
                                             o->get_soid(), 0, 0);
   commit->tid = 
     lockack->tid = 
-    o->last_write_tid = objecter->lock(o->get_oid(), o->get_oloc(), op, 0, lockack, commit);
+    o->last_write_tid = writeback_handler.lock(o->get_oid(), o->get_oloc(), op, 0, lockack, commit);
 }
 
 
@@ -1508,13 +1510,13 @@ bool ObjectCacher::flush_set(ObjectSet *oset, Context *onfinish)
         ob->waitfor_ack[ob->last_write_tid].push_back(gather.new_sub());
     }
   }
-  if (onfinish != NULL)
-    gather.activate();
-  
   if (safe) {
     ldout(cct, 10) << "flush_set " << oset << " has no dirty|tx bhs" << dendl;
+    gather.set_finisher(NULL);  // caller still owns onfinish
     return true;
   }
+  if (onfinish != NULL)
+    gather.activate();
   return false;
 }
 
@@ -1552,12 +1554,12 @@ bool ObjectCacher::commit_set(ObjectSet *oset, Context *onfinish)
         ob->waitfor_commit[ob->last_write_tid].push_back(gather.new_sub());
     }
   }
-  gather.activate();
-
   if (safe) {
     ldout(cct, 10) << "commit_set " << oset << " all committed" << dendl;
+    gather.set_finisher(NULL);  // caller still owns onfinish
     return true;
   }
+  gather.activate();
   return false;
 }
 
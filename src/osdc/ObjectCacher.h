@@ -11,11 +11,10 @@
 #include "common/Cond.h"
 #include "common/Thread.h"
 
-#include "Objecter.h"
 #include "Filer.h"
+#include "WritebackHandler.h"
 
 class CephContext;
-class Objecter;
 
 class ObjectCacher {
  public:
@@ -269,11 +268,14 @@ class ObjectCacher {
   // ******* ObjectCacher *********
   // ObjectCacher fields
  public:
-  Objecter *objecter;
-  Filer filer;
+  string name;
+  WritebackHandler& writeback_handler;
 
  private:
   Mutex& lock;
+
+  uint64_t max_dirty, target_dirty, max_size;
+  double max_dirty_age;
   
   flush_set_callback_t flush_set_callback, commit_set_callback;
   void *flush_set_callback_arg;
@@ -527,10 +529,12 @@ class ObjectCacher {
 
 
  public:
-  ObjectCacher(CephContext *cct_, Objecter *o, Mutex& l,
+  ObjectCacher(CephContext *cct_, string name, WritebackHandler& wb, Mutex& l,
 	       flush_set_callback_t flush_callback,
 	       flush_set_callback_t commit_callback,
-	       void *callback_arg);
+	       void *callback_arg,
+	       uint64_t max_size, uint64_t max_dirty, uint64_t target_dirty,
+	       double max_dirty_age);
   ~ObjectCacher() {
     // we should be empty.
     for (vector<hash_map<sobject_t, Object *> >::iterator i = objects.begin();
@@ -611,7 +615,7 @@ class ObjectCacher {
   int file_is_cached(ObjectSet *oset, ceph_file_layout *layout, snapid_t snapid,
 		     loff_t offset, uint64_t len) {
     vector<ObjectExtent> extents;
-    filer.file_to_extents(oset->ino, layout, offset, len, extents);
+    Filer::file_to_extents(cct, oset->ino, layout, offset, len, extents);
     return is_cached(oset, extents, snapid);
   }
 
@@ -621,7 +625,7 @@ class ObjectCacher {
 		int flags,
                 Context *onfinish) {
     OSDRead *rd = prepare_read(snapid, bl, flags);
-    filer.file_to_extents(oset->ino, layout, offset, len, rd->extents);
+    Filer::file_to_extents(cct, oset->ino, layout, offset, len, rd->extents);
     return readx(rd, oset, onfinish);
   }
 
@@ -629,7 +633,7 @@ class ObjectCacher {
                  loff_t offset, uint64_t len, 
                  bufferlist& bl, utime_t mtime, int flags) {
     OSDWrite *wr = prepare_write(snapc, bl, mtime, flags);
-    filer.file_to_extents(oset->ino, layout, offset, len, wr->extents);
+    Filer::file_to_extents(cct, oset->ino, layout, offset, len, wr->extents);
     return writex(wr, oset);
   }
 
@@ -643,7 +647,7 @@ class ObjectCacher {
                             bufferlist *bl, int flags,
                             Mutex &lock) {
     OSDRead *rd = prepare_read(snapid, bl, flags);
-    filer.file_to_extents(oset->ino, layout, offset, len, rd->extents);
+    Filer::file_to_extents(cct, oset->ino, layout, offset, len, rd->extents);
     return atomic_sync_readx(rd, oset, lock);
   }
 
@@ -653,7 +657,7 @@ class ObjectCacher {
                              bufferlist& bl, utime_t mtime, int flags,
                              Mutex &lock) {
     OSDWrite *wr = prepare_write(snapc, bl, mtime, flags);
-    filer.file_to_extents(oset->ino, layout, offset, len, wr->extents);
+    Filer::file_to_extents(cct, oset->ino, layout, offset, len, wr->extents);
     return atomic_sync_writex(wr, oset, lock);
   }
 
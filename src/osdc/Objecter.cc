@@ -226,6 +226,11 @@ void Objecter::handle_osd_map(MOSDMap *m)
 	  maybe_request_map();
 	  break;
 	}
+
+	// with enough ops in flight, a table of every pg is cheaper than
+	// running crush for each op below
+	if (ops.size() + linger_ops.size() >= osdmap->get_num_pgs())
+	  osdmap->update_mapping(cct->_conf->osd_map_mapping_threads);
 	
 	// check for changed linger mappings (_before_ regular ops)
 	for (map<tid_t,LingerOp*>::iterator p = linger_ops.begin();
@@ -868,6 +873,17 @@ void Objecter::handle_osd_op_reply(MOSDOpReply *m)
     return;
   }
 
+  if (rc < 0 && !m->get_connection()->has_feature(CEPH_FEATURE_OSD_COPY_FROM)) {
+    // an osd that predates copy_from fails it however its source lookup
+    // went (usually ENOENT); make sure the caller falls back
+    for (vector<OSDOp>::iterator p = op->ops.begin(); p != op->ops.end(); ++p)
+      if (p->op.op == CEPH_OSD_OP_COPY_FROM) {
+	ldout(cct, 7) << " osd doesn't support copy_from, got " << rc << dendl;
+	rc = -EOPNOTSUPP;
+	break;
+      }
+  }
+
   if (op->objver)
     *op->objver = m->get_version();
   if (op->reply_epoch)
@@ -181,6 +181,14 @@ struct ObjectOperation {
     add_clone_range(CEPH_OSD_OP_CLONERANGE, dst_offset, len, src_oid, src_offset, CEPH_NOSNAP);
   }
 
+  // replace data and user xattrs with those of src_oid (which may live in
+  // another pg or pool; the osd fetches it)
+  void copy_from(const object_t& src_oid, const object_locator_t& src_oloc, snapid_t src_snapid) {
+    OSDOp& o = add_op(CEPH_OSD_OP_COPY_FROM);
+    o.soid = sobject_t(src_oid, src_snapid);
+    ::encode(src_oloc, o.data);
+  }
+
   // object attrs
   void getxattr(const char *name) {
     bufferlist bl;
@@ -0,0 +1,45 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+#ifndef CEPH_OSDC_OBJECTERWRITEBACKHANDLER_H
+#define CEPH_OSDC_OBJECTERWRITEBACKHANDLER_H
+
+#include "osdc/Objecter.h"
+#include "osdc/WritebackHandler.h"
+
+/*
+ * Objecter-backed writeback.  Objecter callbacks already run under the
+ * lock the Objecter was built with, so this only works if that's the
+ * same lock the ObjectCacher uses (as it is in the Client).
+ */
+class ObjecterWriteback : public WritebackHandler {
+ public:
+  ObjecterWriteback(Objecter *o) : objecter(o) {}
+  virtual ~ObjecterWriteback() {}
+
+  virtual tid_t read(const object_t& oid, const object_locator_t& oloc,
+		     uint64_t off, uint64_t len, snapid_t snapid,
+		     bufferlist *pbl, uint64_t trunc_size, __u32 trunc_seq,
+		     Context *onfinish) {
+    return objecter->read_trunc(oid, oloc, off, len, snapid, pbl, 0,
+				trunc_size, trunc_seq, onfinish);
+  }
+
+  virtual tid_t write(const object_t& oid, const object_locator_t& oloc,
+		      uint64_t off, uint64_t len, const SnapContext& snapc,
+		      const bufferlist &bl, utime_t mtime,
+		      uint64_t trunc_size, __u32 trunc_seq,
+		      Context *onack, Context *oncommit) {
+    return objecter->write_trunc(oid, oloc, off, len, snapc, bl, mtime, 0,
+				 trunc_size, trunc_seq, onack, oncommit);
+  }
+
+  virtual tid_t lock(const object_t& oid, const object_locator_t& oloc,
+		     int op, int flags, Context *onack, Context *oncommit) {
+    return objecter->lock(oid, oloc, op, flags, onack, oncommit);
+  }
+
+ private:
+  Objecter *objecter;
+};
+
+#endif
@@ -0,0 +1,37 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+#ifndef CEPH_OSDC_WRITEBACKHANDLER_H
+#define CEPH_OSDC_WRITEBACKHANDLER_H
+
+#include "include/Context.h"
+#include "include/types.h"
+#include "osd/osd_types.h"
+
+/*
+ * WritebackHandler - how the ObjectCacher talks to the osds.
+ *
+ * The Client hands it the Objecter directly (ObjecterWriteback); librbd
+ * only has the public librados api and goes through that instead.  The
+ * ObjectCacher calls these with its lock held, and expects the Contexts
+ * to be completed with that same lock held.  Returned tids must increase
+ * monotonically.
+ */
+class WritebackHandler {
+ public:
+  WritebackHandler() {}
+  virtual ~WritebackHandler() {}
+
+  virtual tid_t read(const object_t& oid, const object_locator_t& oloc,
+		     uint64_t off, uint64_t len, snapid_t snapid,
+		     bufferlist *pbl, uint64_t trunc_size, __u32 trunc_seq,
+		     Context *onfinish) = 0;
+  virtual tid_t write(const object_t& oid, const object_locator_t& oloc,
+		      uint64_t off, uint64_t len, const SnapContext& snapc,
+		      const bufferlist &bl, utime_t mtime,
+		      uint64_t trunc_size, __u32 trunc_seq,
+		      Context *onack, Context *oncommit) = 0;
+  virtual tid_t lock(const object_t& oid, const object_locator_t& oloc,
+		     int op, int flags, Context *onack, Context *oncommit) = 0;
+};
+
+#endif
@@ -21,12 +21,14 @@
 #include "global/global_init.h"
 #include "common/safe_io.h"
 #include "common/secret.h"
+#include "common/zero_runs.h"
 #include "include/rados/librados.hpp"
 #include "include/rbd/librbd.hpp"
 #include "include/byteorder.h"
 
 #include "include/intarith.h"
 
+#include <deque>
 #include <dirent.h>
 #include <errno.h>
 #include <inttypes.h>
@@ -65,6 +67,8 @@ void usage()
        << "  export [image-name] [dest-path]           export image to file\n"
        << "  import [path] [dst-image]                 import image from file (dest defaults\n"
        << "                                            as the filename part of file)\n"
+       << "  clone <--snap=name> [parent-image] [dest-image]\n"
+       << "                                            clone a snapshot as a new image\n"
        << "  <cp | copy> [src-image] [dest-image]      copy image to dest\n"
        << "  <mv | rename> [src-image] [dest-image]    copy image to dest\n"
        << "  snap ls [image-name]                      dump list of image snapshots\n"
@@ -85,6 +89,7 @@ void usage()
        << "  --dest-pool <name>           destination pool name\n"
        << "  --path <path-name>           path name for import/export (if not specified)\n"
        << "  --size <size in MB>          size parameter for create and resize commands\n"
+       << "  --object-map                 track which objects exist, for create and import\n"
        << "\n"
        << "For the map command:\n"
        << "  --user <username>            rados user to authenticate as\n"
@@ -127,9 +132,20 @@ static int do_list(librbd::RBD &rbd, librados::IoCtx& io_ctx)
 }
 
 static int do_create(librbd::RBD &rbd, librados::IoCtx& io_ctx,
-		     const char *imgname, uint64_t size, int *order)
+		     const char *imgname, uint64_t size, uint64_t features, int *order)
 {
-  int r = rbd.create(io_ctx, imgname, size, order);
+  int r = rbd.create2(io_ctx, imgname, size, features, order);
+  if (r < 0)
+    return r;
+  return 0;
+}
+
+static int do_clone(librbd::RBD &rbd, librados::IoCtx& p_ioctx,
+		    const char *p_name, const char *p_snapname,
+		    librados::IoCtx& c_ioctx, const char *c_name,
+		    uint64_t features, int *c_order)
+{
+  int r = rbd.clone(p_ioctx, p_name, p_snapname, c_ioctx, c_name, features, c_order);
   if (r < 0)
     return r;
   return 0;
@@ -152,6 +168,26 @@ static int do_show_info(const char *imgname, librbd::Image& image)
     return r;
 
   print_info(imgname, info);
+
+  uint64_t features;
+  r = image.get_features(&features);
+  if (r < 0)
+    return r;
+  if (features) {
+    cout << "\tfeatures:";
+    if (features & RBD_FEATURE_OBJECT_MAP)
+      cout << " object-map";
+    if (features & RBD_FEATURE_LAYERING)
+      cout << " layering";
+    cout << std::endl;
+  }
+  if (features & RBD_FEATURE_OBJECT_MAP) {
+    uint64_t used;
+    r = image.get_used_size(&used);
+    if (r < 0)
+      return r;
+    cout << "\tused " << prettybyte_t(used) << std::endl;
+  }
   return 0;
 }
 
@@ -213,51 +249,146 @@ static int do_rollback_snap(librbd::Image& image, const char *snapname)
   return 0;
 }
 
-static int export_read_cb(uint64_t ofs, size_t len, const char *buf, void *arg)
-{
-  ssize_t ret;
-  int fd = *(int *)arg;
+class MyProgressContext : public librbd::ProgressContext {
+  const char *operation;
+  utime_t start;
+  uint64_t last_offset;
+  int last_pc;
+
+  void print(int pc) {
+    double elapsed = ceph_clock_now(g_ceph_context) - start;
+    cerr << "\r" << operation << ": " << pc << "% complete";
+    if (elapsed > 0)
+      cerr << ", " << (int)((double)last_offset / elapsed / (1 << 20)) << " MB/s";
+  }
 
-  if (!buf) /* a hole */
+public:
+  MyProgressContext(const char *o)
+    : operation(o), start(ceph_clock_now(g_ceph_context)),
+      last_offset(0), last_pc(-1) {}
+
+  int update_progress(uint64_t offset, uint64_t total) {
+    int pc = total ? (offset * 100ull / total) : 0;
+    last_offset = offset;
+    if (pc > last_pc) {
+      print(pc);
+      cerr.flush();
+      last_pc = pc;
+    }
     return 0;
+  }
+  void finish() {
+    print(100);
+    cerr << "...done." << std::endl;
+  }
+  void fail() {
+    print(MAX(last_pc, 0));
+    cerr << "...failed." << std::endl;
+  }
+};
 
-  ret = lseek64(fd, ofs, SEEK_SET);
-  if (ret < 0)
-    return -errno;
-  ret = write(fd, buf, len);
-  if (ret < 0)
-    return -errno;
+static unsigned concurrent_ops()
+{
+  return MAX(1, g_conf->rbd_concurrent_ops);
+}
 
-  cerr << "writing " << len << " bytes at ofs " << ofs << std::endl;
+/*
+ * write out the non-zero parts of buf, leaving the zeroed ones as holes
+ * (the file is ftruncate()d to the full image size afterwards)
+ */
+static int export_write(int fd, uint64_t ofs, const char *buf, size_t len)
+{
+  map<uint64_t, uint64_t> runs;
+  get_data_runs(buf, len, ZERO_RUN_GRANULARITY, &runs);
+  for (map<uint64_t, uint64_t>::iterator p = runs.begin(); p != runs.end(); ++p) {
+    int r = safe_pwrite(fd, buf + p->first, p->second, ofs + p->first);
+    if (r < 0)
+      return r;
+  }
   return 0;
 }
 
+struct ExportChunk {
+  uint64_t ofs;
+  size_t len;
+  bufferlist bl;
+  librbd::RBD::AioCompletion *c;
+};
+
 static int do_export(librbd::Image& image, const char *path)
 {
   int64_t r;
   librbd::image_info_t info;
-  bufferlist bl;
+  MyProgressContext pc("Exporting image");
   int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
   if (fd < 0)
     return -errno;
 
   r = image.stat(info, sizeof(info));
-  if (r < 0)
-    return r;
-
-  r = image.read_iterate(0, info.size, export_read_cb, (void *)&fd);
-  if (r < 0)
+  if (r < 0) {
+    close(fd);
     return r;
+  }
 
-  r = write(fd, bl.c_str(), bl.length());
-  if (r < 0)
+  // one object per read, with up to rbd_concurrent_ops of them in flight;
+  // retire them in order so we only ever wait on the oldest
+  uint64_t period = info.obj_size;
+  unsigned max_ops = concurrent_ops();
+  std::deque<ExportChunk*> in_flight;
+  uint64_t ofs = 0;
+  r = 0;
+  while (!in_flight.empty() || (r == 0 && ofs < info.size)) {
+    while (r == 0 && ofs < info.size && in_flight.size() < max_ops) {
+      ExportChunk *e = new ExportChunk;
+      e->ofs = ofs;
+      e->len = MIN(period, info.size - ofs);
+      e->c = new librbd::RBD::AioCompletion(NULL, NULL);
+      r = image.aio_read(e->ofs, e->len, e->bl, e->c);
+      if (r < 0) {
+	e->c->release();
+	delete e;
+	break;
+      }
+      in_flight.push_back(e);
+      ofs += e->len;
+    }
+    if (in_flight.empty())
+      break;
+
+    ExportChunk *e = in_flight.front();
+    in_flight.pop_front();
+    e->c->wait_for_complete();
+    int64_t ret = e->c->get_return_value();
+    e->c->release();
+    if (ret < 0 && r == 0) {
+      cerr << "error reading image at " << e->ofs << ": " << cpp_strerror(ret) << std::endl;
+      r = ret;
+    }
+    if (r == 0) {
+      r = export_write(fd, e->ofs, e->bl.c_str(), e->len);
+      if (r < 0)
+	cerr << "error writing " << path << ": " << cpp_strerror(r) << std::endl;
+      else
+	pc.update_progress(e->ofs + e->len, info.size);
+    }
+    delete e;
+  }
+  if (r < 0) {
+    pc.fail();
+    close(fd);
     return r;
+  }
 
   r = ftruncate(fd, info.size);
-  if (r < 0)
+  if (r < 0) {
+    r = -errno;
+    pc.fail();
+    close(fd);
     return r;
+  }
 
   close(fd);
+  pc.finish();
 
   return 0;
 }
@@ -324,8 +455,27 @@ done_img:
   update_snap_name(*new_img, snap);
 }
 
+struct ImportChunk {
+  uint64_t ofs;
+  bufferlist bl;
+  librbd::RBD::AioCompletion *c;
+};
+
+static int import_retire_oldest(std::deque<ImportChunk*>& in_flight)
+{
+  ImportChunk *ic = in_flight.front();
+  in_flight.pop_front();
+  ic->c->wait_for_complete();
+  int r = ic->c->get_return_value();
+  ic->c->release();
+  if (r < 0)
+    cerr << "error writing to image at " << ic->ofs << ": " << cpp_strerror(r) << std::endl;
+  delete ic;
+  return r < 0 ? r : 0;
+}
+
 static int do_import(librbd::RBD &rbd, librados::IoCtx& io_ctx,
-		     const char *imgname, int *order, const char *path)
+		     const char *imgname, uint64_t features, int *order, const char *path)
 {
   int fd = open(path, O_RDONLY);
   int r;
@@ -353,7 +503,7 @@ static int do_import(librbd::RBD &rbd, librados::IoCtx& io_ctx,
   md_oid = imgname;
   md_oid += RBD_SUFFIX;
 
-  r = do_create(rbd, io_ctx, imgname, size, order);
+  r = do_create(rbd, io_ctx, imgname, size, features, order);
   if (r < 0) {
     cerr << "image creation failed" << std::endl;
     return r;
@@ -388,9 +538,22 @@ static int do_import(librbd::RBD &rbd, librados::IoCtx& io_ctx,
     fiemap->fm_extents[0].fe_flags = 0;
   }
 
+  librbd::image_info_t info;
+  r = image.stat(info, sizeof(info));
+  if (r < 0) {
+    free(fiemap);
+    return r;
+  }
+
+  MyProgressContext pc("Importing image");
+  // each write covers at most one object, with up to rbd_concurrent_ops
+  // of them in flight
+  uint64_t period = info.obj_size;
+  unsigned max_ops = concurrent_ops();
+  std::deque<ImportChunk*> in_flight;
   uint64_t extent = 0;
 
-  while (extent < fiemap->fm_mapped_extents) {
+  while (r == 0 && extent < fiemap->fm_mapped_extents) {
     off_t file_pos, end_ofs;
     size_t extent_len = 0;
 
@@ -411,53 +574,59 @@ static int do_import(librbd::RBD &rbd, librados::IoCtx& io_ctx,
       
     } while (end_ofs == (off_t)fiemap->fm_extents[extent].fe_logical);
 
-    cerr << "rbd import file_pos=" << file_pos << " extent_len=" << extent_len << std::endl;
-#define READ_BLOCK_LEN (4 * 1024 * 1024)
     uint64_t left = end_ofs - file_pos;
     while (left) {
-      uint64_t cur_seg = (left < READ_BLOCK_LEN ? left : READ_BLOCK_LEN);
-      while (cur_seg) {
-        bufferptr p(cur_seg);
-        cerr << "reading " << cur_seg << " bytes at offset " << file_pos << std::endl;
-        ssize_t rval = TEMP_FAILURE_RETRY(::pread(fd, p.c_str(), cur_seg, file_pos));
-        if (rval < 0) {
-          r = -errno;
-          cerr << "error reading file: " << cpp_strerror(r) << std::endl;
-          goto done;
-        }
-	size_t len = rval;
-        if (!len) {
-          r = 0;
-          goto done;
-        }
-        bufferlist bl;
-        bl.append(p);
-        librbd::RBD::AioCompletion *completion = new librbd::RBD::AioCompletion(NULL, NULL);
-        if (!completion) {
-          r = -ENOMEM;
-          goto done;
-        }
-        r = image.aio_write(file_pos, len, bl, completion);
+      uint64_t cur_seg = MIN(left, period - (file_pos % period));
+      bufferptr p(cur_seg);
+      ssize_t rval = safe_pread(fd, p.c_str(), cur_seg, file_pos);
+      if (rval < 0) {
+        r = rval;
+        cerr << "error reading file: " << cpp_strerror(r) << std::endl;
+        break;
+      }
+      size_t len = rval;
+      if (!len) {
+        extent = fiemap->fm_mapped_extents;
+        break;
+      }
+
+      // the new image reads back zeros already
+      if (!buf_is_zero(p.c_str(), len)) {
+        while (r == 0 && in_flight.size() >= max_ops)
+          r = import_retire_oldest(in_flight);
         if (r < 0)
-          goto done;
-	completion->wait_for_complete();
-	r = completion->get_return_value();
-	completion->release();
+          break;
+
+        ImportChunk *ic = new ImportChunk;
+        ic->ofs = file_pos;
+        ic->bl.append(p, 0, len);
+        ic->c = new librbd::RBD::AioCompletion(NULL, NULL);
+        r = image.aio_write(file_pos, len, ic->bl, ic->c);
         if (r < 0) {
-          cerr << "error writing to image block" << std::endl;
-          goto done;
+          ic->c->release();
+          delete ic;
+          break;
         }
-
-        file_pos += len;
-        cur_seg -= len;
-        left -= len;
+        in_flight.push_back(ic);
       }
+
+      file_pos += len;
+      left -= len;
+      pc.update_progress(file_pos, size);
     }
   }
 
-  r = 0;
+  while (!in_flight.empty()) {
+    int ret = import_retire_oldest(in_flight);
+    if (ret < 0 && r == 0)
+      r = ret;
+  }
+
+  if (r < 0)
+    pc.fail();
+  else
+    pc.finish();
 
-done:
   free(fiemap);
 
   return r;
@@ -467,9 +636,13 @@ static int do_copy(librbd::RBD &rbd, librados::IoCtx& pp,
 	   const char *imgname, librados::IoCtx& dest_pp,
 	   const char *destname)
 {
-  int r = rbd.copy(pp, imgname, dest_pp, destname);
-  if (r < 0)
+  MyProgressContext pc("Image copy");
+  int r = rbd.copy_with_progress(pp, imgname, dest_pp, destname, pc);
+  if (r < 0) {
+    pc.fail();
     return r;
+  }
+  pc.finish();
   return 0;
 }
 
@@ -731,6 +904,7 @@ enum {
   OPT_EXPORT,
   OPT_IMPORT,
   OPT_COPY,
+  OPT_CLONE,
   OPT_RENAME,
   OPT_SNAP_CREATE,
   OPT_SNAP_ROLLBACK,
@@ -770,6 +944,8 @@ static int get_cmd(const char *cmd, bool *snapcmd)
     if (strcmp(cmd, "copy") == 0 ||
         strcmp(cmd, "cp") == 0)
       return OPT_COPY;
+    if (strcmp(cmd, "clone") == 0)
+      return OPT_CLONE;
     if (strcmp(cmd, "rename") == 0 ||
         strcmp(cmd, "mv") == 0)
       return OPT_RENAME;
@@ -829,6 +1005,7 @@ int main(int argc, const char **argv)
   const char *poolname = NULL;
   uint64_t size = 0;
   int order = 0;
+  bool object_map = false;
   const char *imgname = NULL, *snapname = NULL, *destname = NULL, *dest_poolname = NULL, *path = NULL, *secretfile = NULL, *user = NULL, *devpath = NULL;
   bool is_snap_cmd = false;
   FOR_EACH_ARG(args) {
@@ -850,6 +1027,8 @@ int main(int argc, const char **argv)
       CEPH_ARGPARSE_SET_ARG_VAL(&size, OPT_LONGLONG);
     } else if (CEPH_ARGPARSE_EQ("order", '\0')) {
       CEPH_ARGPARSE_SET_ARG_VAL(&order, OPT_INT);
+    } else if (CEPH_ARGPARSE_EQ("object-map", '\0')) {
+      CEPH_ARGPARSE_SET_ARG_VAL(&object_map, OPT_BOOL);
     } else if (CEPH_ARGPARSE_EQ("path", '\0')) {
       CEPH_ARGPARSE_SET_ARG_VAL(&path, OPT_STR);
     } else if (CEPH_ARGPARSE_EQ("dest", '\0')) {
@@ -892,6 +1071,7 @@ int main(int argc, const char **argv)
             set_conf_param(CEPH_ARGPARSE_VAL, &path, &destname);
             break;
           case OPT_COPY:
+          case OPT_CLONE:
           case OPT_RENAME:
             set_conf_param(CEPH_ARGPARSE_VAL, &imgname, &destname);
             break;
@@ -929,7 +1109,7 @@ int main(int argc, const char **argv)
   set_pool_image_name(dest_poolname, destname, (char **)&dest_poolname, (char **)&destname, NULL);
 
   if ((opt_cmd == OPT_SNAP_CREATE || opt_cmd == OPT_SNAP_ROLLBACK ||
-       opt_cmd == OPT_SNAP_REMOVE) && !snapname) {
+       opt_cmd == OPT_SNAP_REMOVE || opt_cmd == OPT_CLONE) && !snapname) {
     cerr << "error: snap name was not specified" << std::endl;
     usage_exit();
   }
@@ -940,7 +1120,7 @@ int main(int argc, const char **argv)
   if (opt_cmd == OPT_EXPORT && !path)
     path = imgname;
 
-  if (opt_cmd == OPT_COPY && !destname ) {
+  if ((opt_cmd == OPT_COPY || opt_cmd == OPT_CLONE) && !destname ) {
     cerr << "error: destination image name was not specified" << std::endl;
     usage_exit();
   }
@@ -976,7 +1156,7 @@ int main(int argc, const char **argv)
     }
   }
 
-  if (snapname) {
+  if (snapname && opt_cmd != OPT_CLONE) {
     r = image.snap_set(snapname);
     if (r < 0 && !(r == -ENOENT && opt_cmd == OPT_SNAP_CREATE)) {
       cerr << "error setting snapshot context: " << strerror(-r) << std::endl;
@@ -984,7 +1164,7 @@ int main(int argc, const char **argv)
     }
   }
 
-  if (opt_cmd == OPT_COPY || opt_cmd == OPT_IMPORT) {
+  if (opt_cmd == OPT_COPY || opt_cmd == OPT_IMPORT || opt_cmd == OPT_CLONE) {
     r = rados.ioctx_create(dest_poolname, dest_io_ctx);
     if (r < 0) {
       cerr << "error opening pool " << dest_poolname << " (err=" << r << ")" << std::endl;
@@ -1018,13 +1198,28 @@ int main(int argc, const char **argv)
       usage();
       exit(1);
     }
-    r = do_create(rbd, io_ctx, imgname, size, &order);
+    r = do_create(rbd, io_ctx, imgname, size,
+		  object_map ? RBD_FEATURE_OBJECT_MAP : 0, &order);
     if (r < 0) {
       cerr << "create error: " << strerror(-r) << std::endl;
       exit(1);
     }
     break;
 
+  case OPT_CLONE:
+    if (order && (order < 12 || order > 25)) {
+      cerr << "order must be between 12 (4 KB) and 25 (32 MB)" << std::endl;
+      usage();
+      exit(1);
+    }
+    r = do_clone(rbd, io_ctx, imgname, snapname, dest_io_ctx, destname,
+		 object_map ? RBD_FEATURE_OBJECT_MAP : 0, &order);
+    if (r < 0) {
+      cerr << "clone error: " << strerror(-r) << std::endl;
+      exit(1);
+    }
+    break;
+
   case OPT_RENAME:
     r = do_rename(rbd, io_ctx, imgname, destname);
     if (r < 0) {
@@ -1122,7 +1317,8 @@ int main(int argc, const char **argv)
       cerr << "pathname should be specified" << std::endl;
       exit(1);
     }
-    r = do_import(rbd, dest_io_ctx, destname, &order, path);
+    r = do_import(rbd, dest_io_ctx, destname,
+		  object_map ? RBD_FEATURE_OBJECT_MAP : 0, &order, path);
     if (r < 0) {
       cerr << "import failed: " << strerror(-r) << std::endl;
       exit(1);
@@ -494,6 +494,22 @@ int RGWRados::copy_obj(std::string& id, rgw_obj& dest_obj,
   if (ret < 0)
     return ret;
 
+  for (iter = attrs.begin(); iter != attrs.end(); ++iter) {
+    attrset[iter->first] = iter->second;
+  }
+  attrs = attrset;
+
+  // have the osd copy it; osds that can't do that get the data through us.
+  // ENOENT can come from an osd that couldn't find the source where it
+  // looked, so that goes through us too.
+  ret = copy_obj_data(dest_obj, src_obj, attrs);
+  if (ret != -EOPNOTSUPP && ret != -ENOENT) {
+    if (ret >= 0 && mtime)
+      obj_stat(dest_obj, NULL, mtime);
+    finish_get_obj(&handle);
+    return ret;
+  }
+
   off_t ofs = 0;
   do {
     ret = get_obj(&handle, src_obj, &data, ofs, end);
@@ -510,11 +526,6 @@ int RGWRados::copy_obj(std::string& id, rgw_obj& dest_obj,
     ofs += ret;
   } while (ofs <= end);
 
-  for (iter = attrs.begin(); iter != attrs.end(); ++iter) {
-    attrset[iter->first] = iter->second;
-  }
-  attrs = attrset;
-
   ret = clone_obj(dest_obj, 0, tmp_obj, 0, end + 1, attrs);
   if (mtime)
     obj_stat(tmp_obj, NULL, mtime);
@@ -532,6 +543,38 @@ done_err:
   return r;
 }
 
+/**
+ * Copy an object within the osds, replacing its attrs.
+ * Returns -EOPNOTSUPP if the osds can't do that, or the object is too
+ * big for them to.
+ */
+int RGWRados::copy_obj_data(rgw_obj& dest_obj, rgw_obj& src_obj,
+                            map<string, bufferlist>& attrs)
+{
+  librados::IoCtx dest_ctx, src_ctx;
+  int r = open_bucket_ctx(dest_obj.bucket, dest_ctx);
+  if (r < 0)
+    return r;
+  dest_ctx.locator_set_key(dest_obj.key);
+
+  r = open_bucket_ctx(src_obj.bucket, src_ctx);
+  if (r < 0)
+    return r;
+  src_ctx.locator_set_key(src_obj.key);
+
+  ObjectOperation op;
+  op.copy_from(src_obj.object, src_ctx);
+  map<string, bufferlist>::iterator iter;
+  for (iter = attrs.begin(); iter != attrs.end(); ++iter) {
+    const string& name = iter->first;
+    bufferlist& bl = iter->second;
+    op.setxattr(name.c_str(), bl);
+  }
+
+  bufferlist outbl;
+  return dest_ctx.operate(dest_obj.object, &op, &outbl);
+}
+
 /**
  * Delete a bucket.
  * id: unused
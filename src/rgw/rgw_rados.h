@@ -22,6 +22,8 @@ class RGWRados  : public RGWAccess
   };
 
   int set_buckets_auid(vector<std::string>& buckets, uint64_t auid);
+  int copy_obj_data(rgw_obj& dest_obj, rgw_obj& src_obj,
+                    map<std::string, bufferlist>& attrs);
 
   RGWWatcher *watcher;
   uint64_t watch_handle;
@@ -0,0 +1,71 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2011 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * Time each crc32c implementation over a range of buffer sizes.
+ *
+ *   bench_crc32c [total MB per size, default 256]
+ */
+
+#include "include/crc32c.h"
+
+#include <iostream>
+#include <iomanip>
+#include <stdlib.h>
+#include <sys/time.h>
+
+using namespace std;
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void bench(const char *name, ceph_crc32c_func_t f,
+		  unsigned char *buf, unsigned len, uint64_t total)
+{
+  uint64_t iters = total / len;
+  if (!iters)
+    iters = 1;
+  uint32_t crc = 0;
+  double start = now();
+  for (uint64_t i = 0; i < iters; i++)
+    crc = f(crc, buf, len);
+  double el = now() - start;
+  cout << setw(12) << name << setw(10) << len
+       << setw(12) << fixed << setprecision(1)
+       << (double)iters * len / el / 1048576.0 << " MB/s"
+       << "  (crc " << hex << crc << dec << ")" << std::endl;
+}
+
+int main(int argc, const char **argv)
+{
+  uint64_t total = (argc > 1 ? atoll(argv[1]) : 256) << 20;
+  unsigned sizes[] = { 16, 64, 256, 1024, 4096, 16384, 65536, 1 << 20, 4 << 20 };
+  unsigned max = 4 << 20;
+  unsigned char *buf = (unsigned char *)malloc(max);
+  for (unsigned i = 0; i < max; i++)
+    buf[i] = rand();
+
+  cout << "default is " << ceph_crc32c_name(ceph_choose_crc32c()) << std::endl;
+  for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    bench("sctp", ceph_crc32c_sctp, buf, sizes[s], total);
+    if (ceph_crc32c_intel_fast_exists())
+      bench("intel_fast", ceph_crc32c_intel_fast, buf, sizes[s], total);
+  }
+  free(buf);
+  return 0;
+}
@@ -75,3 +75,121 @@ TEST(BufferList, TestCopyAll) {
   bl2.copy(0, BIG_SZ, (char*)big2);
   ASSERT_EQ(memcmp(big.get(), big2, BIG_SZ), 0);
 }
+
+TEST(BufferList, RebuildPageAlignedKeepsInPhaseMiddle) {
+  // a payload that starts 100 bytes into a page, at list offset 100
+  bufferptr big = buffer::create_page_aligned(4 * PAGE_SIZE);
+  memset(big.c_str(), 'x', big.length());
+  bufferptr payload(big, 100, 3 * PAGE_SIZE);
+  const char *middle = payload.c_str() + PAGE_SIZE - 100;
+
+  bufferlist bl;
+  bl.append(std::string(100, 'h').c_str(), 100);
+  bl.append(payload);
+  bl.append(std::string(PAGE_SIZE - 100, 't').c_str(), PAGE_SIZE - 100);
+  std::string orig;
+  bl.copy(0, bl.length(), orig);
+
+  bl.rebuild_page_aligned();
+  ASSERT_TRUE(bl.is_page_aligned());
+  ASSERT_TRUE(bl.is_n_page_sized());
+  std::string after;
+  bl.copy(0, bl.length(), after);
+  ASSERT_EQ(orig, after);
+
+  // the aligned middle of the payload was not copied
+  bool found = false;
+  for (std::list<bufferptr>::const_iterator p = bl.buffers().begin();
+       p != bl.buffers().end(); ++p)
+    if (p->c_str() == middle)
+      found = true;
+  ASSERT_TRUE(found);
+}
+
+TEST(BufferList, Crc32cCache) {
+  bufferptr a(8192), b(1000);
+  for (unsigned i = 0; i < a.length(); i++)
+    a.c_str()[i] = i * 7;
+  for (unsigned i = 0; i < b.length(); i++)
+    b.c_str()[i] = i * 13;
+  bufferlist bl;
+  bl.append(a);
+  bl.append(b);
+
+  uint32_t want0 = ceph_crc32c_sctp(0, (unsigned char*)a.c_str(), a.length());
+  want0 = ceph_crc32c_sctp(want0, (unsigned char*)b.c_str(), b.length());
+  uint32_t want5 = ceph_crc32c_sctp(5, (unsigned char*)a.c_str(), a.length());
+  want5 = ceph_crc32c_sctp(want5, (unsigned char*)b.c_str(), b.length());
+
+  ASSERT_EQ(want0, bl.crc32c(0));
+  ASSERT_EQ(want0, bl.crc32c(0));   // cached
+  ASSERT_EQ(want5, bl.crc32c(5));   // cached, other seed
+
+  // another list sharing the same buffers
+  bufferlist bl2;
+  bl2.append(a);
+  bl2.append(b);
+  ASSERT_EQ(want0, bl2.crc32c(0));
+
+  // a sub-range is a different range
+  bufferlist part;
+  part.substr_of(bl, 100, 500);
+  ASSERT_EQ(ceph_crc32c_sctp(0, (unsigned char*)a.c_str() + 100, 500),
+	    part.crc32c(0));
+
+  // writes drop what we had
+  bl.copy_in(10, 3, "xyz");
+  uint32_t want = ceph_crc32c_sctp(0, (unsigned char*)a.c_str(), a.length());
+  want = ceph_crc32c_sctp(want, (unsigned char*)b.c_str(), b.length());
+  ASSERT_NE(want0, want);
+  ASSERT_EQ(want, bl.crc32c(0));
+
+  b.c_str()[0]++;
+  b.invalidate_crc();
+  want = ceph_crc32c_sctp(0, (unsigned char*)a.c_str(), a.length());
+  want = ceph_crc32c_sctp(want, (unsigned char*)b.c_str(), b.length());
+  ASSERT_EQ(want, bl.crc32c(0));
+
+  // look without invalidating, so only operator[] can drop the cache
+  const bufferptr &ca = a, &cb = b;
+  ASSERT_EQ(want, bl.crc32c(0));
+  a[20]++;
+  want = ceph_crc32c_sctp(0, (unsigned char*)ca.c_str(), ca.length());
+  want = ceph_crc32c_sctp(want, (unsigned char*)cb.c_str(), cb.length());
+  ASSERT_EQ(want, bl.crc32c(0));
+}
+
+/*
+ * the messenger reads replies straight into buffers posted by the
+ * Objecter (post_rx_buffer), which may be reused for several reads and
+ * already carry a cached crc from the last one.
+ */
+TEST(BufferList, Crc32cRxBufferReuse) {
+  bufferptr rx(4096);
+  const bufferptr &crx = rx;  // look without invalidating
+  bufferlist posted;
+  posted.push_back(rx);
+
+  for (int round = 0; round < 3; round++) {
+    // what the reader does: write through c_str(), in pieces
+    bufferptr bp(posted.buffers().front());
+    for (unsigned off = 0; off < bp.length(); off += 1000) {
+      unsigned len = std::min(1000u, bp.length() - off);
+      char *p = bp.c_str() + off;
+      for (unsigned i = 0; i < len; i++)
+	p[i] = (off + i) * (round + 3);
+    }
+
+    bufferlist data;
+    data.push_back(bp);
+    uint32_t want = ceph_crc32c_sctp(0, (unsigned char*)crx.c_str(), crx.length());
+    ASSERT_EQ(want, data.crc32c(0));
+    ASSERT_EQ(want, posted.crc32c(0));
+  }
+
+  // writes through bufferlist::c_str() count too
+  posted.crc32c(0);
+  posted.c_str()[17] ^= 0xff;
+  ASSERT_EQ(ceph_crc32c_sctp(0, (unsigned char*)crx.c_str(), crx.length()),
+	    posted.crc32c(0));
+}
@@ -0,0 +1,205 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2011 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "os/FlatIndex.h"
+#include "os/HashIndex.h"
+#include "test/temp_dir.h"
+#include "test/unit.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static const int NUM_OBJS = 200;
+
+static void create(CollectionIndex &index, const sobject_t &oid)
+{
+  string path;
+  int exist;
+  ASSERT_EQ(0, index.lookup(oid, &path, &exist));
+  ASSERT_EQ(0, exist);
+  int fd = ::open(path.c_str(), O_CREAT|O_WRONLY, 0644);
+  ASSERT_LE(0, fd);
+  ::close(fd);
+  int r = index.created(oid, path.c_str());
+  ASSERT_LE(0, r);
+  if (r > 0) {
+    ASSERT_EQ(0, index.split(oid));
+  }
+}
+
+// every third object is a clone at snap 2; the rest are heads
+static void populate(CollectionIndex &index, set<sobject_t> *all, set<sobject_t> *heads)
+{
+  for (int i = 0; i < NUM_OBJS; i++) {
+    char name[40];
+    snprintf(name, sizeof(name), "obj_%d", i);
+    sobject_t oid(object_t(name), i % 3 ? snapid_t(CEPH_NOSNAP) : snapid_t(2));
+    create(index, oid);
+    all->insert(oid);
+    if (i % 3)
+      heads->insert(oid);
+  }
+}
+
+/*
+ * Partial listings return exactly max_count matching objects per call
+ * until the last one, see each matching object once, and end with the
+ * handle reset to 0.
+ */
+static void check_partial(CollectionIndex &index, snapid_t seq, int max_count,
+			  const set<sobject_t> &expect)
+{
+  set<sobject_t> seen;
+  collection_list_handle_t handle = 0;
+  for (int calls = 0; calls <= NUM_OBJS + 1; calls++) {
+    vector<sobject_t> ls;
+    ASSERT_EQ(0, index.collection_list_partial(seq, max_count, &ls, &handle));
+    ASSERT_GE(max_count, (int)ls.size());
+    for (vector<sobject_t>::iterator p = ls.begin(); p != ls.end(); ++p) {
+      ASSERT_TRUE(expect.count(*p)) << *p;
+      ASSERT_TRUE(seen.insert(*p).second) << *p;
+    }
+    if (!handle)
+      break;
+    ASSERT_EQ(max_count, (int)ls.size());
+  }
+  ASSERT_EQ(0u, handle);
+  ASSERT_EQ(expect, seen);
+}
+
+static void check_index(CollectionIndex &index)
+{
+  set<sobject_t> all, heads;
+  populate(index, &all, &heads);
+
+  vector<sobject_t> ls;
+  ASSERT_EQ(0, index.collection_list(&ls));
+  ASSERT_EQ(all, set<sobject_t>(ls.begin(), ls.end()));
+
+  check_partial(index, 0, 7, all);
+  check_partial(index, 3, 7, heads);
+  check_partial(index, 3, 1, heads);
+  check_partial(index, 3, NUM_OBJS, heads);
+}
+
+TEST(CollectionIndex, FlatIndexPartialList) {
+  string dir = make_temp_dir("collection_index");
+  ASSERT_NE("", dir);
+  FlatIndex index(coll_t(string("test")), dir.c_str());
+  ASSERT_EQ(0, index.init());
+  check_index(index);
+  remove_temp_dir(dir);
+}
+
+TEST(CollectionIndex, HashIndexPartialList) {
+  string dir = make_temp_dir("collection_index");
+  ASSERT_NE("", dir);
+  // small enough that the collection splits a couple of levels deep
+  HashIndex index(coll_t(string("test")), dir.c_str(), 8);
+  ASSERT_EQ(0, index.init());
+  check_index(index);
+  remove_temp_dir(dir);
+}
+
+static void remove(CollectionIndex &index, const sobject_t &oid)
+{
+  int r = index.unlink(oid, false);
+  if (r > 0)
+    r = index.unlink(oid, true);
+  ASSERT_EQ(0, r);
+}
+
+/*
+ * A fresh index over an already split collection finds the split
+ * directories again in cleanup(), and removing every object leaves
+ * nothing listed.
+ */
+TEST(CollectionIndex, HashIndexReload) {
+  string dir = make_temp_dir("collection_index");
+  ASSERT_NE("", dir);
+  set<sobject_t> all, heads;
+  {
+    HashIndex index(coll_t(string("test")), dir.c_str(), 8);
+    ASSERT_EQ(0, index.init());
+    populate(index, &all, &heads);
+  }
+
+  HashIndex index(coll_t(string("test")), dir.c_str(), 8);
+  ASSERT_EQ(0, index.cleanup());
+  for (set<sobject_t>::iterator p = all.begin(); p != all.end(); ++p) {
+    string path;
+    int exist;
+    ASSERT_EQ(0, index.lookup(*p, &path, &exist));
+    ASSERT_EQ(1, exist) << *p;
+    // found below the top level, without asking the filesystem
+    ASSERT_NE(string::npos, path.find("/DIR_")) << path;
+  }
+
+  for (set<sobject_t>::iterator p = all.begin(); p != all.end(); ++p)
+    remove(index, *p);
+  vector<sobject_t> ls;
+  ASSERT_EQ(0, index.collection_list(&ls));
+  ASSERT_EQ(0u, ls.size());
+  remove_temp_dir(dir);
+}
+
+/*
+ * prep_delete() on a collection that still holds an object fails
+ * without removing any of the split directories, so lookups and
+ * creates keep working.
+ */
+TEST(CollectionIndex, HashIndexPrepDeleteNotEmpty) {
+  string dir = make_temp_dir("collection_index");
+  ASSERT_NE("", dir);
+  HashIndex index(coll_t(string("test")), dir.c_str(), 8);
+  ASSERT_EQ(0, index.init());
+  set<sobject_t> all, heads;
+  populate(index, &all, &heads);
+
+  sobject_t left = *all.rbegin();
+  all.erase(left);
+  for (set<sobject_t>::iterator p = all.begin(); p != all.end(); ++p)
+    remove(index, *p);
+  ASSERT_EQ(-ENOTEMPTY, index.prep_delete());
+
+  string path;
+  int exist;
+  ASSERT_EQ(0, index.lookup(left, &path, &exist));
+  ASSERT_EQ(1, exist);
+  set<sobject_t> more;
+  for (int i = 0; i < NUM_OBJS; i++) {
+    char name[40];
+    snprintf(name, sizeof(name), "more_%d", i);
+    sobject_t oid(object_t(name), CEPH_NOSNAP);
+    create(index, oid);
+    more.insert(oid);
+  }
+  more.insert(left);
+  vector<sobject_t> ls;
+  ASSERT_EQ(0, index.collection_list(&ls));
+  ASSERT_EQ(more, set<sobject_t>(ls.begin(), ls.end()));
+
+  for (set<sobject_t>::iterator p = more.begin(); p != more.end(); ++p)
+    remove(index, *p);
+  ASSERT_EQ(0, index.prep_delete());
+  remove_temp_dir(dir);
+}
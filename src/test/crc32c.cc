@@ -0,0 +1,66 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2011 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+#include "include/crc32c.h"
+#include "gtest/gtest.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+TEST(Crc32c, Small) {
+  const char *a = "foo bar baz";
+  const char *b = "whiz bang boom";
+  ASSERT_EQ(4119623852u, ceph_crc32c_sctp(0, (unsigned char *)a, strlen(a)));
+  ASSERT_EQ(881700046u, ceph_crc32c_sctp(1234, (unsigned char *)a, strlen(a)));
+  ASSERT_EQ(2360230088u, ceph_crc32c_sctp(0, (unsigned char *)b, strlen(b)));
+  ASSERT_EQ(3743019208u, ceph_crc32c_sctp(5678, (unsigned char *)b, strlen(b)));
+  ASSERT_EQ(4119623852u, ceph_crc32c_le(0, (unsigned char *)a, strlen(a)));
+  ASSERT_EQ(3743019208u, ceph_crc32c_le(5678, (unsigned char *)b, strlen(b)));
+}
+
+TEST(Crc32c, Choose) {
+  ceph_crc32c_func_t f = ceph_choose_crc32c();
+  ASSERT_STRNE("unknown", ceph_crc32c_name(f));
+  if (ceph_crc32c_intel_fast_exists()) {
+    ASSERT_STREQ("intel_fast", ceph_crc32c_name(f));
+  }
+}
+
+TEST(Crc32c, IntelFastMatchesSctp) {
+  if (!ceph_crc32c_intel_fast_exists())
+    return;
+
+  // big enough for several of the long three-way blocks plus a tail
+  unsigned max = 3 * 3 * 8192 + 3 * 256 + 37;
+  unsigned char *buf = (unsigned char *)malloc(max + 8);
+  srand(0);
+  for (unsigned i = 0; i < max + 8; i++)
+    buf[i] = rand();
+
+  unsigned sizes[] = { 0, 1, 7, 8, 9, 255, 256, 767, 768, 769, 4096,
+		       3 * 8192 - 1, 3 * 8192, 3 * 8192 + 1, 100000, max };
+  uint32_t seeds[] = { 0, 1, 0xffffffff, 0x12345678 };
+  for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    for (unsigned off = 0; off < 8; off++) {
+      for (unsigned k = 0; k < sizeof(seeds) / sizeof(seeds[0]); k++) {
+	unsigned len = sizes[s];
+	if (len > max)
+	  len = max;
+	ASSERT_EQ(ceph_crc32c_sctp(seeds[k], buf + off, len),
+		  ceph_crc32c_intel_fast(seeds[k], buf + off, len))
+	  << "len " << len << " off " << off << " seed " << seeds[k];
+      }
+    }
+  }
+  free(buf);
+}
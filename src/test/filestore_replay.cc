@@ -0,0 +1,364 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2011 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * Journal a run of transactions that interleave across collections,
+ * some of them touching several collections at once, then replay the
+ * journal onto a copy of the store as it was before the run, serially
+ * and with several replay threads.  Both have to end up where the
+ * original run did: order within a collection is kept, and a
+ * transaction that spans collections is ordered against each of them.
+ * An object linked into two collections is ordered across both.
+ */
+
+#include "common/config.h"
+#include "os/FileStore.h"
+#include "test/temp_dir.h"
+#include "test/unit.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static const int NUM_COLLS = 4;
+static const int NUM_OBJS = 16;
+static const int NUM_OPS = 500;
+
+typedef map<string, string> state_t;
+
+static int run(const string &cmd)
+{
+  return system(cmd.c_str());
+}
+
+static void set_conf(const char *key, const char *val)
+{
+  ASSERT_EQ(0, g_ceph_context->_conf->set_val(key, val));
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
+static coll_t coll(int i)
+{
+  char n[20];
+  snprintf(n, sizeof(n), "coll_%d", i);
+  return coll_t(n);
+}
+
+static sobject_t obj(int i)
+{
+  char n[20];
+  snprintf(n, sizeof(n), "obj_%d", i);
+  return sobject_t(n, CEPH_NOSNAP);
+}
+
+static void fill(bufferlist& bl, unsigned len, int op)
+{
+  bufferptr bp(len);
+  for (unsigned i = 0; i < len; i++)
+    bp[i] = (char)(op + i);
+  bl.push_back(bp);
+}
+
+static void set_last(ObjectStore::Transaction& t, coll_t c, const sobject_t& o, int op)
+{
+  bufferlist bl;
+  ::encode(op, bl);
+  t.setattr(c, o, "last", bl);
+}
+
+/*
+ * Objects move between collections with collection_add +
+ * collection_remove, as the osd moves objects into snap collections.
+ * LinkedObject below covers an object left in two of them.
+ */
+class Workload {
+  unsigned seed;
+  int where[NUM_OBJS];
+
+  int rnd(int n) {
+    return rand_r(&seed) % n;
+  }
+  int other_coll(int c) {
+    return (c + 1 + rnd(NUM_COLLS - 1)) % NUM_COLLS;
+  }
+
+public:
+  Workload() : seed(42) {
+    for (int i = 0; i < NUM_OBJS; i++)
+      where[i] = i % NUM_COLLS;
+  }
+
+  void create(ObjectStore::Transaction& t, int i) {
+    t.touch(coll(where[i]), obj(i));
+  }
+
+  void make(ObjectStore::Transaction& t, int op) {
+    int o = rnd(NUM_OBJS);
+    coll_t c = coll(where[o]);
+    switch (rnd(10)) {
+    case 0:
+      t.truncate(c, obj(o), rnd(8192));
+      break;
+    case 1:
+      t.zero(c, obj(o), rnd(8192), 1 + rnd(1024));
+      break;
+    case 2:
+      {
+	// move, then write through the new collection
+	int d = other_coll(where[o]);
+	t.collection_add(coll(d), c, obj(o));
+	t.collection_remove(c, obj(o));
+	where[o] = d;
+	c = coll(d);
+	bufferlist bl;
+	fill(bl, 1 + rnd(2048), op);
+	t.write(c, obj(o), rnd(8192), bl.length(), bl);
+      }
+      break;
+    case 3:
+      {
+	// two objects in (most likely) different collections
+	int o2 = rnd(NUM_OBJS);
+	coll_t c2 = coll(where[o2]);
+	bufferlist bl, bl2;
+	fill(bl, 1 + rnd(2048), op);
+	fill(bl2, 1 + rnd(2048), op + 1);
+	t.write(c, obj(o), rnd(8192), bl.length(), bl);
+	t.write(c2, obj(o2), rnd(8192), bl2.length(), bl2);
+	bufferlist v;
+	::encode(op, v);
+	t.collection_setattr(c, "last", v);
+	t.collection_setattr(c2, "last", v);
+	set_last(t, c2, obj(o2), op);
+      }
+      break;
+    case 4:
+      {
+	// recreate
+	t.remove(c, obj(o));
+	bufferlist bl;
+	fill(bl, 1 + rnd(2048), op);
+	t.write(c, obj(o), 0, bl.length(), bl);
+      }
+      break;
+    default:
+      {
+	bufferlist bl;
+	fill(bl, 1 + rnd(4096), op);
+	t.write(c, obj(o), rnd(8192), bl.length(), bl);
+      }
+    }
+    set_last(t, c, obj(o), op);
+  }
+};
+
+static string describe(const coll_t& c, const sobject_t& o)
+{
+  ostringstream ss;
+  ss << c << "/" << o;
+  return ss.str();
+}
+
+/// everything a replay could get wrong: which objects are where, their
+/// data, and the attrs of objects and collections
+static void dump(ObjectStore *fs, state_t *s)
+{
+  vector<coll_t> colls;
+  ASSERT_EQ(0, fs->list_collections(colls));
+  for (vector<coll_t>::iterator c = colls.begin(); c != colls.end(); ++c) {
+    map<string,bufferptr> cattrs;
+    fs->collection_getattrs(*c, cattrs);
+    for (map<string,bufferptr>::iterator p = cattrs.begin(); p != cattrs.end(); ++p)
+      (*s)[c->to_str() + "@" + p->first] = string(p->second.c_str(), p->second.length());
+
+    vector<sobject_t> objs;
+    ASSERT_EQ(0, fs->collection_list(*c, objs));
+    for (vector<sobject_t>::iterator o = objs.begin(); o != objs.end(); ++o) {
+      string name = describe(*c, *o);
+      struct stat st;
+      ASSERT_EQ(0, fs->stat(*c, *o, &st));
+      bufferlist bl;
+      if (st.st_size) {
+	ASSERT_EQ(st.st_size, fs->read(*c, *o, 0, st.st_size, bl));
+      }
+      (*s)[name] = string(bl.c_str(), bl.length());
+
+      map<string,bufferptr> attrs;
+      ASSERT_EQ(0, fs->getattrs(*c, *o, attrs));
+      for (map<string,bufferptr>::iterator p = attrs.begin(); p != attrs.end(); ++p)
+	(*s)[name + "@" + p->first] = string(p->second.c_str(), p->second.length());
+    }
+  }
+}
+
+static void check_same(const state_t& expect, const state_t& got)
+{
+  state_t::const_iterator p = expect.begin(), q = got.begin();
+  while (p != expect.end() && q != got.end()) {
+    ASSERT_EQ(p->first, q->first);
+    ASSERT_TRUE(p->second == q->second) << "contents of " << p->first << " differ";
+    ++p;
+    ++q;
+  }
+  ASSERT_TRUE(p == expect.end()) << "missing " << p->first;
+  ASSERT_TRUE(q == got.end()) << "extra " << q->first;
+}
+
+/// mount a copy of the pre-run store with the run's journal
+static void replay(const string& dir, const char *threads, state_t *s)
+{
+  string base = dir + "/replay." + threads;
+  string journal = base + ".journal";
+  ASSERT_EQ(0, run("cp -a " + dir + "/before " + base));
+  ASSERT_EQ(0, run("cp " + dir + "/journal.saved " + journal));
+  set_conf("journal_replay_threads", threads);
+
+  FileStore *fs = new FileStore(base, journal);
+  ASSERT_EQ(0, fs->mount());
+  dump(fs, s);
+  ASSERT_EQ(0, fs->umount());
+  delete fs;
+}
+
+static void set_replay_conf()
+{
+  set_conf("osd_journal_size", "16");
+  set_conf("osd_max_write_size", "1");
+  set_conf("journal_dio", "false");
+  set_conf("journal_aio", "false");
+  set_conf("filestore_journal_writeahead", "true");
+}
+
+TEST(FileStoreReplay, ParallelMatchesSerial)
+{
+  string dir = make_temp_dir("filestore_replay");
+  ASSERT_NE("", dir);
+  string base = dir + "/store";
+  string journal = dir + "/journal";
+
+  set_replay_conf();
+
+  ObjectStore::Transaction mk;
+  for (int i = 0; i < NUM_COLLS; i++)
+    mk.create_collection(coll(i));
+
+  FileStore *fs = new FileStore(base, journal);
+  ASSERT_EQ(0, mkdir(base.c_str(), 0755));
+  ASSERT_EQ(0, fs->mkfs());
+  ASSERT_EQ(0, fs->mount());
+  fs->apply_transaction(mk);
+  ASSERT_EQ(0, fs->umount());
+  ASSERT_EQ(0, run("cp -a " + base + " " + dir + "/before"));
+
+  // no commits during the run, so the journal keeps all of it
+  set_conf("filestore_min_sync_interval", "1000");
+  set_conf("filestore_max_sync_interval", "1000");
+  ASSERT_EQ(0, fs->mount());
+  Workload w;
+  for (int i = 0; i < NUM_OBJS; i++) {
+    ObjectStore::Transaction t;
+    w.create(t, i);
+    fs->apply_transaction(t);
+  }
+  for (int op = 0; op < NUM_OPS; op++) {
+    ObjectStore::Transaction t;
+    w.make(t, op);
+    fs->apply_transaction(t);
+  }
+  ASSERT_EQ(0, run("cp " + journal + " " + dir + "/journal.saved"));
+  state_t expect;
+  dump(fs, &expect);
+  ASSERT_EQ(0, fs->umount());
+  delete fs;
+  ASSERT_LT((unsigned)NUM_OBJS, expect.size());
+
+  state_t serial, parallel;
+  replay(dir, "1", &serial);
+  check_same(expect, serial);
+  replay(dir, "4", &parallel);
+  check_same(serial, parallel);
+
+  remove_temp_dir(dir);
+}
+
+/*
+ * The object is linked into two collections before the journaled run,
+ * so replay never sees the collection_add, and then written through
+ * each of them in turn.
+ */
+TEST(FileStoreReplay, LinkedObject)
+{
+  string dir = make_temp_dir("filestore_replay_linked");
+  ASSERT_NE("", dir);
+  string base = dir + "/store";
+  string journal = dir + "/journal";
+
+  set_replay_conf();
+
+  ObjectStore::Transaction mk;
+  for (int i = 0; i < NUM_COLLS; i++)
+    mk.create_collection(coll(i));
+  mk.touch(coll(0), obj(0));
+  mk.collection_add(coll(1), coll(0), obj(0));
+  mk.touch(coll(2), obj(1));
+
+  FileStore *fs = new FileStore(base, journal);
+  ASSERT_EQ(0, mkdir(base.c_str(), 0755));
+  ASSERT_EQ(0, fs->mkfs());
+  ASSERT_EQ(0, fs->mount());
+  fs->apply_transaction(mk);
+  ASSERT_EQ(0, fs->umount());
+  ASSERT_EQ(0, run("cp -a " + base + " " + dir + "/before"));
+
+  set_conf("filestore_min_sync_interval", "1000");
+  set_conf("filestore_max_sync_interval", "1000");
+  ASSERT_EQ(0, fs->mount());
+  for (int op = 0; op < NUM_OPS; op++) {
+    ObjectStore::Transaction t;
+    coll_t c = coll(op % 2);
+    bufferlist bl;
+    fill(bl, 1 + (op * 37) % 4096, op);
+    t.truncate(c, obj(0), 0);
+    t.write(c, obj(0), 0, bl.length(), bl);
+    set_last(t, c, obj(0), op);
+    fs->apply_transaction(t);
+
+    // something unrelated for the other threads to do
+    ObjectStore::Transaction t2;
+    bufferlist bl2;
+    fill(bl2, 4096, op);
+    t2.write(coll(2), obj(1), 0, bl2.length(), bl2);
+    fs->apply_transaction(t2);
+  }
+  ASSERT_EQ(0, run("cp " + journal + " " + dir + "/journal.saved"));
+  state_t expect;
+  dump(fs, &expect);
+  ASSERT_EQ(0, fs->umount());
+  delete fs;
+  ASSERT_EQ(expect[describe(coll(0), obj(0))], expect[describe(coll(1), obj(0))]);
+
+  state_t parallel;
+  replay(dir, "4", &parallel);
+  check_same(expect, parallel);
+
+  remove_temp_dir(dir);
+}
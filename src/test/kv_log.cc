@@ -0,0 +1,353 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2011 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "common/config.h"
+#include "os/FileStore.h"
+#include "os/KeyValueLog.h"
+#include "test/temp_dir.h"
+#include "test/unit.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static uint64_t file_size(const string &path)
+{
+  struct stat st;
+  if (::stat(path.c_str(), &st) < 0)
+    return 0;
+  return st.st_size;
+}
+
+static bufferlist make_val(const string &s)
+{
+  bufferlist bl;
+  bl.append(s);
+  return bl;
+}
+
+static string get_str(KeyValueLog &kv, const string &key)
+{
+  bufferlist bl;
+  if (kv.get(key, &bl) < 0)
+    return "<missing>";
+  return string(bl.c_str(), bl.length());
+}
+
+static void set_key(KeyValueLog &kv, const string &key, const string &val)
+{
+  KeyValueLog::Transaction t;
+  t.set(key, make_val(val));
+  ASSERT_EQ(0, kv.submit(t));
+}
+
+TEST(KeyValueLog, OpenMissing)
+{
+  string dir = make_temp_dir("kv_log");
+  ASSERT_NE("", dir);
+  KeyValueLog kv(dir + "/log", 0);
+  ASSERT_EQ(-ENOENT, kv.open(false));
+  ASSERT_EQ(0, kv.open(true));
+  ASSERT_TRUE(kv.empty());
+  kv.close();
+  ASSERT_EQ(0, kv.open(false));
+  ASSERT_EQ(0, kv.destroy());
+  ASSERT_EQ(-ENOENT, kv.open(false));
+  remove_temp_dir(dir);
+}
+
+TEST(KeyValueLog, SetRmReopen)
+{
+  string dir = make_temp_dir("kv_log");
+  ASSERT_NE("", dir);
+  KeyValueLog kv(dir + "/log", 1 << 20);
+  ASSERT_EQ(0, kv.open(true));
+
+  KeyValueLog::Transaction t;
+  t.set("a", make_val("1"));
+  t.set("b", make_val("2"));
+  t.set("c", make_val("3"));
+  ASSERT_EQ(0, kv.submit(t));
+
+  KeyValueLog::Transaction t2;
+  t2.rm("b");
+  t2.set("c", make_val("33"));
+  ASSERT_EQ(0, kv.submit(t2));
+
+  ASSERT_EQ("1", get_str(kv, "a"));
+  ASSERT_FALSE(kv.exists("b"));
+  ASSERT_EQ("33", get_str(kv, "c"));
+
+  kv.close();
+  ASSERT_EQ(0, kv.open(false));
+  ASSERT_EQ("1", get_str(kv, "a"));
+  ASSERT_FALSE(kv.exists("b"));
+  ASSERT_EQ("33", get_str(kv, "c"));
+  bufferlist bl;
+  ASSERT_EQ(-ENOENT, kv.get("b", &bl));
+  kv.close();
+  remove_temp_dir(dir);
+}
+
+TEST(KeyValueLog, TornTail)
+{
+  string dir = make_temp_dir("kv_log");
+  ASSERT_NE("", dir);
+  string path = dir + "/log";
+  KeyValueLog kv(path, 1 << 20);
+  ASSERT_EQ(0, kv.open(true));
+  set_key(kv, "first", "kept");
+  uint64_t good = file_size(path);
+  set_key(kv, "second", "torn");
+  kv.close();
+
+  // cut the second record short
+  ASSERT_EQ(0, ::truncate(path.c_str(), file_size(path) - 2));
+  ASSERT_EQ(0, kv.open(false));
+  ASSERT_EQ("kept", get_str(kv, "first"));
+  ASSERT_FALSE(kv.exists("second"));
+  ASSERT_EQ(good, file_size(path));
+
+  // new records go where the torn one was
+  set_key(kv, "third", "after");
+  kv.close();
+  ASSERT_EQ(0, kv.open(false));
+  ASSERT_EQ("kept", get_str(kv, "first"));
+  ASSERT_EQ("after", get_str(kv, "third"));
+  kv.close();
+  remove_temp_dir(dir);
+}
+
+TEST(KeyValueLog, CorruptTail)
+{
+  string dir = make_temp_dir("kv_log");
+  ASSERT_NE("", dir);
+  string path = dir + "/log";
+  KeyValueLog kv(path, 1 << 20);
+  ASSERT_EQ(0, kv.open(true));
+  set_key(kv, "first", "kept");
+  uint64_t good = file_size(path);
+  set_key(kv, "second", "corrupt");
+  kv.close();
+
+  // flip the last payload byte so the crc no longer matches
+  int fd = ::open(path.c_str(), O_RDWR);
+  ASSERT_LE(0, fd);
+  char c;
+  uint64_t last = file_size(path) - 1;
+  ASSERT_EQ(1, ::pread(fd, &c, 1, last));
+  c ^= 0xff;
+  ASSERT_EQ(1, ::pwrite(fd, &c, 1, last));
+  // and trail it with garbage
+  const char junk[] = "not a record";
+  ASSERT_EQ((ssize_t)sizeof(junk), ::pwrite(fd, junk, sizeof(junk), last + 1));
+  ::close(fd);
+
+  ASSERT_EQ(0, kv.open(false));
+  ASSERT_EQ("kept", get_str(kv, "first"));
+  ASSERT_FALSE(kv.exists("second"));
+  ASSERT_EQ(good, file_size(path));
+  kv.close();
+  remove_temp_dir(dir);
+}
+
+TEST(KeyValueLog, Compaction)
+{
+  string dir = make_temp_dir("kv_log");
+  ASSERT_NE("", dir);
+  string path = dir + "/log";
+  KeyValueLog kv(path, 4096);
+  ASSERT_EQ(0, kv.open(true));
+
+  string big(1000, 'x');
+  set_key(kv, "keep", "kept");
+  for (int i = 0; i < 100; i++) {
+    char v[16];
+    snprintf(v, sizeof(v), "%d", i);
+    set_key(kv, "overwritten", big + v);
+  }
+  KeyValueLog::Transaction t;
+  t.set("gone", make_val(big));
+  ASSERT_EQ(0, kv.submit(t));
+  KeyValueLog::Transaction t2;
+  t2.rm("gone");
+  ASSERT_EQ(0, kv.submit(t2));
+
+  // 100k of overwrites, but never much more dead than compact_min
+  // or the live data
+  ASSERT_GT(3 * 4096u, file_size(path));
+  ASSERT_EQ(big + "99", get_str(kv, "overwritten"));
+  ASSERT_EQ("kept", get_str(kv, "keep"));
+  ASSERT_FALSE(kv.exists("gone"));
+  ASSERT_NE(0, ::access((path + ".tmp").c_str(), F_OK));
+
+  kv.close();
+  ASSERT_EQ(0, kv.open(false));
+  ASSERT_EQ(big + "99", get_str(kv, "overwritten"));
+  ASSERT_EQ("kept", get_str(kv, "keep"));
+  ASSERT_FALSE(kv.exists("gone"));
+  kv.close();
+  remove_temp_dir(dir);
+}
+
+TEST(KeyValueLog, LeftoverCompaction)
+{
+  string dir = make_temp_dir("kv_log");
+  ASSERT_NE("", dir);
+  string path = dir + "/log";
+  KeyValueLog kv(path, 1 << 20);
+  ASSERT_EQ(0, kv.open(true));
+  set_key(kv, "a", "1");
+  kv.close();
+
+  // a compaction that died before its rename is thrown away
+  int fd = ::open((path + ".tmp").c_str(), O_CREAT|O_WRONLY, 0644);
+  ASSERT_LE(0, fd);
+  ASSERT_EQ(4, ::write(fd, "junk", 4));
+  ::close(fd);
+  ASSERT_EQ(0, kv.open(false));
+  ASSERT_EQ("1", get_str(kv, "a"));
+  ASSERT_NE(0, ::access((path + ".tmp").c_str(), F_OK));
+  kv.close();
+  remove_temp_dir(dir);
+}
+
+TEST(KeyValueLog, Prefix)
+{
+  string dir = make_temp_dir("kv_log");
+  ASSERT_NE("", dir);
+  KeyValueLog kv(dir + "/log", 1 << 20);
+  ASSERT_EQ(0, kv.open(true));
+
+  KeyValueLog::Transaction t;
+  t.set("a", make_val("bare"));
+  t.set("a.1", make_val("one"));
+  t.set("a.2", make_val("two"));
+  t.set("ab", make_val("other"));
+  t.set("b.1", make_val("b"));
+  ASSERT_EQ(0, kv.submit(t));
+  // a value in a later record, not adjacent to the others
+  set_key(kv, "z", string(8192, 'z'));
+  set_key(kv, "a.3", "three");
+
+  map<string, bufferlist> out;
+  ASSERT_EQ(0, kv.get_prefix("a.", &out));
+  ASSERT_EQ(3u, out.size());
+  ASSERT_EQ("one", string(out["1"].c_str(), out["1"].length()));
+  ASSERT_EQ("two", string(out["2"].c_str(), out["2"].length()));
+  ASSERT_EQ("three", string(out["3"].c_str(), out["3"].length()));
+
+  out.clear();
+  ASSERT_EQ(0, kv.get_prefix("a", &out));
+  ASSERT_EQ(5u, out.size());
+  ASSERT_EQ("bare", string(out[""].c_str(), out[""].length()));
+  ASSERT_EQ("other", string(out["b"].c_str(), out["b"].length()));
+
+  out.clear();
+  ASSERT_EQ(0, kv.get_prefix("c", &out));
+  ASSERT_TRUE(out.empty());
+
+  KeyValueLog::Transaction rm;
+  ASSERT_EQ(3, kv.rm_prefix("a.", &rm));
+  ASSERT_EQ(0, kv.submit(rm));
+  out.clear();
+  ASSERT_EQ(0, kv.get_prefix("a", &out));
+  ASSERT_EQ(2u, out.size());
+  ASSERT_EQ("b", get_str(kv, "b.1"));
+  kv.close();
+  remove_temp_dir(dir);
+}
+
+static void set_conf(const char *key, const char *val)
+{
+  ASSERT_EQ(0, g_ceph_context->_conf->set_val(key, val));
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
+static bool coll_marked(const string &base, const char *c)
+{
+  char v;
+  string fn = base + "/current/" + c;
+  return ::getxattr(fn.c_str(), "user.cephos.kvattrs", &v, sizeof(v)) >= 0;
+}
+
+/*
+ * Only collections holding an object with spilled attrs are marked, a
+ * link in another collection carries the mark along, and attrs read the
+ * same through every link.
+ */
+TEST(FileStoreKvAttrs, MarkedCollections)
+{
+  string dir = make_temp_dir("kv_log");
+  ASSERT_NE("", dir);
+  string base = dir + "/store";
+  set_conf("filestore_kv_attrs", "true");
+  set_conf("filestore_kv_attr_size_threshold", "64");
+  set_conf("journal_dio", "false");
+  set_conf("journal_aio", "false");
+
+  FileStore *fs = new FileStore(base, dir + "/journal");
+  ASSERT_EQ(0, mkdir(base.c_str(), 0755));
+  ASSERT_EQ(0, fs->mkfs());
+  ASSERT_EQ(0, fs->mount());
+
+  coll_t a("a"), b("b"), plain("plain");
+  sobject_t o("obj", CEPH_NOSNAP);
+  bufferlist big, small;
+  big.append(string(200, 'b'));
+  small.append("s");
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(a);
+    t.create_collection(b);
+    t.create_collection(plain);
+    t.touch(a, o);
+    t.touch(plain, o);
+    t.setattr(plain, o, "small", small);
+    t.setattr(a, o, "big", big);
+    t.collection_add(b, a, o);
+    ASSERT_EQ(0u, fs->apply_transaction(t));
+  }
+  ASSERT_TRUE(coll_marked(base, "a"));
+  ASSERT_TRUE(coll_marked(base, "b"));
+  ASSERT_FALSE(coll_marked(base, "plain"));
+
+  bufferptr bp;
+  ASSERT_EQ(200, fs->getattr(b, o, "big", bp));
+  ASSERT_EQ(0, memcmp(bp.c_str(), big.c_str(), 200));
+  ASSERT_EQ(1, fs->getattr(plain, o, "small", bp));
+  ASSERT_EQ(-ENODATA, fs->getattr(plain, o, "big", bp));
+
+  {
+    ObjectStore::Transaction t;
+    t.collection_remove(a, o);
+    ASSERT_EQ(0u, fs->apply_transaction(t));
+  }
+  ASSERT_EQ(200, fs->getattr(b, o, "big", bp));
+
+  ASSERT_EQ(0, fs->umount());
+  delete fs;
+  set_conf("filestore_kv_attrs", "false");
+  remove_temp_dir(dir);
+}
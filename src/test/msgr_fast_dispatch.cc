@@ -0,0 +1,172 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2011 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * Block the dispatch thread on one message, then check that messages
+ * the dispatcher claims for fast dispatch still arrive, in order and
+ * on another thread.
+ */
+
+#include "common/Cond.h"
+#include "common/Mutex.h"
+#include "common/config.h"
+#include "messages/MGenericMessage.h"
+#include "messages/MPing.h"
+#include "msg/SimpleMessenger.h"
+#include "test/unit.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+static const int NUM_FAST = 20;
+
+class FastDispatcher : public Dispatcher {
+public:
+  Mutex lock;
+  Cond cond;
+  bool blocked, released;
+  pthread_t dispatch_thread;
+  int fast;
+  bool fast_on_dispatch_thread;
+  bool in_order;
+
+  FastDispatcher()
+    : Dispatcher(g_ceph_context), lock("FastDispatcher::lock"),
+      blocked(false), released(false), fast(0),
+      fast_on_dispatch_thread(false), in_order(true) {}
+
+  bool ms_can_fast_dispatch(Message *m) {
+    return m->get_type() == CEPH_MSG_PING;
+  }
+
+  void ms_fast_dispatch(Message *m) {
+    Mutex::Locker l(lock);
+    if (blocked && pthread_equal(pthread_self(), dispatch_thread))
+      fast_on_dispatch_thread = true;
+    if (m->get_seq() != (uint64_t)fast + 2)  // the slow message was 1
+      in_order = false;
+    fast++;
+    cond.Signal();
+    m->put();
+  }
+
+  bool ms_dispatch(Message *m) {
+    assert(m->get_type() == CEPH_MSG_SHUTDOWN);
+    Mutex::Locker l(lock);
+    dispatch_thread = pthread_self();
+    blocked = true;
+    cond.Signal();
+    while (!released)
+      cond.Wait(lock);
+    blocked = false;
+    m->put();
+    return true;
+  }
+
+  bool ms_handle_reset(Connection *con) { return false; }
+  void ms_handle_remote_reset(Connection *con) {}
+
+  /// wait up to a few seconds for pred to hold
+  template <class P>
+  bool wait_for(P pred) {
+    utime_t until = ceph_clock_now(g_ceph_context);
+    until += 10.0;
+    while (!pred(this)) {
+      if (ceph_clock_now(g_ceph_context) > until)
+	return false;
+      cond.WaitInterval(g_ceph_context, lock, utime_t(0, 100000000));
+    }
+    return true;
+  }
+};
+
+class NullDispatcher : public Dispatcher {
+public:
+  NullDispatcher() : Dispatcher(g_ceph_context) {}
+  bool ms_dispatch(Message *m) {
+    m->put();
+    return true;
+  }
+  bool ms_handle_reset(Connection *con) { return false; }
+  void ms_handle_remote_reset(Connection *con) {}
+};
+
+static bool is_blocked(FastDispatcher *d) { return d->blocked; }
+static bool got_all_fast(FastDispatcher *d) { return d->fast == NUM_FAST; }
+
+static SimpleMessenger *start_messenger(entity_name_t name, uint64_t nonce,
+					Dispatcher *d)
+{
+  SimpleMessenger *m = new SimpleMessenger(g_ceph_context);
+  entity_addr_t addr;
+  addr.parse("127.0.0.1:0");
+  if (m->bind(addr, nonce) < 0)
+    return NULL;
+  m->register_entity(name);
+  m->add_dispatcher_head(d);
+  m->start();
+  return m;
+}
+
+static void stop_messenger(SimpleMessenger *m)
+{
+  m->shutdown();
+  m->wait();
+  m->destroy();
+}
+
+static void check_bypass(const char *threads)
+{
+  ASSERT_EQ(0, g_ceph_context->_conf->set_val("ms_fast_dispatch_threads", threads));
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  FastDispatcher server_d;
+  NullDispatcher client_d;
+  SimpleMessenger *server = start_messenger(entity_name_t::OSD(0), getpid(), &server_d);
+  ASSERT_TRUE(server);
+  SimpleMessenger *client = start_messenger(entity_name_t::CLIENT(-1), getpid() + 1, &client_d);
+  ASSERT_TRUE(client);
+
+  entity_inst_t dest = server->get_myinst();
+  client->send_message(new MGenericMessage(CEPH_MSG_SHUTDOWN), dest);
+  server_d.lock.Lock();
+  ASSERT_TRUE(server_d.wait_for(is_blocked));
+  server_d.lock.Unlock();
+
+  // the dispatch thread is stuck; these can only arrive by the fast path
+  for (int i = 0; i < NUM_FAST; i++)
+    client->send_message(new MPing, dest);
+  server_d.lock.Lock();
+  bool got = server_d.wait_for(got_all_fast);
+  bool still_blocked = server_d.blocked;
+  server_d.released = true;
+  server_d.cond.Signal();
+  server_d.lock.Unlock();
+
+  ASSERT_TRUE(got);
+  ASSERT_TRUE(still_blocked);
+  ASSERT_FALSE(server_d.fast_on_dispatch_thread);
+  ASSERT_TRUE(server_d.in_order);
+
+  stop_messenger(client);
+  stop_messenger(server);
+}
+
+TEST(MsgrFastDispatch, ReaderThread) {
+  check_bypass("0");
+}
+
+TEST(MsgrFastDispatch, DispatchThreads) {
+  check_bypass("2");
+}
@@ -0,0 +1,230 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2011 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "os/ObjectCache.h"
+#include "test/unit.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+
+using namespace std;
+
+static sobject_t obj(int i)
+{
+  char n[20];
+  snprintf(n, sizeof(n), "obj_%d", i);
+  return sobject_t(n, CEPH_NOSNAP);
+}
+
+static bufferlist make_data(unsigned len, char c)
+{
+  bufferlist bl;
+  bufferptr bp(len);
+  memset(bp.c_str(), c, len);
+  bl.push_back(bp);
+  return bl;
+}
+
+static bufferptr make_attr(const char *s)
+{
+  return bufferptr(s, strlen(s));
+}
+
+TEST(ObjectCache, AttrHitMiss)
+{
+  ObjectCache cache(4, 1 << 20, 4096);
+  coll_t c("c");
+  sobject_t o = obj(0);
+  bufferptr bp;
+
+  ASSERT_EQ(-ENOENT, cache.get_attr(c, o, "a", &bp));
+  cache.add_attr(cache.get_gen(o), c, o, "a", make_attr("1"));
+  ASSERT_EQ(0, cache.get_attr(c, o, "a", &bp));
+  ASSERT_EQ(string("1"), string(bp.c_str(), bp.length()));
+
+  // a single attr says nothing about the others
+  ASSERT_EQ(-ENOENT, cache.get_attr(c, o, "b", &bp));
+  map<string, bufferptr> aset;
+  ASSERT_FALSE(cache.get_attrs(c, o, &aset));
+
+  // the full set does
+  aset["a"] = make_attr("1");
+  aset["c"] = make_attr("3");
+  cache.add_attrs(cache.get_gen(o), c, o, aset);
+  ASSERT_EQ(-ENODATA, cache.get_attr(c, o, "b", &bp));
+  map<string, bufferptr> got;
+  ASSERT_TRUE(cache.get_attrs(c, o, &got));
+  ASSERT_EQ(2u, got.size());
+}
+
+TEST(ObjectCache, StaleGen)
+{
+  ObjectCache cache(4, 1 << 20, 4096);
+  coll_t c("c");
+  sobject_t o = obj(0);
+  bufferlist bl;
+
+  // a read that raced with a write must not fill the cache
+  uint64_t gen = cache.get_gen(o);
+  cache.invalidate_data(o);
+  cache.add_data(gen, c, o, 0, make_data(100, 'x'), true);
+  ASSERT_EQ(-ENOENT, cache.read(c, o, 0, 100, &bl));
+  ASSERT_FALSE(cache.is_cached(c, o, 0, 100));
+
+  gen = cache.get_gen(o);
+  cache.invalidate_attrs(o);
+  cache.add_attr(gen, c, o, "a", make_attr("1"));
+  map<string, bufferptr> aset;
+  aset["a"] = make_attr("1");
+  cache.add_attrs(gen, c, o, aset);
+  bufferptr bp;
+  ASSERT_EQ(-ENOENT, cache.get_attr(c, o, "a", &bp));
+  ASSERT_FALSE(cache.get_attrs(c, o, &aset));
+
+  // ... as must any invalidation of the object, through any collection
+  gen = cache.get_gen(o);
+  cache.invalidate(coll_t("other"), o);
+  cache.add_data(gen, c, o, 0, make_data(100, 'x'), true);
+  ASSERT_EQ(-ENOENT, cache.read(c, o, 0, 100, &bl));
+
+  // a fresh ticket works
+  gen = cache.get_gen(o);
+  cache.add_data(gen, c, o, 0, make_data(100, 'x'), true);
+  ASSERT_EQ(100, cache.read(c, o, 0, 100, &bl));
+  ASSERT_LT(0u, cache.get_bytes());
+}
+
+TEST(ObjectCache, TrimToLimit)
+{
+  // one shard, so the limit is exact
+  const uint64_t max = 64 * 1024;
+  ObjectCache cache(1, max, 16384);
+  coll_t c("c");
+  bufferlist bl;
+
+  for (int i = 0; i < 32; i++) {
+    sobject_t o = obj(i);
+    cache.add_data(cache.get_gen(o), c, o, 0, make_data(8192, 'a' + i % 26), true);
+    ASSERT_GE(max, cache.get_bytes());
+
+    // keep obj_0 warm
+    bl.clear();
+    ASSERT_EQ(8192, cache.read(c, obj(0), 0, 8192, &bl));
+  }
+  ASSERT_LT(0u, cache.get_bytes());
+
+  // the oldest went first; the newest and the warm one are still here
+  ASSERT_FALSE(cache.is_cached(c, obj(1), 0, 8192));
+  ASSERT_TRUE(cache.is_cached(c, obj(31), 0, 8192));
+  ASSERT_TRUE(cache.is_cached(c, obj(0), 0, 8192));
+
+  // extents over max_extent are not cached at all
+  sobject_t big = obj(100);
+  cache.add_data(cache.get_gen(big), c, big, 0, make_data(16385, 'b'), true);
+  ASSERT_FALSE(cache.is_cached(c, big, 0, 1));
+
+  cache.clear();
+  ASSERT_EQ(0u, cache.get_bytes());
+}
+
+TEST(ObjectCache, ShortReads)
+{
+  ObjectCache cache(4, 1 << 20, 4096);
+  coll_t c("c");
+  sobject_t o = obj(0), p = obj(1);
+  bufferlist bl;
+
+  // o is 100 bytes long, and we have all of it
+  cache.add_data(cache.get_gen(o), c, o, 0, make_data(100, 'x'), true);
+  ASSERT_EQ(100, cache.read(c, o, 0, 200, &bl));
+  ASSERT_EQ(100u, bl.length());
+  bl.clear();
+  ASSERT_EQ(50, cache.read(c, o, 50, 0, &bl));   // to the end
+  ASSERT_EQ(50u, bl.length());
+  bl.clear();
+  ASSERT_EQ(0, cache.read(c, o, 150, 10, &bl));  // past the end
+  ASSERT_EQ(0u, bl.length());
+  ASSERT_TRUE(cache.is_cached(c, o, 90, 1000));
+
+  // p goes on past what we have
+  cache.add_data(cache.get_gen(p), c, p, 10, make_data(100, 'y'), false);
+  ASSERT_EQ(-ENOENT, cache.read(c, p, 10, 200, &bl));
+  ASSERT_EQ(-ENOENT, cache.read(c, p, 10, 0, &bl));
+  ASSERT_EQ(-ENOENT, cache.read(c, p, 0, 20, &bl));  // before the extent
+  ASSERT_EQ(0u, bl.length());
+  ASSERT_EQ(50, cache.read(c, p, 20, 50, &bl));
+  ASSERT_EQ(string(50, 'y'), string(bl.c_str(), bl.length()));
+  ASSERT_FALSE(cache.is_cached(c, p, 100, 20));
+  ASSERT_TRUE(cache.is_cached(c, p, 100, 10));
+
+  // a write overlapping the extent drops it; one that doesn't, doesn't
+  cache.trim(c, p, 200, 10);
+  ASSERT_TRUE(cache.is_cached(c, p, 10, 100));
+  cache.trim(c, p, 0, 11);
+  ASSERT_FALSE(cache.is_cached(c, p, 10, 100));
+}
+
+TEST(ObjectCache, InvalidateAcrossCollections)
+{
+  ObjectCache cache(4, 1 << 20, 4096);
+  coll_t c1("c1"), c2("c2");
+  sobject_t o = obj(0), other = obj(1);
+  bufferptr bp;
+
+  // o is linked into both collections
+  for (int i = 0; i < 2; i++) {
+    coll_t c = i ? c2 : c1;
+    cache.add_attr(cache.get_gen(o), c, o, "a", make_attr("1"));
+    cache.add_data(cache.get_gen(o), c, o, 0, make_data(100, 'x'), true);
+  }
+  cache.add_data(cache.get_gen(other), c1, other, 0, make_data(100, 'z'), true);
+
+  // a write through either link is seen through both
+  cache.invalidate_data(o);
+  ASSERT_FALSE(cache.is_cached(c1, o, 0, 100));
+  ASSERT_FALSE(cache.is_cached(c2, o, 0, 100));
+  ASSERT_EQ(0, cache.get_attr(c1, o, "a", &bp));
+  ASSERT_EQ(0, cache.get_attr(c2, o, "a", &bp));
+  ASSERT_TRUE(cache.is_cached(c1, other, 0, 100));
+
+  cache.invalidate_attrs(o);
+  ASSERT_EQ(-ENOENT, cache.get_attr(c1, o, "a", &bp));
+  ASSERT_EQ(-ENOENT, cache.get_attr(c2, o, "a", &bp));
+
+  // unlinking from one collection leaves the other
+  for (int i = 0; i < 2; i++) {
+    coll_t c = i ? c2 : c1;
+    cache.add_data(cache.get_gen(o), c, o, 0, make_data(100, 'x'), true);
+  }
+  cache.invalidate(c1, o);
+  ASSERT_FALSE(cache.is_cached(c1, o, 0, 100));
+  ASSERT_TRUE(cache.is_cached(c2, o, 0, 100));
+
+  // as does removing a whole collection
+  cache.add_data(cache.get_gen(o), c1, o, 0, make_data(100, 'x'), true);
+  cache.invalidate_collection(c1);
+  ASSERT_FALSE(cache.is_cached(c1, o, 0, 100));
+  ASSERT_FALSE(cache.is_cached(c1, other, 0, 100));
+  ASSERT_TRUE(cache.is_cached(c2, o, 0, 100));
+
+  // and removing the object drops every link
+  cache.add_data(cache.get_gen(o), c1, o, 0, make_data(100, 'x'), true);
+  cache.invalidate(o);
+  ASSERT_FALSE(cache.is_cached(c1, o, 0, 100));
+  ASSERT_FALSE(cache.is_cached(c2, o, 0, 100));
+  ASSERT_EQ(0u, cache.get_bytes());
+}
@@ -0,0 +1,195 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2011 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "osd/OSDMap.h"
+#include "osd/OSDMapMapping.h"
+#include "test/unit.h"
+
+#include <map>
+#include <set>
+#include <vector>
+
+using namespace std;
+
+static const int NUM_OSD = 20;
+
+// 20 osds, all up and in; 3 pools of 1280 pgs with pgp_num 640
+static void make_map(OSDMap& osdmap)
+{
+  ceph_fsid_t fsid;
+  memset(&fsid, 0, sizeof(fsid));
+  OSDMap tmp;
+  tmp.build_simple(g_ceph_context, 0, fsid, NUM_OSD, 0, 6, 5, 0);
+  bufferlist bl;
+  tmp.encode(bl);
+  osdmap.decode(bl);
+
+  OSDMap::Incremental inc(osdmap.get_epoch() + 1);
+  inc.fsid = fsid;
+  for (int i = 0; i < NUM_OSD; i++) {
+    inc.new_up_client[i] = entity_addr_t();
+    inc.new_weight[i] = CEPH_OSD_IN;
+  }
+  osdmap.apply_incremental(inc);
+}
+
+static void apply(OSDMap& osdmap, OSDMap::Incremental& inc)
+{
+  inc.epoch = osdmap.get_epoch() + 1;
+  inc.fsid = osdmap.get_fsid();
+  ASSERT_EQ(0, osdmap.apply_incremental(inc));
+}
+
+struct mapping_t {
+  vector<int> raw, up, acting;
+};
+
+// compute every (raw) pg directly, without a table
+static void compute_all(OSDMap& osdmap, map<pg_t,mapping_t>& out)
+{
+  ASSERT_FALSE(osdmap.have_mapping());
+  const map<int,pg_pool_t>& pools = osdmap.get_pools();
+  for (map<int,pg_pool_t>::const_iterator p = pools.begin(); p != pools.end(); ++p) {
+    for (unsigned ps = 0; ps < 2 * (unsigned)p->second.get_pg_num(); ps++) {
+      pg_t pg(ps, p->first, -1);
+      mapping_t& m = out[pg];
+      osdmap.pg_to_osds(pg, m.raw);
+      osdmap.pg_to_up_acting_osds(pg, m.up, m.acting);
+    }
+  }
+}
+
+static void check_all(OSDMap& osdmap, map<pg_t,mapping_t>& expect)
+{
+  ASSERT_TRUE(osdmap.have_mapping());
+  for (map<pg_t,mapping_t>::iterator p = expect.begin(); p != expect.end(); ++p) {
+    vector<int> raw, up, acting, up2, acting2;
+    osdmap.pg_to_osds(p->first, raw);
+    osdmap.pg_to_up_acting_osds(p->first, up, acting);
+    osdmap.pg_to_raw_up(p->first, up2);
+    osdmap.pg_to_acting_osds(p->first, acting2);
+    ASSERT_EQ(p->second.raw, raw) << p->first;
+    ASSERT_EQ(p->second.up, up) << p->first;
+    ASSERT_EQ(p->second.acting, acting) << p->first;
+    ASSERT_EQ(p->second.up, up2) << p->first;
+    ASSERT_EQ(p->second.acting, acting2) << p->first;
+  }
+}
+
+TEST(OSDMapMapping, MatchesCrush) {
+  OSDMap osdmap;
+  make_map(osdmap);
+
+  // one osd down, a pg_temp longer than the pool size, and one shorter
+  OSDMap::Incremental inc;
+  inc.new_state[3] = CEPH_OSD_UP;
+  inc.new_pg_temp[pg_t(7, 0, -1)].push_back(1);
+  inc.new_pg_temp[pg_t(7, 0, -1)].push_back(2);
+  inc.new_pg_temp[pg_t(7, 0, -1)].push_back(3);
+  inc.new_pg_temp[pg_t(7, 0, -1)].push_back(4);
+  inc.new_pg_temp[pg_t(9, 1, -1)].push_back(5);
+  apply(osdmap, inc);
+
+  map<pg_t,mapping_t> expect;
+  compute_all(osdmap, expect);
+
+  osdmap.update_mapping(1);
+  check_all(osdmap, expect);
+  ASSERT_EQ(osdmap.get_num_pgs(), osdmap.get_mapping().get_num_pgs());
+
+  osdmap.update_mapping(4);
+  check_all(osdmap, expect);
+
+  // the pg_temp entries are honored, and also apply to raw pgs folding onto them
+  vector<int> up, acting;
+  osdmap.pg_to_up_acting_osds(pg_t(7, 0, -1), up, acting);
+  ASSERT_EQ(3u, acting.size());
+  osdmap.pg_to_up_acting_osds(pg_t(7 + osdmap.get_pg_pool(0)->get_pg_num_mask() + 1, 0, -1),
+			      up, acting);
+  ASSERT_EQ(3u, acting.size());
+
+  // localized pgs aren't in the table but still resolve
+  vector<int> raw;
+  ASSERT_FALSE(osdmap.get_mapping().get(*osdmap.get_pg_pool(0), pg_t(1, 0, 2),
+					 &raw, NULL, NULL));
+  ASSERT_LT(0, osdmap.pg_to_osds(pg_t(1, 0, 2), raw));
+}
+
+TEST(OSDMapMapping, Invalidate) {
+  OSDMap osdmap;
+  make_map(osdmap);
+  osdmap.update_mapping(1);
+  ASSERT_TRUE(osdmap.have_mapping());
+
+  OSDMap::Incremental inc;
+  inc.new_state[5] = CEPH_OSD_UP;
+  apply(osdmap, inc);
+  ASSERT_FALSE(osdmap.have_mapping());
+
+  osdmap.update_mapping(1);
+  osdmap.set_weight(2, CEPH_OSD_OUT);
+  ASSERT_FALSE(osdmap.have_mapping());
+
+  osdmap.update_mapping(1);
+  bufferlist bl;
+  osdmap.encode(bl);
+  osdmap.decode(bl);
+  ASSERT_FALSE(osdmap.have_mapping());
+
+  // crush changes don't go through the epoch
+  osdmap.update_mapping(1);
+  osdmap.crush.adjust_item_weightf(0, 0.5);
+  ASSERT_FALSE(osdmap.have_mapping());
+}
+
+TEST(OSDMapMapping, Diff) {
+  OSDMap osdmap;
+  make_map(osdmap);
+  map<pg_t,mapping_t> before;
+  compute_all(osdmap, before);
+  osdmap.update_mapping(4);
+  OSDMapMapping old = osdmap.get_mapping();
+
+  // nothing changed
+  set<pg_t> changed;
+  OSDMapMapping::diff(old, osdmap.get_mapping(), &changed);
+  ASSERT_TRUE(changed.empty());
+
+  // take an osd down and remove a pool
+  OSDMap::Incremental inc;
+  inc.new_state[11] = CEPH_OSD_UP;
+  inc.old_pools.insert(2);
+  apply(osdmap, inc);
+  map<pg_t,mapping_t> after;
+  compute_all(osdmap, after);
+  osdmap.update_mapping(4);
+
+  OSDMapMapping::diff(old, osdmap.get_mapping(), &changed);
+  set<pg_t> expect;
+  for (map<pg_t,mapping_t>::iterator p = before.begin(); p != before.end(); ++p) {
+    if (p->first.ps() >= (unsigned)(NUM_OSD << 6))
+      continue;  // raw pg
+    if (!osdmap.have_pg_pool(p->first.pool()) ||
+	after[p->first].up != p->second.up ||
+	after[p->first].acting != p->second.acting)
+      expect.insert(p->first);
+  }
+  ASSERT_FALSE(expect.empty());
+  ASSERT_EQ(expect, changed);
+
+  // ... and back again
+  changed.clear();
+  OSDMapMapping::diff(osdmap.get_mapping(), old, &changed);
+  ASSERT_EQ(expect, changed);
+}
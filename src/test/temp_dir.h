@@ -0,0 +1,46 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2011 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_TEST_TEMP_DIR_H
+#define CEPH_TEST_TEMP_DIR_H
+
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+/*
+ * Scratch directories for unit tests that need a real filesystem:
+ * $TMPDIR/<name>.XXXXXX, or /tmp if TMPDIR isn't set.
+ */
+
+/// create a fresh scratch directory; returns "" on failure
+static inline std::string make_temp_dir(const char *name)
+{
+  const char *tmpdir = getenv("TMPDIR");
+  std::string tmpl = std::string(tmpdir ? tmpdir : "/tmp") + "/" + name + ".XXXXXX";
+  std::vector<char> buf(tmpl.begin(), tmpl.end());
+  buf.push_back('\0');
+  if (!mkdtemp(&buf[0]))
+    return "";
+  return std::string(&buf[0]);
+}
+
+/// remove a scratch directory and everything in it
+static inline void remove_temp_dir(const std::string &dir)
+{
+  std::string cmd = "rm -rf " + dir;
+  system(cmd.c_str());
+}
+
+#endif
@@ -0,0 +1,281 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2011 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * Test ObjectOperation::copy_from against a running cluster: a source in
+ * the same pg, one in another pg, a missing source, one too big for the
+ * osds to copy, which the caller has to copy itself, and ops sent right
+ * behind a copy to the same object.
+ */
+
+#include "common/ceph_argparse.h"
+#include "common/debug.h"
+#include "common/config.h"
+#include "global/global_init.h"
+#include "include/assert.h"
+#include "include/rados/librados.hpp"
+#include "include/types.h"
+
+#include <errno.h>
+#include <iostream>
+#include <map>
+#include <string>
+#include <string.h>
+
+using std::cerr;
+using std::cout;
+using std::map;
+using std::string;
+
+using namespace librados;
+
+static void usage(void)
+{
+  cerr << "--pool          set pool to copy objects in" << std::endl;
+}
+
+static bool same_data(bufferlist& a, bufferlist& b)
+{
+  return a.length() == b.length() &&
+    (!a.length() || memcmp(a.c_str(), b.c_str(), a.length()) == 0);
+}
+
+static int copy(IoCtx& dest_ctx, const string& dest, IoCtx& src_ctx, const string& src)
+{
+  librados::ObjectOperation op;
+  op.copy_from(src, src_ctx);
+  bufferlist outbl;
+  return dest_ctx.operate(dest, &op, &outbl);
+}
+
+static void check_copy(IoCtx& dest_ctx, const string& dest, IoCtx& src_ctx, const string& src)
+{
+  uint64_t src_size, dest_size;
+  time_t mtime;
+  assert(src_ctx.stat(src, &src_size, &mtime) == 0);
+  assert(dest_ctx.stat(dest, &dest_size, &mtime) == 0);
+  assert(src_size == dest_size);
+
+  bufferlist src_bl, dest_bl;
+  assert(src_ctx.read(src, src_bl, src_size, 0) == (int)src_size);
+  assert(dest_ctx.read(dest, dest_bl, dest_size, 0) == (int)dest_size);
+  assert(same_data(src_bl, dest_bl));
+
+  map<string, bufferlist> src_attrs, dest_attrs;
+  assert(src_ctx.getxattrs(src, src_attrs) == 0);
+  assert(dest_ctx.getxattrs(dest, dest_attrs) == 0);
+  assert(src_attrs.size() == dest_attrs.size());
+  for (map<string, bufferlist>::iterator p = src_attrs.begin(); p != src_attrs.end(); ++p) {
+    assert(dest_attrs.count(p->first));
+    assert(same_data(p->second, dest_attrs[p->first]));
+  }
+}
+
+static void make_source(IoCtx& ctx, const string& oid)
+{
+  bufferlist bl, attr;
+  bl.append("copy me, then leave a hole");
+  assert(ctx.write_full(oid, bl) == 0);
+  bufferlist tail;
+  tail.append("tail");
+  assert(ctx.write(oid, tail, tail.length(), 65536) == (int)tail.length());
+  attr.append("value");
+  assert(ctx.setxattr(oid, "attr", attr) == 0);
+}
+
+static void make_dest(IoCtx& ctx, const string& oid)
+{
+  // a dest that already exists gets its data and xattrs replaced
+  bufferlist bl, attr;
+  bl.append("old data that is longer than the source data, by a good bit");
+  assert(ctx.write_full(oid, bl) == 0);
+  attr.append("stale");
+  assert(ctx.setxattr(oid, "stale_attr", attr) == 0);
+}
+
+static void test_same_pg(Rados& rados, const string& pool_name)
+{
+  IoCtx ctx;
+  assert(rados.ioctx_create(pool_name.c_str(), ctx) == 0);
+  ctx.locator_set_key("copy_from_same_pg");
+  make_source(ctx, "same_pg_src");
+  make_dest(ctx, "same_pg_dest");
+  assert(copy(ctx, "same_pg_dest", ctx, "same_pg_src") == 0);
+  check_copy(ctx, "same_pg_dest", ctx, "same_pg_src");
+  ctx.remove("same_pg_src");
+  ctx.remove("same_pg_dest");
+  cout << "copy_from same pg: ok" << std::endl;
+}
+
+static void test_other_pg(Rados& rados, const string& pool_name)
+{
+  IoCtx src_ctx, dest_ctx;
+  assert(rados.ioctx_create(pool_name.c_str(), src_ctx) == 0);
+  assert(rados.ioctx_create(pool_name.c_str(), dest_ctx) == 0);
+
+  // different keys almost always land in different pgs; try a few
+  for (int i = 0; i < 16; i++) {
+    char src[32], dest[32];
+    snprintf(src, sizeof(src), "other_pg_src.%d", i);
+    snprintf(dest, sizeof(dest), "other_pg_dest.%d", i);
+    make_source(src_ctx, src);
+    assert(copy(dest_ctx, dest, src_ctx, src) == 0);
+    check_copy(dest_ctx, dest, src_ctx, src);
+    src_ctx.remove(src);
+    dest_ctx.remove(dest);
+  }
+  cout << "copy_from other pg: ok" << std::endl;
+}
+
+static void test_missing_source(Rados& rados, const string& pool_name)
+{
+  IoCtx ctx;
+  assert(rados.ioctx_create(pool_name.c_str(), ctx) == 0);
+  ctx.remove("missing_src");
+  assert(copy(ctx, "missing_dest", ctx, "missing_src") == -ENOENT);
+
+  uint64_t size;
+  time_t mtime;
+  assert(ctx.stat("missing_dest", &size, &mtime) == -ENOENT);
+  cout << "copy_from missing source: ok" << std::endl;
+}
+
+static void test_copy_then_write(Rados& rados, const string& pool_name)
+{
+  IoCtx src_ctx, dest_ctx;
+  assert(rados.ioctx_create(pool_name.c_str(), src_ctx) == 0);
+  assert(rados.ioctx_create(pool_name.c_str(), dest_ctx) == 0);
+
+  // a copy from another pg waits for the source to be fetched; a write
+  // and a read sent behind it must still see the copy applied first
+  for (int i = 0; i < 16; i++) {
+    char src[32], dest[32];
+    snprintf(src, sizeof(src), "order_src.%d", i);
+    snprintf(dest, sizeof(dest), "order_dest.%d", i);
+    make_source(src_ctx, src);
+    make_dest(dest_ctx, dest);
+
+    librados::ObjectOperation op;
+    op.copy_from(src, src_ctx);
+    bufferlist copy_out, after, read_bl;
+    after.append("written after the copy");
+    AioCompletion *copy_c = Rados::aio_create_completion();
+    AioCompletion *write_c = Rados::aio_create_completion();
+    AioCompletion *read_c = Rados::aio_create_completion();
+    assert(dest_ctx.aio_operate(dest, copy_c, &op, &copy_out) == 0);
+    assert(dest_ctx.aio_write_full(dest, write_c, after) == 0);
+    assert(dest_ctx.aio_read(dest, read_c, &read_bl, 1 << 20, 0) == 0);
+    copy_c->wait_for_complete();
+    write_c->wait_for_complete();
+    read_c->wait_for_complete();
+    assert(copy_c->get_return_value() == 0);
+    assert(write_c->get_return_value() == 0);
+    assert(read_c->get_return_value() == (int)after.length());
+    assert(same_data(read_bl, after));
+    copy_c->release();
+    write_c->release();
+    read_c->release();
+
+    bufferlist bl;
+    assert(dest_ctx.read(dest, bl, 1 << 20, 0) == (int)after.length());
+    assert(same_data(bl, after));
+    src_ctx.remove(src);
+    dest_ctx.remove(dest);
+  }
+  cout << "copy_from then write: ok" << std::endl;
+}
+
+static void test_fallback(Rados& rados, const string& pool_name)
+{
+  IoCtx ctx;
+  assert(rados.ioctx_create(pool_name.c_str(), ctx) == 0);
+
+  // one byte past what the osds will copy
+  bufferlist bl;
+  bl.append("x");
+  uint64_t max = g_conf->osd_copy_from_max_bytes;
+  assert(ctx.write("big_src", bl, bl.length(), max) == (int)bl.length());
+  make_dest(ctx, "big_dest");
+
+  assert(copy(ctx, "big_dest", ctx, "big_src") == -EOPNOTSUPP);
+
+  // and the dest is left alone
+  uint64_t size;
+  time_t mtime;
+  map<string, bufferlist> attrs;
+  assert(ctx.stat("big_dest", &size, &mtime) == 0);
+  assert(size < max);
+  assert(ctx.getxattrs("big_dest", attrs) == 0);
+  assert(attrs.count("stale_attr"));
+
+  ctx.remove("big_src");
+  ctx.remove("big_dest");
+  cout << "copy_from fallback: ok" << std::endl;
+}
+
+int main(int argc, const char **argv)
+{
+  vector<const char*> args;
+  argv_to_vec(argc, argv, args);
+  env_to_vec(args);
+  global_init(args, CEPH_ENTITY_TYPE_CLIENT, CODE_ENVIRONMENT_UTILITY, 0);
+  common_init_finish(g_ceph_context);
+
+  string val;
+  string pool_name("test_copy_from");
+  for (std::vector<const char*>::iterator i = args.begin(); i != args.end(); ) {
+    if (strcmp(*i, "--") == 0)
+      break;
+    else if (ceph_argparse_witharg(args, i, &val, "--pool", "-p", (char*)NULL)) {
+      pool_name = val;
+    }
+    else {
+      cerr << "unknown command line option: " << *i << std::endl;
+      cerr << std::endl;
+      usage();
+      return 2;
+    }
+  }
+
+  Rados rados;
+  if (rados.init_with_context(g_ceph_context) < 0) {
+     cerr << "couldn't initialize rados!" << std::endl;
+     return 1;
+  }
+  if (rados.conf_read_file(NULL) < 0) {
+     cerr << "failed to read rados configuration file!" << std::endl;
+     return 1;
+  }
+  if (rados.connect() < 0) {
+     cerr << "couldn't connect to cluster!" << std::endl;
+     return 1;
+  }
+  if (rados.pool_lookup(pool_name.c_str()) <= 0) {
+    int ret = rados.pool_create(pool_name.c_str());
+    if (ret) {
+       cerr << "failed to create pool named '" << pool_name
+	    << "': error " << ret << std::endl;
+       return 1;
+    }
+  }
+
+  test_same_pg(rados, pool_name);
+  test_other_pg(rados, pool_name);
+  test_missing_source(rados, pool_name);
+  test_copy_then_write(rados, pool_name);
+  test_fallback(rados, pool_name);
+
+  rados.shutdown();
+  return 0;
+}
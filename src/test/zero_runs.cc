@@ -0,0 +1,92 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2011 New Dream Network
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "common/zero_runs.h"
+#include "gtest/gtest.h"
+
+#include <map>
+#include <string.h>
+
+using std::map;
+
+TEST(ZeroRuns, BufIsZero) {
+  char buf[100];
+  memset(buf, 0, sizeof(buf));
+  ASSERT_TRUE(buf_is_zero(buf, 0));
+  ASSERT_TRUE(buf_is_zero(buf, 1));
+  ASSERT_TRUE(buf_is_zero(buf, sizeof(buf)));
+
+  buf[0] = 1;
+  ASSERT_FALSE(buf_is_zero(buf, sizeof(buf)));
+  ASSERT_TRUE(buf_is_zero(buf + 1, sizeof(buf) - 1));
+  buf[0] = 0;
+
+  buf[sizeof(buf) - 1] = 1;
+  ASSERT_FALSE(buf_is_zero(buf, sizeof(buf)));
+  ASSERT_TRUE(buf_is_zero(buf, sizeof(buf) - 1));
+}
+
+TEST(ZeroRuns, AllZero) {
+  char buf[40];
+  memset(buf, 0, sizeof(buf));
+  map<uint64_t, uint64_t> runs;
+  get_data_runs(buf, sizeof(buf), 8, &runs);
+  ASSERT_TRUE(runs.empty());
+
+  get_data_runs(buf, 0, 8, &runs);
+  ASSERT_TRUE(runs.empty());
+}
+
+TEST(ZeroRuns, Leading) {
+  // data in the first two blocks, zeros after
+  char buf[40];
+  memset(buf, 0, sizeof(buf));
+  buf[0] = 1;
+  buf[15] = 1;
+  map<uint64_t, uint64_t> runs;
+  get_data_runs(buf, sizeof(buf), 8, &runs);
+  ASSERT_EQ(1u, runs.size());
+  ASSERT_EQ(16u, runs[0]);
+}
+
+TEST(ZeroRuns, Trailing) {
+  // zeros, then data in a short last block
+  char buf[36];
+  memset(buf, 0, sizeof(buf));
+  buf[35] = 1;
+  map<uint64_t, uint64_t> runs;
+  get_data_runs(buf, sizeof(buf), 8, &runs);
+  ASSERT_EQ(1u, runs.size());
+  ASSERT_EQ(4u, runs[32]);
+
+  // and a run that goes on to the end
+  buf[28] = 1;
+  runs.clear();
+  get_data_runs(buf, sizeof(buf), 8, &runs);
+  ASSERT_EQ(1u, runs.size());
+  ASSERT_EQ(12u, runs[24]);
+}
+
+TEST(ZeroRuns, Holes) {
+  char buf[64];
+  memset(buf, 0, sizeof(buf));
+  buf[3] = 1;
+  buf[40] = 1;
+  buf[50] = 1;
+  map<uint64_t, uint64_t> runs;
+  get_data_runs(buf, sizeof(buf), 8, &runs);
+  ASSERT_EQ(2u, runs.size());
+  ASSERT_EQ(8u, runs[0]);
+  ASSERT_EQ(16u, runs[40]);
+}
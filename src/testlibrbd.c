@@ -323,6 +323,365 @@ void test_io_to_snapshot(rados_ioctx_t io_ctx, rbd_image_t image, size_t isize)
   test_ls_snaps(image, 0);
 }
 
+int copy_progress_cb(uint64_t offset, uint64_t total, void *arg)
+{
+  uint64_t *last = (uint64_t *)arg;
+  assert(offset >= *last);
+  assert(offset <= total);
+  *last = offset;
+  return 0;
+}
+
+void compare_images(rbd_image_t a, rbd_image_t b, uint64_t size)
+{
+  char *abuf, *bbuf;
+  uint64_t off;
+  assert((abuf = malloc(MB_BYTES(1))) != 0);
+  assert((bbuf = malloc(MB_BYTES(1))) != 0);
+  for (off = 0; off < size; off += MB_BYTES(1)) {
+    assert(rbd_read(a, off, MB_BYTES(1), abuf) == MB_BYTES(1));
+    assert(rbd_read(b, off, MB_BYTES(1), bbuf) == MB_BYTES(1));
+    assert(memcmp(abuf, bbuf, MB_BYTES(1)) == 0);
+  }
+  free(abuf);
+  free(bbuf);
+}
+
+/*
+ * copy a mostly empty image spanning more objects than rbd_concurrent_ops,
+ * with data across object boundaries, an all-zero write and the last
+ * byte of the image set; the copy must read back the same and keep the
+ * holes.
+ */
+void test_copy_sparse(rados_ioctx_t io_ctx)
+{
+  rbd_image_t src, dst;
+  rbd_image_info_t info;
+  char test_data[TEST_IO_SIZE + 1];
+  char zeros[TEST_IO_SIZE];
+  uint64_t size = MB_BYTES(64ull), last = 0;
+  int i, order = 22;
+
+  for (i = 0; i < TEST_IO_SIZE; ++i)
+    test_data[i] = (char) (rand() % (126 - 33) + 33);
+  test_data[TEST_IO_SIZE] = '\0';
+  memset(zeros, 0, sizeof(zeros));
+
+  assert(rbd_create(io_ctx, TEST_IMAGE "src", size, &order) == 0);
+  assert(rbd_open(io_ctx, TEST_IMAGE "src", &src, NULL) == 0);
+  write_test_data(src, test_data, 0, TEST_IO_SIZE);
+  write_test_data(src, test_data, MB_BYTES(4) - 10, TEST_IO_SIZE);
+  write_test_data(src, test_data, MB_BYTES(20) + 12345, TEST_IO_SIZE);
+  write_test_data(src, zeros, MB_BYTES(40), TEST_IO_SIZE);
+  write_test_data(src, test_data, size - TEST_IO_SIZE, TEST_IO_SIZE);
+
+  assert(rbd_copy_with_progress(io_ctx, TEST_IMAGE "src", io_ctx, TEST_IMAGE "dst",
+				copy_progress_cb, &last) == 0);
+  assert(last == size);
+
+  assert(rbd_open(io_ctx, TEST_IMAGE "dst", &dst, NULL) == 0);
+  assert(rbd_stat(dst, &info, sizeof(info)) == 0);
+  assert(info.size == size);
+  assert(info.order == order);
+  read_test_data(dst, test_data, MB_BYTES(4) - 10, TEST_IO_SIZE);
+  read_test_data(dst, test_data, size - TEST_IO_SIZE, TEST_IO_SIZE);
+  read_test_data(dst, zeros, MB_BYTES(12), TEST_IO_SIZE);
+  compare_images(src, dst, size);
+
+  // a copy of the copy is the same again
+  assert(rbd_copy(io_ctx, TEST_IMAGE "dst", io_ctx, TEST_IMAGE "dst2") == 0);
+  assert(rbd_close(dst) == 0);
+  assert(rbd_open(io_ctx, TEST_IMAGE "dst2", &dst, NULL) == 0);
+  compare_images(src, dst, size);
+  assert(rbd_close(dst) == 0);
+  assert(rbd_close(src) == 0);
+
+  test_delete(io_ctx, TEST_IMAGE "src");
+  test_delete(io_ctx, TEST_IMAGE "dst");
+  test_delete(io_ctx, TEST_IMAGE "dst2");
+}
+
+void aio_flush_test(rbd_image_t image)
+{
+  rbd_completion_t comp;
+  rbd_aio_create_completion(NULL, (rbd_callback_t) simple_write_cb, &comp);
+  assert(rbd_aio_flush(image, comp) == 0);
+  rbd_aio_wait_for_complete(comp);
+  assert(rbd_aio_get_return_value(comp) == 0);
+  rbd_aio_release(comp);
+}
+
+/*
+ * an image opened with rbd_cache reads back its own buffered writes,
+ * and an uncached opener sees them once they are flushed.
+ */
+void test_cache(int argc, const char **argv, rados_ioctx_t io_ctx)
+{
+  rados_t cache_cluster;
+  rados_ioctx_t cache_io;
+  rbd_image_t cached, uncached;
+  rbd_completion_t comps[4];
+  char test_data[TEST_IO_SIZE + 1];
+  int i, order = 0;
+
+  for (i = 0; i < TEST_IO_SIZE; ++i)
+    test_data[i] = (char) (rand() % (126 - 33) + 33);
+  test_data[TEST_IO_SIZE] = '\0';
+
+  assert(rados_create(&cache_cluster, NULL) == 0);
+  assert(rados_conf_parse_argv(cache_cluster, argc, argv) == 0);
+  assert(rados_conf_read_file(cache_cluster, NULL) == 0);
+  assert(rados_conf_set(cache_cluster, "rbd_cache", "true") == 0);
+  assert(rados_connect(cache_cluster) == 0);
+  assert(rados_ioctx_create(cache_cluster, TEST_POOL, &cache_io) == 0);
+
+  assert(rbd_create(io_ctx, TEST_IMAGE "cache", MB_BYTES(8), &order) == 0);
+  assert(rbd_open(cache_io, TEST_IMAGE "cache", &cached, NULL) == 0);
+  assert(rbd_open(io_ctx, TEST_IMAGE "cache", &uncached, NULL) == 0);
+
+  // read after write
+  write_test_data(cached, test_data, 0, TEST_IO_SIZE);
+  read_test_data(cached, test_data, 0, TEST_IO_SIZE);
+  aio_write_test_data(cached, test_data, TEST_IO_SIZE, TEST_IO_SIZE);
+  aio_read_test_data(cached, test_data, TEST_IO_SIZE, TEST_IO_SIZE);
+  read_test_data(cached, test_data, 0, TEST_IO_SIZE);
+
+  // flush and aio_flush push them out
+  assert(rbd_flush(cached) == 0);
+  read_test_data(uncached, test_data, 0, TEST_IO_SIZE);
+  read_test_data(uncached, test_data, TEST_IO_SIZE, TEST_IO_SIZE);
+
+  write_test_data(cached, test_data, MB_BYTES(4) - 10, TEST_IO_SIZE);
+  aio_flush_test(cached);
+  read_test_data(uncached, test_data, MB_BYTES(4) - 10, TEST_IO_SIZE);
+
+  // without the cache aio_flush waits for the aio writes in flight
+  for (i = 0; i < 4; ++i) {
+    rbd_aio_create_completion(NULL, (rbd_callback_t) simple_write_cb, &comps[i]);
+    assert(rbd_aio_write(uncached, MB_BYTES(i * 2), TEST_IO_SIZE, test_data, comps[i]) == 0);
+  }
+  aio_flush_test(uncached);
+  for (i = 0; i < 4; ++i) {
+    read_test_data(cached, test_data, MB_BYTES(i * 2), TEST_IO_SIZE);
+    rbd_aio_wait_for_complete(comps[i]);
+    assert(rbd_aio_get_return_value(comps[i]) == 0);
+    rbd_aio_release(comps[i]);
+  }
+
+  // close flushes what is left
+  write_test_data(cached, test_data, MB_BYTES(6), TEST_IO_SIZE);
+  assert(rbd_close(cached) == 0);
+  read_test_data(uncached, test_data, MB_BYTES(6), TEST_IO_SIZE);
+  assert(rbd_close(uncached) == 0);
+
+  test_delete(io_ctx, TEST_IMAGE "cache");
+  rados_ioctx_destroy(cache_io);
+  rados_shutdown(cache_cluster);
+}
+
+static int map_update(rados_ioctx_t io_ctx, const char *oid,
+		      uint64_t start, uint64_t end, int exists)
+{
+  char in[17];
+  int i;
+  for (i = 0; i < 8; i++) {
+    in[i] = (start >> (i * 8)) & 0xff;
+    in[8 + i] = (end >> (i * 8)) & 0xff;
+  }
+  in[16] = exists;
+  return rados_exec(io_ctx, oid, "rbd", "map_update", in, sizeof(in), NULL, 0);
+}
+
+static void check_map(rados_ioctx_t io_ctx, const char *oid, const char *expected, int len)
+{
+  char buf[16];
+  assert(rados_read(io_ctx, oid, buf, sizeof(buf), 0) == len);
+  assert(memcmp(buf, expected, len) == 0);
+}
+
+/*
+ * the rbd class's map_update sets and clears ranges of bits, growing
+ * the map as needed and leaving it alone when nothing changes.
+ */
+void test_map_update(rados_ioctx_t io_ctx)
+{
+  const char *oid = "testmap";
+  uint64_t size;
+  time_t mtime;
+
+  rados_remove(io_ctx, oid);
+  assert(map_update(io_ctx, oid, 3, 10, 0) >= 0);
+  assert(rados_stat(io_ctx, oid, &size, &mtime) == -ENOENT);
+
+  assert(map_update(io_ctx, oid, 3, 10, 1) >= 0);
+  check_map(io_ctx, oid, "\xf8\x03", 2);
+  assert(map_update(io_ctx, oid, 5, 7, 0) >= 0);
+  check_map(io_ctx, oid, "\x98\x03", 2);
+  assert(map_update(io_ctx, oid, 20, 21, 1) >= 0);
+  check_map(io_ctx, oid, "\x98\x03\x10", 3);
+  assert(map_update(io_ctx, oid, 8, 8, 1) >= 0);
+  check_map(io_ctx, oid, "\x98\x03\x10", 3);
+
+  assert(rados_remove(io_ctx, oid) == 0);
+}
+
+/*
+ * with an object map, reads of unwritten blocks are zeros, a second
+ * opener sees the blocks the first one writes, and resize and remove
+ * drop the objects and their bits.
+ */
+void test_object_map(rados_ioctx_t io_ctx)
+{
+  rbd_image_t image, reader;
+  rbd_image_info_t info;
+  char test_data[TEST_IO_SIZE + 1];
+  char zeros[TEST_IO_SIZE];
+  char map_oid[RBD_MAX_BLOCK_NAME_SIZE + 8];
+  char block_oid[RBD_MAX_BLOCK_NAME_SIZE];
+  uint64_t used, size, features;
+  time_t mtime;
+  int i, order = 22;
+
+  for (i = 0; i < TEST_IO_SIZE; ++i)
+    test_data[i] = (char) (rand() % (126 - 33) + 33);
+  test_data[TEST_IO_SIZE] = '\0';
+  memset(zeros, 0, sizeof(zeros));
+
+  assert(rbd_create2(io_ctx, TEST_IMAGE "map", MB_BYTES(16), RBD_FEATURE_OBJECT_MAP,
+		     &order) == 0);
+  assert(rbd_open(io_ctx, TEST_IMAGE "map", &image, NULL) == 0);
+  assert(rbd_get_features(image, &features) == 0);
+  assert(features == RBD_FEATURE_OBJECT_MAP);
+  assert(rbd_stat(image, &info, sizeof(info)) == 0);
+  snprintf(map_oid, sizeof(map_oid), "%s.map", info.block_name_prefix);
+  assert(rbd_get_used_size(image, &used) == 0);
+  assert(used == 0);
+
+  // the reader has seen block 1 as a hole before it is written
+  assert(rbd_open(io_ctx, TEST_IMAGE "map", &reader, NULL) == 0);
+  read_test_data(reader, zeros, MB_BYTES(4), TEST_IO_SIZE);
+  write_test_data(image, test_data, MB_BYTES(4), TEST_IO_SIZE);
+  read_test_data(reader, test_data, MB_BYTES(4), TEST_IO_SIZE);
+  aio_read_test_data(reader, test_data, MB_BYTES(4), TEST_IO_SIZE);
+  read_test_data(reader, zeros, 0, TEST_IO_SIZE);
+
+  write_test_data(image, test_data, MB_BYTES(12) + 100, TEST_IO_SIZE);
+  read_test_data(reader, test_data, MB_BYTES(12) + 100, TEST_IO_SIZE);
+  assert(rbd_get_used_size(image, &used) == 0);
+  assert(used == MB_BYTES(8));
+
+  // shrinking drops block 3 and its bit; growing back leaves a hole
+  test_resize_and_stat(image, MB_BYTES(8));
+  assert(rbd_get_used_size(image, &used) == 0);
+  assert(used == MB_BYTES(4));
+  test_resize_and_stat(image, MB_BYTES(16));
+  read_test_data(image, zeros, MB_BYTES(12) + 100, TEST_IO_SIZE);
+  read_test_data(reader, zeros, MB_BYTES(12) + 100, TEST_IO_SIZE);
+  read_test_data(reader, test_data, MB_BYTES(4), TEST_IO_SIZE);
+  snprintf(block_oid, sizeof(block_oid), "%s.%012x", info.block_name_prefix, 3);
+  assert(rados_stat(io_ctx, block_oid, &size, &mtime) == -ENOENT);
+  check_map(io_ctx, map_oid, "\x02", 1);
+
+  assert(rbd_close(reader) == 0);
+  assert(rbd_close(image) == 0);
+
+  // remove takes the map with it
+  test_delete(io_ctx, TEST_IMAGE "map");
+  snprintf(block_oid, sizeof(block_oid), "%s.%012x", info.block_name_prefix, 1);
+  assert(rados_stat(io_ctx, block_oid, &size, &mtime) == -ENOENT);
+  assert(rados_stat(io_ctx, map_oid, &size, &mtime) == -ENOENT);
+}
+
+/*
+ * a clone reads through to its parent's snapshot until a block is
+ * written, when the block is copied up first; a copy of the clone
+ * stands on its own; and the parent and its snapshot can't go away (or
+ * be renamed) while the clone exists.
+ */
+void test_clone(rados_ioctx_t io_ctx, uint64_t features)
+{
+  rbd_image_t parent, child, copy;
+  rbd_image_info_t info;
+  char test_data[TEST_IO_SIZE + 1];
+  char new_data[TEST_IO_SIZE + 1];
+  char zeros[TEST_IO_SIZE];
+  uint64_t size = MB_BYTES(12), child_features;
+  int i, order = 22, child_order = 0;
+
+  for (i = 0; i < TEST_IO_SIZE; ++i) {
+    test_data[i] = (char) (rand() % (126 - 33) + 33);
+    new_data[i] = (char) (rand() % (126 - 33) + 33);
+  }
+  test_data[TEST_IO_SIZE] = '\0';
+  new_data[TEST_IO_SIZE] = '\0';
+  memset(zeros, 0, sizeof(zeros));
+
+  assert(rbd_create(io_ctx, TEST_IMAGE "parent", size, &order) == 0);
+  assert(rbd_open(io_ctx, TEST_IMAGE "parent", &parent, NULL) == 0);
+  write_test_data(parent, test_data, 0, TEST_IO_SIZE);
+  write_test_data(parent, test_data, MB_BYTES(4) + 100, TEST_IO_SIZE);
+  write_test_data(parent, test_data, MB_BYTES(8) - 10, TEST_IO_SIZE);
+  test_create_snap(parent, TEST_SNAP);
+  // the clone sees the snapshot, not what comes after
+  write_test_data(parent, new_data, 0, TEST_IO_SIZE);
+
+  assert(rbd_clone(io_ctx, TEST_IMAGE "parent", TEST_SNAP, io_ctx, TEST_IMAGE "child",
+		   features, &child_order) == 0);
+  assert(child_order == order);
+  assert(rbd_open(io_ctx, TEST_IMAGE "child", &child, NULL) == 0);
+  assert(rbd_get_features(child, &child_features) == 0);
+  assert(child_features == (features | RBD_FEATURE_LAYERING));
+  assert(rbd_stat(child, &info, sizeof(info)) == 0);
+  assert(info.size == size);
+  assert(strcmp(info.parent_name, TEST_IMAGE "parent@" TEST_SNAP) == 0);
+
+  // read through
+  read_test_data(child, test_data, 0, TEST_IO_SIZE);
+  aio_read_test_data(child, test_data, MB_BYTES(4) + 100, TEST_IO_SIZE);
+  read_test_data(child, test_data, MB_BYTES(8) - 10, TEST_IO_SIZE);
+  read_test_data(child, zeros, MB_BYTES(10), TEST_IO_SIZE);
+
+  // copy up keeps the rest of the block
+  write_test_data(child, new_data, 1024, TEST_IO_SIZE);
+  aio_write_test_data(child, new_data, MB_BYTES(4) + 1024, TEST_IO_SIZE);
+  read_test_data(child, test_data, 0, TEST_IO_SIZE);
+  read_test_data(child, new_data, 1024, TEST_IO_SIZE);
+  aio_read_test_data(child, test_data, MB_BYTES(4) + 100, TEST_IO_SIZE);
+  read_test_data(child, new_data, MB_BYTES(4) + 1024, TEST_IO_SIZE);
+  read_test_data(parent, zeros, 1024, TEST_IO_SIZE);
+
+  // the parent, its snapshot and its name are pinned
+  assert(rbd_remove(io_ctx, TEST_IMAGE "parent") == -EBUSY);
+  assert(rbd_rename(io_ctx, TEST_IMAGE "parent", TEST_IMAGE "parent2") == -EBUSY);
+  assert(rbd_snap_remove(parent, TEST_SNAP) == -EBUSY);
+
+  // with snapshots, a clone can't cut off what they read through
+  test_create_snap(child, TEST_SNAP);
+  assert(rbd_resize(child, MB_BYTES(6)) == -EBUSY);
+  test_delete_snap(child, TEST_SNAP);
+
+  // a copy is flattened
+  assert(rbd_copy(io_ctx, TEST_IMAGE "child", io_ctx, TEST_IMAGE "copy") == 0);
+  assert(rbd_open(io_ctx, TEST_IMAGE "copy", &copy, NULL) == 0);
+  assert(rbd_get_features(copy, &child_features) == 0);
+  assert(child_features == features);
+  assert(rbd_stat(copy, &info, sizeof(info)) == 0);
+  assert(info.parent_pool == -1);
+  compare_images(child, copy, size);
+  assert(rbd_close(child) == 0);
+  test_delete(io_ctx, TEST_IMAGE "child");
+  read_test_data(copy, test_data, 0, TEST_IO_SIZE);
+  read_test_data(copy, new_data, 1024, TEST_IO_SIZE);
+  read_test_data(copy, test_data, MB_BYTES(8) - 10, TEST_IO_SIZE);
+  assert(rbd_close(copy) == 0);
+  test_delete(io_ctx, TEST_IMAGE "copy");
+
+  // and with the clone gone the parent is free again
+  test_delete_snap(parent, TEST_SNAP);
+  assert(rbd_close(parent) == 0);
+  test_delete(io_ctx, TEST_IMAGE "parent");
+}
+
 int main(int argc, const char **argv) 
 {
   rados_t cluster;
@@ -378,6 +737,20 @@ int main(int argc, const char **argv)
   test_delete(io_ctx, TEST_IMAGE "1");
   test_ls(io_ctx, 0);
 
+  test_cache(argc, argv, io_ctx);
+  test_ls(io_ctx, 0);
+
+  test_copy_sparse(io_ctx);
+  test_ls(io_ctx, 0);
+
+  test_map_update(io_ctx);
+  test_object_map(io_ctx);
+  test_ls(io_ctx, 0);
+
+  test_clone(io_ctx, 0);
+  test_clone(io_ctx, RBD_FEATURE_OBJECT_MAP);
+  test_ls(io_ctx, 0);
+
   rados_ioctx_destroy(io_ctx);
   rados_shutdown(cluster);
 
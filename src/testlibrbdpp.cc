@@ -237,6 +237,128 @@ void test_io(librados::IoCtx& io_ctx, librbd::Image& image)
 
 }
 
+struct iterate_check {
+  const char *expected;
+  size_t len;
+};
+
+// read_iterate hands holes over as NULL
+int iterate_check_cb(uint64_t ofs, size_t len, const char *buf, void *arg)
+{
+  iterate_check *c = (iterate_check *)arg;
+  for (size_t i = 0; i < len; i++) {
+    char ch = buf ? buf[i] : 0;
+    uint64_t pos = ofs + i;
+    char want = pos < c->len ? c->expected[pos] : 0;
+    assert(ch == want);
+  }
+  return 0;
+}
+
+void read_iterate_test_data(librbd::Image& image, const char *expected, uint64_t off, size_t len)
+{
+  iterate_check c;
+  c.expected = expected;
+  c.len = expected ? strlen(expected) : 0;
+  assert(image.read_iterate(off, len, iterate_check_cb, &c) == (int64_t)len);
+}
+
+void read_zeros(librbd::Image& image, uint64_t off, size_t len)
+{
+  ceph::bufferlist bl;
+  assert(image.read(off, len, bl) == (ssize_t)len);
+  for (size_t i = 0; i < len; i++)
+    assert(bl[i] == 0);
+  read_iterate_test_data(image, NULL, off, len);
+}
+
+/*
+ * clone a snapshot, read through to it with read, aio_read and
+ * read_iterate, copy up on write, flatten on copy, and check that the
+ * parent is pinned while the clone exists.
+ */
+void test_clone(librados::IoCtx& io_ctx, uint64_t features)
+{
+  char test_data[TEST_IO_SIZE], new_data[TEST_IO_SIZE];
+  int i, order = 22, child_order = 0;
+  uint64_t size = MB_BYTES(12ull), child_features;
+  librbd::image_info_t info;
+
+  for (i = 0; i < TEST_IO_SIZE - 1; ++i) {
+    test_data[i] = (char) (rand() % (126 - 33) + 33);
+    new_data[i] = (char) (rand() % (126 - 33) + 33);
+  }
+  test_data[TEST_IO_SIZE - 1] = '\0';
+  new_data[TEST_IO_SIZE - 1] = '\0';
+
+  // closed by delete, before the image is removed
+  librbd::Image *parent = new librbd::Image;
+  assert(rbd->create(io_ctx, TEST_IMAGE "parent", size, &order) == 0);
+  assert(rbd->open(io_ctx, *parent, TEST_IMAGE "parent", NULL) == 0);
+  write_test_data(*parent, test_data, 0);
+  write_test_data(*parent, test_data, MB_BYTES(4) + 100);
+  test_create_snap(*parent, TEST_SNAP);
+  write_test_data(*parent, new_data, 0);
+
+  assert(rbd->clone(io_ctx, TEST_IMAGE "parent", TEST_SNAP, io_ctx, TEST_IMAGE "child",
+		    features, &child_order) == 0);
+  assert(child_order == order);
+  {
+    librbd::Image child;
+    assert(rbd->open(io_ctx, child, TEST_IMAGE "child", NULL) == 0);
+    assert(child.get_features(&child_features) == 0);
+    assert(child_features == (features | RBD_FEATURE_LAYERING));
+    assert(child.stat(info, sizeof(info)) == 0);
+    assert(info.size == size);
+    assert(info.parent_pool == io_ctx.get_id());
+
+    // read through, even where an object map says there's nothing
+    read_test_data(child, test_data, 0);
+    aio_read_test_data(child, test_data, MB_BYTES(4) + 100);
+    read_iterate_test_data(child, test_data, 0, MB_BYTES(1));
+    read_zeros(child, MB_BYTES(10), 4096);
+
+    // copy up
+    write_test_data(child, new_data, 2048);
+    aio_write_test_data(child, new_data, MB_BYTES(4) + 2048);
+    read_test_data(child, test_data, 0);
+    read_test_data(child, new_data, 2048);
+    aio_read_test_data(child, test_data, MB_BYTES(4) + 100);
+    aio_read_test_data(child, new_data, MB_BYTES(4) + 2048);
+    read_zeros(*parent, 2048, TEST_IO_SIZE);
+
+    assert(rbd->remove(io_ctx, TEST_IMAGE "parent") == -EBUSY);
+    assert(rbd->rename(io_ctx, TEST_IMAGE "parent", TEST_IMAGE "parent2") == -EBUSY);
+    assert(parent->snap_remove(TEST_SNAP) == -EBUSY);
+
+    test_create_snap(child, TEST_SNAP);
+    assert(child.resize(MB_BYTES(6)) == -EBUSY);
+    test_delete_snap(child, TEST_SNAP);
+  }
+
+  // the copy has the clone's data and no parent
+  assert(rbd->copy(io_ctx, TEST_IMAGE "child", io_ctx, TEST_IMAGE "copy") == 0);
+  test_delete(io_ctx, TEST_IMAGE "child");
+  {
+    librbd::Image copy;
+    assert(rbd->open(io_ctx, copy, TEST_IMAGE "copy", NULL) == 0);
+    assert(copy.get_features(&child_features) == 0);
+    assert(child_features == features);
+    assert(copy.stat(info, sizeof(info)) == 0);
+    assert(info.parent_pool == -1);
+    read_test_data(copy, test_data, 0);
+    read_test_data(copy, new_data, 2048);
+    aio_read_test_data(copy, test_data, MB_BYTES(4) + 100);
+    aio_read_test_data(copy, new_data, MB_BYTES(4) + 2048);
+    read_zeros(copy, MB_BYTES(10), 4096);
+  }
+  test_delete(io_ctx, TEST_IMAGE "copy");
+
+  test_delete_snap(*parent, TEST_SNAP);
+  delete parent;
+  test_delete(io_ctx, TEST_IMAGE "parent");
+}
+
 int main(int argc, const char **argv) 
 {
   librados::Rados rados;
@@ -275,6 +397,9 @@ int main(int argc, const char **argv)
   test_ls(io_ctx, 1, TEST_IMAGE "1");
   test_delete(io_ctx, TEST_IMAGE "1");
   test_ls(io_ctx, 0);
+  test_clone(io_ctx, 0);
+  test_clone(io_ctx, RBD_FEATURE_OBJECT_MAP);
+  test_ls(io_ctx, 0);
   delete rbd;
   return 0;
 }